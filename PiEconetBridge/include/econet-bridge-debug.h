@@ -0,0 +1,22 @@
+#ifndef __ECONETBRIDGE_DEBUG_H
+
+#define __ECONETBRIDGE_DEBUG_H
+
+/* Leave the bridge's debug output (-d, -r, -n and -m) out altogether - for a release build */
+
+//#define ECONET_NO_DEBUG 1
+
+/* Debug and fileserver log output goes through econet_log(), which puts the format and its arguments on the
+   calling thread's log ring for the log thread to turn into text, so that nothing waits on stderr. The format
+   must be a string constant. econet_debug() is the same, but for output only wanted with a debug option on, and
+   compiles to nothing (arguments and all) with ECONET_NO_DEBUG. */
+
+extern void econet_log(const char *, ...) __attribute__ ((format (printf, 1, 2)));
+
+#ifdef ECONET_NO_DEBUG
+#define econet_debug(...) do { if (0) econet_log(__VA_ARGS__); } while (0)
+#else
+#define econet_debug(...) econet_log(__VA_ARGS__)
+#endif
+
+#endif
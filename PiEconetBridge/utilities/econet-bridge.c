@@ -15,6 +15,8 @@
 
 */
 
+#define _GNU_SOURCE // For recvmmsg() / sendmmsg()
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -27,7 +29,8 @@
 #include <sys/socket.h>
 #include <sys/time.h>
 #include <unistd.h>
-#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <netdb.h>
@@ -36,9 +39,22 @@
 #include <regex.h>
 #include <time.h>
 #include <stdint.h>
+#include <limits.h>
 #include <inttypes.h>
+#include <signal.h>
+#include <zlib.h>
+#include <pthread.h>
+#include <sched.h>
+#include <poll.h>
+#include <stdatomic.h>
+#include <sys/eventfd.h>
+#include <sys/un.h>
+#include <sys/resource.h>
+#include <stdarg.h>
+#include <stddef.h>
 #include "../include/econet-gpio-consumer.h"
 #include "../include/econet-pserv.h"
+#include "../include/econet-bridge-debug.h"
 
 extern int fs_initialize(unsigned char, unsigned char, char *);
 extern int sks_initialize(unsigned char, unsigned char, char *);
@@ -46,13 +62,19 @@ extern void handle_fs_traffic(int, unsigned char, unsigned char, unsigned char,
 extern void sks_handle_traffic(int, unsigned char, unsigned char, unsigned char, unsigned char *, unsigned int);
 extern void handle_fs_bulk_traffic(int, unsigned char, unsigned char, unsigned char, unsigned char, unsigned char *, unsigned int);
 extern void fs_garbage_collect(int);
+void econet_dynamic_timer_expired(int);
+uint64_t econet_ms(void);
 extern void fs_eject_station(unsigned char, unsigned char); // Used to get rid of an old dynamic station
+extern __thread struct load_queue *fs_load_queue; // Non-NULL whilst this thread's fileservers have *LOAD data waiting to go
 extern void fs_dequeue();
 extern int fs_stn_logged_in(int, unsigned char, unsigned char); // Used to identify if a user is logged in
 extern void fs_get_username(int, int, char *); // Returns username or null first byte into the char* array
 extern short fs_dequeuable();
 extern void sks_poll(int);
 extern int8_t fs_get_user_printer(int, unsigned char, unsigned char);
+extern void fs_server_lock(int); // The fileserver workers share each server's state
+extern void fs_server_unlock(int);
+extern unsigned long fs_ops[256]; // Fileserver operations handled, by function code
 
 short aun_wait (unsigned char, unsigned char, unsigned char, unsigned char, unsigned char, uint32_t, short, struct __econet_packet_aun **);
 extern unsigned short fs_quiet, fs_noisy;
@@ -81,13 +103,53 @@ int trunk_xlate_fw(struct __econet_packet_aun *, int, unsigned char);
 short trunk_find (unsigned char);
 int aun_trunk_send (struct __econet_packet_aun *, int);
 int aun_trunk_send_internal (struct __econet_packet_aun *, int, int);
-
-void dump_pkt_data(unsigned char *, int, unsigned long);
+int aun_trunk_enqueue (struct __econet_packet_aun *, int, unsigned char);
+void aun_trunk_flush (void);
+void trunk_caps_send (int, unsigned char);
+void trunk_caps_ask (int);
+void trunk_caps_expired (int);
+int trunk_compress (int, struct __econet_packet_aun *, int, struct __econet_packet_aun **);
+int trunk_decompress (int, struct __econet_packet_aun *, int, struct __econet_packet_aun *);
+void trunk_agg_expired (int);
+void trunk_rel_expired (int);
+void trunk_rel_ack_send (int);
+void trunk_rel_reset (int);
+int trunk_rel_on (int);
+long trunk_rel_rto (int);
+void trunk_datagram_send (int, void *, int);
+void trunk_agg_receive (struct __econet_packet_aun *, int, int);
+int udp_send_batched (int, void *, int, struct sockaddr *, socklen_t, struct in_addr *);
+void udp_flush (void);
+
+void dump_pkt_data(FILE *, unsigned char *, int, unsigned long);
+void econet_dump_aun(FILE *, struct __econet_packet_aun *, int, int, char, char);
 
 char * econet_strtxerr(int);
+void econet_wire_done(int, int, uint32_t);
+void econet_wire_readmode(void);
+void econet_wire_send_now(struct __econet_packet_aun *, int);
+int econet_fs_bound(struct __econet_packet_aun *);
+void econet_service_post(int, uint16_t, struct __econet_packet_aun *, int, uint16_t, int);
+int econet_service_send(struct __econet_packet_aun *, int);
+int econet_queue_room(unsigned char, unsigned char, unsigned char, unsigned char);
+
+#define ECONET_MAX_EVENTS 64 // Most descriptors we will service from one epoll_wait()
+
+typedef void (*econet_fd_handler)(int, uint32_t);
+
+int epoll_fd; // Everything we listen on - wire, AUN sockets, named pipes, trunks
+econet_fd_handler fd_handlers[65536]; // What to call when a given fd has traffic
+
+void econet_watch_fd(int, econet_fd_handler);
+void econet_handle_wire_ring(int, uint32_t);
+void econet_handle_service_ring(int, uint32_t);
+void econet_handle_local_aun (struct __econet_packet_aun *, int, int);
+void econet_handle_trunk_fd(int, uint32_t);
+void econet_handle_trunk_frame(struct __econet_packet_aun *, int, int);
+void econet_handle_pipeudp_fd(int, uint32_t);
+void econet_handle_pipe_fd(int, uint32_t);
+void econet_handle_aun_fd(int, uint32_t);
 
-struct pollfd pset[65536];
-int pmax;
 int econet_fd;
 int seq;
 int pkt_debug = 0;
@@ -99,8 +161,9 @@ short learned_net = -1;
 int wire_tx_errors = 0; // Count of successive errors on tx to the wire - if it gets too high, we'll do a chip reset
 unsigned char last_net = 0, last_stn = 0;
 char *printhandler = NULL; // Filename of generic print handling routine
+char *stats_path = NULL; // Unix domain socket the statistics can be read from ('STATS' in the config), NULL = none
 
-int start_fd = 0; // Which index number do we start looking for UDP traffic from after poll returns? We do this cyclicly so we give all stations an even chance
+int start_event = 0; // Which entry in the epoll_wait() results do we start servicing from? We do this cyclicly so we give all stations an even chance
 
 unsigned short numtrunks; // Only used to determine whether to display trunk info on summary at startup
 
@@ -114,10 +177,27 @@ unsigned char econet_stations[8192];
 #define ECONET_WIRE_MAX_TX 20  // Attempt to improve reliability on a busy network
 // Time before we send another packet on the Econet - Query whether we should be doing this at all (looks like we don't actually use it anywhere)
 #define ECONET_RETX_INTERVAL_MSEC 75
-// AUN Ack wait time in ms
+// AUN Ack wait time in ms - the retransmission timeout for a host until we have timed some ACKs from it
 #define ECONET_AUN_ACK_WAIT_TIME 200
+// Limits on the per-host retransmission timeout worked out from measured round trip times (ms)
+#define ECONET_AUN_MIN_RTO 20
+#define ECONET_AUN_MAX_RTO 1000
+// Least slack allowed over the smoothed round trip time, so that a very steady host isn't retransmitted to on the slightest delay (ms)
+#define ECONET_AUN_RTO_MARGIN 10
+// Most times the timeout doubles for successive retransmissions before it stops growing
+#define ECONET_AUN_MAX_BACKOFF 3
 // Mandatory gap between last tx to or rx from an AUN host so that it doesn't get confused (ms)
 #define ECONET_AUN_INTERPACKET_GAP 50
+// How long an AUN host's IMM REP / ACK tracker lasts after we last heard from it (ms)
+#define ECONET_AUN_TOSEND_EXPIRY 2000
+// How long things must have been quiet after an immediate to an AUN host went unanswered before we reset the chip (ms)
+#define ECONET_AUN_IMM_RESET_TIME 500
+// Largest 'WINDOW n' allowed on an A line
+#define ECONET_AUN_MAX_WINDOW 16
+// Retry interval for the wire queue, and for AUN transmits which failed outright (ms)
+#define ECONET_QUEUE_RETRY_TIME 10
+// Fileserver housekeeping interval (ms)
+#define ECONET_HOUSEKEEPING_TIME 1000
 
 struct __econet_packet_aun_cache {
 	struct __econet_packet_aun *p;
@@ -172,7 +252,71 @@ struct __printer {
 	char banner[24]; // Banner filename. SJ has this max 23 characters
 };
 
+// Timer wheel. Everything the main loop has to do at a particular time - AUN ACK waits and retransmits,
+// resetting the chip after an unanswered immediate, wire retries, housekeeping, bridge resets and dynamic
+// host expiry - hangs off one of these, and epoll_wait() sleeps until the nearest one is due.
+// 1ms ticks. Level 0 has 256 slots of 1ms; levels 1-3 have 64 slots each of 256ms, 16.4s and 17.5 minutes,
+// so anything up to about 18 hours fits. Timers on the upper levels are re-filed a level down as the
+// wheel reaches their slot.
+
+#define ECONET_TW_L0_BITS 8
+#define ECONET_TW_LN_BITS 6
+#define ECONET_TW_LEVELS 4
+#define ECONET_TW_SLOTS ((1 << ECONET_TW_L0_BITS) + ((ECONET_TW_LEVELS - 1) << ECONET_TW_LN_BITS))
+
+struct econet_timer {
+	struct econet_timer *next, **pprev; // pprev is NULL whilst the timer is not armed
+	uint64_t expires; // When it goes off, in ms on the wheel's clock
+	void (*fn)(int); // What to call when it does (may be NULL, in which case it just wakes the main loop)
+	int arg; // Passed to fn
+};
+
+// Queue delay management - see econet_codel_dequeued(). One of these per wire flow, per AUN host and for the trunk queue
+
+struct econet_codel {
+	uint64_t first_above; // econet_ms() when packets leaving the queue will have been above target delay for a whole interval; 0 = they aren't above it
+	uint64_t drop_next; // Whilst dropping, when the next arrival gets shed
+	unsigned int count; // Packets shed since we started dropping
+	unsigned char dropping; // Set whilst the queue has stayed above target delay for too long
+	_Atomic unsigned char full; // What econet_queue_has_room() last said (inverted), for the server threads - see econet_queue_publish()
+};
+
+// Latency histogram, log-linear after HdrHistogram. Values (us) below 2 * ECONET_HIST_SUB each have a bucket of their
+// own; above that, each power of two is split into ECONET_HIST_SUB equal buckets, so any value is known to within about
+// 3% of itself. Recording one is a bit of arithmetic and an increment. See econet_hist_add().
+
+#define ECONET_HIST_SUB_BITS 5
+#define ECONET_HIST_SUB (1 << ECONET_HIST_SUB_BITS)
+#define ECONET_HIST_MAX_BITS 32 // Longer than 2^32 us (71 minutes) counts as that
+#define ECONET_HIST_BUCKETS ((ECONET_HIST_MAX_BITS - ECONET_HIST_SUB_BITS + 1) * ECONET_HIST_SUB)
+
+struct econet_hist {
+	unsigned long counts[ECONET_HIST_BUCKETS];
+	uint64_t sum, max; // Of the values recorded (us)
+};
+
+struct econet_hist_summary {
+	unsigned long count;
+	uint64_t mean, p50, p90, p99, p999, max; // us
+};
+
 // Holds data from econet.cfg file
+// Locally emulated server configuration. Only hosts with an F or P line get one of these, so that the bulky
+// parameter strings and printer tables stay out of network[].
+struct econet_server_config {
+// File server variables
+	char fs_serverparam[1024];
+
+// Print server variables
+	char print_serverparam[1024];
+	uint8_t numprinters;
+	struct __printer printers[MAX_PRINTERS]; // Defined printers. All valid up to printers[numprinters-1]
+	uint8_t printer_priorities[MAX_PRINTERS]; // List of indices into printers[] to indicate auto priority - see FS 65 function 0x03, 0x04
+	
+// Socket server parameter
+	char socket_serverparam[1024];
+};
+
 struct econet_hosts {							// what we we need to find a beeb?
 // Econet net & station of this host
 	unsigned char station;
@@ -180,7 +324,7 @@ struct econet_hosts {							// what we we need to find a beeb?
 
 // IP Address / port data
 	struct in_addr s_addr;
-	char hostname[250];
+	char *hostname; // strdup()ed from the config for A lines, NULL otherwise
 	unsigned int port;
 	int listensocket; /* One socket for each thing on the Econet wire - -2 if on UDP because we don't listen "for" those, we only transmit /to/ them */
 
@@ -190,23 +334,10 @@ struct econet_hosts {							// what we we need to find a beeb?
 // Locally emulated server type(s)
 	short servertype;
 
-// File server variables
-	char fs_serverparam[1024];
+	struct econet_server_config *server; // Allocated when the first F / P line for this host is read, NULL otherwise
 	int fileserver_index;
-
-// Print server variables
-	char print_serverparam[1024];
-	uint8_t numprinters;
-	struct __printer printers[MAX_PRINTERS]; // Defined printers. All valid up to printers[numprinters-1]
-	uint8_t printer_priorities[MAX_PRINTERS]; // List of indices into printers[] to indicate auto priority - see FS 65 function 0x03, 0x04
-	
-// Socket server parameter
-	char socket_serverparam[1024];
 	int sks_index;
 
-// PSet index
-	int pind; /* Index into pset for this host, if it has a socket */
-
 // AUN ACK / IMM tracking
 	uint32_t seq, last_imm_seq_sent; // Our local sequence number, and the last immediate sequence number sent to this host (for wire hosts) so that we acknowledge with the same immediate sequence number
 	uint32_t last_seq_ack; // The last sequence number which was acknowledged to this host if it is AUN. If we have already acknoweldged a given sequence number, we *don't* attempt to re-transmit the data onto the Econet Wire, but we do acknowledge the packet again
@@ -214,36 +345,107 @@ struct econet_hosts {							// what we we need to find a beeb?
 	struct timespec last_wire_tx;
 	struct timeval aun_last_tx; // Last AUN tx to an AUN machine. Used to time out the ACK/IMM wait below. (The 'awaited' value.)
 	struct timeval aun_last_rx; // When we received a packet from the AUN machine so we can time out the ACK / IMMREP timer on our own transmits to it
+	unsigned long aun_srtt, aun_rttvar; // Smoothed ACK round trip time and its mean deviation, in microseconds. Only meaningful once aun_rtt_samples > 0
+	unsigned long aun_rtt_samples; // How many ACKs have been timed
+	unsigned int aun_rto; // Retransmission timeout in ms (before backoff), from the above. 0 = not yet measured - use ECONET_AUN_ACK_WAIT_TIME
+	unsigned char aun_backoff; // How many times the timeout has doubled since the last ACK we could time
 	uint32_t ackimm_seq_awaited; // Sequence number we are waiting for an ACK for (or could be Immediate reply) FROM the AUN machine
 	struct __econet_packet_aun_cache *aun_head, *aun_tail; // Output queue for AUN clients, so that we can re-tx unacknowledged packets a few times
+	unsigned int aun_queue_len; // Number of packets on aun_head (and in the window, if any)
+	unsigned long aun_queue_bytes; // And how big they are
+	struct econet_codel aun_codel; // Delay management for that queue
+	int aun_ready_next; // Next network[] index on the AUN ready list (or -1). Only meaningful whilst aun_ready is set
+	unsigned char aun_ready; // Set whilst this host is on the AUN ready list - see econet_aun_ready()
+	unsigned char aun_window; // Most data packets we will have unacknowledged at once ('WINDOW n' on the A line). 0 or 1 = stop-and-wait
+	unsigned char aun_inflight; // Window hosts only - how many of aun_outstanding[] are in use
+	struct __econet_packet_aun_cache **aun_outstanding; // Window hosts only - aun_window slots of data packets (and immediates) sent but not yet acknowledged (tstamp = when last sent)
+	unsigned char aun_imm_inflight; // Window hosts only - one of aun_outstanding[] is an immediate, so nothing else goes until it's answered
+	unsigned char aun_parked; // Set whilst this host has queued traffic but can't send it until aun_timer goes off (or an ACK turns up)
+	struct econet_timer aun_timer; // ACK wait / retransmit timer. Host timers are only armed once network[] has stopped moving, after the config is read
+	struct econet_timer idle_timer; // Dynamic hosts only - goes off when the host has been idle for ECONET_LEARNED_HOST_IDLE_TIMEOUT
 	uint32_t ackimm_seq_tosend; // Sequence number FROM the AUN machine which needs acknowledging
+	struct econet_hist *aun_rtt_hist; // ACK round trip times - allocated when the first one is timed, NULL until then
 
 	unsigned char is_dynamic; // 0 = ordinary fixed host; 1 = host which can be assigned to unknown incoming traffic
 	unsigned char is_wired_fs; // 0 = not a fileserver; 1 = we have seen port &99 traffic to this host and it is on the wire, so we think it's a fileserver. This is used to spoof *bye equivalents when a station number of dynamically allocated to an unknown AUN source, so that the previous user of the same address's login cannot be re-used
 	unsigned long last_transaction;
 	struct timeval last_bridge_reply;
-// These only apply to wire hosts - Bridge announcements
-	unsigned char adv_in[256], adv_out[256]; // Advertised networks. _in received from other end, _out is last advert sent by us
-
-// Trunk variables
-	unsigned char filter_in[256], filter_out[256]; // Filter masks for in & out
 
 // Named pipe filename if this is a named pipe host
-	char named_pipe_filename[200];
+	char *named_pipe_filename; // strdup()ed from the config, NULL otherwise
 	int pipewritesocket; /* file descriptor for the socket we write to when this connection is a named pipe */
 	int pipeudpsocket; /* Socket descriptor for inbound UDP AUN traffic to this host */
 
+// Statistics - traffic the bridge has had from this host, and has taken on for it, in packets & bytes; retransmissions to it, and traffic for it which was turned away or given up on
+	unsigned long rx_packets, rx_bytes, tx_packets, tx_bytes, retx, drops;
+
+};
+
+// Queue limits. Each wire flow, each AUN host's queue and the trunk queue can hold at most so many packets / bytes
+// (QUEUELIMIT in the config; 0 = no limit), and sheds traffic once packets have been waiting longer than
+// codel_target ms for codel_interval ms or more (QUEUEDELAY; target 0 = never). Shed DATA from an AUN host gets a NAK.
+
+#define ECONET_QUEUE_WIRE 0
+#define ECONET_QUEUE_AUN 1
+#define ECONET_QUEUE_TRUNK 2
+#define ECONET_QUEUE_TYPES 3
+
+// Packets older than this on the wire queue are not worth sending (ms)
+#define ECONET_QUEUE_MAX_AGE 2000
+
+struct econet_qlimit {
+	unsigned int packets;
+	unsigned long bytes;
 };
 
-// Wire packet queue & priority system
+struct econet_qlimit queue_limits[ECONET_QUEUE_TYPES] = { { 64, 96 * 1024 }, { 64, 96 * 1024 }, { 256, 384 * 1024 } };
+char *queue_names[ECONET_QUEUE_TYPES] = { "WIRE", "AUN", "TRUNK" };
+unsigned int codel_target = 100, codel_interval = 1000;
+unsigned long queue_full_drops[ECONET_QUEUE_TYPES], queue_delay_drops[ECONET_QUEUE_TYPES], queue_age_drops[ECONET_QUEUE_TYPES];
+
+// Traffic dropped other than by the queues, which count their own above, by reason. (Running out of pool memory is
+// counted by the pools themselves.)
+
+#define ECONET_DROP_INTERLOCK 0 // Refused by the interlock in aun_send_internal()
+#define ECONET_DROP_NOROUTE 1 // Nowhere to send it
+#define ECONET_DROP_FIREWALL 2 // Trunk firewall, or from a network the far end of the trunk hasn't advertised
+#define ECONET_DROP_RETRIES 3 // AUN host never acknowledged it
+#define ECONET_DROP_SERVICE 4 // A server thread had too much to do
+#define ECONET_DROP_REASONS 5
+
+unsigned long econet_drops[ECONET_DROP_REASONS];
+char *drop_names[ECONET_DROP_REASONS] = { "interlock", "no_route", "firewall", "retries", "server_busy" };
+
+// Wire packet queues. Immediate replies go in a priority lane which is always emptied first. Everything else is
+// spread over ECONET_WIRE_FLOWS queues by source & destination, and those are served by deficit round robin so that
+// a bulk transfer to one station can't hold up everyone else. Flows which share a queue just share its turn.
+
+#define ECONET_WIRE_FLOWS 64 // Must be a power of 2
+#define ECONET_WIRE_QUANTUM 1500 // Bytes a flow may send per round - a bit more than the biggest fileserver data packet
+
+struct wire_flow {
+	struct __econet_packet_aun_cache *head, *tail;
+	long deficit; // Bytes this flow may still send this round
+	int next; // Next flow on the active list, -1 at the end
+	unsigned char active; // Set whilst on the active list
+	unsigned int len; // Packets queued
+	unsigned long bytes; // And how big they are
+	struct econet_codel codel;
+};
 
-struct __econet_packet_aun_cache *wire_head = NULL, *wire_tail = NULL;
-short wire_prio_out_srcnet, wire_prio_out_srcstn, wire_prio_out_dstnet, wire_prio_out_dststn, wire_prio_out_auntype, wire_prio_out_port; // -1 = value unused. Used to allow a packet headed for this machine to jump the queue and go first, e.g. an immediate reply the machine is waiting for. Basically used to decide whether we put a new packet destined for this machine on the head or the tail of the queue
-struct timeval wire_prio_expiry; // Time at which the priority values in the line above expire and become invalid
+struct __econet_packet_aun_cache *wire_prio_head = NULL, *wire_prio_tail = NULL; // Priority lane
+struct wire_flow wire_flows[ECONET_WIRE_FLOWS];
+int wire_active_head = -1, wire_active_tail = -1; // Flows with something queued, in service order
+int wire_current = -1; // Flow that packet returned by econet_wire_next() came from; -1 = priority lane
+unsigned long wire_queued = 0; // Packets on all the wire queues
+unsigned long wire_sent[2], wire_sojourn_total[2], wire_sojourn_max[2]; // [0] = priority lane, [1] = fair queues. Time (ms) packets spent queued before going out
+unsigned long wire_tx_results[256]; // How each attempt to send a queued packet onto the wire went, by ECONET_TX_* code (ECONET_TX_SUCCESS = it went)
 
 // Econet hosts lists & FD pointers back into the various arrays
 
-struct econet_hosts network[65536]; // Hosts we know about / listen for / bridge for
+struct econet_hosts *network = NULL; // Hosts we know about / listen for / bridge for. Grown by econet_host_reserve() whilst reading the config, then trimmed to 'stations' entries
+int network_size = 0; // Number of entries allocated in network[]
+int network_servers = 0; // Number of econet_server_config structures allocated
 short econet_ptr[256][256]; /* [net][stn] pointer into network[] array. */
 uint16_t last_ps[256][256]; // Last print (emulated) print server used by each station. Used to re-set default printer if the station uses a new print server
 uint8_t last_prn[256][256]; // Last printer index used by a station on the current print server. Gets re-set to 0 on change of PS (i.e. when a job gets sent to an emulated PS which is not the current one in last_ps).
@@ -252,10 +454,173 @@ int pipeudpsockets[65536]; /* Array of descriptors which are actually UDP socket
 short trunk_fd_ptr[65536]; /* Index is a file descriptor - pointer to index in trunks[] */
 int stations; // How many entries in network[]
 unsigned long aun_queued = 0; // Number of packets in AUN network[] entries
+int aun_ready_head = -1; // First network[] index on the list of AUN hosts with something queued, or -1
+unsigned long aun_service_passes = 0, aun_service_hosts = 0; // Passes the main loop has made over the AUN ready list, and hosts it looked at in total
+unsigned long aun_window_retx = 0, aun_window_naks = 0, aun_window_drops = 0; // Window hosts - selective retransmissions, NAKs received, packets given up on
 unsigned char queue_debug = 0; // Whether we produce verbose queueing diagnostics
 
 struct timeval last_bridge_reset;
 
+struct econet_timer *tw_slots[ECONET_TW_SLOTS]; // Heads of the timer wheel slot lists - level 0 first
+uint64_t tw_now; // Every timer due at or before this has gone off
+unsigned long tw_pending = 0, tw_fired = 0; // Timers armed now, and timers which have gone off since start
+unsigned long loop_wakeups = 0, loop_idle_wakeups = 0; // Trips round the main loop, and how many of those were timeouts with no traffic
+
+// Where the main loop spends its time. Only kept once somebody has connected to the statistics socket, so that the clock
+// isn't read several times every trip round for nobody's benefit - see econet_loop_phase()
+
+#define ECONET_PHASE_WAIT 0 // In epoll_wait()
+#define ECONET_PHASE_TIMERS 1 // Timers which have gone off
+#define ECONET_PHASE_EVENTS 2 // Whatever woke us up
+#define ECONET_PHASE_WIRE 3 // Wire queue
+#define ECONET_PHASE_AUN 4 // AUN queues
+#define ECONET_PHASE_TRUNK 5 // Trunk queues
+#define ECONET_PHASE_FLUSH 6 // Servers' held traffic, the UDP batch, and waking the other threads
+#define ECONET_PHASES 7
+
+unsigned char loop_timing = 0; // Set once the phases are being timed
+unsigned long loop_timed = 0; // Trips round the loop since then
+uint64_t loop_phase_ns[ECONET_PHASES], loop_phase_max[ECONET_PHASES]; // Time spent in each phase in all, and the longest once (ns)
+uint64_t loop_phase_mark; // When the phase we're in started
+char *phase_names[ECONET_PHASES] = { "wait", "timers", "events", "wire", "aun", "trunk", "flush" };
+struct econet_timer imm_reset_timer, wire_retry_timer, housekeeping_timer, bridge_reset_timer;
+
+// Threads. The main (network) thread does the bridging - routing, queues, timers, AUN, named pipes and trunks. The
+// wire thread owns /dev/econet-gpio, so that waiting for a transmission to finish on the wire holds nothing else up,
+// the service thread runs the print and socket servers, and a pool of fileserver workers runs the fileservers, so
+// that a slow disc doesn't either. Each station's fileserver traffic always goes to the same worker, so it is dealt
+// with in the order it arrived. Packets go between the threads on single producer, single consumer rings - one for
+// each direction - and an eventfd on each ring wakes the thread which reads it. The log thread writes out the debug
+// and fileserver log output which the others put on their log rings. Each thread can be pinned to a core ('CPU' in
+// the config).
+
+#define ECONET_THREAD_NET 0
+#define ECONET_THREAD_WIRE 1
+#define ECONET_THREAD_SERVICE 2
+#define ECONET_THREAD_FS 3 // The first fileserver worker - the rest follow on
+#define ECONET_MAX_FS_WORKERS 8
+#define ECONET_THREAD_LOG (ECONET_THREAD_FS + ECONET_MAX_FS_WORKERS)
+#define ECONET_THREADS (ECONET_THREAD_LOG + 1)
+
+struct econet_ring {
+	unsigned char *buf;
+	uint32_t size; // Bytes - a power of 2
+	_Atomic uint32_t head, tail; // Free running byte counts. The producer writes at head, the consumer reads from tail
+	uint32_t reserved; // Producer only - where the record being filled in starts
+	unsigned char unsignalled; // Producer only - set when records have gone on since the consumer was last woken
+	int efd; // eventfd the consumer waits on
+	_Atomic uint32_t hwm; // Most bytes there have been in use at once. This and the counts are written by the producer
+	_Atomic unsigned long records, full; // only, but read by others (the log thread, statistics): records which have been through, and times there wasn't room for one
+	char name[24];
+};
+
+// Each record is one of these followed by len bytes, rounded up so that the next header is aligned. A record never
+// wraps round the end of the buffer - the space at the end is filled with an ECONET_RING_PAD record instead.
+
+struct econet_ring_rec {
+	uint32_t len;
+	uint16_t type;
+	uint16_t arg;
+	int32_t val, err;
+}; // 16 bytes, so that records stay aligned
+
+#define ECONET_RING_RECLEN(l) (sizeof(struct econet_ring_rec) + (((l) + 15) & ~15))
+#define ECONET_RING_PAD 0xffff
+
+// Records on the wire thread's rings
+#define ECONET_WIRE_REQ_QUEUED 1 // Send the packet off a wire queue (data is a pointer to it, val its length) and say how it went
+#define ECONET_WIRE_REQ_NOW 2 // Send the packet in the record (a broadcast or a bridge advert) - nobody wants to know how it went
+#define ECONET_WIRE_REQ_READMODE 3 // Put the chip back into read mode
+#define ECONET_WIRE_RX 4 // Packet off the wire
+#define ECONET_WIRE_DONE 5 // An ECONET_WIRE_REQ_QUEUED has finished - val is what econet_write_wire() returned, err the TX status, and the record holds how long it took (us, uint32_t)
+
+// Records on the service thread's and fileserver workers' rings
+#define ECONET_SVC_PACKET 1 // Traffic for a local file, print or socket server; val is the source for econet_handle_local_aun()
+#define ECONET_SVC_HOUSEKEEPING 2 // Time for fileserver garbage collection & socket server polling
+#define ECONET_SVC_EJECT 3 // Log station arg (net * 256 + stn) off the fileservers
+#define ECONET_SVC_SEND 4 // Packet from a server to go out through aun_send()
+
+#define ECONET_SVC_HEADROOM (2 * ECONET_RING_RECLEN(ECONET_MAX_PACKET_SIZE)) // The servers are told the bridge's queues are full if their ring has less room than this
+#define ECONET_SVC_HOLD 500 // Longest a server's packet waits for room on the queue it's going to before it's sent anyway (and probably dropped) (ms)
+
+// Records on the log rings - the data starts with when the record was made (ns, in a union econet_log_arg)
+#define ECONET_LOG_PRINTF 1 // From econet_log() - then the format, and its arguments (see econet_log())
+#define ECONET_LOG_AUN 2 // From dump_udp_pkt_aun() - then as much of the packet as was kept; val is its length, arg the source and destination letters
+
+#define ECONET_LOG_RING_SIZE (512 * 1024) // Each thread's
+#define ECONET_LOG_MAX_RECORD 2048 // Most data an econet_log() record can have - strings are cut short to fit
+#define ECONET_LOG_MAX_DUMP 1024 // Most packet data kept for a dump
+#define ECONET_LOG_LINE 4096 // Longest line the log thread will put together from one thread's records
+#define ECONET_LOG_BATCH 10 // How often the log thread looks at the rings while there is output about (ms) - nobody wakes it until it has gone to sleep, or a ring is half full
+
+union econet_log_arg {
+	long long i;
+	double d;
+	const void *p;
+}; // 8 bytes whether pointers are 4 or 8
+
+struct econet_log_line {
+	char buf[ECONET_LOG_LINE];
+	int len;
+}; // Where the log thread puts together a thread's line until its newline turns up
+
+struct econet_log_spec {
+	char flags[8];
+	int width, prec; // -1 = none given, -2 = '*'
+	char len, conv; // Length modifier, conversion
+}; // A printf() conversion specification, picked apart
+
+// The service thread is services[0], and fileserver worker n is services[n] - thread ECONET_THREAD_SERVICE + n
+
+struct econet_service {
+	struct econet_ring in, out; // Requests to the thread, and what its servers send back
+	uint64_t held_since; // When the packet at the front of out started waiting for room on its queue (ms), 0 = it isn't
+	struct econet_timer retry_timer; // Goes off when it's time to look at out again after a packet was held
+	_Atomic unsigned char wants_room; // Set by the thread while its *LOAD traffic waits for room on the bridge's queues - the network thread wakes it next time round
+};
+
+struct econet_ring wire_tx_ring, wire_rx_ring; // To & from the wire thread
+struct econet_service services[1 + ECONET_MAX_FS_WORKERS];
+int fs_workers = 2; // How many fileserver workers there are ('FSWORKERS' in the config)
+__thread int econet_thread = ECONET_THREAD_NET; // Which thread this is
+char *thread_names[ECONET_THREADS] = { "NET", "WIRE", "SERVICE", "FS1", "FS2", "FS3", "FS4", "FS5", "FS6", "FS7", "FS8", "LOG" };
+int thread_cpu[ECONET_THREADS] = { -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 }; // Core each thread is pinned to, -1 = not pinned
+pthread_t threads[ECONET_THREADS];
+clockid_t thread_clocks[ECONET_THREADS]; // CPU time clock for each thread, for the utilisation figures
+unsigned char thread_running[ECONET_THREADS];
+uint64_t thread_cpu_last[ECONET_THREADS], thread_wall_last; // CPU time each thread had used, and when, at the last statistics dump (ns)
+struct __econet_packet_aun_cache *wire_tx_entry = NULL; // Queued packet the wire thread is sending, if any
+struct econet_ring log_rings[ECONET_THREADS]; // Each thread's log output - those without one (before the log thread starts, and the log thread itself) write straight to stderr
+struct econet_log_line log_lines[ECONET_THREADS]; // Log thread only
+unsigned long log_lost[ECONET_THREADS]; // Log thread only - how many records from each thread it has said were lost
+_Atomic unsigned char log_running = 0; // Cleared again by econet_log_finish() on the way out
+pthread_mutex_t log_drain_lock = PTHREAD_MUTEX_INITIALIZER; // Held by whoever is draining the log rings - the log thread, or econet_log_finish()
+int log_efd = -1; // Wakes the log thread
+_Atomic unsigned char log_sleeping, log_woken; // Log thread has nothing to do & is waiting; somebody has already woken it
+FILE *log_out; // Log thread only - what it has to write out
+char *log_out_buf;
+size_t log_out_size;
+
+// AUN source lookup - maps (IPv4 address, UDP port) of distant AUN hosts to their network[] index so that
+// econet_find_source_station() doesn't have to walk the whole of network[] for every inbound datagram.
+// Open addressing with linear probing; deletion shifts entries back so there are no tombstones to build up
+// as dynamic stations come and go.
+
+#define ECONET_AUN_HASH_SIZE 8192 // Must be a power of 2, and comfortably bigger than the number of A / IP / dynamic hosts
+
+struct __aun_hash_entry {
+	struct in_addr s_addr;
+	unsigned int port;
+	int index; // Index into network[], -1 if this bucket is empty
+};
+
+struct __aun_hash_entry aun_hash[ECONET_AUN_HASH_SIZE];
+unsigned long aun_hash_hits = 0, aun_hash_misses = 0, aun_hash_collisions = 0; // Collisions counts extra buckets probed beyond the first
+unsigned long aun_hash_full = 0; // Dynamic allocations turned down because the host couldn't be indexed
+
+volatile sig_atomic_t dump_stats = 0; // Set by SIGUSR1 - main loop dumps statistics to stderr when it sees it
+volatile sig_atomic_t quit_signal = 0; // Set to SIGTERM or SIGINT when one arrives - main loop writes out the log and goes
+
 
 // Bridge control arrays
 unsigned char wire_advertizable[256]; /* AUN/IP and local networks - for replying to wire bridge queries */
@@ -275,20 +640,128 @@ struct __fw_entry {
 	void *next;
 };
 
+// Compiled form of a trunk's firewall list. Each (source net, destination net) pair gets a verdict - either FW_DROP or FW_ACCEPT
+// outright, or (FW_STNLIST + n) meaning that station numbers matter and list n has to be consulted. Built once at config time
+// by trunk_fw_compile() so that trunk_xlate_fw() doesn't have to walk the rule list for every packet.
+
+#define FW_STNLIST 3
+
+struct __fw_stnrule {
+	unsigned short srcstn, dststn; // 255 = wildcard
+	unsigned short action;
+};
+
+struct __fw_stnlist {
+	unsigned short numrules;
+	unsigned short dflt; // Verdict if none of the rules matches
+	struct __fw_stnrule *rules;
+};
+
+struct __fw_compiled {
+	unsigned short verdict[256][256]; // [srcnet][dstnet]
+	unsigned short numlists;
+	struct __fw_stnlist *lists;
+};
+
+// Trunk framing extensions. None is sent to a peer unless it has sent us a CAPS frame first, and bridges which
+// predate them ignore AUN types they don't know, so a CAPS frame to an old bridge does no harm.
+#define ECONET_TRUNK_CAPS 0x40 // Data: version, flags, largest aggregate we will take (2 bytes, little endian), then from version 2 the sender's trunk_epoch (4 bytes, little endian)
+#define ECONET_TRUNK_AGGREGATE 0x41 // Data: several frames (internal 12 byte header & all), each preceded by its length (2 bytes, little endian)
+#define ECONET_TRUNK_COMPRESSED 0x42 // Header as the original frame's; data: its AUN type, then its data as raw deflate using trunk_z_dict
+#define ECONET_TRUNK_CAPS_VERSION 2
+#define ECONET_TRUNK_CAPS_REPLY 0x01 // Flag: please send yours back
+#define ECONET_TRUNK_CAPS_COMPRESS 0x02 // Flag: we can take ECONET_TRUNK_COMPRESSED frames
+#define ECONET_TRUNK_CAPS_RELIABLE 0x04 // Flag: we can do reliable mode (ECONET_TRUNK_RELIABLE & ECONET_TRUNK_RACK)
+#define ECONET_TRUNK_CAPS_RETRY 1000 // ms to wait for the far end's CAPS before asking again - ours, or its reply, may have been lost
+#define ECONET_TRUNK_CAPS_TRIES 5 // Times we ask before deciding it's a bridge which doesn't know about CAPS (or has been replaced by one)
+#define ECONET_TRUNK_RELIABLE 0x43 // Header seq is the datagram's sequence number; data: the lowest one the sender is still trying to get across (4 bytes, little endian), then the datagram it would otherwise have sent
+#define ECONET_TRUNK_RACK 0x44 // Header seq is the next sequence number the receiver is waiting for; data: bitmap of the 64 after it, bit 0 = seq+1, set for those which have arrived (8 bytes, little endian)
+// Most datagrams a reliable trunk has in flight. Also how far ahead the receiver keeps track of which have arrived
+#define ECONET_TRUNK_REL_WINDOW 64
+// Congestion window a reliable trunk starts with (datagrams)
+#define ECONET_TRUNK_REL_INIT_CWND 4
+// Duplicate ACKs (ones with later datagrams marked as arrived, but no progress) before a fast retransmission
+#define ECONET_TRUNK_REL_DUPACKS 3
+// Frames with less data than this aren't worth compressing (bytes)
+#define ECONET_TRUNK_COMPRESS_MIN 64
+// Limits on 'MTU n' on a TRUNK line (bytes). The top one is as big as a datagram udp_receive() will take
+#define ECONET_TRUNK_MIN_MTU 512
+#define ECONET_TRUNK_MAX_MTU 32768
+// How long frames wait for others to share a datagram with before a part-filled aggregate goes anyway (ms)
+#define ECONET_TRUNK_AGG_DELAY 2
+
+// A datagram in flight on a reliable trunk
+
+struct __trunk_rel_tx {
+	unsigned char *d; // The datagram, envelope & all, in a pool block; NULL once it's known to have arrived (or we've given up)
+	unsigned int len;
+	unsigned char tx_count; // Times sent
+	struct timeval first_tx; // When it was first sent - for timing round trips, and giving up after ECONET_QUEUE_MAX_AGE
+};
+
 struct __trunk {
 	struct addrinfo *addr;
 	int listenport; // Local port number
 	int port; // Remote port number
 	int listensocket;
 	struct __fw_entry *head, *tail;
+	struct __fw_compiled *fw; // NULL if there are no firewall rules on this trunk
 	unsigned char xlate_src[256], xlate_dst[256]; // _src is the map we apply outbound, _dst is the mirror image for inbound
 	unsigned char adv_in[256], adv_out[256]; // Advertised networks. _in received from other end, _out is last advert sent by us
 	unsigned char filter_in[256], filter_out[256]; // Filter masks for in & out
 	char hostname[300];
+	struct __econet_packet_aun_cache *q_head, *q_tail; // Output queue - already translated for this trunk
+	unsigned int q_len; // Packets on it
+	unsigned long q_bytes; // And how big they are
+	struct econet_codel q_codel; // Delay management for the queue
+	int ready_next; // Next trunk on the ready list (or -1). Only meaningful whilst ready is set
+	unsigned char ready; // Set whilst this trunk is on the ready list
+	unsigned long flushes, flushed_packets, flush_max; // How many times the queue has been sent, how many packets that came to, and the most in one go
+	unsigned short mtu; // Largest aggregate datagram we will send or take on this trunk ('MTU n' on the TRUNK line); 0 = one frame per datagram
+	unsigned short peer_mtu; // Largest the far end will take, from its CAPS frame; 0 = it hasn't said it can take them
+	struct econet_timer agg_timer; // Goes off when a part-filled aggregate has waited long enough
+	unsigned char agg_due; // Set when it has
+	unsigned long agg_tx, agg_tx_frames, agg_rx, agg_rx_frames; // Aggregates sent & received, and how many frames were in them
+	unsigned char compress; // 'COMPRESS' on the TRUNK line - compress what we send, if the far end can take it
+	unsigned char peer_compress; // Far end said in its CAPS frame that it can
+	unsigned long z_tx, z_tx_skipped, z_rx; // Frames sent compressed, sent as they were (too small, or didn't shrink), and received compressed
+	unsigned long long z_tx_in, z_tx_out; // Bytes of frame before & after compression
+	uint64_t z_tx_ns, z_rx_ns; // CPU time spent compressing & decompressing
+	unsigned char reliable; // 'RELIABLE' on the TRUNK line - sequence & acknowledge what we send, if the far end can
+	unsigned char peer_reliable; // Far end said in its CAPS frame that it can
+	struct econet_timer caps_timer; // Goes off when it's time to ask for the far end's CAPS again
+	unsigned char caps_tries; // Times left to ask
+	uint32_t peer_epoch; // Far end's trunk_epoch from its last CAPS frame; 0 = not known, so the next one is taken as a restart
+	struct __trunk_rel_tx rel_tx[ECONET_TRUNK_REL_WINDOW]; // Datagrams in flight, indexed by sequence number modulo the window
+	uint32_t snd_una, snd_nxt; // Oldest sequence number not yet known to have arrived; next one to use
+	uint32_t recover; // Whilst in_recovery, snd_nxt when the loss was spotted
+	unsigned int cwnd, ssthresh, cwnd_acc; // Congestion window & slow start threshold (datagrams); ACKs counted towards the next window increase
+	unsigned int dupacks; // Successive ACKs which didn't move snd_una
+	unsigned char in_recovery; // Set after a fast retransmission until everything sent before it has arrived
+	unsigned long srtt, rttvar, rtt_samples; // See econet_rtt_update()
+	unsigned int rto; // Retransmission timeout in ms before backoff; 0 = not yet measured
+	unsigned char backoff; // Times the timeout has doubled since the last ACK which moved snd_una
+	struct econet_timer rel_timer; // Retransmission timer
+	uint32_t rcv_next; // Next sequence number we're waiting for from the far end
+	uint64_t rcv_map; // Which of rcv_next onwards have arrived (bit 0 = rcv_next)
+	unsigned char rcv_sync; // Clear until the first datagram after a CAPS frame tells us where the far end has got to
+	unsigned char ack_due; // Something has arrived which we haven't ACKed
+	unsigned long rel_sent, rel_fast_retx, rel_timeout_retx, rel_given_up, rel_rcvd, rel_dups;
+	unsigned long tx_frames, tx_bytes, rx_frames, rx_bytes; // Traffic over the trunk, as frames before aggregation or compression
+	unsigned long fw_drops; // Inbound frames stopped by the firewall, or from networks the far end hasn't advertised
 };
 
 struct __trunk trunks[256];
-struct __econet_packet_aun_cache *trunk_head = NULL, *trunk_tail = NULL;
+uint32_t trunk_epoch; // Picked afresh each time the bridge starts, and sent in CAPS frames so the far end can tell a restart from a routine bridge reset
+unsigned long trunk_unknown_drops = 0; // Datagrams arriving on a trunk socket from somewhere other than that trunk's peer
+short trunk_route[256]; // Network number -> index into trunks[] of the (lowest numbered) trunk advertizing it to us, or -1. Kept up to date by econet_bridge_process() whenever an adv_in[] changes
+_Atomic short queue_route[256]; // Network number -> trunk_route[] for the server threads, or ECONET_QUEUE_ROUTE_WIRE if it's via a bridge on the wire - see econet_queue_route_publish()
+#define ECONET_QUEUE_ROUTE_WIRE -2
+int trunk_ready_head = -1; // First trunk with something queued to go, or -1
+unsigned long trunk_queued = 0; // Packets on all the trunk queues
+
+// Most a trunk's queue sends each time round the main loop, so that one busy trunk can't hold everything else up (bytes)
+#define ECONET_TRUNK_FLUSH_BUDGET 65536
 
 // The network number we report in a first bridge reply. It's the first distant network we learn about from the config
 // Eventually we may listen for bridge announcements and update it from that
@@ -297,6 +770,43 @@ short nativebridgenet = 0, localnet = 0;
 
 struct sockaddr_in src_address;
 
+// Batched UDP I/O. Inbound datagrams are drained from a socket ECONET_UDP_BATCH at a time with recvmmsg(); outbound ones are copied into udp_tx and sent per-socket with sendmmsg() at the end of each trip round the main loop
+
+#define ECONET_UDP_BATCH 16
+
+struct {
+	int fd, count, next; // Socket the batch came from, how many datagrams, and which one udp_receive() hands out next
+	struct mmsghdr msgs[ECONET_UDP_BATCH];
+	struct iovec iov[ECONET_UDP_BATCH];
+	struct sockaddr_in addr[ECONET_UDP_BATCH];
+	unsigned char control[ECONET_UDP_BATCH][CMSG_SPACE(sizeof(struct in_pktinfo))];
+	struct __econet_packet_aun buf[ECONET_UDP_BATCH];
+} udp_rx = { .fd = -1 };
+
+struct __udp_tx_entry {
+	int fd, offset, len;
+	struct sockaddr_storage addr;
+	socklen_t addrlen;
+	struct in_addr from; // Source address to send from, if has_from - used on the shared AUN socket
+	unsigned char has_from;
+};
+
+struct {
+	int count, used; // Number of queued datagrams, bytes used in arena
+	struct __udp_tx_entry entries[ECONET_UDP_BATCH * 4];
+	unsigned char arena[ECONET_UDP_BATCH * 8192];
+} udp_tx;
+
+unsigned long udp_rx_calls, udp_rx_datagrams, udp_tx_calls, udp_tx_datagrams, udp_tx_errors;
+struct in_addr udp_rx_dst; // Local address the datagram most recently handed out by udp_receive() was sent to (from IP_PKTINFO)
+
+// Shared AUN listener ('B a.b.c SHARED'). Rather than one socket per wire / local station, one socket on port 32768 takes traffic for all of them and the destination station is the last octet of the address it was sent to
+
+int aun_shared_socket = -1;
+struct in_addr aun_shared_base; // a.b.c.0
+int aun_shared_ptr[256]; // Station number (last octet) -> network[] index, or -1
+unsigned long aun_shared_rx, aun_shared_unknown;
+
 // Packet Buffers
 struct __econet_packet_udp udp_pkt;
 struct __econet_packet_aun aun_pkt;
@@ -339,2661 +849,7858 @@ unsigned long timediffmsec(struct timeval *s, struct timeval *d)
 
 }
 
+// Packet pools. Queued packets (and their queue entries, which live in the same block) come out of a handful of size classes, each with its own free list, rather than malloc()/free() per packet.
+// Blocks are carved from slabs which are never handed back; once the slabs add up to pool_cap bytes, allocation fails and the caller drops (or NAKs) the traffic instead of the bridge growing without bound.
+
+#define POOL_CLASSES 5
+#define POOL_SLAB_SIZE 65536 // Slabs are this big, or one block if the block is bigger
+#define POOL_DEFAULT_CAP 64 // Megabytes
+
+struct __pool_block {
+	_Alignas(max_align_t) union { // Keeps what follows as aligned as malloc() would have it, whatever the word size
+		struct __pool_block *next; // When on the free list
+		unsigned char class; // When allocated
+	};
+};
+
+struct __pool_class {
+	unsigned int size; // Usable bytes in each block
+	struct __pool_block *free;
+	unsigned long blocks, inuse, hwm, allocs, failures;
+} pool_class[POOL_CLASSES] = {
+	{ .size = 128 }, { .size = 512 }, { .size = 2048 }, { .size = 8192 }, { .size = ECONET_MAX_PACKET_SIZE + 256 }
+};
+
+unsigned long pool_reserved = 0, pool_cap = POOL_DEFAULT_CAP * 1024 * 1024; // Bytes of slab obtained so far, and the most we'll get
+pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER; // The fileserver uses the pools too, from the service thread
 
-#define QUEUE_HEAD 1
-#define QUEUE_TAIL 2
-#define QUEUE_AUTO 3
+// Get a block of at least len bytes, or NULL if it's too big or we've hit the memory cap
 
-// Puts packet *p on the queue starting at *head. If headortail = QUEUE_HEAD, it will go at *head; if QUEUE_TAIL, then at *tail; if AUTO then it will decide based
-// on whether the current priority settings for this host require it to be prioritised
-// ptr is a pointer into the network[] array for the host in question, so we can find the priority settings
-// This will COPY p from its current memory and malloc a new structure for the queue
-void econet_enqueue (struct __econet_packet_aun *p, int len, unsigned char headortail)
+void * econet_pool_alloc(unsigned int len)
 {
 
-	struct timeval now;
-	unsigned char placeat = QUEUE_TAIL;
-	struct __econet_packet_aun *p_entry;
-	struct __econet_packet_aun_cache *q_entry;
+	int c;
+	struct __pool_class *pc;
+	struct __pool_block *b;
 
-	gettimeofday(&now, 0);
+	for (c = 0; c < POOL_CLASSES && pool_class[c].size < len; c++);
 
-	if (queue_debug)	fprintf (stderr, "QUEUE: to %3d.%3d from %3d.%3d len 0x%04X request  wire   enqueue mode %02X ",
-		p->p.dstnet, p->p.dststn,
-		p->p.srcnet, p->p.srcstn,
-		len,
-		headortail);
-
-	if (headortail == QUEUE_AUTO) // See if it's prioritized
-	{
-		if (
-			((wire_prio_out_srcnet != -1 || wire_prio_out_srcstn != -1 || wire_prio_out_dstnet != -1 || wire_prio_out_dststn != -1 || wire_prio_out_auntype != -1 || wire_prio_out_port == -1)) // Some sort of priority set
-		&&	(timediffmsec(&(wire_prio_expiry), &now) < 0) // I.e. now is before expiry
-		&&	(
-				(wire_prio_out_srcnet == -1 || (wire_prio_out_srcnet == p->p.srcnet))
-			&&	(wire_prio_out_srcstn == -1 || (wire_prio_out_srcstn == p->p.srcstn))
-			&&	(wire_prio_out_dstnet == -1 || (wire_prio_out_dstnet == p->p.dstnet))
-			&&	(wire_prio_out_dststn == -1 || (wire_prio_out_dststn == p->p.dststn))
-			&&	(wire_prio_out_auntype == -1 || (wire_prio_out_auntype == p->p.aun_ttype))
-			&&	(wire_prio_out_port == -1 || (wire_prio_out_port == p->p.port))
-			)
-		)
-			placeat = QUEUE_HEAD;
-		if (queue_debug) fprintf (stderr, "placing on %s ", (placeat == QUEUE_HEAD ? "head" : "tail"));
-	
-	}
+	if (c == POOL_CLASSES)
+		return NULL;
 
-	p_entry = malloc(len);
-	if (!p_entry) // Malloc failed
-	{
-		if (queue_debug)	fprintf (stderr, ": main malloc failed!\n");
-		return;
-	}
+	pc = &(pool_class[c]);
+
+	pthread_mutex_lock(&pool_lock);
 
-	q_entry = malloc(sizeof(struct __econet_packet_aun_cache));
-	if (!q_entry) // Malloc failed
+	if (!pc->free) // Need another slab
 	{
-		if (queue_debug)	fprintf (stderr, ": packet malloc failed!\n");
-		free(p_entry);
-		return;
-	}
+		unsigned int bsize, count, n;
+		unsigned char *slab;
 
-	memcpy(p_entry, p, len);
-	q_entry->p = p_entry;
-	q_entry->size = len;
-	q_entry->next = NULL;
-	q_entry->tx_count = 0;
-	memcpy(&(q_entry->tstamp), &now, sizeof(struct timeval));
+		bsize = sizeof(struct __pool_block) + ((pc->size + _Alignof(max_align_t) - 1) & ~(_Alignof(max_align_t) - 1)); // So the next block is aligned too
+		count = (POOL_SLAB_SIZE / bsize) ? (POOL_SLAB_SIZE / bsize) : 1;
 
-	// Is the queue empty so it doesn't matter where we put this?
-	if (wire_head == NULL)
-		wire_head = wire_tail = q_entry;
-	else if (placeat == QUEUE_HEAD)
-	{
-		q_entry->next = wire_head;
-		wire_head = q_entry;
-	}
-	else
-	{
-		wire_tail->next = q_entry;
-		wire_tail = q_entry;
+		if (pool_reserved + (bsize * count) > pool_cap || !(slab = malloc(bsize * count)))
+		{
+			pc->failures++;
+			pthread_mutex_unlock(&pool_lock);
+			if (queue_debug) econet_debug (" POOL: Unable to allocate %d bytes - %lu of %lu bytes reserved\n", len, pool_reserved, pool_cap);
+			return NULL;
+		}
+
+		pool_reserved += bsize * count;
+		pc->blocks += count;
+
+		for (n = 0; n < count; n++)
+		{
+			b = (struct __pool_block *) (slab + (n * bsize));
+			b->next = pc->free;
+			pc->free = b;
+		}
 	}
 
-	if (queue_debug) fprintf (stderr, "- queued\n");
+	b = pc->free;
+	pc->free = b->next;
+	b->class = c;
+
+	pc->allocs++;
+	if (++(pc->inuse) > pc->hwm)
+		pc->hwm = pc->inuse;
 
-	return;
+	pthread_mutex_unlock(&pool_lock);
+
+	return (void *) (b + 1);
 
 }
 
-int econet_general_enqueue(struct __econet_packet_aun_cache **head, struct __econet_packet_aun_cache **tail, struct __econet_packet_aun *p, int len)
+// Put a block from econet_pool_alloc() back on its free list
+
+void econet_pool_free(void *p)
 {
 
-	struct timeval now;
-	struct __econet_packet_aun *p_entry;
-	struct __econet_packet_aun_cache *q_entry;
+	struct __pool_block *b;
+	struct __pool_class *pc;
 
-	if (queue_debug)	fprintf (stderr, "QUEUE: to %3d.%3d from %3d.%3d len 0x%04X request general enqueue\n",
-		p->p.dstnet, p->p.dststn,
-		p->p.srcnet, p->p.srcstn,
-		len);
+	if (!p) return;
 
-	gettimeofday(&now, 0);
-	p_entry = malloc(len);
-	if (!p_entry) // Malloc failed
-	{
-		if (queue_debug)	fprintf (stderr, "QUEUE: main malloc failed!\n");
-		return 0;
-	}
+	b = ((struct __pool_block *) p) - 1;
+	pc = &(pool_class[b->class]);
 
-	q_entry = malloc(sizeof(struct __econet_packet_aun_cache));
-	if (!q_entry) // Malloc failed
-	{
-		if (queue_debug)	fprintf (stderr, "QUEUE: packet malloc failed!\n");
-		free(p_entry);
-		return 0;
-	}
+	pthread_mutex_lock(&pool_lock);
+	pc->inuse--;
+	b->next = pc->free;
+	pc->free = b;
+	pthread_mutex_unlock(&pool_lock);
+
+}
+
+// Make a queue entry with a copy of packet p (len bytes) in one pool block
 
-	memcpy(p_entry, p, len);
-	q_entry->p = p_entry;
+struct __econet_packet_aun_cache * econet_queue_entry(struct __econet_packet_aun *p, int len)
+{
+
+	struct __econet_packet_aun_cache *q_entry;
+
+	if (!(q_entry = econet_pool_alloc(sizeof(struct __econet_packet_aun_cache) + len)))
+		return NULL;
+
+	q_entry->p = (struct __econet_packet_aun *) (q_entry + 1);
+	memcpy(q_entry->p, p, len);
 	q_entry->size = len;
 	q_entry->next = NULL;
 	q_entry->tx_count = 0;
-	memcpy(&(q_entry->tstamp), &now, sizeof(struct timeval));
-
-	// Is the queue empty so it doesn't matter where we put this?
-	if (*head == NULL)
-		*head = *tail = q_entry;
-	else
-	{
-		(*tail)->next = q_entry;
-		(*tail) = q_entry;
-	}
 
-	return 1;
+	return q_entry;
 
 }
 
-void econet_general_dumphead(struct __econet_packet_aun_cache **head, struct __econet_packet_aun_cache **tail) // see econet_dumphead() - this is the trunk equivalent
+void econet_pool_dump(FILE *out)
 {
 
-	struct __econet_packet_aun_cache *q_entry;
+	int c;
 
-	q_entry = *head;
+	fprintf (out, "STATS: Packet pools - %lu of %lu bytes reserved\n", pool_reserved, pool_cap);
 
-	if (queue_debug) fprintf (stderr, "QUEUE: Dumping packet at queue head %p\n", *head);
+	for (c = 0; c < POOL_CLASSES; c++)
+		fprintf (out, "STATS:   %5d byte blocks: %5lu allocated, %5lu in use, high water %5lu, %8lu allocations, %5lu refused\n",
+			pool_class[c].size, pool_class[c].blocks, pool_class[c].inuse, pool_class[c].hwm, pool_class[c].allocs, pool_class[c].failures);
 
-	if (q_entry)
-	{
-		*head = (*head)->next;
-		if (!(*head))
-			*tail = NULL;
-		free (q_entry->p);
-		free (q_entry);
-	}
+}
 
+// Latency histograms - see struct econet_hist. Each is recorded by one thread, apart from fs_op_hist[], which the
+// fileserver workers share and record with econet_hist_add_shared(). The network thread reads and resets them all.
 
-}
+struct econet_hist wire_tx_hist; // How long econet_write_wire() took over each queued packet
+struct econet_hist queue_sojourn_hist[ECONET_QUEUE_TYPES]; // How long packets waited on each type of queue before they went
+struct econet_hist fs_op_hist[256]; // How long the fileservers took over each operation, by function code
 
-// cache_pos = 0 means put this packet on the tail of the queue if it collides. 1 = put it on the head, because that's where it came from
-unsigned int econet_write_wire(struct __econet_packet_aun *p, int len, int cache_pos)
+static inline int econet_hist_bucket(uint64_t v)
 {
+	int e;
 
-	int err = ECONET_TX_JAMMED; // Default
-	int result;
+	if (v >> ECONET_HIST_MAX_BITS)
+		v = ((uint64_t) 1 << ECONET_HIST_MAX_BITS) - 1;
 
-		result = write(econet_fd, p, len);
-	
-		err = ioctl(econet_fd, ECONETGPIO_IOC_TXERR);
+	if (v < (2 * ECONET_HIST_SUB))
+		return v;
 
-		if (err == ECONET_TX_NOCLOCK || err == ECONET_TX_NOCOPY || result != len)
-			return (-1 * err);
+	e = (63 - __builtin_clzll(v)) - ECONET_HIST_SUB_BITS; // Bits below the top ECONET_HIST_SUB_BITS + 1 which don't matter
 
-		if (err == ECONET_TX_INPROGRESS || err == ECONET_TX_DATAPROGRESS)
-		{
-			struct timeval start, now;
+	return (e * ECONET_HIST_SUB) + (v >> e);
+}
 
-			gettimeofday(&start, 0);
-			gettimeofday(&now, 0);
+// The largest value which goes in bucket b
 
-			// Wait for TX to complete
-			err = ioctl(econet_fd, ECONETGPIO_IOC_TXERR);
-			while ((err == ECONET_TX_INPROGRESS || err == ECONET_TX_DATAPROGRESS) && (timediffmsec(&start, &now) < ((2 + ((len+1024) / 1024) * 41)) )) // 1Kb on the wire is < 50ms. So 30Kb is < 150ms.
-			{
-				gettimeofday(&now, 0);
-				err = ioctl(econet_fd, ECONETGPIO_IOC_TXERR);
-			}
+uint64_t econet_hist_value(int b)
+{
+	int e;
 
-			if (err == ECONET_TX_SUCCESS)
-			{
-				return len;
-			}
+	if (b < (2 * ECONET_HIST_SUB))
+		return b;
 
-		}
+	e = (b / ECONET_HIST_SUB) - 1;
 
-	return (-1 * err);
+	return (((uint64_t) (b - (e * ECONET_HIST_SUB)) + 1) << e) - 1;
+}
+
+// Record v (us) in h
 
+void econet_hist_add(struct econet_hist *h, uint64_t v)
+{
+	h->counts[econet_hist_bucket(v)]++;
+	h->sum += v;
+	if (v > h->max)
+		h->max = v;
 }
 
-int econet_write_general(struct __econet_packet_aun *p, int len)
+// The same, for a histogram which more than one thread records in
+
+void econet_hist_add_shared(struct econet_hist *h, uint64_t v)
 {
-	int trunk, ptr;
+	uint64_t max;
 
-	trunk = trunk_find(p->p.dstnet);
-	ptr = econet_ptr[p->p.dstnet][p->p.dststn];
+	__atomic_add_fetch(&(h->counts[econet_hist_bucket(v)]), 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&(h->sum), v, __ATOMIC_RELAXED);
 
-	if (ptr != -1 || p->p.aun_ttype == ECONET_AUN_BCAST) // A station we know
-	{
-		// What sort of destination?
-		
-		if ((network[ptr].type & ECONET_HOSTTYPE_TWIRE) || (ptr == -1 && p->p.aun_ttype == ECONET_AUN_BCAST)) // WIRE, or an unknown station and it's a broadcast
-			return econet_write_wire(p, len, 0); // Will eventually get rid of parameter 3!
-		else if (network[ptr].type & ECONET_HOSTTYPE_TDIS) // AUN
-		{
-			struct sockaddr_in n;
-			int sender;
-			int result;
+	max = __atomic_load_n(&(h->max), __ATOMIC_RELAXED);
+	while (v > max && !__atomic_compare_exchange_n(&(h->max), &max, v, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
 
-			n.sin_family = AF_INET;
-			n.sin_port = htons(network[ptr].port);
-			n.sin_addr = network[ptr].s_addr;
+void econet_hist_reset(struct econet_hist *h)
+{
+	int b;
 
-			// Since AUN hosts can't talk to trunks, we should be able to safely look up the sending host
+	for (b = 0; b < ECONET_HIST_BUCKETS; b++)
+		__atomic_store_n(&(h->counts[b]), 0, __ATOMIC_RELAXED);
 
-			sender = econet_ptr[p->p.srcnet][p->p.srcstn];
+	__atomic_store_n(&(h->sum), 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&(h->max), 0, __ATOMIC_RELAXED);
+}
 
-			result = sendto(
-				(network[sender].type & ECONET_HOSTTYPE_TNAMEDPIPE) ? network[sender].pipeudpsocket : network[sender].listensocket,  // If it's a named pipe, we don't send from listensocket, we send from pipeudpsocket
-				&(p->p.aun_ttype), len-4, MSG_DONTWAIT, (struct sockaddr *)&n, sizeof(n));
-			
-			if (result == len-4) return len; // Because we drop the 4 header bytes off!
-			else return result;
+// Work out the percentiles of h into *s. A percentile is given as the top of the bucket it falls in (or the largest
+// value recorded, if that's smaller), so it is never an underestimate. Returns how many values h holds.
 
-		}
-		else if (network[ptr].type & ECONET_HOSTTYPE_TNAMEDPIPE) // Named Pipe
-		{
-			if (network[ptr].pipewritesocket != -1)
-			{
-				struct __econet_packet_pipe delivery;
+unsigned long econet_hist_summarise(struct econet_hist *h, struct econet_hist_summary *s)
+{
+	static unsigned long counts[ECONET_HIST_BUCKETS]; // Taken all at once, in case another thread is adding to h
+	static const unsigned int per10000[4] = { 5000, 9000, 9900, 9990 };
+	uint64_t *results[4] = { &(s->p50), &(s->p90), &(s->p99), &(s->p999) };
+	unsigned long want[4], seen = 0;
+	int b, p;
 
-				int r;
+	memset(s, 0, sizeof(struct econet_hist_summary));
 
-				delivery.length_low = len & 0xff;
-				delivery.length_high = (len >> 8) & 0xff;
+	for (b = 0; b < ECONET_HIST_BUCKETS; b++)
+		s->count += (counts[b] = __atomic_load_n(&(h->counts[b]), __ATOMIC_RELAXED));
 
-				memcpy (&(delivery.dststn), p, len);
+	if (!s->count)
+		return 0;
 
-				r = write(network[ptr].pipewritesocket, &delivery, len+2);
+	s->mean = __atomic_load_n(&(h->sum), __ATOMIC_RELAXED) / s->count;
+	s->max = __atomic_load_n(&(h->max), __ATOMIC_RELAXED);
 
-				if (r == (len+2)) return r-2;
-				else return r;
-			}
-			else	
-			{
-				if (pkt_debug) fprintf (stderr, "PIPE : Pipe write socket not open\n");
-				return -1; // The other end of the named pipe isn't open
-			}
-		}
-		else
-		{
-			fprintf (stderr, "ERROR: to %3d.%3d from %3d.%3d Unknown destination type (0x%02x) - cannot route\n", p->p.dstnet, p->p.dststn, p->p.srcnet, p->p.srcstn, network[ptr].type);
-			return -1;
-		} // NB, Local transmission handled on arrival
+	for (p = 0; p < 4; p++)
+		want[p] = ((s->count * per10000[p]) + 9999) / 10000;
 
-	}
-	else if (trunk >= 0) // On a trunk
-		return aun_trunk_send(p, len);
-	else
+	for (b = 0, p = 0; b < ECONET_HIST_BUCKETS && p < 4; b++)
 	{
-		fprintf (stderr, "ERROR: to %3d.%3d from %3d.%3d Cannot route\n", p->p.dstnet, p->p.dststn, p->p.srcnet, p->p.srcstn);
-		return -1;
+		seen += counts[b];
+
+		while (p < 4 && seen >= want[p])
+		{
+			*(results[p]) = econet_hist_value(b);
+			if (*(results[p]) > s->max)
+				*(results[p]) = s->max;
+			p++;
+		}
 	}
 
+	return s->count;
 }
 
-// Get index number of printer (not priority number, but the index into network[].printers)
-// Or return -1 if no such printer.
+// Queue delay management, after CoDel. As each packet leaves a queue, econet_codel_dequeued() is told how long it
+// waited. Once packets have been waiting longer than codel_target for a whole codel_interval, the queue starts
+// 'dropping': econet_queue_admit() then sheds an arrival, and sheds them closer together (interval / sqrt(count))
+// the longer the delay persists. Shedding happens as packets arrive rather than at the head of the queue, because
+// AUN data has usually been ACKed by then - turning it away on arrival means we can NAK it instead.
 
-int8_t get_printer(unsigned char net, unsigned char stn, char *pname) 
+static unsigned int econet_isqrt(unsigned int n)
 {
+	unsigned int r = 0, b = 1 << 15;
 
-	uint8_t printindex;
-	char pnamepad[7];
+	while (b)
+	{
+		if ((r + b) * (r + b) <= n)
+			r += b;
+		b >>= 1;
+	}
 
-	int netindex;
+	return r;
+}
 
-	netindex = econet_ptr[net][stn];
+// A packet which had been queued since *tstamp has just gone from a queue of type 'type'. left = bytes still queued behind it
 
-	if (netindex == -1) return -1; // Can't find that station defined locally.
+void econet_codel_dequeued(int type, struct econet_codel *c, struct timeval *tstamp, unsigned long left)
+{
+	struct timeval now;
+	uint64_t ms;
+	long sojourn;
+	unsigned char ok_to_drop = 0;
 
-	snprintf(pnamepad, 7, "%-6.6s", pname);
+	gettimeofday(&now, 0);
 
-	printindex = 0;
+	sojourn = ((now.tv_sec - tstamp->tv_sec) * 1000000) + (now.tv_usec - tstamp->tv_usec);
+	econet_hist_add(&(queue_sojourn_hist[type]), sojourn < 0 ? 0 : sojourn);
+
+	if (!codel_target)
+		return;
+
+	ms = econet_ms();
 
-	while (printindex < network[netindex].numprinters)
+	if (sojourn < (long) codel_target * 1000 || left == 0) // Fine - or the queue has gone, which will do
+		c->first_above = 0;
+	else if (c->first_above == 0)
+		c->first_above = ms + codel_interval;
+	else if (ms >= c->first_above)
+		ok_to_drop = 1;
+
+	if (c->dropping)
 	{
-		if (!strncasecmp(network[netindex].printers[printindex].name, pnamepad, 6))
-			return printindex;
-		printindex++;
+		if (!ok_to_drop)
+			c->dropping = 0;
+	}
+	else if (ok_to_drop)
+	{
+		c->dropping = 1;
+		// Shed the next arrival. If we were dropping not long ago, carry on from about where we got to
+		c->count = (c->count > 2 && ms < c->drop_next + (16 * codel_interval)) ? c->count - 2 : 0;
+		c->drop_next = ms;
 	}
+}
 
-	return -1; // not found if we get here
+// May a packet of len bytes join a queue of type 'type' which already has 'packets' packets totalling 'bytes'?
+// sheddable = 1 if the packet's sender will try again (or at least can be told to) if it's turned away. Returns 1 if so.
+
+int econet_queue_admit(int type, struct econet_codel *c, unsigned int packets, unsigned long bytes, int len, unsigned char sheddable)
+{
+	uint64_t ms;
+
+	if ((queue_limits[type].packets && packets >= queue_limits[type].packets) || (queue_limits[type].bytes && (bytes + len) > queue_limits[type].bytes))
+	{
+		queue_full_drops[type]++;
+		return 0;
+	}
+
+	if (sheddable && c->dropping && packets)
+	{
+		ms = econet_ms();
+
+		if (ms >= c->drop_next)
+		{
+			c->count++;
+			c->drop_next = ms + (codel_interval / econet_isqrt(c->count));
+			queue_delay_drops[type]++;
+			return 0;
+		}
+	}
+
+	return 1;
 }
 
-void econet_readconfig(void) 
+// Whether a queue holding 'packets' packets / 'bytes' bytes has room to take more from a sender which is happy to wait
+// (e.g. a fileserver *LOAD) - i.e. it's not full, and it isn't building up a delay
+
+int econet_queue_has_room(int type, struct econet_codel *c, unsigned int packets, unsigned long bytes)
 {
-	// This reads a config file in like the BeebEm One.
-	// However, stations with IP address 0.0.0.0 are on the Econet wire.
-	// We listen on all IP addresses with the specified port for each one.
-	// Stations with real IP addresses are out on the internet (or potentially on
-	// The local machine if some sort of emulator is running - e.g. BeebEm
-	
-	FILE *configfile;
-	char linebuf[256], basenet[20];
-	regex_t r_comment, r_entry_distant, r_entry_local, r_entry_server, r_entry_wire, r_entry_trunk, r_entry_xlate, r_entry_fw, r_entry_learn, r_entry_namedpipe, r_entry_filter, r_entry_basenet, r_entry_printhandler;
-	regmatch_t matches[9];
-	int count;
-	short j, k;
-	int networkp; // Pointer into network[] array whilst reading config. 
-	
-	char *end;
+	if (packets == 0)
+		return 1;
 
-	struct hostent *h;
-	struct sockaddr_in service;
+	if (queue_limits[type].packets && packets >= queue_limits[type].packets)
+		return 0;
 
-	numtrunks = 0;
+	if (queue_limits[type].bytes && bytes >= queue_limits[type].bytes)
+		return 0;
 
-	pmax = 0;
-	memset(&wire_advertizable, 0, sizeof(wire_advertizable));
-	memset(&trunk_advertizable, 0, sizeof(wire_advertizable));
-	memset(&wire_adv_in, 0, sizeof(wire_adv_in));
-	memset(&wire_adv_out, 0, sizeof(wire_adv_out));
-	memset(&wire_filter_in, 0, sizeof(wire_filter_in));
-	memset(&wire_filter_out, 0, sizeof(wire_filter_out));
-	*basenet='\0';
+	return (c->first_above == 0);
+}
 
-// Set all the networkp entries within the last printer table to 65535.
-	memset(&last_printers, 255, sizeof(last_printers));
+// The server threads can't look at a queue while the network thread is changing it, so whenever a queue's length
+// or c->first_above moves, the network thread leaves the answer econet_queue_has_room() would give in c->full for
+// econet_queue_room() to read
 
-	configfile = fopen(cfgpath, "r");
-	if (configfile == NULL)
-	{
-		fprintf(stderr, "Unable to open config file %s: %s\n", cfgpath, strerror(errno));
-		exit(EXIT_FAILURE);
-	}
+void econet_queue_publish(int type, struct econet_codel *c, unsigned int packets, unsigned long bytes)
+{
+	atomic_store_explicit(&(c->full), !econet_queue_has_room(type, c, packets, bytes), memory_order_relaxed);
+}
 
-	/* Blank off the variables */
+// Flow queue a packet from srcnet.srcstn to dstnet.dststn goes on
 
-	for (j = 0; j < 256; j++)
-		for (k = 0; k < 256; k++)
-			econet_ptr[j][k] = -1;
+int econet_wire_flow(unsigned char srcnet, unsigned char srcstn, unsigned char dstnet, unsigned char dststn)
+{
+	uint32_t h;
 
-	for (j = 0; j < 256; j++)
-	{
-		trunks[j].listensocket = -1;
-	}
+	h = ((srcnet << 24) | (srcstn << 16) | (dstnet << 8) | dststn) * 2654435761U;
 
-	networkp = 0;
+	return (h ^ (h >> 15)) & (ECONET_WIRE_FLOWS - 1);
+}
 
-	/* Compile some regular expressions */
+// Puts packet *p on the wire output queues - the priority lane if it is an immediate reply (the station on the wire
+// is sat waiting for it), otherwise on the end of its flow's queue. sheddable - see econet_queue_admit()
+// This will COPY p from its current memory into a pool block for the queue. Returns 0 if the pool is exhausted or
+// the flow's queue is full (or too slow) and the packet was dropped.
+int econet_enqueue (struct __econet_packet_aun *p, int len, unsigned char sheddable)
+{
 
-	if (regcomp(&r_comment, "^\\s*#.*$", 0) != 0)
+	struct timeval now;
+	struct __econet_packet_aun_cache *q_entry;
+	struct wire_flow *f = NULL;
+	int flow = -1;
+
+	gettimeofday(&now, 0);
+
+	if (queue_debug)	econet_debug ("QUEUE: to %3d.%3d from %3d.%3d len 0x%04X request  wire   enqueue ",
+		p->p.dstnet, p->p.dststn,
+		p->p.srcnet, p->p.srcstn,
+		len);
+
+	if (p->p.aun_ttype != ECONET_AUN_IMMREP)
 	{
-		fprintf(stderr, "Unable to compile comment regex.\n");
-		exit(EXIT_FAILURE);
+		flow = econet_wire_flow(p->p.srcnet, p->p.srcstn, p->p.dstnet, p->p.dststn);
+		f = &(wire_flows[flow]);
+
+		if (!econet_queue_admit(ECONET_QUEUE_WIRE, &(f->codel), f->len, f->bytes, len, sheddable))
+		{
+			if (queue_debug)	econet_debug (": flow %d full or too slow - dropped\n", flow);
+			return 0;
+		}
 	}
 
-	/* This needs a better regex */
-	if (regcomp(&r_entry_printhandler, "^\\s*PRINTHANDLER\\s+(.+)\\s*$", REG_EXTENDED) != 0)
+	q_entry = econet_queue_entry(p, len);
+	if (!q_entry) // Pool exhausted
 	{
-		fprintf(stderr, "Unable to compile print handler regex.\n");		
-		exit(EXIT_FAILURE);
+		if (queue_debug)	econet_debug (": pool allocation failed!\n");
+		return 0;
 	}
 
-	if (regcomp(&r_entry_distant, "^\\s*([Aa]|IP)\\s+([[:digit:]]{1,3})\\s+([[:digit:]]{1,3})\\s+([^[:space:]]+)\\s+([[:digit:]]{4,5})\\s*$", REG_EXTENDED) != 0)
+	memcpy(&(q_entry->tstamp), &now, sizeof(struct timeval));
+
+	wire_queued++;
+
+	if (!f)
 	{
-		fprintf(stderr, "Unable to compile full distant station regex.\n");
-		exit(EXIT_FAILURE);
+		if (wire_prio_head == NULL)
+			wire_prio_head = wire_prio_tail = q_entry;
+		else
+		{
+			wire_prio_tail->next = q_entry;
+			wire_prio_tail = q_entry;
+		}
+
+		if (queue_debug) econet_debug ("- queued on priority lane\n");
+
+		return 1;
 	}
 
-	if (regcomp(&r_entry_basenet, "^\\s*([Bb])\\s+([[:digit:]]{1,3}\\.[[:digit:]]{1,3}\\.[[:digit:]]{1,3})\\s*$", REG_EXTENDED) != 0)
+	if (f->head == NULL)
+		f->head = f->tail = q_entry;
+	else
 	{
-		fprintf(stderr, "Unable to compile base network regex.\n");
-		exit(EXIT_FAILURE);
+		f->tail->next = q_entry;
+		f->tail = q_entry;
 	}
 
-	if (regcomp(&r_entry_local, "^\\s*([Nn]|LOCALNET)\\s+([[:digit:]]{1,3})\\s*$", REG_EXTENDED) != 0)
+	f->len++;
+	f->bytes += len;
+	econet_queue_publish(ECONET_QUEUE_WIRE, &(f->codel), f->len, f->bytes);
+
+	if (!f->active) // Join the end of the round
 	{
-		fprintf(stderr, "Unable to compile full local config regex.\n");
-		exit(EXIT_FAILURE);
+		f->active = 1;
+		f->next = -1;
+		f->deficit = 0;
+
+		if (wire_active_tail == -1)
+			wire_active_head = flow;
+		else
+			wire_flows[wire_active_tail].next = flow;
+
+		wire_active_tail = flow;
 	}
 
-	//if (regcomp(&r_entry_server, "^\\s*([FfPpSs])\\s+([[:digit:]]{1,3})\\s+([[:digit:]]{1,3})\\s+([[:digit:]]{4,5}|AUTO)\\s+(.+)\\s*$", REG_EXTENDED) != 0)
-	if (regcomp(&r_entry_server, "^\\s*([FfPp])\\s+([[:digit:]]{1,3})\\s+([[:digit:]]{1,3})\\s+([[:digit:]]{4,5}|AUTO)\\s+(.+)\\s*$", REG_EXTENDED) != 0)
+	if (queue_debug) econet_debug ("- queued on flow %d (%u waiting)\n", flow, f->len);
+
+	return 1;
+
+}
+
+// Move the flow at the front of the active list to the back
+
+static void econet_wire_rotate(void)
+{
+	int flow;
+
+	flow = wire_active_head;
+
+	if (flow == -1 || wire_flows[flow].next == -1) // Nothing else to go to
+		return;
+
+	wire_active_head = wire_flows[flow].next;
+	wire_flows[flow].next = -1;
+	wire_flows[wire_active_tail].next = flow;
+	wire_active_tail = flow;
+}
+
+// The next packet to go on the wire, or NULL if there isn't one. It stays put (and this will keep returning it)
+// until econet_wire_dumphead() takes it off, so it can be retried.
+
+struct __econet_packet_aun_cache * econet_wire_next(void)
+{
+	struct wire_flow *f;
+
+	if (wire_prio_head)
 	{
-		fprintf(stderr, "Unable to compile server regex.\n");
-		exit(EXIT_FAILURE);
+		wire_current = -1;
+		return wire_prio_head;
 	}
 
-	if (regcomp(&r_entry_namedpipe, "^\\s*(UNIX)\\s+([[:digit:]]{1,3})\\s+([[:digit:]]{1,3})\\s+([[:digit:]]{4,5}|AUTO)\\s+(\\/.+)\\s*$", REG_EXTENDED) != 0)
+	while (wire_active_head != -1)
 	{
-		fprintf(stderr, "Unable to compile named pipe regex.\n");
-		exit(EXIT_FAILURE);
+		f = &(wire_flows[wire_active_head]);
+
+		if (f->deficit >= f->head->size)
+		{
+			wire_current = wire_active_head;
+			return f->head;
+		}
+
+		f->deficit += ECONET_WIRE_QUANTUM; // Its turn, but it has used up its allowance - top it up and go round
+		econet_wire_rotate();
 	}
 
-	if (regcomp(&r_entry_wire, "^\\s*([Ww]|WIRE)\\s+([[:digit:]]{1,3})\\s+([[:digit:]]{1,3}|\\*)\\s+([[:digit:]]{4,5}|AUTO)\\s*$", REG_EXTENDED) != 0)
+	return NULL;
+}
+
+// Take the packet last returned by econet_wire_next() off its queue. sent = 1 if it went out, for the stats.
+
+void econet_wire_dumphead(int sent)
+{
+	struct __econet_packet_aun_cache *q_entry;
+	struct wire_flow *f;
+	struct timeval now;
+
+	if (wire_current == -1)
 	{
-		fprintf(stderr, "Unable to compile full wire station regex.\n");
-		exit(EXIT_FAILURE);
+		q_entry = wire_prio_head;
+		if (!q_entry) return;
+		wire_prio_head = q_entry->next;
+		if (!wire_prio_head)
+			wire_prio_tail = NULL;
 	}
-
-	if (regcomp(&r_entry_learn, "^\\s*([Ll]|LEARN|DYNAMIC)\\s+([[:digit:]]{1,3})\\s*$", REG_EXTENDED) != 0)
+	else
 	{
-		fprintf(stderr, "Unable to compile full wire station regex.\n");
-		exit(EXIT_FAILURE);
+		f = &(wire_flows[wire_current]);
+		q_entry = f->head;
+		if (!q_entry) return;
+		f->head = q_entry->next;
+		if (!f->head)
+			f->tail = NULL;
+		f->len--;
+		f->bytes -= q_entry->size;
+		f->deficit -= q_entry->size;
+
+		if (sent)
+			econet_codel_dequeued(ECONET_QUEUE_WIRE, &(f->codel), &(q_entry->tstamp), f->bytes);
+
+		econet_queue_publish(ECONET_QUEUE_WIRE, &(f->codel), f->len, f->bytes);
+
+		if (!f->head) // Flow has emptied - off the active list. It's always at the front, since that's where econet_wire_next() serves from
+		{
+			wire_active_head = f->next;
+			if (wire_active_head == -1)
+				wire_active_tail = -1;
+			f->active = 0;
+			f->deficit = 0;
+		}
 	}
 
-	if (regcomp(&r_entry_trunk, "^\\s*([T]|TRUNK)\\s+([[:digit:]]{1,3})\\s+([[:digit:]]{4,5})\\s+([^[:space:]]+)\\s+([[:digit:]]{4,5})\\s*$", REG_EXTENDED | REG_ICASE) != 0)
+	if (sent)
 	{
-		fprintf(stderr, "Unable to compile trunk regex.\n");
-		exit(EXIT_FAILURE);
+		unsigned long sojourn;
+		int lane;
+
+		gettimeofday(&now, 0);
+		sojourn = timediffmsec(&(q_entry->tstamp), &now);
+		lane = (wire_current == -1) ? 0 : 1;
+
+		wire_sent[lane]++;
+		wire_sojourn_total[lane] += sojourn;
+		if (sojourn > wire_sojourn_max[lane])
+			wire_sojourn_max[lane] = sojourn;
+
+		if (lane == 0) // Flows' packets went in the histogram when econet_codel_dequeued() was told about them
+		{
+			long us = ((now.tv_sec - q_entry->tstamp.tv_sec) * 1000000) + (now.tv_usec - q_entry->tstamp.tv_usec);
+
+			econet_hist_add(&(queue_sojourn_hist[ECONET_QUEUE_WIRE]), us < 0 ? 0 : us);
+		}
 	}
 
-	if (regcomp(&r_entry_xlate, "^\\s*([X]|XLATE|TRANSLATE)\\s+([[:digit:]]{1,3})\\s+([[:digit:]]{1,3})\\s+([[:digit:]]{1,3})\\s*$", REG_EXTENDED | REG_ICASE) != 0)
+	if (queue_debug) econet_debug ("QUEUE: Dumping packet at wire queue head %p\n", q_entry);
+
+	econet_pool_free(q_entry);
+	wire_queued--;
+}
+
+// The station at the front of the round didn't take its packet - let the other flows have a go before it is tried again
+
+void econet_wire_skip(void)
+{
+	if (wire_current != -1 && wire_current == wire_active_head)
+		econet_wire_rotate();
+}
+
+int econet_general_enqueue(struct __econet_packet_aun_cache **head, struct __econet_packet_aun_cache **tail, struct __econet_packet_aun *p, int len)
+{
+
+	struct timeval now;
+	struct __econet_packet_aun_cache *q_entry;
+
+	if (queue_debug)	econet_debug ("QUEUE: to %3d.%3d from %3d.%3d len 0x%04X request general enqueue\n",
+		p->p.dstnet, p->p.dststn,
+		p->p.srcnet, p->p.srcstn,
+		len);
+
+	gettimeofday(&now, 0);
+	q_entry = econet_queue_entry(p, len);
+	if (!q_entry) // Pool exhausted
 	{
-		fprintf(stderr, "Unable to compile network translation regex.\n");
-		exit(EXIT_FAILURE);
+		if (queue_debug)	econet_debug ("QUEUE: pool allocation failed!\n");
+		return 0;
 	}
 
-	if (regcomp(&r_entry_fw, "^\\s*([Y]|FIREWALL)\\s+([[:digit:]]{1,3})\\s+([[:digit:]]{1,3})\\s+([[:digit:]]{1,3})\\s+([[:digit:]]{1,3})\\s+([[:digit:]]{1,3})\\s+(DROP|ACCEPT)\\s*$", REG_EXTENDED | REG_ICASE) != 0)
+	memcpy(&(q_entry->tstamp), &now, sizeof(struct timeval));
+
+	// Is the queue empty so it doesn't matter where we put this?
+	if (*head == NULL)
+		*head = *tail = q_entry;
+	else
 	{
-		fprintf(stderr, "Unable to compile network firewall regex.\n");
-		exit(EXIT_FAILURE);
+		(*tail)->next = q_entry;
+		(*tail) = q_entry;
 	}
 
-	if (regcomp(&r_entry_filter, "^\\s*FILTER\\s+(IN|OUT)\\s+([[:digit:]]{1,3})\\s+NET\\s+([[:digit:]]{1,3})\\s*$", REG_EXTENDED | REG_ICASE) != 0)
+	return 1;
+
+}
+
+void econet_general_dumphead(struct __econet_packet_aun_cache **head, struct __econet_packet_aun_cache **tail) // see econet_dumphead() - this is the trunk equivalent
+{
+
+	struct __econet_packet_aun_cache *q_entry;
+
+	q_entry = *head;
+
+	if (queue_debug) econet_debug ("QUEUE: Dumping packet at queue head %p\n", *head);
+
+	if (q_entry)
 	{
-		fprintf(stderr, "Unable to compile network filter regex.\n");
-		exit(EXIT_FAILURE);
+		*head = (*head)->next;
+		if (!(*head))
+			*tail = NULL;
+		econet_pool_free (q_entry); // Packet is in the same block
 	}
 
-	while (!feof(configfile))
-	{
-		if (fgets(linebuf, 255, configfile) == NULL) break;
-		linebuf[strlen(linebuf)-1] = 0x00; // Drop the linefeed
 
-		// Strip off any trailing whitespace - Thank you @sweh
-		end = linebuf + strlen(linebuf) + 1;
-		while (end >= linebuf && isspace((unsigned char) *end))
-			end--;
+}
 
-		end[1] = '\0';
+// Milliseconds on the monotonic clock - the timer wheel's time base
 
-		// Skip if empty line
-		if (strlen(linebuf) == 0)
-			continue;
+uint64_t econet_ms(void)
+{
+	struct timespec t;
 
-		// Blank off the server parameters
+	clock_gettime(CLOCK_MONOTONIC, &t);
 
-		strcpy(network[networkp].fs_serverparam, "");
-		strcpy(network[networkp].print_serverparam, "");
-		memset(&(network[networkp].printers), 0, sizeof(network[networkp].printers));
-		memset(&(network[networkp].printer_priorities), 255, sizeof(network[networkp].printer_priorities));
-		network[networkp].numprinters = 0; // i.e. last index+1, so start at 0
-		strcpy(network[networkp].socket_serverparam, "");
-		network[networkp].is_dynamic = 0;
-		network[networkp].last_transaction = 0;
-		network[networkp].is_wired_fs = 0;
+	return ((uint64_t) t.tv_sec * 1000) + (t.tv_nsec / 1000000);
+}
 
-		if (regexec(&r_comment, linebuf, 0, NULL, 0) == 0)
-		{ }
-		else if (regexec(&r_entry_printhandler, linebuf, 2, matches, 0) == 0)
-		{
-			printhandler = malloc(sizeof(linebuf));
-			if (!printhandler)
-			{
-				fprintf (stderr, "Error on malloc() for print handler string.\n");
-				exit(EXIT_FAILURE);
-			}
-			strcpy(printhandler, &(linebuf[matches[1].rm_so]));
-		}
-		else if (regexec(&r_entry_distant, linebuf, 6, matches, 0) == 0)
-		{
-			char 	tmp[300];
-			int	ptr;
-				
-			/* Find our matches */
-			for (count = 1; count <= 5; count++)
-			{
-				ptr = 0;
-				while (ptr < (matches[count].rm_eo - matches[count].rm_so))
-				{
-					tmp[ptr] = linebuf[ptr + matches[count].rm_so];	
-					ptr++;
-				}
-				tmp[ptr] = 0x00;
-				
-				switch (count)
-				{
-					case 1: // D (Distant, IP, Raw packets), A (Distant, IP, AUN)
-						switch (tmp[0]) {
-							case 'A':
-							case 'a':
-								network[networkp].type = ECONET_HOSTTYPE_DIS_AUN;
-								break;
-						}
-						break;
-					case 2:
-						network[networkp].network = atoi(tmp);
-						break;
-					case 3:
-						network[networkp].station = atoi(tmp);
-						break;
-					case 4:
-						strncpy(network[networkp].hostname, tmp, 249);
-						h = gethostbyname(tmp);
-						if (h == NULL)
-						{
-							fprintf(stderr, "Cannot resolve hostname %s\n", tmp);
-							exit (EXIT_FAILURE);
-						}
-	
-						network[networkp].s_addr = *(struct in_addr *)h->h_addr;
+void econet_timer_init(struct econet_timer *t, void (*fn)(int), int arg)
+{
+	t->next = NULL;
+	t->pprev = NULL;
+	t->fn = fn;
+	t->arg = arg;
+}
 
-						network[networkp].listensocket = -2; // Distant host
-						
-						break;
-					case 5:
-						network[networkp].port = atoi(tmp);
-						break;		
-				}
-			}
+static inline int econet_timer_armed(struct econet_timer *t)
+{
+	return (t->pprev != NULL);
+}
 
-			// Turn local server off
-			network[networkp].servertype = 0;
-			network[networkp].last_seq_ack = 0; // Tracks the last AUN data packet we acknowledged from this host.
+void econet_timer_cancel(struct econet_timer *t)
+{
+	if (!t->pprev)
+		return;
 
-			// Include the network in our list
-			wire_advertizable[network[networkp].network] = 0xff;
-			econet_ptr[network[networkp].network][network[networkp].station] = networkp;
+	*(t->pprev) = t->next;
+	if (t->next)
+		t->next->pprev = t->pprev;
 
-			// If this is a distant AUN station, put it in the station map so the kernel module does the 4-way handshake / replies to immediates
-			ECONET_SET_STATION(econet_stations, network[networkp].network, network[networkp].station);
+	t->next = NULL;
+	t->pprev = NULL;
+	tw_pending--;
+}
 
-			// Next, if we haven't yet got a native bridged network (i.e. the equivalent of the opposite side of a read bridge), the set one - takes the first in the file basically 
-			if (nativebridgenet == 0 && network[networkp].network != 0)
-				nativebridgenet = network[networkp].network;
-			
-			network[networkp].aun_head = network[networkp].aun_tail = NULL;
-			network[networkp].aun_last_tx.tv_sec = network[networkp].aun_last_tx.tv_usec = 0;
-			network[networkp].aun_last_rx.tv_sec = network[networkp].aun_last_rx.tv_usec = 0;
-			network[networkp].ackimm_seq_awaited = 0; // Sequence number we're waiting to be acked / immediate replied
-			network[networkp].ackimm_seq_tosend = 0; // Sequence number the host is waiting to be responded to with ACK / NAK / IMMREP
+static void econet_timer_link(struct econet_timer *t, int slot)
+{
+	t->next = tw_slots[slot];
+	if (t->next)
+		t->next->pprev = &(t->next);
+	tw_slots[slot] = t;
+	t->pprev = &(tw_slots[slot]);
+}
 
-			networkp++;
-		}
-		else if (regexec(&r_entry_basenet, linebuf, 3, matches, 0) == 0)
-		{
-			char 	tmp[300];
-			int	ptr;
+// File an armed timer in the right slot for how far off it is from tw_now
 
-			for (count = 2; count <= 2; count++)
-			{
-				ptr = 0;
-				while (ptr < (matches[count].rm_eo - matches[count].rm_so))
-				{
-					tmp[ptr] = linebuf[ptr + matches[count].rm_so];
-					ptr++;
-				}
-				tmp[ptr] = 0x00;
+static void econet_timer_file(struct econet_timer *t)
+{
+	uint64_t delta;
+	int slot, level;
 
-				if (count == 2)
-					strcpy(basenet,tmp);
-			}
-		}
-		else if (regexec(&r_entry_local, linebuf, 3, matches, 0) == 0)
-		{
-			char 	tmp[300];
-			int	ptr;
-				
-			/* Find our matches */
-			for (count = 2; count <= 2; count++)
-			{
-				ptr = 0;
-				while (ptr < (matches[count].rm_eo - matches[count].rm_so))
-				{
-					tmp[ptr] = linebuf[ptr + matches[count].rm_so];	
-					ptr++;
-				}
-				tmp[ptr] = 0x00;
-				
-				if (count == 2)
-					localnet = atoi(tmp);
+	if (t->expires <= tw_now) // Already due - goes off on the next tick
+		slot = (tw_now + 1) & ((1 << ECONET_TW_L0_BITS) - 1);
+	else if ((delta = t->expires - tw_now) < (1 << ECONET_TW_L0_BITS))
+		slot = t->expires & ((1 << ECONET_TW_L0_BITS) - 1);
+	else
+	{
+		uint64_t when = t->expires;
 
-				if (localnet)
-					trunk_advertizable[localnet] = 0xff;
-			}
-		}
-		else if (regexec(&r_entry_namedpipe, linebuf, 6, matches, 0) == 0)
-		{
-			int stn, net, ptr, entry, mfr, port;
-			char filename[200], tmp[300];
-			char readerfilename[250], writerfilename[250];
-			unsigned char buffer[1024];
+		level = 1;
+		while (level < (ECONET_TW_LEVELS - 1) && delta >= ((uint64_t) 1 << (ECONET_TW_L0_BITS + (level * ECONET_TW_LN_BITS))))
+			level++;
 
-			for (count = 2; count <= 5; count++) // start at 2 - we know the first one is 'UNIX'
-			{
-				ptr = 0;
-				while (ptr < (matches[count].rm_eo - matches[count].rm_so))
-				{
-					tmp[ptr] = linebuf[ptr + matches[count].rm_so];
-					ptr++;
-				}
-				tmp[ptr] = 0x00;
+		if (delta >= ((uint64_t) 1 << (ECONET_TW_L0_BITS + (level * ECONET_TW_LN_BITS)))) // Too far off even for the top level - park it as far out as we can and re-file it when we get there
+			when = tw_now + ((uint64_t) 1 << (ECONET_TW_L0_BITS + (level * ECONET_TW_LN_BITS))) - 1;
 
-				switch (count)
-				{
-					case 2: net = atoi(tmp); break;
-					case 3: stn = atoi(tmp); break;
-					case 4: port = atoi(tmp); 
-						if (port == 0 && !*basenet)
-							fprintf (stderr, "Warning: use of AUTO mode for station %d.%d with no base network will generate a random port\n", net, stn);
-						if (port == 32768 && *basenet)
-							fprintf (stderr, "Warning: direct use of port 32768 for station %d.%d may prevent AUTO in base network mode from working\n", net, stn);
-						break;
-					case 5: strncpy(filename, tmp, 199); break;	
-				}
+		slot = (1 << ECONET_TW_L0_BITS) + ((level - 1) << ECONET_TW_LN_BITS) + ((when >> (ECONET_TW_L0_BITS + ((level - 1) * ECONET_TW_LN_BITS))) & ((1 << ECONET_TW_LN_BITS) - 1));
+	}
 
-			}
+	econet_timer_link(t, slot);
+}
 
-			entry = econet_ptr[net][stn];
+// (Re-)arm a timer to go off in 'ms' milliseconds
 
-			if (entry != -1)
-			{
-				fprintf (stderr, "Cannot configure named pipe station %d.%d - station already configured some other way.\n", net, stn);
-				exit(EXIT_FAILURE);
-			}
+void econet_timer_arm(struct econet_timer *t, unsigned long ms)
+{
+	econet_timer_cancel(t);
 
-			network[networkp].type = ECONET_HOSTTYPE_TNAMEDPIPE | ECONET_HOSTTYPE_TAUN;
-			network[networkp].servertype = 0;
-			network[networkp].seq = 0x00004000;
-			network[networkp].network = net;
-			network[networkp].station = stn;
-			strcpy(network[networkp].named_pipe_filename, filename);
+	t->expires = econet_ms() + ms;
 
-			snprintf(readerfilename, 249, "%s.tobridge", filename);
-			snprintf(writerfilename, 249, "%s.frombridge", filename);
+	if (!tw_pending) // Wheel is empty - bring it up to date now rather than have econet_timer_run() step through all the idle time
+		tw_now = t->expires - ms;
 
-			mfr = mkfifo(readerfilename, 0666); // Not keen on this.
+	econet_timer_file(t);
+	tw_pending++;
+}
 
-			network[networkp].listensocket = -1;
+// Take everything off an upper level slot and re-file it against the current time, which moves it down a level (or more)
 
-			if (mfr == -1 && (errno != EEXIST)) // mkfifo failed and it wasn't because the fifo already existed
-			{
-				fprintf (stderr, "Cannot initialize named pipe at %s - ignoring\n", readerfilename);
-			}
-			else
-				network[networkp].listensocket = open(readerfilename, O_RDONLY | O_NONBLOCK | O_SYNC);
+static void econet_timer_cascade(int level, int index)
+{
+	struct econet_timer *t, *list;
 
-			if (network[networkp].listensocket != -1) // Open succeeded
-			{
-			
-				mfr = mkfifo(writerfilename, 0666); // Still not keen on this
-				
-				if (mfr == -1 && (errno != EEXIST))
-				{
-					fprintf (stderr, "Cannot initialize named pipe at %s - ignoring\n", writerfilename);
-				}
-				else
-				{
-					network[networkp].pipewritesocket = -1; // Rogue - we open it when we see traffic on the pipe, otherwise there's no endpoint and it won't open
-					network[networkp].pind = pmax; // Index into pset from the network[] array
+	list = tw_slots[(1 << ECONET_TW_L0_BITS) + ((level - 1) << ECONET_TW_LN_BITS) + index];
+	tw_slots[(1 << ECONET_TW_L0_BITS) + ((level - 1) << ECONET_TW_LN_BITS) + index] = NULL;
 
-					fd_ptr[network[networkp].listensocket] = networkp; // Create the index to find a station from its FD
-	
-					pset[pmax++].fd = network[networkp].listensocket; // Fill in our poll structure
-	
-					ECONET_SET_STATION(econet_stations, net, stn); // Put it in our list of AUN bridges
+	while ((t = list))
+	{
+		list = t->next;
 
-					if (net != 0)
-					{
-						wire_advertizable[net] = 0xff;
-						trunk_advertizable[net] = 0xff;
-					}
+		if (t->expires <= tw_now) // Due on this very tick, whose slot is about to be run
+			econet_timer_link(t, tw_now & ((1 << ECONET_TW_L0_BITS) - 1));
+		else	econet_timer_file(t);
+	}
+}
 
-					econet_ptr[net][stn] = networkp;
+// Move the wheel up to the present, setting off whatever has come due on the way
 
-				}
-			}
-			else	fprintf (stderr, "Failed to initialize named pipe for station %d.%d - passively ignoring\n", net, stn);
+void econet_timer_run(void)
+{
+	uint64_t now;
 
-			// Set up the UDP listener
-			if ( (network[networkp].pipeudpsocket = socket(AF_INET, SOCK_DGRAM, 0)) == -1)
-			{
-				fprintf(stderr, "Failed to open listening socket for local emulation %d/%d: %s.", network[networkp].network, network[networkp].station, strerror(errno));
-				exit(EXIT_FAILURE);
-			}
+	now = econet_ms();
 
-			service.sin_family = AF_INET;
-			if (*basenet && port == 0)
-			{
-				sprintf(tmp,"%s.%d",basenet,network[networkp].station);
-				service.sin_addr.s_addr = inet_addr(tmp);
-				port = 32768;
-			}
-			else
-			{
-				service.sin_addr.s_addr = INADDR_ANY;
-			}
+	if (!tw_pending) // Nothing to go off, so nothing to step through
+	{
+		tw_now = now;
+		return;
+	}
 
-			network[networkp].port = port;
-			service.sin_port = htons(network[networkp].port);
+	while (tw_now < now)
+	{
+		struct econet_timer *t;
+		int slot, level;
 
-			if (bind(network[networkp].pipeudpsocket, (struct sockaddr *) &service, sizeof(service)) != 0)
-			{
-				fprintf(stderr, "Failed to bind listening socket for named pipe %d/%d: %s.", network[networkp].network, network[networkp].station, strerror(errno));
-				exit(EXIT_FAILURE);
-			}
+		tw_now++;
 
-			pset[pmax++].fd = network[networkp].pipeudpsocket; // Fill in our poll structure
+		slot = tw_now & ((1 << ECONET_TW_L0_BITS) - 1);
 
-			pipeudpsockets[network[networkp].pipeudpsocket] = networkp; // Mark this as a special one for UDP traffic to Named Pipes
+		for (level = 1; level < ECONET_TW_LEVELS; level++) // Each time a level wraps, bring down the next slot of the level above
+		{
+			int index;
 
-			// Empty the pipe
+			if (tw_now & (((uint64_t) 1 << (ECONET_TW_L0_BITS + ((level - 1) * ECONET_TW_LN_BITS))) - 1))
+				break;
 
-			while (read(network[networkp].listensocket, buffer, 1023) > 0);
+			index = (tw_now >> (ECONET_TW_L0_BITS + ((level - 1) * ECONET_TW_LN_BITS))) & ((1 << ECONET_TW_LN_BITS) - 1);
+			econet_timer_cascade(level, index);
+		}
 
-			networkp++;
+		while ((t = tw_slots[slot])) // One at a time, since the handler may well re-arm it
+		{
+			econet_timer_cancel(t);
+			tw_fired++;
+			if (t->fn)
+				(t->fn)(t->arg);
+		}
+	}
+}
+
+// How long epoll_wait() can sleep for before the next timer needs attention (-1 = no timers). Timers on the
+// upper levels are only known to the resolution of their slot, so for those this is when the slot gets
+// brought down a level, which is never later than the timer itself.
 
+int econet_timer_next(void)
+{
+	uint64_t next = UINT64_MAX, now;
+	int i, level;
+
+	if (!tw_pending)
+		return -1;
+
+	for (i = 1; i <= (1 << ECONET_TW_L0_BITS); i++)
+		if (tw_slots[(tw_now + i) & ((1 << ECONET_TW_L0_BITS) - 1)])
+		{
+			next = tw_now + i;
+			break;
 		}
-		else if (regexec(&r_entry_server, linebuf, 6, matches, 0) == 0)
+
+	for (level = 1; level < ECONET_TW_LEVELS; level++)
+	{
+		int shift = ECONET_TW_L0_BITS + ((level - 1) * ECONET_TW_LN_BITS);
+		uint64_t base = tw_now >> shift;
+
+		for (i = 1; i <= (1 << ECONET_TW_LN_BITS); i++)
 		{
-			int stn, net, port, ptr, entry;
-			char servertype;
-			char datastring[200];
-			char tmp[300];
-				
-			servertype = 0;
+			if (((base + i) << shift) >= next)
+				break;
 
-			/* Find our matches */
-			for (count = 1; count <= 5; count++)
+			if (tw_slots[(1 << ECONET_TW_L0_BITS) + ((level - 1) << ECONET_TW_LN_BITS) + ((base + i) & ((1 << ECONET_TW_LN_BITS) - 1))])
 			{
-				ptr = 0;
-				while (ptr < (matches[count].rm_eo - matches[count].rm_so))
-				{
-					tmp[ptr] = linebuf[ptr + matches[count].rm_so];	
-					ptr++;
-				}
-				tmp[ptr] = 0x00;
-				
-				switch (count)
-				{
-					case 1: // <F>ileserver, <P>rint server
-						switch (tmp[0]) {
-							case 'F':
-							case 'f':
-								servertype = ECONET_SERVER_FILE;
-								break;
-							case 'P':
-							case 'p':
-								servertype = ECONET_SERVER_PRINT;
-								break;
-/*
-							case 'S':
-							case 's':
-								servertype = ECONET_SERVER_SOCKET;
-*/
-						}
-						break;
-					case 2:
-						net = atoi(tmp);
-						//network[networkp].network = net;
-						break;
-					case 3:
-						stn = atoi(tmp);
-						//network[networkp].station = stn;
-						break;
-					case 4:
-						// we cheat here; AUTO automatically will parse as "0"
-						port = atoi(tmp);
-						//network[networkp].port = atoi(tmp);
-						if (port == 0 && !*basenet)
-							fprintf (stderr, "Warning: use of AUTO mode for station %d.%d with no base network will generate a random port\n", net, stn);
-						if (port == 32768 && *basenet)
-							fprintf (stderr, "Warning: direct use of port 32768 for station %d.%d may prevent AUTO in base network mode from working\n", net, stn);
-						break;		
-					case 5:
-						strncpy(datastring, tmp, 199);
-						break;
-				}
+				next = (base + i) << shift;
+				break;
 			}
+		}
+	}
 
-			entry = econet_ptr[net][stn]; // Existing host
-			
-			if (entry == -1)
+	now = econet_ms();
+
+	if (next <= now)
+		return 0;
+	else if (next - now > INT_MAX)
+		return INT_MAX;
+	else	return (int) (next - now);
+}
+
+// Put network[d] on the list of AUN hosts with queued output, so that the main loop only has to look at those
+// rather than at every station. Hosts come off again in econet_aun_ready_prune() once their queue empties,
+// or once they have been parked (econet_aun_park()) to wait for an ACK.
+
+void econet_aun_ready(int d)
+{
+	if (network[d].aun_parked)
+	{
+		econet_timer_cancel(&(network[d].aun_timer));
+		network[d].aun_parked = 0;
+	}
+
+	if (network[d].aun_ready)
+		return;
+
+	network[d].aun_ready = 1;
+	network[d].aun_ready_next = aun_ready_head;
+	aun_ready_head = d;
+}
+
+void econet_aun_ready_prune(void)
+{
+	int *link, d;
+
+	link = &aun_ready_head;
+
+	while ((d = *link) != -1)
+	{
+		if ((network[d].aun_head || network[d].aun_inflight) && !network[d].aun_parked)
+			link = &(network[d].aun_ready_next);
+		else
+		{
+			*link = network[d].aun_ready_next;
+			network[d].aun_ready = 0;
+		}
+	}
+}
+
+// Nothing to send to network[d] for 'ms' milliseconds, unless an ACK turns up first. It comes off the ready list
+// at the end of this pass, and econet_aun_timer_expired() puts it back.
+
+void econet_aun_park(int d, long ms)
+{
+	network[d].aun_parked = 1;
+	econet_timer_arm(&(network[d].aun_timer), (ms > 0) ? ms : 1);
+}
+
+void econet_aun_timer_expired(int d)
+{
+	if (network[d].aun_head || network[d].aun_inflight)
+		econet_aun_ready(d);
+	else	network[d].aun_parked = 0;
+}
+
+// cache_pos = 0 means put this packet on the tail of the queue if it collides. 1 = put it on the head, because that's where it came from
+unsigned int econet_write_wire(struct __econet_packet_aun *p, int len, int cache_pos)
+{
+
+	int err = ECONET_TX_JAMMED; // Default
+	int result;
+
+		result = write(econet_fd, p, len);
+	
+		err = ioctl(econet_fd, ECONETGPIO_IOC_TXERR);
+
+		if (err == ECONET_TX_NOCLOCK || err == ECONET_TX_NOCOPY || result != len)
+			return (-1 * err);
+
+		if (err == ECONET_TX_INPROGRESS || err == ECONET_TX_DATAPROGRESS)
+		{
+			struct timeval start, now;
+
+			gettimeofday(&start, 0);
+			gettimeofday(&now, 0);
+
+			// Wait for TX to complete
+			err = ioctl(econet_fd, ECONETGPIO_IOC_TXERR);
+			while ((err == ECONET_TX_INPROGRESS || err == ECONET_TX_DATAPROGRESS) && (timediffmsec(&start, &now) < ((2 + ((len+1024) / 1024) * 41)) )) // 1Kb on the wire is < 50ms. So 30Kb is < 150ms.
 			{
-				network[networkp].type = ECONET_HOSTTYPE_LOCAL_AUN;
-				network[networkp].servertype = servertype;
-				network[networkp].seq = 0x00004000;
-				network[networkp].network = net;
-				network[networkp].station = stn;
-				network[networkp].port = port;
-				network[networkp].numprinters = 0;
+				gettimeofday(&now, 0);
+				err = ioctl(econet_fd, ECONETGPIO_IOC_TXERR);
 			}
-			else	network[entry].servertype |= servertype;
 
-			if (servertype == ECONET_SERVER_FILE)
-			{
-				if (datastring[strlen(datastring)-1] == '/') // Strip trailing slash
-					datastring[strlen(datastring)-1] = '\0';
-				strcpy(network[(entry == -1) ? networkp : entry].fs_serverparam, datastring);
-			}
-			else if (servertype == ECONET_SERVER_PRINT)
-			{
-				char pname[7];
-				char *at;
-				char *colon; // Location of divider between Unix printer name and Econet printer name
-				uint8_t index;
+			if (err == ECONET_TX_SUCCESS)
+			{
+				return len;
+			}
+
+		}
+
+	return (-1 * err);
+
+}
+
+// Set up ring r, size bytes (a power of 2)
+
+void econet_ring_init(struct econet_ring *r, uint32_t size, char *name)
+{
+	r->size = size;
+	snprintf (r->name, sizeof(r->name), "%s", name);
+	atomic_init(&(r->head), 0);
+	atomic_init(&(r->tail), 0);
+
+	if (!(r->buf = malloc(size)) || (r->efd = eventfd(0, EFD_NONBLOCK)) == -1)
+	{
+		fprintf (stderr, "Unable to set up %s ring: %s\n", name, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+}
+
+// Bytes free in ring r, as the producer sees it
+
+static inline uint32_t econet_ring_room(struct econet_ring *r)
+{
+	return r->size - (atomic_load_explicit(&(r->head), memory_order_relaxed) - atomic_load_explicit(&(r->tail), memory_order_acquire));
+}
+
+// Producer - make room for a record with up to len bytes of data. Returns its header (the data goes straight after
+// it), or NULL if the ring is full. The consumer can't see it until econet_ring_commit().
+
+struct econet_ring_rec * econet_ring_reserve(struct econet_ring *r, uint16_t type, uint32_t len)
+{
+	uint32_t head, off, need, pad;
+	struct econet_ring_rec *rec;
+
+	head = atomic_load_explicit(&(r->head), memory_order_relaxed);
+	off = head & (r->size - 1);
+	need = ECONET_RING_RECLEN(len);
+	pad = (r->size - off < need) ? r->size - off : 0; // Won't fit before the end, so it goes at the start
+
+	if (pad + need > econet_ring_room(r))
+	{
+		atomic_fetch_add_explicit(&(r->full), 1, memory_order_relaxed);
+		return NULL;
+	}
+
+	if (pad)
+	{
+		rec = (struct econet_ring_rec *) (r->buf + off);
+		rec->type = ECONET_RING_PAD;
+		rec->len = pad - sizeof(struct econet_ring_rec);
+		head += pad;
+		off = 0;
+	}
+
+	r->reserved = head;
+
+	rec = (struct econet_ring_rec *) (r->buf + off);
+	rec->type = type;
+	rec->len = len;
+	rec->arg = 0;
+	rec->val = rec->err = 0;
+
+	return rec;
+}
+
+// Producer - hand the record from econet_ring_reserve() over, with len bytes of data (no more than were reserved)
+
+void econet_ring_commit(struct econet_ring *r, struct econet_ring_rec *rec, uint32_t len)
+{
+	uint32_t head, used;
+
+	rec->len = len;
+	head = r->reserved + ECONET_RING_RECLEN(len);
+
+	atomic_store_explicit(&(r->head), head, memory_order_release);
+
+	atomic_store_explicit(&(r->records), atomic_load_explicit(&(r->records), memory_order_relaxed) + 1, memory_order_relaxed); // No need for a locked add - nobody else writes it
+	r->unsignalled = 1;
+
+	if ((used = r->size - econet_ring_room(r)) > atomic_load_explicit(&(r->hwm), memory_order_relaxed))
+		atomic_store_explicit(&(r->hwm), used, memory_order_relaxed);
+}
+
+// Producer - wake the consumer if anything has gone on since it was last woken. Done once per batch rather than per record.
+
+void econet_ring_wake(struct econet_ring *r)
+{
+	uint64_t one = 1;
+
+	if (r->unsignalled)
+	{
+		r->unsignalled = 0;
+		if (write(r->efd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+			fprintf (stderr, "Unable to wake the reader of the %s ring: %s\n", r->name, strerror(errno));
+	}
+}
+
+// Consumer - clear the wakeup. Do this before looking for records, so that one going on afterwards wakes us again.
+
+void econet_ring_woken(struct econet_ring *r)
+{
+	uint64_t count;
+
+	if (read(r->efd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+		fprintf (stderr, "Unable to read the %s ring's wakeup: %s\n", r->name, strerror(errno));
+}
+
+// Consumer - the oldest record in ring r, or NULL if there isn't one. It stays put until econet_ring_release().
+
+struct econet_ring_rec * econet_ring_peek(struct econet_ring *r)
+{
+	uint32_t head, tail;
+	struct econet_ring_rec *rec;
+
+	tail = atomic_load_explicit(&(r->tail), memory_order_relaxed);
+	head = atomic_load_explicit(&(r->head), memory_order_acquire);
+
+	while (tail != head)
+	{
+		rec = (struct econet_ring_rec *) (r->buf + (tail & (r->size - 1)));
+
+		if (rec->type != ECONET_RING_PAD)
+			return rec;
+
+		tail += ECONET_RING_RECLEN(rec->len);
+		atomic_store_explicit(&(r->tail), tail, memory_order_release);
+	}
+
+	return NULL;
+}
+
+// Consumer - finished with rec, which econet_ring_peek() returned
+
+void econet_ring_release(struct econet_ring *r, struct econet_ring_rec *rec)
+{
+	atomic_store_explicit(&(r->tail), atomic_load_explicit(&(r->tail), memory_order_relaxed) + ECONET_RING_RECLEN(rec->len), memory_order_release);
+}
+
+// Start thread t running fn (which is passed t), pinned to its core if it has one. Signals stay with the main thread.
+
+void econet_thread_start(int t, void *(*fn)(void *))
+{
+	sigset_t all, old;
+	char name[16];
+
+	if (t != ECONET_THREAD_NET)
+	{
+		sigfillset(&all); // Signals are the network thread's business - except a crash, which is the crashing thread's
+		sigdelset(&all, SIGSEGV);
+		sigdelset(&all, SIGBUS);
+		sigdelset(&all, SIGFPE);
+		sigdelset(&all, SIGILL);
+		sigdelset(&all, SIGABRT);
+		pthread_sigmask(SIG_BLOCK, &all, &old);
+
+		if (pthread_create(&(threads[t]), NULL, fn, (void *) (intptr_t) t))
+		{
+			fprintf (stderr, "Unable to start the %s thread\n", thread_names[t]);
+			exit(EXIT_FAILURE);
+		}
+
+		pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+		snprintf (name, sizeof(name), "econet-%s", thread_names[t]);
+		pthread_setname_np(threads[t], name);
+	}
+	else	threads[t] = pthread_self();
+
+	if (thread_cpu[t] != -1)
+	{
+		cpu_set_t cpus;
+
+		CPU_ZERO(&cpus);
+		CPU_SET(thread_cpu[t], &cpus);
+
+		if (pthread_setaffinity_np(threads[t], sizeof(cpus), &cpus))
+			fprintf (stderr, "Unable to pin the %s thread to core %d\n", thread_names[t], thread_cpu[t]);
+	}
+
+	if (pthread_getcpuclockid(threads[t], &(thread_clocks[t])) == 0)
+		thread_running[t] = 1;
+}
+
+// Time on clock c, in ns
+
+uint64_t econet_clock_ns(clockid_t c)
+{
+	struct timespec t;
+
+	if (clock_gettime(c, &t))
+		return 0;
+
+	return ((uint64_t) t.tv_sec * 1000000000) + t.tv_nsec;
+}
+
+// How busy each thread has been since the last time, and how much has been through the rings
+
+void econet_thread_dump(FILE *out)
+{
+	uint64_t now, wall;
+	int t, r, nrings = 0;
+	struct econet_ring *rings[2 + (2 * (1 + ECONET_MAX_FS_WORKERS)) + ECONET_THREADS];
+
+	now = econet_clock_ns(CLOCK_MONOTONIC);
+	wall = now - thread_wall_last;
+	thread_wall_last = now;
+
+	for (t = 0; t < ECONET_THREADS; t++)
+		if (thread_running[t])
+		{
+			uint64_t cpu, used;
+			char core[12];
+
+			cpu = econet_clock_ns(thread_clocks[t]);
+			used = cpu - thread_cpu_last[t];
+			thread_cpu_last[t] = cpu;
+
+			if (thread_cpu[t] != -1)
+				snprintf (core, sizeof(core), "core %d", thread_cpu[t]);
+			else	strcpy (core, "any core");
+
+			fprintf (out, "STATS: Thread %-7s (%s) %" PRIu64 ".%02" PRIu64 "%% busy since the last statistics, %" PRIu64 " ms CPU in all\n",
+				thread_names[t], core,
+				(wall ? (used * 100) / wall : 0), (wall ? ((used * 10000) / wall) % 100 : 0),
+				cpu / 1000000);
+		}
+
+	if (thread_running[ECONET_THREAD_WIRE])
+	{
+		rings[nrings++] = &wire_tx_ring;
+		rings[nrings++] = &wire_rx_ring;
+	}
+
+	for (t = 0; t <= fs_workers; t++)
+	{
+		rings[nrings++] = &(services[t].in);
+		rings[nrings++] = &(services[t].out);
+	}
+
+	for (t = 0; t < ECONET_THREADS; t++)
+		if (log_rings[t].buf)
+			rings[nrings++] = &(log_rings[t]);
+
+	for (r = 0; r < nrings; r++)
+		fprintf (out, "STATS:     %-15s ring %8lu records, most in use %6u of %6u bytes, full %lu times\n",
+			rings[r]->name, atomic_load_explicit(&(rings[r]->records), memory_order_relaxed), atomic_load_explicit(&(rings[r]->hwm), memory_order_relaxed),
+			rings[r]->size, atomic_load_explicit(&(rings[r]->full), memory_order_relaxed));
+}
+
+// Pick apart the conversion specification starting just after a '%' in a format. Width and precision are -1 if
+// there isn't one, -2 for '*'. The length modifiers hh and ll come back as 'H' and 'L'. Returns where the text
+// after it starts.
+
+const char * econet_log_spec(const char *f, struct econet_log_spec *s)
+{
+	int n = 0;
+
+	while (*f && strchr("-+ #0'", *f) && n < sizeof(s->flags) - 1)
+		s->flags[n++] = *(f++);
+
+	s->flags[n] = 0;
+	s->width = s->prec = -1;
+
+	if (*f == '*')
+	{
+		s->width = -2;
+		f++;
+	}
+	else if (isdigit(*f))
+		s->width = strtol(f, (char **) &f, 10);
+
+	if (*f == '.')
+	{
+		f++;
+		if (*f == '*')
+		{
+			s->prec = -2;
+			f++;
+		}
+		else	s->prec = (isdigit(*f) ? strtol(f, (char **) &f, 10) : 0);
+	}
+
+	s->len = 0;
+
+	if (*f == 'h' || *f == 'l')
+	{
+		s->len = *(f++);
+		if (*f == s->len)
+		{
+			s->len = (s->len == 'h' ? 'H' : 'L');
+			f++;
+		}
+	}
+	else if (*f && strchr("qLjzt", *f))
+	{
+		s->len = (*f == 'q' ? 'L' : *f);
+		f++;
+	}
+
+	s->conv = *f;
+
+	return (*f ? f + 1 : f);
+}
+
+// The next integer argument for a conversion with length modifier len - with the value the conversion would have seen
+
+static long long econet_log_int(va_list *ap, char len, char conv)
+{
+	int is_signed = (conv == 'd' || conv == 'i');
+
+	switch (len)
+	{
+		case 'H': return (is_signed ? (long long) (signed char) va_arg(*ap, int) : (long long) (unsigned char) va_arg(*ap, int));
+		case 'h': return (is_signed ? (long long) (short) va_arg(*ap, int) : (long long) (unsigned short) va_arg(*ap, int));
+		case 'l': return (is_signed ? (long long) va_arg(*ap, long) : (long long) va_arg(*ap, unsigned long));
+		case 'L': return va_arg(*ap, long long);
+		case 'j': return va_arg(*ap, intmax_t);
+		case 'z': return (is_signed ? (long long) (ssize_t) va_arg(*ap, size_t) : (long long) va_arg(*ap, size_t));
+		case 't': return va_arg(*ap, ptrdiff_t);
+		default: return (is_signed ? (long long) va_arg(*ap, int) : (long long) va_arg(*ap, unsigned int));
+	}
+}
+
+// Wake the log thread if it has gone to sleep, or if ring r is getting full
+
+static inline void econet_log_wake(struct econet_ring *r)
+{
+	uint64_t one = 1;
+
+	atomic_thread_fence(memory_order_seq_cst); // Pairs with the log thread's, so that either it sees the record we've just put on or we see it asleep
+
+	if ((atomic_load_explicit(&log_sleeping, memory_order_relaxed) || r->size - econet_ring_room(r) > r->size / 2)
+	&&  !atomic_exchange_explicit(&log_woken, 1, memory_order_relaxed))
+	{
+		if (write(log_efd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+			fprintf (stderr, "Unable to wake the log thread: %s\n", strerror(errno));
+	}
+}
+
+// Debug and log output, from any thread. Rather than being formatted there and then, the format (which must be a
+// string constant) and its arguments go on the thread's log ring - strings are copied, everything else is kept as
+// a union econet_log_arg - and the log thread does the rest. If the ring is full, it's lost (and counted).
+
+void econet_log(const char *fmt, ...)
+{
+	struct econet_ring *r = &(log_rings[econet_thread]);
+	struct econet_ring_rec *rec;
+	struct econet_log_spec s;
+	union econet_log_arg *a, *end;
+	const char *f;
+	va_list ap;
+
+	va_start(ap, fmt);
+
+	if (!atomic_load_explicit(&log_running, memory_order_relaxed) || !r->buf)
+	{
+		vfprintf (stderr, fmt, ap);
+		va_end(ap);
+		return;
+	}
+
+	if (!(rec = econet_ring_reserve(r, ECONET_LOG_PRINTF, ECONET_LOG_MAX_RECORD)))
+	{
+		va_end(ap);
+		return;
+	}
+
+	a = (union econet_log_arg *) (rec + 1);
+	end = a + (ECONET_LOG_MAX_RECORD / sizeof(union econet_log_arg));
+
+	(a++)->i = econet_clock_ns(CLOCK_MONOTONIC);
+	(a++)->p = fmt;
+
+	for (f = strchr(fmt, '%'); f && (end - a) >= 3; f = strchr(f, '%')) // Room for a width, a precision and the argument
+	{
+		f = econet_log_spec(f + 1, &s);
+
+		if (s.width == -2)
+			(a++)->i = va_arg(ap, int);
+		if (s.prec == -2)
+			s.prec = (a++)->i = va_arg(ap, int);
+
+		switch (s.conv)
+		{
+			case 'd': case 'i': case 'u': case 'o': case 'x': case 'X':
+				(a++)->i = econet_log_int(&ap, s.len, s.conv);
+				break;
+			case 'c':
+				(a++)->i = va_arg(ap, int);
+				break;
+			case 'e': case 'E': case 'f': case 'F': case 'g': case 'G': case 'a': case 'A':
+				(a++)->d = (s.len == 'L' ? (double) va_arg(ap, long double) : va_arg(ap, double));
+				break;
+			case 'p':
+				(a++)->p = va_arg(ap, void *);
+				break;
+			case 'n':
+				va_arg(ap, void *);
+				break;
+			case 's':
+			{
+				const char *str = va_arg(ap, const char *);
+				size_t n, room;
+
+				if (!str)
+					str = "(null)";
+
+				room = ((end - a - 1) * sizeof(union econet_log_arg)) - 1; // After the length, leaving room for the terminator
+				n = strnlen(str, (s.prec >= 0 && s.prec < room) ? s.prec : room);
+
+				(a++)->i = n;
+				memcpy(a, str, n);
+				((char *) a)[n] = 0;
+				a += (n + sizeof(union econet_log_arg)) / sizeof(union econet_log_arg);
+			} break;
+			case '%':
+				break;
+			default: // Not something we know about - the log thread stops at the same place
+				f = NULL;
+				break;
+		}
+
+		if (!f)
+			break;
+	}
+
+	va_end(ap);
+
+	econet_ring_commit(r, rec, (unsigned char *) a - (unsigned char *) (rec + 1));
+	econet_log_wake(r);
+}
+
+// Add to line l as printf() would
+
+void econet_log_put(struct econet_log_line *l, const char *fmt, ...)
+{
+	va_list ap;
+	int n;
+
+	va_start(ap, fmt);
+	n = vsnprintf(l->buf + l->len, sizeof(l->buf) - l->len, fmt, ap);
+	va_end(ap);
+
+	if (n > 0)
+		l->len += n;
+
+	if (l->len > sizeof(l->buf) - 1)
+		l->len = sizeof(l->buf) - 1;
+}
+
+// Log thread - turn the data (len bytes) from an ECONET_LOG_PRINTF record back into text, on the end of line l
+
+void econet_log_format(struct econet_log_line *l, unsigned char *data, uint32_t len)
+{
+	union econet_log_arg *a, *end;
+	struct econet_log_spec s;
+	const char *f, *pc;
+	char spec[64];
+	int n;
+
+	a = (union econet_log_arg *) data;
+	end = (union econet_log_arg *) (data + len);
+	f = a[1].p;
+	a += 2;
+
+	while ((pc = strchr(f, '%')))
+	{
+		econet_log_put(l, "%.*s", (int) (pc - f), f);
+
+		f = econet_log_spec(pc + 1, &s);
+
+		if (s.conv == '%')
+		{
+			econet_log_put(l, "%%");
+			continue;
+		}
+		else if (s.conv == 'n')
+			continue;
+
+		if (end - a < 1 + (s.width == -2) + (s.prec == -2)) // It was cut short when it went on the ring
+		{
+			econet_log_put(l, " ...\n");
+			return;
+		}
+
+		n = snprintf (spec, sizeof(spec), "%%%s", s.flags);
+
+		if (s.width == -2)
+			n += snprintf (spec + n, sizeof(spec) - n, "%d", (int) (a++)->i);
+		else if (s.width >= 0)
+			n += snprintf (spec + n, sizeof(spec) - n, "%d", s.width);
+
+		if (s.prec == -2)
+			s.prec = (a++)->i;
+
+		if (s.prec >= 0)
+			n += snprintf (spec + n, sizeof(spec) - n, ".%d", s.prec);
+
+		switch (s.conv)
+		{
+			case 'd': case 'i':
+				snprintf (spec + n, sizeof(spec) - n, "lld");
+				econet_log_put(l, spec, (a++)->i);
+				break;
+			case 'u': case 'o': case 'x': case 'X':
+				snprintf (spec + n, sizeof(spec) - n, "ll%c", s.conv);
+				econet_log_put(l, spec, (unsigned long long) (a++)->i);
+				break;
+			case 'c':
+				snprintf (spec + n, sizeof(spec) - n, "c");
+				econet_log_put(l, spec, (int) (a++)->i);
+				break;
+			case 'e': case 'E': case 'f': case 'F': case 'g': case 'G': case 'a': case 'A':
+				snprintf (spec + n, sizeof(spec) - n, "%c", s.conv);
+				econet_log_put(l, spec, (a++)->d);
+				break;
+			case 'p':
+				snprintf (spec + n, sizeof(spec) - n, "p");
+				econet_log_put(l, spec, (a++)->p);
+				break;
+			case 's':
+				snprintf (spec + n, sizeof(spec) - n, "s");
+				econet_log_put(l, spec, (char *) (a + 1));
+				a += 1 + ((a->i + sizeof(union econet_log_arg)) / sizeof(union econet_log_arg));
+				break;
+			default:
+				econet_log_put(l, " ...\n");
+				return;
+		}
+	}
+
+	econet_log_put(l, "%s", f);
+}
+
+// Log thread - write out what is in thread t's line so far
+
+void econet_log_line_out(int t)
+{
+	struct econet_log_line *l = &(log_lines[t]);
+
+	if (l->len)
+	{
+		fwrite(l->buf, 1, l->len, log_out);
+		if (l->buf[l->len - 1] != '\n' && l->len == sizeof(l->buf) - 1) // It didn't fit
+			fputc('\n', log_out);
+		l->len = 0;
+	}
+}
+
+// Log thread - write out everything on the log rings, oldest first. Returns 1 if there was anything.
+
+int econet_log_drain(void)
+{
+	struct econet_ring_rec *recs[ECONET_THREADS];
+	int t, found = 0;
+	off_t len;
+
+	for (t = 0; t < ECONET_THREADS; t++)
+		recs[t] = (log_rings[t].buf ? econet_ring_peek(&(log_rings[t])) : NULL);
+
+	while (1)
+	{
+		int oldest = -1;
+
+		for (t = 0; t < ECONET_THREADS; t++)
+			if (recs[t] && (oldest == -1 || ((union econet_log_arg *) (recs[t] + 1))->i < ((union econet_log_arg *) (recs[oldest] + 1))->i))
+				oldest = t;
+
+		if (oldest == -1)
+			break;
+
+		t = oldest;
+
+		if (recs[t]->type == ECONET_LOG_PRINTF)
+		{
+			econet_log_format(&(log_lines[t]), (unsigned char *) (recs[t] + 1), recs[t]->len);
+			if (log_lines[t].buf[log_lines[t].len - 1] == '\n' || log_lines[t].len == sizeof(log_lines[t].buf) - 1)
+				econet_log_line_out(t);
+		}
+		else if (recs[t]->type == ECONET_LOG_AUN)
+		{
+			econet_log_line_out(t);
+			econet_dump_aun(log_out, (struct __econet_packet_aun *) (((union econet_log_arg *) (recs[t] + 1)) + 1), recs[t]->val, recs[t]->len - sizeof(union econet_log_arg), recs[t]->arg >> 8, recs[t]->arg & 0xff);
+		}
+
+		econet_ring_release(&(log_rings[t]), recs[t]);
+		recs[t] = econet_ring_peek(&(log_rings[t]));
+		found = 1;
+	}
+
+	for (t = 0; t < ECONET_THREADS; t++)
+	{
+		unsigned long full;
+
+		if (log_rings[t].buf && (full = atomic_load_explicit(&(log_rings[t].full), memory_order_relaxed)) != log_lost[t])
+		{
+			fprintf (log_out, "  LOG: %lu line(s) from the %s thread lost - its log ring was full\n", full - log_lost[t], thread_names[t]);
+			log_lost[t] = full;
+		}
+	}
+
+	fflush(log_out);
+
+	if ((len = ftello(log_out)) > 0)
+	{
+		fwrite(log_out_buf, 1, len, stderr);
+		fseeko(log_out, 0, SEEK_SET);
+	}
+
+	return found;
+}
+
+// The log thread. Looks at the log rings every ECONET_LOG_BATCH ms while there is output about, and sleeps until it is
+// woken when there isn't.
+
+void * econet_log_thread(void *arg)
+{
+	struct pollfd fds;
+	uint64_t count;
+
+	econet_thread = ECONET_THREAD_LOG;
+
+	setpriority(PRIO_PROCESS, gettid(), 10); // If it has to share a core, the bridging comes first
+
+	fds.fd = log_efd;
+	fds.events = POLLIN;
+
+	while (1)
+	{
+		int found;
+
+		atomic_store_explicit(&log_woken, 0, memory_order_relaxed);
+
+		pthread_mutex_lock(&log_drain_lock);
+		found = econet_log_drain();
+		pthread_mutex_unlock(&log_drain_lock);
+
+		if (found)
+			poll(&fds, 1, ECONET_LOG_BATCH);
+		else
+		{
+			atomic_store_explicit(&log_sleeping, 1, memory_order_relaxed);
+			atomic_thread_fence(memory_order_seq_cst);
+
+			pthread_mutex_lock(&log_drain_lock);
+			found = econet_log_drain(); // Anything which went on before we said we were asleep
+			pthread_mutex_unlock(&log_drain_lock);
+
+			if (!found)
+				poll(&fds, 1, -1);
+
+			atomic_store_explicit(&log_sleeping, 0, memory_order_relaxed);
+		}
+
+		if (read(log_efd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+			fprintf (stderr, "Unable to read the log thread's wakeup: %s\n", strerror(errno));
+	}
+
+	return NULL;
+}
+
+// On the way out - write out whatever is still on the log rings, half-finished lines and all, and send anything
+// logged after that straight to stderr. The log thread is left waiting for the lock, so it can't get in the way.
+// wait = 0 after a crash, when the log thread might be what crashed, lock and all - so don't wait for it then.
+
+void econet_log_finish(int wait)
+{
+	int t;
+
+	if (!atomic_load_explicit(&log_running, memory_order_relaxed))
+		return;
+
+	if (wait)
+		pthread_mutex_lock(&log_drain_lock);
+	else if (pthread_mutex_trylock(&log_drain_lock))
+		return;
+
+	econet_log_drain();
+
+	atomic_store_explicit(&log_running, 0, memory_order_relaxed);
+
+	for (t = 0; t < ECONET_THREADS; t++)
+		econet_log_line_out(t);
+
+	econet_log_drain(); // Whatever went on meanwhile, and writes out the half lines
+}
+
+void econet_log_exit(void)
+{
+	econet_log_finish(1);
+}
+
+// SIGTERM or SIGINT - just flag it, and the main loop will write out the log and go
+void econet_sigquit(int sig)
+{
+	quit_signal = sig;
+}
+
+// SIGSEGV and the like - get out what we can of the log, which will be what led up to it, then die as we would have
+
+void econet_sigfatal(int sig)
+{
+	econet_log_finish(0);
+	signal(sig, SIG_DFL);
+	raise(sig);
+}
+
+// Give each thread which will be running a log ring, and start the log thread
+
+void econet_log_start(void)
+{
+	int t;
+
+	if ((log_efd = eventfd(0, EFD_NONBLOCK)) == -1 || !(log_out = open_memstream(&log_out_buf, &log_out_size)))
+	{
+		fprintf (stderr, "Unable to set up the log thread: %s\n", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	for (t = 0; t < ECONET_THREAD_LOG; t++)
+		if (t == ECONET_THREAD_NET || (t == ECONET_THREAD_WIRE && wire_enabled) || (t >= ECONET_THREAD_SERVICE && t <= ECONET_THREAD_SERVICE + fs_workers))
+		{
+			char name[24];
+
+			snprintf (name, sizeof(name), "%s log", thread_names[t]);
+			econet_ring_init(&(log_rings[t]), ECONET_LOG_RING_SIZE, name);
+		}
+
+	atomic_store_explicit(&log_running, 1, memory_order_relaxed);
+
+	atexit(econet_log_exit);
+	signal(SIGSEGV, econet_sigfatal);
+	signal(SIGBUS, econet_sigfatal);
+	signal(SIGFPE, econet_sigfatal);
+	signal(SIGILL, econet_sigfatal);
+	signal(SIGABRT, econet_sigfatal);
+
+	econet_thread_start(ECONET_THREAD_LOG, econet_log_thread);
+}
+
+// The wire thread. Sends what the network thread asks it to, and passes whatever arrives off the wire back to it.
+
+void * econet_wire_thread(void *arg)
+{
+	struct pollfd fds[2];
+
+	econet_thread = ECONET_THREAD_WIRE;
+
+	fds[0].fd = econet_fd;
+	fds[1].fd = wire_tx_ring.efd;
+	fds[1].events = POLLIN;
+
+	while (1)
+	{
+		struct econet_ring_rec *req, *rec;
+		int room;
+
+		room = (econet_ring_room(&wire_rx_ring) >= 2 * ECONET_RING_RECLEN(ECONET_MAX_PACKET_SIZE)); // Enough for a packet however the ring has wrapped
+		fds[0].events = room ? POLLIN : 0; // If not, leave it in the kernel until the network thread has caught up
+
+		if (poll(fds, 2, room ? -1 : 1) < 0)
+			continue;
+
+		if (fds[1].revents & POLLIN)
+		{
+			econet_ring_woken(&wire_tx_ring);
+
+			while ((req = econet_ring_peek(&wire_tx_ring)))
+			{
+				if (req->type == ECONET_WIRE_REQ_QUEUED)
+				{
+					int result, err;
+					uint64_t start, took;
+
+					start = econet_clock_ns(CLOCK_MONOTONIC);
+					result = econet_write_wire(*((struct __econet_packet_aun **) (req + 1)), req->val, 0);
+					took = econet_clock_ns(CLOCK_MONOTONIC) - start;
+					err = ioctl(econet_fd, ECONETGPIO_IOC_TXERR);
+
+					while (!(rec = econet_ring_reserve(&wire_rx_ring, ECONET_WIRE_DONE, sizeof(uint32_t)))) // The network thread is waiting for this, so it can't be lost
+						usleep(100);
+
+					rec->val = result;
+					rec->err = err;
+					*((uint32_t *) (rec + 1)) = took / 1000;
+					econet_ring_commit(&wire_rx_ring, rec, sizeof(uint32_t));
+				}
+				else if (req->type == ECONET_WIRE_REQ_NOW)
+					econet_write_wire((struct __econet_packet_aun *) (req + 1), req->len, 0);
+				else if (req->type == ECONET_WIRE_REQ_READMODE)
+					ioctl(econet_fd, ECONETGPIO_IOC_READMODE);
+
+				econet_ring_release(&wire_tx_ring, req);
+			}
+		}
+
+		if ((fds[0].revents & POLLIN) && (rec = econet_ring_reserve(&wire_rx_ring, ECONET_WIRE_RX, ECONET_MAX_PACKET_SIZE)))
+		{
+			int r;
+
+			r = read(econet_fd, rec + 1, ECONET_MAX_PACKET_SIZE);
+
+			if (r > 0) // (and if it's -1, the module was busy on read - try next time)
+				econet_ring_commit(&wire_rx_ring, rec, r);
+		}
+
+		econet_ring_wake(&wire_rx_ring);
+	}
+
+	return NULL;
+}
+
+// Get queued packet e onto the wire - econet_wire_done() is called when it has gone (or not)
+
+void econet_wire_submit(struct __econet_packet_aun_cache *e)
+{
+	struct econet_ring_rec *rec;
+
+	wire_tx_entry = e;
+
+	if (!thread_running[ECONET_THREAD_WIRE])
+	{
+		int result;
+		uint64_t start;
+
+		start = econet_clock_ns(CLOCK_MONOTONIC);
+		result = econet_write_wire(e->p, e->size, 0);
+		econet_wire_done(result, ioctl(econet_fd, ECONETGPIO_IOC_TXERR), (econet_clock_ns(CLOCK_MONOTONIC) - start) / 1000);
+		return;
+	}
+
+	if (!(rec = econet_ring_reserve(&wire_tx_ring, ECONET_WIRE_REQ_QUEUED, sizeof(struct __econet_packet_aun *)))) // Try again next time round
+	{
+		wire_tx_entry = NULL;
+		e->tx_count--;
+		return;
+	}
+
+	*((struct __econet_packet_aun **) (rec + 1)) = e->p;
+	rec->val = e->size;
+	econet_ring_commit(&wire_tx_ring, rec, sizeof(struct __econet_packet_aun *));
+}
+
+// The packet econet_wire_submit() sent has gone, or not. result is what econet_write_wire() returned, err the module's
+// TX status afterwards, and us how long econet_write_wire() took.
+
+void econet_wire_done(int result, int err, uint32_t us)
+{
+	struct __econet_packet_aun_cache *wire_entry;
+
+	wire_entry = wire_tx_entry;
+	wire_tx_entry = NULL;
+
+	econet_hist_add(&wire_tx_hist, us);
+
+	wire_tx_results[(result == wire_entry->size || err == 0) ? ECONET_TX_SUCCESS : (err & 0xff)]++;
+
+	if (queue_debug) econet_debug ("QUEUE: to %3d.%3d from %3d.%3d len 0x%04X retrieved from wire queue (tx count %02d) ", 
+		wire_entry->p->p.dstnet,
+		wire_entry->p->p.dststn,
+		wire_entry->p->p.srcnet,
+		wire_entry->p->p.srcstn,
+		wire_entry->size,
+		wire_entry->tx_count);
+
+	if (result == wire_entry->size || err == 0) // successful tx
+	{
+		if (queue_debug) econet_debug ("Sent ");
+		if (is_aun(wire_entry->p->p.srcnet, wire_entry->p->p.srcstn) && wire_entry->p->p.aun_ttype == ECONET_AUN_DATA) // Send ACK if we've just successfully sent a DATA packet and the sender is AUN
+		{
+/* Disabled because we ack an AUN on receipt now to avoid rapid retransmits from BeebEm
+			if (queue_debug) econet_debug (" AUN ack sent ");
+			aun_acknowledge(wire_entry->p, ECONET_AUN_ACK);	
+*/
+		}
+		if (queue_debug) econet_debug ("\n");
+		econet_wire_dumphead(1);
+		wire_tx_errors = 0;
+	}
+	else 
+	{
+		if (err == ECONET_TX_HANDSHAKEFAIL) // Receiver not present
+			econet_wire_dumphead(0);
+		else if (err != ECONET_TX_BUSY) // Give the other stations a go before this one is tried again
+			econet_wire_skip();
+
+		/* Inserted because on *REMOTE traffic where the remoted station is talking to the server, we tend to get lots of module busy for some reason, so we'll pretend they didn't happen. */
+
+		if (err == ECONET_TX_BUSY) wire_entry->tx_count--;
+
+		if (wire_tx_errors++ > 300)
+			econet_wire_readmode();
+
+		if (queue_debug) econet_debug ("TX FAIL - %s (0x%02X)\n", econet_strtxerr(-1 * err), err);
+	}
+}
+
+// Put packet p (len bytes) straight onto the wire, not waiting to see how it went. For broadcasts and bridge adverts.
+
+void econet_wire_send_now(struct __econet_packet_aun *p, int len)
+{
+	struct econet_ring_rec *rec;
+
+	if (!thread_running[ECONET_THREAD_WIRE])
+		econet_write_wire(p, len, 0);
+	else if ((rec = econet_ring_reserve(&wire_tx_ring, ECONET_WIRE_REQ_NOW, len)))
+	{
+		memcpy(rec + 1, p, len);
+		econet_ring_commit(&wire_tx_ring, rec, len);
+	}
+	else if (queue_debug) econet_debug ("QUEUE: to %3d.%3d from %3d.%3d len 0x%04X dropped - wire thread has too much to do\n", p->p.dstnet, p->p.dststn, p->p.srcnet, p->p.srcstn, len);
+}
+
+// Reset the chip into read mode, via the wire thread if there is one so that it doesn't happen part way through a transmission
+
+void econet_wire_readmode(void)
+{
+	struct econet_ring_rec *rec;
+
+	if (!thread_running[ECONET_THREAD_WIRE])
+		ioctl(econet_fd, ECONETGPIO_IOC_READMODE);
+	else if ((rec = econet_ring_reserve(&wire_tx_ring, ECONET_WIRE_REQ_READMODE, 0)))
+		econet_ring_commit(&wire_tx_ring, rec, 0);
+}
+
+// Fileserver garbage collection, and polling the socket servers. On the service thread.
+
+void econet_service_housekeeping(void)
+{
+	int s;
+
+	for (s = 0; s < stations; s++)
+	{
+		if (network[s].servertype & ECONET_SERVER_FILE) 
+		{
+			//if (fs_noisy) fprintf(stderr, "   FS: Garbage collect on server %d\n", network[s].fileserver_index);
+			fs_garbage_collect(network[s].fileserver_index);
+		}
+	
+		if (network[s].servertype & ECONET_SERVER_SOCKET)
+			sks_poll(network[s].sks_index);
+	}
+}
+
+// Which fileserver worker (index into services[]) deals with station net.stn
+
+static inline int econet_fs_worker(unsigned char net, unsigned char stn)
+{
+	return 1 + (((net << 8) | stn) % fs_workers);
+}
+
+// Whether packet a, for a local station, is for a fileserver - so it goes to a worker rather than the service thread
+
+int econet_fs_bound(struct __econet_packet_aun *a)
+{
+	int d;
+
+	if (a->p.port == 0x99) // Fileserver operation, or a broadcast to fileservers
+		return 1;
+
+	if (a->p.aun_ttype != ECONET_AUN_DATA || (d = econet_ptr[a->p.dstnet][a->p.dststn]) < 0)
+		return 0;
+
+	if (!(network[d].servertype & ECONET_SERVER_FILE) || network[d].fileserver_index < 0)
+		return 0;
+
+	if ((a->p.port == 0x9f || a->p.port == 0xd1) && (network[d].servertype & ECONET_SERVER_PRINT))
+		return 0;
+
+	if (a->p.port == 0xdf && (network[d].servertype & ECONET_SERVER_SOCKET) && network[d].sks_index >= 0)
+		return 0;
+
+	return 1; // Bulk transfer
+}
+
+// Pass something to services[svc] - type is ECONET_SVC_PACKET (with packet p, len bytes, and the source for
+// econet_handle_local_aun() in val), ECONET_SVC_HOUSEKEEPING or ECONET_SVC_EJECT (with the station in arg). It is
+// woken at the end of the trip round the main loop.
+
+void econet_service_post(int svc, uint16_t type, struct __econet_packet_aun *p, int len, uint16_t arg, int val)
+{
+	struct econet_ring_rec *rec;
+
+	if (!(rec = econet_ring_reserve(&(services[svc].in), type, len)))
+	{
+		if (pkt_debug) econet_debug ("LOCAL: %s thread has too much to do - dropped request type %d\n", thread_names[ECONET_THREAD_SERVICE + svc], type);
+		econet_drops[ECONET_DROP_SERVICE]++;
+		return;
+	}
+
+	if (len)
+		memcpy(rec + 1, p, len);
+
+	rec->arg = arg;
+	rec->val = val;
+	econet_ring_commit(&(services[svc].in), rec, len);
+}
+
+// aun_send() for the servers on the service thread and fileserver workers - the packet goes to the network thread to
+// be sent. Returns len, or -1 if there's no room.
+
+int econet_service_send(struct __econet_packet_aun *p, int len)
+{
+	struct econet_ring *out;
+	struct econet_ring_rec *rec;
+
+	out = &(services[econet_thread - ECONET_THREAD_SERVICE].out);
+
+	if (!(rec = econet_ring_reserve(out, ECONET_SVC_SEND, len)))
+		return -1;
+
+	memcpy(rec + 1, p, len);
+	econet_ring_commit(out, rec, len);
+
+	return len;
+}
+
+// The service thread and the fileserver workers. Runs the servers on what the network thread passes in, and (on a
+// worker) sends *LOAD data from its fileserver queues whenever the bridge has room for it. The load queues belong to
+// the thread which made them, so the service thread never has any.
+
+void * econet_service_thread(void *arg)
+{
+	struct econet_service *svc;
+	struct pollfd fds;
+
+	econet_thread = (intptr_t) arg;
+	svc = &(services[econet_thread - ECONET_THREAD_SERVICE]);
+
+	fds.fd = svc->in.efd;
+	fds.events = POLLIN;
+
+	while (1)
+	{
+		struct econet_ring_rec *rec;
+		int timeout;
+
+		econet_ring_woken(&(svc->in));
+
+		while ((rec = econet_ring_peek(&(svc->in))))
+		{
+			if (rec->type == ECONET_SVC_PACKET)
+				econet_handle_local_aun((struct __econet_packet_aun *) (rec + 1), rec->len, rec->val);
+			else if (rec->type == ECONET_SVC_HOUSEKEEPING)
+				econet_service_housekeeping();
+			else if (rec->type == ECONET_SVC_EJECT)
+				fs_eject_station(rec->arg >> 8, rec->arg & 0xff);
+
+			econet_ring_release(&(svc->in), rec);
+			econet_ring_wake(&(svc->out)); // Don't keep replies back while the next request is dealt with
+		}
+
+		if (fs_dequeuable())
+			fs_dequeue(); // Do bulk transfers out
+
+		econet_ring_wake(&(svc->out));
+
+		if (fs_dequeuable()) // Straight back round
+			timeout = 0;
+		else if (fs_load_queue) // Waiting for room - the network thread will wake us when it has been round again, but look anyway in a bit
+		{
+			atomic_store_explicit(&(svc->wants_room), 1, memory_order_relaxed);
+			timeout = ECONET_QUEUE_RETRY_TIME;
+		}
+		else	timeout = -1;
+
+		if (timeout)
+			poll(&fds, 1, timeout);
+	}
+
+	return NULL;
+}
+
+// Traffic from services[svc]'s servers - send it, unless the queue it is going on is full, in which case it waits
+// (along with everything behind it from the same thread) for up to ECONET_SVC_HOLD, as the fileserver would have
+// done itself.
+
+void econet_service_drain(int svc)
+{
+	struct econet_service *s;
+	struct econet_ring_rec *rec;
+
+	s = &(services[svc]);
+
+	while ((rec = econet_ring_peek(&(s->out))))
+	{
+		struct __econet_packet_aun *p;
+
+		p = (struct __econet_packet_aun *) (rec + 1);
+
+		if (!econet_queue_room(p->p.srcnet, p->p.srcstn, p->p.dstnet, p->p.dststn))
+		{
+			uint64_t now;
+
+			now = econet_ms();
+
+			if (!s->held_since)
+				s->held_since = now;
+
+			if (now - s->held_since < ECONET_SVC_HOLD)
+			{
+				econet_timer_arm(&(s->retry_timer), ECONET_QUEUE_RETRY_TIME);
+				return;
+			}
+		}
+
+		s->held_since = 0;
+		aun_send(p, rec->len);
+		econet_ring_release(&(s->out), rec);
+	}
+}
+
+void econet_service_retry(int svc)
+{
+	econet_service_drain(svc);
+}
+
+// Deliver AUN-format packet p (len bytes) down a named pipe. The two byte length goes on the front with writev() rather than copying the packet into a __econet_packet_pipe. Returns bytes of packet written, as write() would.
+int econet_pipe_write(int fd, struct __econet_packet_aun *p, int len)
+{
+
+	unsigned char length[2];
+	struct iovec iov[2];
+	int r;
+
+	length[0] = len & 0xff;
+	length[1] = (len >> 8) & 0xff;
+
+	iov[0].iov_base = length;
+	iov[0].iov_len = 2;
+	iov[1].iov_base = p;
+	iov[1].iov_len = len;
+
+	r = writev(fd, iov, 2);
+
+	if (r == (len+2)) return r-2;
+	else return r;
+
+}
+
+int econet_write_general(struct __econet_packet_aun *p, int len)
+{
+	int trunk, ptr;
+
+	trunk = trunk_find(p->p.dstnet);
+	ptr = econet_ptr[p->p.dstnet][p->p.dststn];
+
+	if (ptr != -1 || p->p.aun_ttype == ECONET_AUN_BCAST) // A station we know
+	{
+		// What sort of destination?
+		
+		if ((network[ptr].type & ECONET_HOSTTYPE_TWIRE) || (ptr == -1 && p->p.aun_ttype == ECONET_AUN_BCAST)) // WIRE, or an unknown station and it's a broadcast
+			return econet_write_wire(p, len, 0); // Will eventually get rid of parameter 3!
+		else if (network[ptr].type & ECONET_HOSTTYPE_TDIS) // AUN
+		{
+			struct sockaddr_in n;
+			int sender, fd;
+			int result;
+
+			n.sin_family = AF_INET;
+			n.sin_port = htons(network[ptr].port);
+			n.sin_addr = network[ptr].s_addr;
+
+			// Since AUN hosts can't talk to trunks, we should be able to safely look up the sending host
+
+			sender = econet_ptr[p->p.srcnet][p->p.srcstn];
+
+			fd = (network[sender].type & ECONET_HOSTTYPE_TNAMEDPIPE) ? network[sender].pipeudpsocket : network[sender].listensocket;  // If it's a named pipe, we don't send from listensocket, we send from pipeudpsocket
+
+			result = udp_send_batched(fd, &(p->p.aun_ttype), len-4, (struct sockaddr *)&n, sizeof(n),
+				(fd == aun_shared_socket) ? &(network[sender].s_addr) : NULL); // On the shared socket, make sure it comes from the right station's address
+			
+			if (result == len-4) return len; // Because we drop the 4 header bytes off!
+			else return result;
+
+		}
+		else if (network[ptr].type & ECONET_HOSTTYPE_TNAMEDPIPE) // Named Pipe
+		{
+			if (network[ptr].pipewritesocket != -1)
+				return econet_pipe_write(network[ptr].pipewritesocket, p, len);
+			else	
+			{
+				if (pkt_debug) econet_debug ("PIPE : Pipe write socket not open\n");
+				return -1; // The other end of the named pipe isn't open
+			}
+		}
+		else
+		{
+			econet_log ("ERROR: to %3d.%3d from %3d.%3d Unknown destination type (0x%02x) - cannot route\n", p->p.dstnet, p->p.dststn, p->p.srcnet, p->p.srcstn, network[ptr].type);
+			return -1;
+		} // NB, Local transmission handled on arrival
+
+	}
+	else if (trunk >= 0) // On a trunk
+		return aun_trunk_send(p, len);
+	else
+	{
+		econet_log ("ERROR: to %3d.%3d from %3d.%3d Cannot route\n", p->p.dstnet, p->p.dststn, p->p.srcnet, p->p.srcstn);
+		econet_drops[ECONET_DROP_NOROUTE]++;
+		return -1;
+	}
+
+}
+
+// Take queue entry e (already unlinked from aun_head or the window) off network[d]'s books, and free it
+
+void econet_aun_free(int d, struct __econet_packet_aun_cache *e)
+{
+	network[d].aun_queue_len--;
+	network[d].aun_queue_bytes -= e->size;
+	aun_queued--;
+	econet_queue_publish(ECONET_QUEUE_AUN, &(network[d].aun_codel), network[d].aun_queue_len, network[d].aun_queue_bytes);
+	econet_pool_free(e);
+}
+
+// Dump the packet at the head of network[d]'s AUN queue
+
+void econet_aun_dumphead(int d)
+{
+	struct __econet_packet_aun_cache *e;
+
+	if (!(e = network[d].aun_head))
+		return;
+
+	if (queue_debug) econet_debug ("QUEUE: Dumping packet at queue head %p\n", e);
+
+	network[d].aun_head = e->next;
+	if (!network[d].aun_head)
+		network[d].aun_tail = NULL;
+
+	econet_aun_free(d, e);
+}
+
+// Per-host retransmission timeout for AUN hosts. Each ACK for a data packet that was only sent once gives a
+// round trip time sample (packets which have been retransmitted are not timed, since we can't tell which copy
+// was ACKed), from which we keep a smoothed RTT and mean deviation in the usual TCP way (RFC 6298). The timeout
+// is SRTT + 4 * RTTVAR (but at least ECONET_AUN_RTO_MARGIN over SRTT), doubled for each retransmission of the
+// same packet up to ECONET_AUN_MAX_BACKOFF times.
+
+void econet_aun_rtt_reset(int d)
+{
+	network[d].aun_srtt = network[d].aun_rttvar = network[d].aun_rtt_samples = 0;
+	network[d].aun_rto = 0;
+	network[d].aun_backoff = 0;
+
+	if (network[d].aun_rtt_hist)
+		econet_hist_reset(network[d].aun_rtt_hist);
+}
+
+// Fold a round trip time sample rtt (us) into the smoothed RTT & deviation at *srtt & *rttvar (*samples counts them),
+// and return the retransmission timeout (ms) they now give. Also used for reliable trunks - see trunk_rel_ack_receive()
+
+unsigned int econet_rtt_update(unsigned long *srtt, unsigned long *rttvar, unsigned long *samples, long rtt)
+{
+	long err, rto, margin;
+
+	if ((*samples)++ == 0)
+	{
+		*srtt = rtt;
+		*rttvar = rtt / 2;
+	}
+	else
+	{
+		err = rtt - (long) *srtt;
+		if (err < 0) err = -err;
+		*rttvar = ((3 * *rttvar) + err) / 4;
+		*srtt = ((7 * *srtt) + rtt) / 8;
+	}
+
+	margin = 4 * *rttvar;
+	if (margin < (ECONET_AUN_RTO_MARGIN * 1000)) margin = ECONET_AUN_RTO_MARGIN * 1000;
+
+	rto = (*srtt + margin + 999) / 1000;
+
+	if (rto < ECONET_AUN_MIN_RTO) rto = ECONET_AUN_MIN_RTO;
+	if (rto > ECONET_AUN_MAX_RTO) rto = ECONET_AUN_MAX_RTO;
+
+	return rto;
+}
+
+void econet_aun_rtt_sample(int d, struct timeval *sent)
+{
+	struct econet_hosts *h;
+	struct timeval now;
+	long rtt;
+
+	h = &(network[d]);
+
+	gettimeofday(&now, 0);
+
+	rtt = ((now.tv_sec - sent->tv_sec) * 1000000) + (now.tv_usec - sent->tv_usec);
+
+	if (rtt < 0 || sent->tv_sec == 0) // Clock went backwards, or no send time
+		return;
+
+	h->aun_rto = econet_rtt_update(&(h->aun_srtt), &(h->aun_rttvar), &(h->aun_rtt_samples), rtt);
+	h->aun_backoff = 0;
+
+	if (h->aun_rtt_hist || (h->aun_rtt_hist = calloc(1, sizeof(struct econet_hist))))
+		econet_hist_add(h->aun_rtt_hist, rtt);
+}
+
+// Current retransmission timeout for network[d], in ms
+
+long econet_aun_rto(int d)
+{
+	long rto;
+
+	rto = network[d].aun_rto ? network[d].aun_rto : ECONET_AUN_ACK_WAIT_TIME;
+	rto <<= network[d].aun_backoff;
+
+	return (rto > ECONET_AUN_MAX_RTO) ? ECONET_AUN_MAX_RTO : rto;
+}
+
+// A packet to network[d] went unacknowledged for a whole timeout and is about to go again
+
+void econet_aun_rto_backoff(int d)
+{
+	if (network[d].aun_backoff < ECONET_AUN_MAX_BACKOFF)
+		network[d].aun_backoff++;
+}
+
+// Sliding window transmission to AUN hosts with 'WINDOW n' (n > 1) on their A line. Up to n data packets can be
+// unacknowledged at once. Each waits in aun_outstanding[] until its own ACK comes back, and is retransmitted on
+// its own if that takes longer than the host's retransmission timeout - the rest of the window carries on regardless.
+// An immediate waits in the window for its IMM REP in the same way, but nothing more goes out until that arrives
+// (or the immediate is given up on), so immediates go one at a time as they do without a window.
+
+static void econet_aun_window_release(int d, int slot)
+{
+	if (network[d].aun_outstanding[slot]->p->p.aun_ttype == ECONET_AUN_IMM)
+		network[d].aun_imm_inflight = 0;
+
+	econet_aun_free(d, network[d].aun_outstanding[slot]);
+	network[d].aun_outstanding[slot] = NULL;
+	network[d].aun_inflight--;
+}
+
+void econet_aun_window_service(int d)
+{
+	struct econet_hosts *h;
+	struct timeval now;
+	long wait = -1; // How long until we next need to look at this host; -1 = no need
+	long rto;
+	int slot;
+
+	h = &(network[d]);
+
+	gettimeofday(&now, 0);
+
+	rto = econet_aun_rto(d);
+
+	if (h->ackimm_seq_tosend && (timediffmsec(&(h->aun_last_rx), &now) > ECONET_AUN_TOSEND_EXPIRY)) // Ditch the last RX / Seq tracker, as for stop-and-wait
+	{
+		h->aun_last_rx.tv_sec = h->aun_last_rx.tv_usec = 0;
+		h->ackimm_seq_tosend = 0;
+	}
+
+	// First, retransmit whatever has waited too long for its ACK
+
+	for (slot = 0; slot < h->aun_window; slot++)
+	{
+		struct __econet_packet_aun_cache *e;
+		long tdiff;
+
+		if (!(e = h->aun_outstanding[slot]))
+			continue;
+
+		tdiff = timediffmsec(&(e->tstamp), &now);
+
+		if (tdiff >= 0 && tdiff < rto) // Not yet
+		{
+			if (wait == -1 || (rto - tdiff) < wait)
+				wait = rto - tdiff;
+			continue;
+		}
+
+		if (e->tx_count++ > ECONET_AUN_MAX_TX)
+		{
+			if (queue_debug) econet_debug ("QUEUE: to %3d.%3d from %3d.%3d seq 0x%08X dumped from network[%d] window (too many retries)\n",
+				e->p->p.dstnet, e->p->p.dststn, e->p->p.srcnet, e->p->p.srcstn, e->p->p.seq, d);
+			econet_aun_window_release(d, slot);
+			aun_window_drops++;
+			network[d].drops++;
+			econet_drops[ECONET_DROP_RETRIES]++;
+			continue;
+		}
+
+		if (queue_debug) econet_debug ("QUEUE: to %3d.%3d from %3d.%3d seq 0x%08X retransmitted from network[%d] window (tx count %02X)\n",
+			e->p->p.dstnet, e->p->p.dststn, e->p->p.srcnet, e->p->p.srcstn, e->p->p.seq, d, e->tx_count);
+
+		if (e->tstamp.tv_sec) // Timed out rather than NAKed
+		{
+			econet_aun_rto_backoff(d);
+			rto = econet_aun_rto(d);
+		}
+
+		econet_write_general(e->p, e->size);
+		e->tstamp = now;
+		aun_window_retx++;
+		network[d].retx++;
+
+		if (wait == -1 || rto < wait)
+			wait = rto;
+	}
+
+	// Then fill the window up from the queue
+
+	while (h->aun_head && h->aun_inflight < h->aun_window && !h->aun_imm_inflight)
+	{
+		struct __econet_packet_aun_cache *e;
+
+		e = h->aun_head;
+
+		if (h->ackimm_seq_tosend && (e->p->p.aun_ttype != ECONET_AUN_IMMREP || e->p->p.seq != h->ackimm_seq_tosend)) // Host is waiting for an IMM REP, and this isn't it
+		{
+			long expiry = ECONET_AUN_TOSEND_EXPIRY + 1 - (long) timediffmsec(&(h->aun_last_rx), &now);
+
+			if (wait == -1 || expiry < wait)
+				wait = expiry;
+			break;
+		}
+
+		if (econet_write_general(e->p, e->size) != e->size)
+		{
+			if (queue_debug) econet_debug ("QUEUE: to %3d.%3d from %3d.%3d seq 0x%08X send from network[%d] queue FAILED\n",
+				e->p->p.dstnet, e->p->p.dststn, e->p->p.srcnet, e->p->p.srcstn, e->p->p.seq, d);
+
+			if (wait == -1 || ECONET_QUEUE_RETRY_TIME < wait)
+				wait = ECONET_QUEUE_RETRY_TIME;
+			break;
+		}
+
+		if (queue_debug) econet_debug ("QUEUE: to %3d.%3d from %3d.%3d len 0x%04X type 0x%02X seq 0x%08X sent from network[%d] queue (%d in flight)\n",
+			e->p->p.dstnet, e->p->p.dststn, e->p->p.srcnet, e->p->p.srcstn, e->size, e->p->p.aun_ttype, e->p->p.seq, d, h->aun_inflight);
+
+		if (e->p->p.seq == h->ackimm_seq_tosend)
+			h->ackimm_seq_tosend = 0;
+
+		h->aun_head = e->next;
+		if (!h->aun_head)
+			h->aun_tail = NULL;
+		e->next = NULL;
+
+		econet_codel_dequeued(ECONET_QUEUE_AUN, &(h->aun_codel), &(e->tstamp), (h->aun_head ? h->aun_queue_bytes : 0));
+		econet_queue_publish(ECONET_QUEUE_AUN, &(h->aun_codel), h->aun_queue_len, h->aun_queue_bytes);
+
+		if (e->p->p.aun_ttype == ECONET_AUN_DATA || e->p->p.aun_ttype == ECONET_AUN_IMM) // Hang on to it until it's acknowledged (or replied to)
+		{
+			for (slot = 0; h->aun_outstanding[slot]; slot++); // There is a free one, since aun_inflight < aun_window
+
+			e->tstamp = now;
+			e->tx_count = 1;
+			h->aun_outstanding[slot] = e;
+			h->aun_inflight++;
+
+			if (e->p->p.aun_ttype == ECONET_AUN_IMM) // Reset the chip if it doesn't answer
+			{
+				h->aun_imm_inflight = 1;
+				econet_timer_arm(&imm_reset_timer, ECONET_AUN_IMM_RESET_TIME);
+			}
+
+			if (wait == -1 || rto < wait)
+				wait = rto;
+		}
+		else	econet_aun_free(d, e);
+	}
+
+	if (wait != -1)
+		econet_aun_park(d, wait);
+}
+
+// ACK, NAK or IMM REP from a window host. ACK / IMM REP free up the packet's slot in the window; NAK makes it due
+// for retransmission straight away. Returns 1 if it matched something outstanding.
+
+int econet_aun_window_ack(int d, struct __econet_packet_aun *p)
+{
+	int slot;
+
+	if (p->p.aun_ttype == ECONET_AUN_IMMREP)
+		econet_timer_cancel(&imm_reset_timer);
+
+	for (slot = 0; slot < network[d].aun_window; slot++)
+	{
+		if (network[d].aun_outstanding[slot] && network[d].aun_outstanding[slot]->p->p.seq == p->p.seq)
+		{
+			if (p->p.aun_ttype == ECONET_AUN_NAK)
+			{
+				network[d].aun_outstanding[slot]->tstamp.tv_sec = network[d].aun_outstanding[slot]->tstamp.tv_usec = 0;
+				aun_window_naks++;
+			}
+			else
+			{
+				if (p->p.aun_ttype == ECONET_AUN_ACK && network[d].aun_outstanding[slot]->tx_count == 1) // Only sent once, so we know which transmission this answers
+					econet_aun_rtt_sample(d, &(network[d].aun_outstanding[slot]->tstamp));
+				econet_aun_window_release(d, slot);
+			}
+
+			econet_aun_ready(d);
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+// Make sure network[] has an entry 'index', growing it if need be. New entries are zeroed.
+// Only called whilst reading the config - nothing may hold a pointer into network[] across a call.
+
+void econet_host_reserve(int index)
+{
+	struct econet_hosts *n;
+	int newsize;
+
+	if (index < network_size)
+		return;
+
+	if (index >= 65536)
+	{
+		fprintf (stderr, "Too many stations in configuration\n");
+		exit(EXIT_FAILURE);
+	}
+
+	newsize = network_size ? network_size * 2 : 256;
+	while (newsize <= index)
+		newsize *= 2;
+
+	if (!(n = realloc(network, newsize * sizeof(struct econet_hosts))))
+	{
+		fprintf (stderr, "Unable to allocate station table: %s\n", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	memset(&(n[network_size]), 0, (newsize - network_size) * sizeof(struct econet_hosts));
+	network = n;
+	network_size = newsize;
+}
+
+// Return the server configuration for network[index], allocating it if it doesn't have one yet
+
+struct econet_server_config * econet_server_get(int index)
+{
+	struct econet_server_config *s;
+
+	if ((s = network[index].server))
+		return s;
+
+	if (!(s = calloc(1, sizeof(struct econet_server_config))))
+	{
+		fprintf (stderr, "Unable to allocate server configuration: %s\n", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	memset(&(s->printer_priorities), 255, sizeof(s->printer_priorities));
+	network[index].server = s;
+	network_servers++;
+
+	return s;
+}
+
+// Get index number of printer (not priority number, but the index into network[].server->printers)
+// Or return -1 if no such printer.
+
+int8_t get_printer(unsigned char net, unsigned char stn, char *pname) 
+{
+
+	uint8_t printindex;
+	char pnamepad[7];
+
+	int netindex;
+
+	netindex = econet_ptr[net][stn];
+
+	if (netindex == -1 || !network[netindex].server) return -1; // Can't find that station defined locally, or it has no printers
+
+	snprintf(pnamepad, 7, "%-6.6s", pname);
+
+	printindex = 0;
+
+	while (printindex < network[netindex].server->numprinters)
+	{
+		if (!strncasecmp(network[netindex].server->printers[printindex].name, pnamepad, 6))
+			return printindex;
+		printindex++;
+	}
+
+	return -1; // not found if we get here
+}
+
+static inline unsigned int aun_hash_bucket(struct in_addr a, unsigned int port)
+{
+	uint32_t h;
+
+	h = (ntohl(a.s_addr) * 2654435761U) ^ (port * 40503U);
+
+	return (h ^ (h >> 15)) & (ECONET_AUN_HASH_SIZE - 1);
+}
+
+void aun_hash_init(void)
+{
+	int count;
+
+	for (count = 0; count < ECONET_AUN_HASH_SIZE; count++)
+		aun_hash[count].index = -1;
+}
+
+// Find the bucket holding addr:port, or -1 if it isn't there
+int aun_hash_find(struct in_addr a, unsigned int port)
+{
+	unsigned int b, probes = 0;
+
+	b = aun_hash_bucket(a, port);
+
+	while (aun_hash[b].index != -1 && probes < ECONET_AUN_HASH_SIZE)
+	{
+		if (aun_hash[b].s_addr.s_addr == a.s_addr && aun_hash[b].port == port)
+		{
+			aun_hash_collisions += probes;
+			return b;
+		}
+
+		b = (b + 1) & (ECONET_AUN_HASH_SIZE - 1);
+		probes++;
+	}
+
+	aun_hash_collisions += probes;
+	return -1;
+}
+
+// Point addr:port at network[index]. If the key is already there, it is re-pointed (dynamic reallocation)
+// Returns 0 if the table is full
+int aun_hash_insert(struct in_addr a, unsigned int port, int index)
+{
+	unsigned int b, probes = 0;
+
+	b = aun_hash_bucket(a, port);
+
+	while (aun_hash[b].index != -1)
+	{
+		if (aun_hash[b].s_addr.s_addr == a.s_addr && aun_hash[b].port == port)
+			break;
+
+		b = (b + 1) & (ECONET_AUN_HASH_SIZE - 1);
+		if (++probes == ECONET_AUN_HASH_SIZE)
+			return 0;
+	}
+
+	aun_hash[b].s_addr = a;
+	aun_hash[b].port = port;
+	aun_hash[b].index = index;
+
+	return 1;
+}
+
+// Remove addr:port from the table, but only if it still points at network[index] 
+void aun_hash_remove(struct in_addr a, unsigned int port, int index)
+{
+	int b;
+	unsigned int gap, next, home;
+
+	if ((b = aun_hash_find(a, port)) == -1 || aun_hash[b].index != index)
+		return;
+
+	// Backward shift - pull up anything further along the probe chain which would otherwise be cut off by the hole we're making
+
+	gap = b;
+	next = (gap + 1) & (ECONET_AUN_HASH_SIZE - 1);
+
+	while (aun_hash[next].index != -1)
+	{
+		home = aun_hash_bucket(aun_hash[next].s_addr, aun_hash[next].port);
+
+		if (((next - home) & (ECONET_AUN_HASH_SIZE - 1)) >= ((next - gap) & (ECONET_AUN_HASH_SIZE - 1))) // Entry at next can legitimately live in the gap
+		{
+			aun_hash[gap] = aun_hash[next];
+			gap = next;
+		}
+
+		next = (next + 1) & (ECONET_AUN_HASH_SIZE - 1);
+	}
+
+	aun_hash[gap].index = -1;
+}
+
+// Open the shared AUN listener on port 32768 for base network a.b.c, asking for IP_PKTINFO so we know which station each datagram was for
+
+void aun_shared_open(char *basenet)
+{
+
+	struct sockaddr_in service;
+	char tmp[30];
+	int one = 1;
+
+	snprintf(tmp, 29, "%s.0", basenet);
+	aun_shared_base.s_addr = inet_addr(tmp);
+	memset(&aun_shared_ptr, 0xff, sizeof(aun_shared_ptr));
+
+	if ((aun_shared_socket = socket(AF_INET, SOCK_DGRAM, 0)) == -1)
+	{
+		fprintf(stderr, "Failed to open shared AUN listening socket: %s.", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	setsockopt(aun_shared_socket, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)); // So that named pipe stations can still bind their own address on 32768
+
+	if (setsockopt(aun_shared_socket, IPPROTO_IP, IP_PKTINFO, &one, sizeof(one)) != 0)
+	{
+		fprintf(stderr, "Failed to enable IP_PKTINFO on shared AUN listening socket: %s.", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	service.sin_family = AF_INET;
+	service.sin_addr.s_addr = INADDR_ANY;
+	service.sin_port = htons(32768);
+
+	if (bind(aun_shared_socket, (struct sockaddr *) &service, sizeof(service)) != 0)
+	{
+		fprintf(stderr, "Failed to bind shared AUN listening socket: %s.", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	econet_watch_fd(aun_shared_socket, econet_handle_aun_fd);
+
+}
+
+// Put network[ptr] on the shared AUN listener instead of giving it a socket of its own
+
+void aun_shared_add(int ptr)
+{
+
+	unsigned char stn;
+
+	stn = network[ptr].station;
+
+	if (aun_shared_ptr[stn] != -1) // Same station number on another network - it would have the same IP address
+	{
+		fprintf(stderr, "Station %d.%d has the same address as %d.%d on the shared AUN listener.\n", network[ptr].network, stn, network[aun_shared_ptr[stn]].network, stn);
+		exit(EXIT_FAILURE);
+	}
+
+	aun_shared_ptr[stn] = ptr;
+	network[ptr].listensocket = aun_shared_socket;
+	network[ptr].port = 32768;
+	network[ptr].s_addr.s_addr = aun_shared_base.s_addr | htonl(stn); // So that replies go out from the station's address
+
+}
+
+// Which network[] entry was a datagram to address a on the shared socket for? 0xffff if none
+
+unsigned short aun_shared_lookup(struct in_addr a)
+{
+
+	int ptr;
+
+	if ((a.s_addr & htonl(0xffffff00)) != aun_shared_base.s_addr)
+		return 0xffff;
+
+	ptr = aun_shared_ptr[ntohl(a.s_addr) & 0xff];
+
+	return (ptr == -1 ? 0xffff : ptr);
+
+}
+
+// Compile the firewall rule list for trunk t into trunks[t].fw, preserving first-match semantics
+void trunk_fw_compile(int t)
+{
+
+	struct __fw_entry *e, **rules;
+	struct __fw_stnrule *candidate;
+	struct __fw_compiled *c;
+	unsigned short numrules, count, srcnet, dstnet, numcandidates, dflt, l;
+
+	if (trunks[t].head == NULL)
+	{
+		trunks[t].fw = NULL;
+		return;
+	}
+
+	numrules = 0;
+	for (e = trunks[t].head; e; e = e->next)
+		numrules++;
+
+	rules = malloc(numrules * sizeof(struct __fw_entry *));
+	candidate = malloc(numrules * sizeof(struct __fw_stnrule));
+	c = malloc(sizeof(struct __fw_compiled));
+
+	if (!rules || !candidate || !c)
+	{
+		fprintf (stderr, "Unable to malloc() space to compile firewall for trunk %d\n", t);
+		exit(EXIT_FAILURE);
+	}
+
+	count = 0;
+	for (e = trunks[t].head; e; e = e->next)
+		rules[count++] = e;
+
+	c->numlists = 0;
+	c->lists = NULL;
+
+	for (srcnet = 0; srcnet < 256; srcnet++)
+		for (dstnet = 0; dstnet < 256; dstnet++)
+		{
+			// Collect the rules which apply to this pair of networks, in order, up to the first one which doesn't care about station numbers - that's the default for the pair
+
+			numcandidates = 0;
+			dflt = FW_ACCEPT;
+
+			for (count = 0; count < numrules; count++)
+			{
+				e = rules[count];
+
+				if (!((e->srcnet == 255 || e->srcnet == srcnet) && (e->dstnet == 255 || e->dstnet == dstnet)))
+					continue;
+
+				if (e->srcstn == 255 && e->dststn == 255)
+				{
+					dflt = e->action;
+					break;
+				}
+
+				candidate[numcandidates].srcstn = e->srcstn;
+				candidate[numcandidates].dststn = e->dststn;
+				candidate[numcandidates].action = e->action;
+				numcandidates++;
+			}
+
+			if (numcandidates == 0)
+			{
+				c->verdict[srcnet][dstnet] = dflt;
+				continue;
+			}
+
+			// Station level rules - share a list with any other network pair that ended up with exactly the same one
+
+			for (l = 0; l < c->numlists; l++)
+				if (c->lists[l].dflt == dflt && c->lists[l].numrules == numcandidates && !memcmp(c->lists[l].rules, candidate, numcandidates * sizeof(struct __fw_stnrule)))
+					break;
+
+			if (l == c->numlists)
+			{
+				c->lists = realloc(c->lists, (c->numlists + 1) * sizeof(struct __fw_stnlist));
+				if (!c->lists || !(c->lists[l].rules = malloc(numcandidates * sizeof(struct __fw_stnrule))))
+				{
+					fprintf (stderr, "Unable to malloc() space to compile firewall for trunk %d\n", t);
+					exit(EXIT_FAILURE);
+				}
+
+				memcpy(c->lists[l].rules, candidate, numcandidates * sizeof(struct __fw_stnrule));
+				c->lists[l].numrules = numcandidates;
+				c->lists[l].dflt = dflt;
+				c->numlists++;
+			}
+
+			c->verdict[srcnet][dstnet] = FW_STNLIST + l;
+		}
+
+	free(rules);
+	free(candidate);
+
+	trunks[t].fw = c;
+
+}
+
+// Dump the compiled firewall on trunk t - only the network pairs which aren't a straight accept
+void trunk_fw_dump(int t)
+{
+
+	struct __fw_compiled *c;
+	unsigned short srcnet, srcstart, dstnet, start, l, r;
+
+	if (!(c = trunks[t].fw))
+		return;
+
+	fprintf (stderr, "\n    COMPILED FIREWALL (%d station rule list%s)\n", c->numlists, (c->numlists == 1 ? "" : "s"));
+
+	srcnet = 0;
+
+	while (srcnet < 256)
+	{
+		// Lump together runs of source networks which are treated identically
+
+		srcstart = srcnet;
+
+		while (srcnet < 255 && !memcmp(c->verdict[srcnet+1], c->verdict[srcstart], sizeof(c->verdict[srcstart])))
+			srcnet++;
+
+		dstnet = 0;
+
+		while (dstnet < 256)
+		{
+			start = dstnet;
+
+			while (dstnet < 255 && c->verdict[srcstart][dstnet+1] == c->verdict[srcstart][start])
+				dstnet++;
+
+			if (c->verdict[srcstart][start] == FW_DROP)
+				fprintf (stderr, "    FWCMP from nets %3d-%3d to nets %3d-%3d Drop\n", srcstart, srcnet, start, dstnet);
+			else if (c->verdict[srcstart][start] >= FW_STNLIST)
+				fprintf (stderr, "    FWCMP from nets %3d-%3d to nets %3d-%3d Station list %d\n", srcstart, srcnet, start, dstnet, c->verdict[srcstart][start] - FW_STNLIST);
+
+			dstnet++;
+		}
+
+		srcnet++;
+	}
+
+	for (l = 0; l < c->numlists; l++)
+	{
+		fprintf (stderr, "    FWCMP station list %d:", l);
+		for (r = 0; r < c->lists[l].numrules; r++)
+			fprintf (stderr, " %s %3d->%3d;", (c->lists[l].rules[r].action == FW_ACCEPT ? "Accept" : "Drop"), c->lists[l].rules[r].srcstn, c->lists[l].rules[r].dststn);
+		fprintf (stderr, " otherwise %s\n", (c->lists[l].dflt == FW_ACCEPT ? "Accept" : "Drop"));
+	}
+
+}
+
+void econet_readconfig(void) 
+{
+	// This reads a config file in like the BeebEm One.
+	// However, stations with IP address 0.0.0.0 are on the Econet wire.
+	// We listen on all IP addresses with the specified port for each one.
+	// Stations with real IP addresses are out on the internet (or potentially on
+	// The local machine if some sort of emulator is running - e.g. BeebEm
+	
+	FILE *configfile;
+	char linebuf[256], basenet[20];
+	regex_t r_comment, r_entry_distant, r_entry_local, r_entry_server, r_entry_wire, r_entry_trunk, r_entry_xlate, r_entry_fw, r_entry_learn, r_entry_namedpipe, r_entry_filter, r_entry_basenet, r_entry_printhandler, r_entry_queuemem, r_entry_queuelimit, r_entry_queuedelay, r_entry_cpu, r_entry_fsworkers, r_entry_stats;
+	regmatch_t matches[10];
+	int count;
+	short j, k;
+	int networkp; // Pointer into network[] array whilst reading config. 
+	
+	char *end;
+
+	struct hostent *h;
+	struct sockaddr_in service;
+
+	numtrunks = 0;
+
+	if ((epoll_fd = epoll_create1(0)) == -1)
+	{
+		fprintf (stderr, "Unable to create epoll descriptor: %s\n", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	memset(&wire_advertizable, 0, sizeof(wire_advertizable));
+	memset(&trunk_advertizable, 0, sizeof(wire_advertizable));
+	memset(&wire_adv_in, 0, sizeof(wire_adv_in));
+	memset(&wire_adv_out, 0, sizeof(wire_adv_out));
+	memset(&wire_filter_in, 0, sizeof(wire_filter_in));
+	memset(&wire_filter_out, 0, sizeof(wire_filter_out));
+	*basenet='\0';
+
+// Set all the networkp entries within the last printer table to 65535.
+	memset(&last_printers, 255, sizeof(last_printers));
+
+	configfile = fopen(cfgpath, "r");
+	if (configfile == NULL)
+	{
+		fprintf(stderr, "Unable to open config file %s: %s\n", cfgpath, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	/* Blank off the variables */
+
+	for (j = 0; j < 256; j++)
+		for (k = 0; k < 256; k++)
+			econet_ptr[j][k] = -1;
+
+	for (j = 0; j < 256; j++)
+	{
+		trunks[j].listensocket = -1;
+		trunks[j].ready_next = -1;
+	}
+
+	aun_hash_init();
+
+	memset(&trunk_route, 0xff, sizeof(trunk_route));
+
+	for (j = 0; j < 256; j++)
+		atomic_init(&(queue_route[j]), -1);
+
+	networkp = 0;
+
+	/* Compile some regular expressions */
+
+	if (regcomp(&r_comment, "^\\s*#.*$", 0) != 0)
+	{
+		fprintf(stderr, "Unable to compile comment regex.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	/* This needs a better regex */
+	if (regcomp(&r_entry_printhandler, "^\\s*PRINTHANDLER\\s+(.+)\\s*$", REG_EXTENDED) != 0)
+	{
+		fprintf(stderr, "Unable to compile print handler regex.\n");		
+		exit(EXIT_FAILURE);
+	}
+
+	if (regcomp(&r_entry_queuemem, "^\\s*QUEUEMEM\\s+([[:digit:]]{1,5})\\s*$", REG_EXTENDED | REG_ICASE) != 0)
+	{
+		fprintf(stderr, "Unable to compile queue memory regex.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (regcomp(&r_entry_queuelimit, "^\\s*QUEUELIMIT\\s+(WIRE|AUN|TRUNK)\\s+([[:digit:]]{1,5})\\s+([[:digit:]]{1,6})\\s*$", REG_EXTENDED | REG_ICASE) != 0)
+	{
+		fprintf(stderr, "Unable to compile queue limit regex.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (regcomp(&r_entry_queuedelay, "^\\s*QUEUEDELAY\\s+([[:digit:]]{1,5})\\s+([[:digit:]]{1,5})\\s*$", REG_EXTENDED | REG_ICASE) != 0)
+	{
+		fprintf(stderr, "Unable to compile queue delay regex.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (regcomp(&r_entry_cpu, "^\\s*CPU\\s+(NET|WIRE|SERVICE|FS[1-8])\\s+([[:digit:]]{1,3})\\s*$", REG_EXTENDED | REG_ICASE) != 0)
+	{
+		fprintf(stderr, "Unable to compile CPU regex.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (regcomp(&r_entry_fsworkers, "^\\s*FSWORKERS\\s+([1-8])\\s*$", REG_EXTENDED | REG_ICASE) != 0)
+	{
+		fprintf(stderr, "Unable to compile fileserver workers regex.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (regcomp(&r_entry_stats, "^\\s*STATS\\s+([^[:space:]]+)\\s*$", REG_EXTENDED | REG_ICASE) != 0)
+	{
+		fprintf(stderr, "Unable to compile statistics socket regex.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (regcomp(&r_entry_distant, "^\\s*([Aa]|IP)\\s+([[:digit:]]{1,3})\\s+([[:digit:]]{1,3})\\s+([^[:space:]]+)\\s+([[:digit:]]{4,5})(\\s+WINDOW\\s+([[:digit:]]{1,2}))?\\s*$", REG_EXTENDED) != 0)
+	{
+		fprintf(stderr, "Unable to compile full distant station regex.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (regcomp(&r_entry_basenet, "^\\s*([Bb])\\s+([[:digit:]]{1,3}\\.[[:digit:]]{1,3}\\.[[:digit:]]{1,3})(\\s+SHARED)?\\s*$", REG_EXTENDED) != 0)
+	{
+		fprintf(stderr, "Unable to compile base network regex.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (regcomp(&r_entry_local, "^\\s*([Nn]|LOCALNET)\\s+([[:digit:]]{1,3})\\s*$", REG_EXTENDED) != 0)
+	{
+		fprintf(stderr, "Unable to compile full local config regex.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	//if (regcomp(&r_entry_server, "^\\s*([FfPpSs])\\s+([[:digit:]]{1,3})\\s+([[:digit:]]{1,3})\\s+([[:digit:]]{4,5}|AUTO)\\s+(.+)\\s*$", REG_EXTENDED) != 0)
+	if (regcomp(&r_entry_server, "^\\s*([FfPp])\\s+([[:digit:]]{1,3})\\s+([[:digit:]]{1,3})\\s+([[:digit:]]{4,5}|AUTO)\\s+(.+)\\s*$", REG_EXTENDED) != 0)
+	{
+		fprintf(stderr, "Unable to compile server regex.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (regcomp(&r_entry_namedpipe, "^\\s*(UNIX)\\s+([[:digit:]]{1,3})\\s+([[:digit:]]{1,3})\\s+([[:digit:]]{4,5}|AUTO)\\s+(\\/.+)\\s*$", REG_EXTENDED) != 0)
+	{
+		fprintf(stderr, "Unable to compile named pipe regex.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (regcomp(&r_entry_wire, "^\\s*([Ww]|WIRE)\\s+([[:digit:]]{1,3})\\s+([[:digit:]]{1,3}|\\*)\\s+([[:digit:]]{4,5}|AUTO)\\s*$", REG_EXTENDED) != 0)
+	{
+		fprintf(stderr, "Unable to compile full wire station regex.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (regcomp(&r_entry_learn, "^\\s*([Ll]|LEARN|DYNAMIC)\\s+([[:digit:]]{1,3})\\s*$", REG_EXTENDED) != 0)
+	{
+		fprintf(stderr, "Unable to compile full wire station regex.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (regcomp(&r_entry_trunk, "^\\s*([T]|TRUNK)\\s+([[:digit:]]{1,3})\\s+([[:digit:]]{4,5})\\s+([^[:space:]]+)\\s+([[:digit:]]{4,5})(\\s+MTU\\s+([[:digit:]]{3,5}))?(\\s+COMPRESS)?(\\s+RELIABLE)?\\s*$", REG_EXTENDED | REG_ICASE) != 0)
+	{
+		fprintf(stderr, "Unable to compile trunk regex.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (regcomp(&r_entry_xlate, "^\\s*([X]|XLATE|TRANSLATE)\\s+([[:digit:]]{1,3})\\s+([[:digit:]]{1,3})\\s+([[:digit:]]{1,3})\\s*$", REG_EXTENDED | REG_ICASE) != 0)
+	{
+		fprintf(stderr, "Unable to compile network translation regex.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (regcomp(&r_entry_fw, "^\\s*([Y]|FIREWALL)\\s+([[:digit:]]{1,3})\\s+([[:digit:]]{1,3})\\s+([[:digit:]]{1,3})\\s+([[:digit:]]{1,3})\\s+([[:digit:]]{1,3})\\s+(DROP|ACCEPT)\\s*$", REG_EXTENDED | REG_ICASE) != 0)
+	{
+		fprintf(stderr, "Unable to compile network firewall regex.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (regcomp(&r_entry_filter, "^\\s*FILTER\\s+(IN|OUT)\\s+([[:digit:]]{1,3})\\s+NET\\s+([[:digit:]]{1,3})\\s*$", REG_EXTENDED | REG_ICASE) != 0)
+	{
+		fprintf(stderr, "Unable to compile network filter regex.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	while (!feof(configfile))
+	{
+		if (fgets(linebuf, 255, configfile) == NULL) break;
+		linebuf[strlen(linebuf)-1] = 0x00; // Drop the linefeed
+
+		// Strip off any trailing whitespace - Thank you @sweh
+		end = linebuf + strlen(linebuf) + 1;
+		while (end >= linebuf && isspace((unsigned char) *end))
+			end--;
+
+		end[1] = '\0';
+
+		// Skip if empty line
+		if (strlen(linebuf) == 0)
+			continue;
+
+		// Make sure there is a blank entry for this line to fill in
+
+		econet_host_reserve(networkp);
+		network[networkp].is_dynamic = 0;
+		network[networkp].last_transaction = 0;
+		network[networkp].is_wired_fs = 0;
+
+		if (regexec(&r_comment, linebuf, 0, NULL, 0) == 0)
+		{ }
+		else if (regexec(&r_entry_printhandler, linebuf, 2, matches, 0) == 0)
+		{
+			printhandler = malloc(sizeof(linebuf));
+			if (!printhandler)
+			{
+				fprintf (stderr, "Error on malloc() for print handler string.\n");
+				exit(EXIT_FAILURE);
+			}
+			strcpy(printhandler, &(linebuf[matches[1].rm_so]));
+		}
+		else if (regexec(&r_entry_queuemem, linebuf, 2, matches, 0) == 0)
+		{
+			uint64_t cap;
+
+			cap = (uint64_t) atol(&(linebuf[matches[1].rm_so])) * 1024 * 1024; // (unsigned long is 32 bits on a 32 bit Pi OS)
+			if (cap == 0)
+			{
+				fprintf (stderr, "QUEUEMEM must be at least 1 (megabyte).\n");
+				exit(EXIT_FAILURE);
+			}
+			if (cap > SIZE_MAX)
+			{
+				fprintf (stderr, "QUEUEMEM can be at most %" PRIu64 " (megabytes) on this machine.\n", (uint64_t) SIZE_MAX / (1024 * 1024));
+				exit(EXIT_FAILURE);
+			}
+
+			pool_cap = cap;
+		}
+		else if (regexec(&r_entry_queuelimit, linebuf, 4, matches, 0) == 0)
+		{
+			int type;
+
+			for (type = 0; type < ECONET_QUEUE_TYPES; type++)
+				if (!strncasecmp(&(linebuf[matches[1].rm_so]), queue_names[type], matches[1].rm_eo - matches[1].rm_so))
+					break;
+
+			queue_limits[type].packets = atoi(&(linebuf[matches[2].rm_so]));
+			queue_limits[type].bytes = atol(&(linebuf[matches[3].rm_so])) * 1024;
+		}
+		else if (regexec(&r_entry_queuedelay, linebuf, 3, matches, 0) == 0)
+		{
+			codel_target = atoi(&(linebuf[matches[1].rm_so]));
+			codel_interval = atoi(&(linebuf[matches[2].rm_so]));
+
+			if (codel_target && codel_interval < codel_target)
+			{
+				fprintf (stderr, "QUEUEDELAY interval must be at least as long as the target delay.\n");
+				exit(EXIT_FAILURE);
+			}
+		}
+		else if (regexec(&r_entry_cpu, linebuf, 3, matches, 0) == 0)
+		{
+			int t;
+
+			for (t = 0; t < ECONET_THREADS; t++)
+				if (!strncasecmp(&(linebuf[matches[1].rm_so]), thread_names[t], matches[1].rm_eo - matches[1].rm_so))
+					break;
+
+			thread_cpu[t] = atoi(&(linebuf[matches[2].rm_so]));
+		}
+		else if (regexec(&r_entry_fsworkers, linebuf, 2, matches, 0) == 0)
+			fs_workers = atoi(&(linebuf[matches[1].rm_so]));
+		else if (regexec(&r_entry_stats, linebuf, 2, matches, 0) == 0)
+		{
+			linebuf[matches[1].rm_eo] = 0;
+			stats_path = strdup(&(linebuf[matches[1].rm_so]));
+		}
+		else if (regexec(&r_entry_distant, linebuf, 8, matches, 0) == 0)
+		{
+			char 	tmp[300];
+			int	ptr;
+				
+			/* Find our matches */
+			for (count = 1; count <= 5; count++)
+			{
+				ptr = 0;
+				while (ptr < (matches[count].rm_eo - matches[count].rm_so))
+				{
+					tmp[ptr] = linebuf[ptr + matches[count].rm_so];	
+					ptr++;
+				}
+				tmp[ptr] = 0x00;
+				
+				switch (count)
+				{
+					case 1: // D (Distant, IP, Raw packets), A (Distant, IP, AUN)
+						switch (tmp[0]) {
+							case 'A':
+							case 'a':
+								network[networkp].type = ECONET_HOSTTYPE_DIS_AUN;
+								break;
+						}
+						break;
+					case 2:
+						network[networkp].network = atoi(tmp);
+						break;
+					case 3:
+						network[networkp].station = atoi(tmp);
+						break;
+					case 4:
+						network[networkp].hostname = strndup(tmp, 249);
+						h = gethostbyname(tmp);
+						if (h == NULL)
+						{
+							fprintf(stderr, "Cannot resolve hostname %s\n", tmp);
+							exit (EXIT_FAILURE);
+						}
+	
+						network[networkp].s_addr = *(struct in_addr *)h->h_addr;
+
+						network[networkp].listensocket = -2; // Distant host
+						
+						break;
+					case 5:
+						network[networkp].port = atoi(tmp);
+						break;		
+				}
+			}
+
+			network[networkp].aun_window = 1;
+
+			if (matches[7].rm_so != -1) // WINDOW n
+			{
+				int window;
+
+				window = atoi(linebuf + matches[7].rm_so);
+
+				if (window < 1 || window > ECONET_AUN_MAX_WINDOW)
+				{
+					fprintf(stderr, "Window for AUN host %d.%d must be between 1 and %d\n", network[networkp].network, network[networkp].station, ECONET_AUN_MAX_WINDOW);
+					exit(EXIT_FAILURE);
+				}
+
+				network[networkp].aun_window = window;
+
+				if (window > 1 && !(network[networkp].aun_outstanding = calloc(window, sizeof(struct __econet_packet_aun_cache *))))
+				{
+					fprintf(stderr, "Unable to allocate window for AUN host %d.%d\n", network[networkp].network, network[networkp].station);
+					exit(EXIT_FAILURE);
+				}
+			}
+
+			// Turn local server off
+			network[networkp].servertype = 0;
+			network[networkp].last_seq_ack = 0; // Tracks the last AUN data packet we acknowledged from this host.
+
+			// Include the network in our list
+			wire_advertizable[network[networkp].network] = 0xff;
+			econet_ptr[network[networkp].network][network[networkp].station] = networkp;
+
+			// If this is a distant AUN station, put it in the station map so the kernel module does the 4-way handshake / replies to immediates
+			ECONET_SET_STATION(econet_stations, network[networkp].network, network[networkp].station);
+
+			// Next, if we haven't yet got a native bridged network (i.e. the equivalent of the opposite side of a read bridge), the set one - takes the first in the file basically 
+			if (nativebridgenet == 0 && network[networkp].network != 0)
+				nativebridgenet = network[networkp].network;
+			
+			network[networkp].aun_head = network[networkp].aun_tail = NULL;
+			network[networkp].aun_last_tx.tv_sec = network[networkp].aun_last_tx.tv_usec = 0;
+			network[networkp].aun_last_rx.tv_sec = network[networkp].aun_last_rx.tv_usec = 0;
+			network[networkp].ackimm_seq_awaited = 0; // Sequence number we're waiting to be acked / immediate replied
+			network[networkp].ackimm_seq_tosend = 0; // Sequence number the host is waiting to be responded to with ACK / NAK / IMMREP
+
+			// Index it for source lookup. If the same host:port appears twice, the first one wins (as it always has)
+			if (aun_hash_find(network[networkp].s_addr, network[networkp].port) == -1 && !aun_hash_insert(network[networkp].s_addr, network[networkp].port, networkp))
+			{
+				fprintf(stderr, "Too many AUN hosts - cannot index %s:%d\n", network[networkp].hostname, network[networkp].port);
+				exit(EXIT_FAILURE);
+			}
+
+			networkp++;
+		}
+		else if (regexec(&r_entry_basenet, linebuf, 4, matches, 0) == 0)
+		{
+			char 	tmp[300];
+			int	ptr;
+
+			for (count = 2; count <= 2; count++)
+			{
+				ptr = 0;
+				while (ptr < (matches[count].rm_eo - matches[count].rm_so))
+				{
+					tmp[ptr] = linebuf[ptr + matches[count].rm_so];
+					ptr++;
+				}
+				tmp[ptr] = 0x00;
+
+				if (count == 2)
+					strcpy(basenet,tmp);
+			}
+
+			if (matches[3].rm_so != -1 && aun_shared_socket == -1) // SHARED
+				aun_shared_open(basenet);
+		}
+		else if (regexec(&r_entry_local, linebuf, 3, matches, 0) == 0)
+		{
+			char 	tmp[300];
+			int	ptr;
+				
+			/* Find our matches */
+			for (count = 2; count <= 2; count++)
+			{
+				ptr = 0;
+				while (ptr < (matches[count].rm_eo - matches[count].rm_so))
+				{
+					tmp[ptr] = linebuf[ptr + matches[count].rm_so];	
+					ptr++;
+				}
+				tmp[ptr] = 0x00;
+				
+				if (count == 2)
+					localnet = atoi(tmp);
+
+				if (localnet)
+					trunk_advertizable[localnet] = 0xff;
+			}
+		}
+		else if (regexec(&r_entry_namedpipe, linebuf, 6, matches, 0) == 0)
+		{
+			int stn, net, ptr, entry, mfr, port;
+			char filename[200], tmp[300];
+			char readerfilename[250], writerfilename[250];
+			unsigned char buffer[1024];
+
+			for (count = 2; count <= 5; count++) // start at 2 - we know the first one is 'UNIX'
+			{
+				ptr = 0;
+				while (ptr < (matches[count].rm_eo - matches[count].rm_so))
+				{
+					tmp[ptr] = linebuf[ptr + matches[count].rm_so];
+					ptr++;
+				}
+				tmp[ptr] = 0x00;
+
+				switch (count)
+				{
+					case 2: net = atoi(tmp); break;
+					case 3: stn = atoi(tmp); break;
+					case 4: port = atoi(tmp); 
+						if (port == 0 && !*basenet)
+							fprintf (stderr, "Warning: use of AUTO mode for station %d.%d with no base network will generate a random port\n", net, stn);
+						if (port == 32768 && *basenet)
+							fprintf (stderr, "Warning: direct use of port 32768 for station %d.%d may prevent AUTO in base network mode from working\n", net, stn);
+						break;
+					case 5: strncpy(filename, tmp, 199); break;	
+				}
+
+			}
+
+			entry = econet_ptr[net][stn];
+
+			if (entry != -1)
+			{
+				fprintf (stderr, "Cannot configure named pipe station %d.%d - station already configured some other way.\n", net, stn);
+				exit(EXIT_FAILURE);
+			}
+
+			network[networkp].type = ECONET_HOSTTYPE_TNAMEDPIPE | ECONET_HOSTTYPE_TAUN;
+			network[networkp].servertype = 0;
+			network[networkp].seq = 0x00004000;
+			network[networkp].network = net;
+			network[networkp].station = stn;
+			network[networkp].named_pipe_filename = strdup(filename);
+
+			snprintf(readerfilename, 249, "%s.tobridge", filename);
+			snprintf(writerfilename, 249, "%s.frombridge", filename);
+
+			mfr = mkfifo(readerfilename, 0666); // Not keen on this.
+
+			network[networkp].listensocket = -1;
+
+			if (mfr == -1 && (errno != EEXIST)) // mkfifo failed and it wasn't because the fifo already existed
+			{
+				fprintf (stderr, "Cannot initialize named pipe at %s - ignoring\n", readerfilename);
+			}
+			else
+				network[networkp].listensocket = open(readerfilename, O_RDONLY | O_NONBLOCK | O_SYNC);
+
+			if (network[networkp].listensocket != -1) // Open succeeded
+			{
+			
+				mfr = mkfifo(writerfilename, 0666); // Still not keen on this
+				
+				if (mfr == -1 && (errno != EEXIST))
+				{
+					fprintf (stderr, "Cannot initialize named pipe at %s - ignoring\n", writerfilename);
+				}
+				else
+				{
+					network[networkp].pipewritesocket = -1; // Rogue - we open it when we see traffic on the pipe, otherwise there's no endpoint and it won't open
+					fd_ptr[network[networkp].listensocket] = networkp; // Create the index to find a station from its FD
+	
+					econet_watch_fd(network[networkp].listensocket, econet_handle_pipe_fd);
+	
+					ECONET_SET_STATION(econet_stations, net, stn); // Put it in our list of AUN bridges
+
+					if (net != 0)
+					{
+						wire_advertizable[net] = 0xff;
+						trunk_advertizable[net] = 0xff;
+					}
+
+					econet_ptr[net][stn] = networkp;
+
+				}
+			}
+			else	fprintf (stderr, "Failed to initialize named pipe for station %d.%d - passively ignoring\n", net, stn);
+
+			// Set up the UDP listener
+			if ( (network[networkp].pipeudpsocket = socket(AF_INET, SOCK_DGRAM, 0)) == -1)
+			{
+				fprintf(stderr, "Failed to open listening socket for local emulation %d/%d: %s.", network[networkp].network, network[networkp].station, strerror(errno));
+				exit(EXIT_FAILURE);
+			}
+
+			service.sin_family = AF_INET;
+			if (*basenet && port == 0)
+			{
+				sprintf(tmp,"%s.%d",basenet,network[networkp].station);
+				service.sin_addr.s_addr = inet_addr(tmp);
+				port = 32768;
+
+				if (aun_shared_socket != -1) // Named pipes keep their own socket - this lets it sit alongside the shared listener, which will not see its traffic because this bind is more specific
+				{
+					int one = 1;
+					setsockopt(network[networkp].pipeudpsocket, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+				}
+			}
+			else
+			{
+				service.sin_addr.s_addr = INADDR_ANY;
+			}
+
+			network[networkp].port = port;
+			service.sin_port = htons(network[networkp].port);
+
+			if (bind(network[networkp].pipeudpsocket, (struct sockaddr *) &service, sizeof(service)) != 0)
+			{
+				fprintf(stderr, "Failed to bind listening socket for named pipe %d/%d: %s.", network[networkp].network, network[networkp].station, strerror(errno));
+				exit(EXIT_FAILURE);
+			}
+
+			econet_watch_fd(network[networkp].pipeudpsocket, econet_handle_pipeudp_fd);
+
+			pipeudpsockets[network[networkp].pipeudpsocket] = networkp; // Mark this as a special one for UDP traffic to Named Pipes
+
+			// Empty the pipe
+
+			while (read(network[networkp].listensocket, buffer, 1023) > 0);
+
+			networkp++;
+
+		}
+		else if (regexec(&r_entry_server, linebuf, 6, matches, 0) == 0)
+		{
+			int stn, net, port, ptr, entry;
+			struct econet_server_config *srv;
+			char servertype;
+			char datastring[200];
+			char tmp[300];
+				
+			servertype = 0;
+
+			/* Find our matches */
+			for (count = 1; count <= 5; count++)
+			{
+				ptr = 0;
+				while (ptr < (matches[count].rm_eo - matches[count].rm_so))
+				{
+					tmp[ptr] = linebuf[ptr + matches[count].rm_so];	
+					ptr++;
+				}
+				tmp[ptr] = 0x00;
+				
+				switch (count)
+				{
+					case 1: // <F>ileserver, <P>rint server
+						switch (tmp[0]) {
+							case 'F':
+							case 'f':
+								servertype = ECONET_SERVER_FILE;
+								break;
+							case 'P':
+							case 'p':
+								servertype = ECONET_SERVER_PRINT;
+								break;
+/*
+							case 'S':
+							case 's':
+								servertype = ECONET_SERVER_SOCKET;
+*/
+						}
+						break;
+					case 2:
+						net = atoi(tmp);
+						//network[networkp].network = net;
+						break;
+					case 3:
+						stn = atoi(tmp);
+						//network[networkp].station = stn;
+						break;
+					case 4:
+						// we cheat here; AUTO automatically will parse as "0"
+						port = atoi(tmp);
+						//network[networkp].port = atoi(tmp);
+						if (port == 0 && !*basenet)
+							fprintf (stderr, "Warning: use of AUTO mode for station %d.%d with no base network will generate a random port\n", net, stn);
+						if (port == 32768 && *basenet)
+							fprintf (stderr, "Warning: direct use of port 32768 for station %d.%d may prevent AUTO in base network mode from working\n", net, stn);
+						break;		
+					case 5:
+						strncpy(datastring, tmp, 199);
+						break;
+				}
+			}
+
+			entry = econet_ptr[net][stn]; // Existing host
+			
+			if (entry == -1)
+			{
+				network[networkp].type = ECONET_HOSTTYPE_LOCAL_AUN;
+				network[networkp].servertype = servertype;
+				network[networkp].seq = 0x00004000;
+				network[networkp].network = net;
+				network[networkp].station = stn;
+				network[networkp].port = port;
+			}
+			else	network[entry].servertype |= servertype;
+
+			srv = econet_server_get((entry == -1) ? networkp : entry);
+
+			if (servertype == ECONET_SERVER_FILE)
+			{
+				if (datastring[strlen(datastring)-1] == '/') // Strip trailing slash
+					datastring[strlen(datastring)-1] = '\0';
+				strcpy(srv->fs_serverparam, datastring);
+			}
+			else if (servertype == ECONET_SERVER_PRINT)
+			{
+				char pname[7];
+				char *at;
+				char *colon; // Location of divider between Unix printer name and Econet printer name
+				uint8_t index;
+
+				if (srv->numprinters == MAX_PRINTERS)
+				{
+					fprintf (stderr, "Maximum number of printers exceeded for this emulated server.\n");
+					exit(EXIT_FAILURE);
+				}
+
+				colon = strchr(datastring, ':');
+
+				if (colon)
+				{
+					strncpy(pname, colon+1, 6);
+					*colon = (char) '\0'; // Terminate the data string early now we have the pname
+				}
+				else if ((at = strchr(datastring, '@')) && (*(at+1) != (char) '\0')) // Email address and @ is not last char
+					strncpy(pname, at+1, 6);
+				else
+					strncpy(pname, datastring, 6);
+
+				// Convert pname to upper
+				index = 0;
+				while (pname[index] != (char) 0x00 && index < 7)
+				{
+					pname[index] = toupper(pname[index]);
+					index++;
+				}
+
+				strcpy(srv->print_serverparam, datastring); // Old printer code
+				strcpy(srv->printers[srv->numprinters].unixname, datastring); // If there was a colon, then this will have terminated where the colon was
+				snprintf(srv->printers[srv->numprinters].name, 7, "%-6.6s", pname); // copies first up to six characters and pads with spaces
+				srv->printers[srv->numprinters].control = PRNCTRL_DEFAULT;
+				srv->printers[srv->numprinters].status = PRN_STATUS_DEFAULT;
+				strncpy(srv->printers[srv->numprinters].banner, "", 23);
+				srv->printer_priorities[srv->numprinters] = srv->numprinters; // Initially set the priority list to match the order in the file
+				srv->numprinters++;
+				
+			}
+/*
+			else if (servertype == ECONET_SERVER_SOCKET)
+				strcpy(srv->socket_serverparam, datastring);
+*/
+
+			if (servertype & ECONET_SERVER_FILE)
+			{
+				int f;
+
+				f = fs_initialize(net, stn, (char *) &datastring);
+				if (f >= 0)
+					network[(entry == -1 ? networkp : entry)].fileserver_index = f;
+				else f = -1;
+			}
+
+/*
+			if (servertype & ECONET_SERVER_SOCKET)
+			{
+				int f;
+
+				f = sks_initialize(net, stn, (char *) &datastring);
+				if (f >= 0)
+					network[(entry == -1 ? networkp : entry)].sks_index = f;
+				else f = -1;
+			}
+*/
+			// Set up bridge adverts
+			if (network[networkp].network !=0)
+			{
+				wire_advertizable[network[networkp].network] = 0xff;
+				trunk_advertizable[network[networkp].network] = 0xff;
+			}
+
+			// Set up the listener
+
+			if (entry == -1 && *basenet && port == 0 && aun_shared_socket != -1) // Doesn't presently exist, and goes on the shared listener
+				aun_shared_add(networkp);
+			else if (entry == -1) // Doesn't presently exist
+			{
+				if ( (network[networkp].listensocket = socket(AF_INET, SOCK_DGRAM, 0)) == -1)
+				{
+					fprintf(stderr, "Failed to open listening socket for local emulation %d/%d: %s.", network[networkp].network, network[networkp].station, strerror(errno));
+					exit(EXIT_FAILURE);
+				}
+	
+				service.sin_family = AF_INET;
+				if (*basenet && port == 0)
+				{
+					sprintf(tmp,"%s.%d",basenet,network[networkp].station);
+					service.sin_addr.s_addr = inet_addr(tmp);
+					port = 32768;
+				}
+				else
+				{
+					service.sin_addr.s_addr = INADDR_ANY;
+				}
+				network[networkp].port = port;
+				service.sin_port = htons(network[networkp].port);
+	
+				if (bind(network[networkp].listensocket, (struct sockaddr *) &service, sizeof(service)) != 0)
+				{
+					fprintf(stderr, "Failed to bind listening socket for local emulation %d/%d: %s.", network[networkp].network, network[networkp].station, strerror(errno));
+					exit(EXIT_FAILURE);
+				}
+
+				fd_ptr[network[networkp].listensocket] = networkp; // Create the index to find a station from its FD
+
+				econet_watch_fd(network[networkp].listensocket, econet_handle_aun_fd);
+			}
+
+			if (entry == -1)
+			{
+				ECONET_SET_STATION(econet_stations, net, stn); // Put it in our list of AUN bridges
+
+				if (net != 0)
+				{
+					wire_advertizable[net] = 0xff;
+					trunk_advertizable[net] = 0xff;
+				}
+
+				econet_ptr[net][stn] = networkp;
+
+				networkp++;
+			}
+	
+		}
+		else if (regexec(&r_entry_wire, linebuf, 5, matches, 0) == 0)
+		{
+			char	tmp[300];
+			int	ptr;
+			short this_type;
+			unsigned char this_stn, this_net;
+			unsigned int this_port;
+
+			/* Find our matches */
+			for (count = 1; count <= 4; count++)
+			{
+				ptr = 0;
+				while (ptr < (matches[count].rm_eo - matches[count].rm_so))
+				{
+					tmp[ptr] = linebuf[ptr + matches[count].rm_so];
+					ptr++;
+				}
+				tmp[ptr] = 0x00;
+
+				switch (count)
+				{
+					case 1: // W (Wire machine, listen for RAW packets), X (Wire machine, listen for AUN)
+						switch (tmp[0]) {
+							case 'W':
+							case 'w':
+								this_type = ECONET_HOSTTYPE_WIRE_AUN;
+								break;
+						}
+						break;
+					case 2:
+						this_net = atoi(tmp);
+						break;
+					case 3:
+						// We cheat and let station 0 mean *
+						this_stn = atoi(tmp);
+						break;
+					case 4:
+						// We cheat and let port 0 mean AUTO
+						this_port = atoi(tmp);
+						if (this_port == 0 && this_net > 127)
+						{
+							fprintf(stderr, "Network must be under 128 for AUTO to work: %s\n",linebuf);
+							exit(EXIT_FAILURE);
+						}
+						break;
+				}
+			}
+
+			// Build a simple array of all defined stations on this network
+			unsigned char inuse[255] = {'\0'};
+			for (short i=0;i<networkp;i++)
+			{
+				if (network[i].network == this_net)
+				inuse[network[i].station]=1;
+			}
+
+			// Now if a station has not been specificed we want to set all possible
+			// unused stations, otherwise we just set the one asked
+			// We can simplify the logic by using a loop in both
+			// cases and just set the range accordingly.
+			unsigned char stn_low=this_stn?this_stn:1, stn_high=this_stn?this_stn:254;
+
+			for (this_stn=stn_low;this_stn<=stn_high;this_stn++)
+			{
+				if (inuse[this_stn])
+				{
+					if (!fs_quiet) econet_log ("   Skipping station %d because previously defined\n", this_stn);
+					continue;
+				}
+
+				econet_host_reserve(networkp);
+
+				// Stop this being a server
+				network[networkp].servertype = 0;
+
+				network[networkp].port = this_port;
+				if (this_port == 0 && !*basenet)
+				{
+					network[networkp].port = 10000+this_net*256+this_stn;
+				}
+
+				network[networkp].station = this_stn;
+				network[networkp].network = this_net;
+				network[networkp].type = this_type;
+
+				econet_ptr[network[networkp].network][network[networkp].station] = networkp;
+
+				// Set up the listener
+
+				if (*basenet && network[networkp].port == 0 && aun_shared_socket != -1)
+					aun_shared_add(networkp);
+				else
+				{
+					if ( (network[networkp].listensocket = socket(AF_INET, SOCK_DGRAM, 0)) == -1)
+					{
+						fprintf(stderr, "Failed to open listening socket for econet net/stn %d/%d: %s.", network[networkp].network, network[networkp].station, strerror(errno));
+						exit(EXIT_FAILURE);
+					}
+	
+					service.sin_family = AF_INET;
+					if (*basenet && network[networkp].port == 0)
+					{
+						sprintf(tmp,"%s.%d",basenet,network[networkp].station);
+						service.sin_addr.s_addr = inet_addr(tmp);
+						service.sin_port = htons(32768);
+					}
+					else
+					{
+						service.sin_addr.s_addr = INADDR_ANY;
+						service.sin_port = htons(network[networkp].port);
+					}
+	
+					if (bind(network[networkp].listensocket, (struct sockaddr *) &service, sizeof(service)) != 0)
+					{
+						fprintf(stderr, "Failed to bind listening socket for econet net/stn %d/%d: %s.", network[networkp].network, network[networkp].station, strerror(errno));
+						exit(EXIT_FAILURE);
+					}
+
+					fd_ptr[network[networkp].listensocket] = networkp; // Create the index to find a station from its FD
+	
+					econet_watch_fd(network[networkp].listensocket, econet_handle_aun_fd);
+				}
+
+				network[networkp].seq = 0x00004000;
+
+				gettimeofday(&(network[networkp].last_bridge_reply),0);
+				clock_gettime (CLOCK_MONOTONIC, &(network[networkp].last_wire_tx));
+
+				if (network[networkp].network != 0)
+					trunk_advertizable[network[networkp].network] = 0xff;
+	
+				networkp++;
+			}
+		}
+		else if (regexec(&r_entry_learn, linebuf, 3, matches, 0) == 0) // Learn. Unknown sources will get put into this network temporarily, and garbage-collected out when they have been idle for a while
+		{
+
+			char	tmp[300];
+			int	ptr;
+
+			/* Find our match */
+			ptr = 0;
+			while (ptr < (matches[2].rm_eo - matches[2].rm_so))
+			{
+				tmp[ptr] = linebuf[ptr + matches[2].rm_so];	
+				ptr++;
+			}
+			tmp[ptr] = 0x00;
+			
+			learned_net = atoi(tmp);
+
+			if (learned_net == 0)
+			{
+				fprintf (stderr, "Cannot set dynamic network number to 0 because it is used on the Econet wire.\n");
+				exit(EXIT_FAILURE);
+			}
+
+			for (count = 1; count < 255; count++) // Put the entire network's worth of hosts into network[] and flag as dynamic	
+			{
+				econet_host_reserve(networkp);
+				econet_ptr[learned_net][count] = networkp;
+
+				network[networkp].network = learned_net;
+				network[networkp].station = count;
+				network[networkp].type = ECONET_HOSTTYPE_DIS_AUN;
+				network[networkp].servertype = 0;
+				network[networkp].last_seq_ack = 0; // Tracks the last AUN data packet we acknowledged from this host.
+				network[networkp].listensocket = -2; // Distant - no socket
+				ECONET_SET_STATION(econet_stations, network[networkp].network, network[networkp].station);
+
+				// Include the network in our list
+				wire_advertizable[network[networkp].network] = 0xff;
+			
+				if (nativebridgenet == 0 && network[networkp].network != 0)
+					nativebridgenet = network[networkp].network;
+
+				network[networkp].is_dynamic = 1;
+				networkp++;
+			}
+
+
+		}
+		else if (regexec(&r_entry_trunk, linebuf, 10, matches, 0) == 0)
+		{
+			char tmp[300];
+			int ptr;
+			unsigned short trunknum, localport, port;
+			char hostname[300], portname[6]; // portname is the distant port, which getaddrinfo() wants as a string
+			struct addrinfo hints;
+
+			for (count = 2; count < 6; count++) // The first four after the T - MTU, COMPRESS & RELIABLE, if there, are dealt with below
+			{
+				ptr = 0;
+				while (ptr < (matches[count].rm_eo - matches[count].rm_so))
+				{
+					tmp[ptr] = linebuf[ptr + matches[count].rm_so];
+					ptr++;
+				}
+				tmp[ptr] = 0x00;
+
+				switch (count)
+				{
+					case 2: // Trunk number
+						trunknum = atoi(tmp);
+						break;
+					case 3: // Local port
+						localport = atoi(tmp);
+						break;
+					case 4: // hostname
+						strcpy(hostname, tmp);
+						break;
+					case 5: // port
+						port = atoi(tmp);
+						snprintf(portname, 6, "%d", port);
+						break;	
+				}
+
+			}
+
+			trunks[trunknum].head = trunks[trunknum].tail = NULL;
+			trunks[trunknum].listenport = localport;
+			memset (trunks[trunknum].adv_in, 0x0, sizeof(trunks[trunknum].adv_in));
+			memset (trunks[trunknum].adv_out, 0x0, sizeof(trunks[trunknum].adv_out));
+			memset (trunks[trunknum].filter_in, 0x0, sizeof(trunks[trunknum].filter_in));
+			memset (trunks[trunknum].filter_out, 0x0, sizeof(trunks[trunknum].filter_out));
+			memset (trunks[trunknum].xlate_src, 0xff, sizeof(trunks[trunknum].xlate_src));
+			memset (trunks[trunknum].xlate_dst, 0xff, sizeof(trunks[trunknum].xlate_dst));
+
+			if ( (trunks[trunknum].listensocket = socket(AF_INET, SOCK_DGRAM, 0)) == -1)
+			{
+				fprintf(stderr, "Failed to open listening socket for trunk %d: %s.", trunknum, strerror(errno));
+				exit(EXIT_FAILURE);
+			}
+
+			service.sin_family = AF_INET;
+			service.sin_addr.s_addr = INADDR_ANY;
+			service.sin_port = htons(localport);
+
+			if (bind(trunks[trunknum].listensocket, (struct sockaddr *) &service, sizeof(service)) != 0)
+			{
+				fprintf(stderr, "Failed to bind listening socket for trunk %d: %s.", trunknum, strerror(errno));
+				exit(EXIT_FAILURE);
+			}
+
+			memset (&hints, 0, sizeof(hints));
+			hints.ai_family=AF_INET;
+			hints.ai_socktype=SOCK_DGRAM;
+			hints.ai_protocol=0;
+			hints.ai_flags=0;
+
+			// Now set up distant host structure
+			strcpy(trunks[trunknum].hostname, hostname);
+			
+			if (getaddrinfo(hostname, portname, &hints, &(trunks[trunknum].addr)))
+			{
+				fprintf(stderr, "Cannot resolve hostname %s\n", hostname);
+				exit (EXIT_FAILURE);
+			}
+
+			trunks[trunknum].port = port;
+
+			if (matches[7].rm_so != -1) // MTU n
+			{
+				int mtu;
+
+				mtu = atoi(linebuf + matches[7].rm_so);
+
+				if (mtu < ECONET_TRUNK_MIN_MTU || mtu > ECONET_TRUNK_MAX_MTU)
+				{
+					fprintf(stderr, "MTU for trunk %d must be between %d and %d\n", trunknum, ECONET_TRUNK_MIN_MTU, ECONET_TRUNK_MAX_MTU);
+					exit(EXIT_FAILURE);
+				}
+
+				trunks[trunknum].mtu = mtu;
+			}
+
+			trunks[trunknum].compress = (matches[8].rm_so != -1);
+			trunks[trunknum].reliable = (matches[9].rm_so != -1);
+			trunks[trunknum].cwnd = ECONET_TRUNK_REL_INIT_CWND;
+			trunks[trunknum].ssthresh = ECONET_TRUNK_REL_WINDOW;
+
+			econet_timer_init(&(trunks[trunknum].agg_timer), trunk_agg_expired, trunknum);
+			econet_timer_init(&(trunks[trunknum].rel_timer), trunk_rel_expired, trunknum);
+			econet_timer_init(&(trunks[trunknum].caps_timer), trunk_caps_expired, trunknum);
+
+			econet_watch_fd(trunks[trunknum].listensocket, econet_handle_trunk_fd);
+			trunk_fd_ptr[trunks[trunknum].listensocket] = trunknum; // Map the Trunk FD array
+
+			// Populate our advertizable structure
+			// And set the module to listen for these distant stations
+
+			numtrunks++;
+
+		}
+		else if (regexec(&r_entry_xlate, linebuf, 5, matches, 0) == 0)
+		{
+			unsigned short trunknum, srcnet;
+			int ptr;
+			char tmp[300];
+
+			for (count = 2; count < 5; count++)
+			{
+				ptr = 0;
+				while (ptr < (matches[count].rm_eo - matches[count].rm_so))
+				{
+					tmp[ptr] = linebuf[ptr + matches[count].rm_so];
+					ptr++;
+				}
+				tmp[ptr] = 0x00;
+
+				switch (count)
+				{
+					case 2:  // Trunk number
+						trunknum = atoi(tmp);
+						break;
+					case 3: // Our side's network number
+						srcnet = atoi(tmp);
+						break;
+					case 4: // The number we are seen as at the far end of the trunk
+						trunks[trunknum].xlate_src[srcnet] = atoi(tmp);
+						trunks[trunknum].xlate_dst[atoi(tmp)] = srcnet;
+						break;
+				}
+
+			}	
+		}
+		else if (regexec(&r_entry_fw, linebuf, 8, matches, 0) == 0)
+		{
+			int ptr;
+			char tmp[300];
+
+			unsigned short trunknum;
+
+			struct __fw_entry *e;
+			
+			e = malloc(sizeof(struct __fw_entry));
+
+			e->next = NULL;
+
+			for (count = 2; count < 8; count++)
+			{
+				ptr = 0;
+				while (ptr < (matches[count].rm_eo - matches[count].rm_so))
+				{
+					tmp[ptr] = linebuf[ptr + matches[count].rm_so];
+					ptr++;
+				}
+				tmp[ptr] = 0x00;
+
+				switch (count)
+				{
+					case 2: // trunknum
+						trunknum = atoi(tmp);
+						break;
+					case 3: // incoming source net
+						e->srcnet = atoi(tmp);
+						break;
+					case 4: // incoming source stn 
+						e->srcstn = atoi(tmp);
+						break;
+					case 5: // incoming dest net
+						e->dstnet = atoi(tmp);
+						break;
+					case 6: // incoming dest stn
+						e->dststn = atoi(tmp);
+						break;
+					case 7:						
+						if (!strcasecmp(tmp, "DROP"))
+							e->action = FW_DROP;
+						else	e->action = FW_ACCEPT;
+
+				}	
+
+			}		
+
+			// Update the list
+			if (trunks[trunknum].head == NULL)
+				trunks[trunknum].head = trunks[trunknum].tail = e;
+			else
+			{	
+				trunks[trunknum].tail->next = e;
+				trunks[trunknum].tail = e;
+			}
+
+		}
+		else		
+		{
+			fprintf(stderr,    "Bad configuration line: %s\n", linebuf);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	regfree(&r_entry_wire);
+	regfree(&r_entry_server);
+	regfree(&r_entry_local);
+	regfree(&r_entry_distant);
+	regfree(&r_entry_trunk);
+	regfree(&r_entry_xlate);
+	regfree(&r_entry_fw);
+	regfree(&r_entry_printhandler);
+	regfree(&r_entry_queuemem);
+	regfree(&r_entry_queuelimit);
+	regfree(&r_entry_queuedelay);
+	regfree(&r_entry_cpu);
+	regfree(&r_entry_fsworkers);
+	regfree(&r_entry_stats);
+	
+	fclose(configfile);
+
+	for (j = 0; j < 256; j++)
+		if (trunks[j].listensocket >= 0)
+			trunk_fw_compile(j);
+
+	stations = networkp;
+
+	// Give back what econet_host_reserve() over-allocated. Every entry from here on is a real one.
+
+	if (stations > 0 && stations < network_size)
+	{
+		struct econet_hosts *n;
+
+		if ((n = realloc(network, stations * sizeof(struct econet_hosts))))
+		{
+			network = n;
+			network_size = stations;
+		}
+	}
+
+	for (count = 0; count < stations; count++)
+	{
+		econet_timer_init(&(network[count].aun_timer), econet_aun_timer_expired, count);
+		econet_timer_init(&(network[count].idle_timer), econet_dynamic_timer_expired, count);
+	}
+		
+} 
+
+short fs_get_server_id(unsigned char net, unsigned char stn)
+{
+	short result = -1;
+
+	if (network[econet_ptr[net][stn]].fileserver_index != -1)
+		result = network[econet_ptr[net][stn]].fileserver_index;
+
+	return result;
+}
+
+// Returns local/wire machine sequence number and increments it
+uint32_t get_local_seq(unsigned char net, unsigned char stn)
+{
+
+	return __atomic_add_fetch(&(network[econet_ptr[net][stn]].seq), 4, __ATOMIC_RELAXED); // The servers on every thread use this
+
+}
+
+void dump_pkt_data(FILE *out, unsigned char *a, int len, unsigned long start_index)
+{
+	int count;
+	int packetsize = len;
+
+	count = 0;
+	while (count < packetsize)
+	{
+		char dbgstr[200];
+		char tmpstr[200];
+		int z;
+		sprintf (dbgstr, "%08lx ", count + start_index);
+		z = 0;
+		while (z < 16)
+		{
+			if ((count+z) < packetsize)
+			{
+				sprintf(tmpstr, "%02x ", *(a+count+z)); 
+				strcat(dbgstr, tmpstr);
+			}
+			else	strcat(dbgstr, "   ");
+			z++;
+		}
+
+		z = 0;
+		while (z < 16)
+		{
+			if ((count+z) < packetsize)
+			{
+				sprintf(tmpstr, "%c", (*(a+count+z) >= 32 && *(a+count+z) < 127) ? *(a+count+z) : '.');
+				strcat(dbgstr, tmpstr);
+			}
+			z++;
+		}
+
+		fprintf(out, "%s\n", dbgstr);		
+
+		count += 16;
+
+	}
+	if (start_index == 0)
+		fprintf (out, "%08x --- END ---\n", packetsize);
+}
+
+// Packet dump (with -d) of packet a, which is s bytes long. Which sort of station it's from and to is worked out now,
+// but the text is left to the log thread - only the start of a big packet is kept.
+
+void dump_udp_pkt_aun(struct __econet_packet_aun *a, int s)
+{
+#ifndef ECONET_NO_DEBUG
+	struct econet_ring *r = &(log_rings[econet_thread]);
+	struct econet_ring_rec *rec;
+	int src, dst, have;
+	char src_c, dst_c;
+
+	if (pkt_debug == 0) return;
+
+	src = econet_ptr[a->p.srcnet][a->p.srcstn];
+	dst = econet_ptr[a->p.dstnet][a->p.dststn];
+
+#define sd_sift(x,y) {\
+	if ((x) == -1) \
+		y = 'T'; \
+	else if (network[(x)].type & ECONET_HOSTTYPE_TLOCAL)\
+		y = 'L';\
+	else if (network[(x)].type & ECONET_HOSTTYPE_TWIRE)\
+		y = 'E';\
+	else if (network[(x)].type & ECONET_HOSTTYPE_TNAMEDPIPE)\
+		y = 'N';\
+	else\
+		y = 'A';\
+	}
+
+	sd_sift(src, src_c);
+	sd_sift(dst, dst_c);
+	
+	if (wire_adv_in[a->p.srcnet]) src_c = 'W';
+	if (wire_adv_in[a->p.dstnet]) dst_c = 'W';
+
+	if ((a->p.dstnet == 0xff && a->p.dststn == 0xff))
+		dst_c = 'B';
+
+	if (a->p.srcstn == 0) // Bridge query reply
+		src_c = 'Z';
+
+	if (!atomic_load_explicit(&log_running, memory_order_relaxed) || !r->buf)
+	{
+		econet_dump_aun(stderr, a, s, s, src_c, dst_c);
+		return;
+	}
+
+	have = 12 + (dumpmode_brief ? 40 : ECONET_LOG_MAX_DUMP); // A brief dump only shows the first 40 bytes of data
+	if (have > s)
+		have = s;
+
+	if ((rec = econet_ring_reserve(r, ECONET_LOG_AUN, sizeof(union econet_log_arg) + have)))
+	{
+		((union econet_log_arg *) (rec + 1))->i = econet_clock_ns(CLOCK_MONOTONIC);
+		memcpy(((union econet_log_arg *) (rec + 1)) + 1, a, have);
+		rec->val = s;
+		rec->arg = (src_c << 8) | dst_c;
+		econet_ring_commit(r, rec, sizeof(union econet_log_arg) + have);
+		econet_log_wake(r);
+	}
+#endif
+}
+
+// Write out a packet dump of a (s bytes long, of which the first have are there) to out. src_c and dst_c are the sorts
+// of station it was from and to, as dump_udp_pkt_aun() worked them out.
+
+void econet_dump_aun(FILE *out, struct __econet_packet_aun *a, int s, int have, char src_c, char dst_c)
+{
+
+	int count = 0;
+	int packetsize = s;
+	char ts[30];
+
+	if (dumpmode_brief)
+	{
+		fprintf (out, "%c-->%c: to %3d.%3d from %3d.%3d port 0x%02x ctrl 0x%02x seq 0x%08x len 0x%04x ", src_c, dst_c, a->p.dstnet, a->p.dststn, a->p.srcnet, a->p.srcstn, a->p.port, a->p.ctrl, le32toh(a->p.seq), s-12);
+		for (count = 0; count < ((have-12) < 40 ? (have-12) : 40); count++)
+			fprintf (out, "%02x %c ", a->p.data[count], (a->p.data[count] < 32 || a->p.data[count] > 126) ? '.' : a->p.data[count]);
+		fprintf (out, "%s\n", (s-12) < 40 ? "" : " ...");
+			
+	}
+	else
+	{
+		fprintf (out, "\n%08x --- PACKET %s TO %s ---\n", packetsize, (src_c == 'T' ? "TRUNK" : (src_c == 'E' ? "ECONET" : (src_c == 'L' ? "LOCAL" : (src_c == 'W' ? "WIRE BRIDGED" : (src_c == 'Z' ? "BRIDGE" : "AUN"))))),
+			(dst_c == 'T' ? "TRUNK" : (dst_c == 'E' ? "ECONET" : (dst_c == 'L' ? "LOCAL" : (dst_c == 'W' ? "BDGED" : "AUN")))));
+		switch (a->p.aun_ttype)
+		{
+			case ECONET_AUN_DATA:
+				strcpy(ts, "DATA");
+				break;
+			case ECONET_AUN_IMM:
+				strcpy(ts, "IMMEDIATE");
+				break;
+			case ECONET_AUN_IMMREP:
+				strcpy(ts, "IMMEDIATE REPLY");
+				break;
+			case ECONET_AUN_BCAST:
+				strcpy(ts, "BROADCAST");
+				break;
+			case ECONET_AUN_ACK:
+				strcpy(ts, "ACKNOWLEDGMENT");
+				break;
+			case ECONET_AUN_NAK:
+				strcpy(ts, "NAK");
+				break;
+			default:
+				strcpy(ts, "UNKNOWN");
+		}
+
+		if (a->p.aun_ttype == ECONET_AUN_DATA && (a->p.port == 0x00) && (a->p.ctrl == 0x85))
+			strcpy(ts, "IMMEDIATE - SPECIAL 0x85");
+
+		fprintf (out, "         --- AUN TYPE %s\n", ts);
+
+		if (a->p.aun_ttype != ECONET_AUN_BCAST)
+			fprintf (out, "         DST Net/Stn 0x%02x/0x%02x\n", a->p.dstnet, a->p.dststn);
+
+		fprintf (out, "         SRC Net/Stn 0x%02x/0x%02x\n", a->p.srcnet, a->p.srcstn);
+		fprintf (out, "         PORT/CTRL   0x%02x/0x%02x\n", a->p.port, a->p.ctrl);
+	
+		//fprintf (stderr, "         SEQ         0x%08X\n", a->p.seq);
+		fprintf (out, "         SEQ         0x%08" PRIx32 "\n", a->p.seq);
+
+		if (have < s)
+			fprintf (out, "         DATA        First 0x%04x of 0x%04x bytes\n", have-12, s-12);
+
+		dump_pkt_data(out, (unsigned char *) &(a->p.data), have-12, 0);
+
+	}
+
+}
+
+/* Receive from a particular UDP socket. Datagrams are pulled off the socket ECONET_UDP_BATCH at a time with recvmmsg() and handed out one per call, so callers should keep calling while udp_rx_pending(fd) says there are more.
+   Nothing is copied: *a is pointed at the batch buffer, with the datagram headroom bytes in (4 for AUN, so the bridge's internal address header can be filled in in place; 0 for trunks, which carry it).
+   The buffer is only good until the next call. */
+int udp_receive(int fd, struct __econet_packet_aun **a, int headroom, struct sockaddr * restrict addr)
+{
+	int  r;
+	struct cmsghdr *cmsg;
+
+	if (udp_rx.fd != fd || udp_rx.next >= udp_rx.count) // Batch empty (or belonged to someone else) - refill
+	{
+		int count;
+
+		udp_rx.fd = fd;
+		udp_rx.next = udp_rx.count = 0;
+
+		for (count = 0; count < ECONET_UDP_BATCH; count++)
+		{
+			udp_rx.iov[count].iov_base = ((unsigned char *) &(udp_rx.buf[count])) + headroom;
+			udp_rx.iov[count].iov_len = sizeof(udp_rx.buf[count]) - headroom;
+			udp_rx.msgs[count].msg_hdr.msg_name = &(udp_rx.addr[count]);
+			udp_rx.msgs[count].msg_hdr.msg_namelen = sizeof(udp_rx.addr[count]);
+			udp_rx.msgs[count].msg_hdr.msg_iov = &(udp_rx.iov[count]);
+			udp_rx.msgs[count].msg_hdr.msg_iovlen = 1;
+			udp_rx.msgs[count].msg_hdr.msg_control = &(udp_rx.control[count]);
+			udp_rx.msgs[count].msg_hdr.msg_controllen = sizeof(udp_rx.control[count]);
+			udp_rx.msgs[count].msg_hdr.msg_flags = 0;
+		}
+
+		r = recvmmsg(fd, udp_rx.msgs, ECONET_UDP_BATCH, MSG_DONTWAIT, NULL);
+
+		if (r<0)
+		{
+			econet_log ("Error %d (%s) on receiving UDP from socket %d\n", errno, strerror(errno), fd);
+			return r;
+		}
+
+		udp_rx.count = r;
+		udp_rx_calls++;
+		udp_rx_datagrams += r;
+
+		if (r == 0) return -1;
+	}
+
+	r = udp_rx.msgs[udp_rx.next].msg_len;
+
+	*a = &(udp_rx.buf[udp_rx.next]);
+	memcpy(addr, &(udp_rx.addr[udp_rx.next]), sizeof(struct sockaddr_in));
+
+	udp_rx_dst.s_addr = INADDR_ANY;
+
+	for (cmsg = CMSG_FIRSTHDR(&(udp_rx.msgs[udp_rx.next].msg_hdr)); cmsg; cmsg = CMSG_NXTHDR(&(udp_rx.msgs[udp_rx.next].msg_hdr), cmsg))
+		if (cmsg->cmsg_level == IPPROTO_IP && cmsg->cmsg_type == IP_PKTINFO)
+			udp_rx_dst = ((struct in_pktinfo *) CMSG_DATA(cmsg))->ipi_addr;
+
+	udp_rx.next++;
+
+	return r;
+
+}
+
+/* Are there more datagrams from fd sitting in the receive batch? */
+int udp_rx_pending(int fd)
+{
+	return (udp_rx.fd == fd && udp_rx.next < udp_rx.count);
+}
+
+/* Queue a datagram for transmission on fd, optionally from a particular local address. It goes out with the rest of the batch when udp_flush() is called at the end of the main loop, or sooner if the batch fills up. Returns len, as sendto() would. */
+int udp_send_batched (int fd, void *data, int len, struct sockaddr *addr, socklen_t addrlen, struct in_addr *from)
+{
+
+	struct __udp_tx_entry *e;
+
+	if (udp_tx.count == ECONET_UDP_BATCH * 4 || (udp_tx.used + len) > sizeof(udp_tx.arena))
+		udp_flush();
+
+	e = &(udp_tx.entries[udp_tx.count++]);
+
+	e->fd = fd;
+	e->offset = udp_tx.used;
+	e->len = len;
+	e->addrlen = addrlen;
+	memcpy(&(e->addr), addr, addrlen);
+	e->has_from = (from != NULL);
+	if (from) e->from = *from;
+	memcpy(&(udp_tx.arena[udp_tx.used]), data, len);
+
+	udp_tx.used += len;
+
+	return len;
+
+}
+
+/* Send everything in the transmit batch - one sendmmsg() per socket, in the order the datagrams were queued */
+void udp_flush (void)
+{
+
+	int start, count;
+	unsigned char sent[ECONET_UDP_BATCH * 4];
+	struct mmsghdr msgs[ECONET_UDP_BATCH * 4];
+	struct iovec iov[ECONET_UDP_BATCH * 4];
+	unsigned char control[ECONET_UDP_BATCH * 4][CMSG_SPACE(sizeof(struct in_pktinfo))];
+
+	if (udp_tx.count == 0) return;
+
+	memset(sent, 0, sizeof(sent));
+
+	for (start = 0; start < udp_tx.count; start++)
+	{
+		int fd, n, done;
+
+		if (sent[start]) continue;
+
+		fd = udp_tx.entries[start].fd;
+		n = 0;
+
+		for (count = start; count < udp_tx.count; count++)
+		{
+			struct __udp_tx_entry *e;
+
+			if (sent[count] || udp_tx.entries[count].fd != fd) continue;
+
+			e = &(udp_tx.entries[count]);
+			sent[count] = 1;
+
+			iov[n].iov_base = &(udp_tx.arena[e->offset]);
+			iov[n].iov_len = e->len;
+			memset(&(msgs[n]), 0, sizeof(struct mmsghdr));
+			msgs[n].msg_hdr.msg_name = &(e->addr);
+			msgs[n].msg_hdr.msg_namelen = e->addrlen;
+			msgs[n].msg_hdr.msg_iov = &(iov[n]);
+			msgs[n].msg_hdr.msg_iovlen = 1;
+
+			if (e->has_from)
+			{
+				struct cmsghdr *cmsg;
+				struct in_pktinfo *pi;
+
+				memset(&(control[n]), 0, sizeof(control[n]));
+				msgs[n].msg_hdr.msg_control = &(control[n]);
+				msgs[n].msg_hdr.msg_controllen = sizeof(control[n]);
+				cmsg = CMSG_FIRSTHDR(&(msgs[n].msg_hdr));
+				cmsg->cmsg_level = IPPROTO_IP;
+				cmsg->cmsg_type = IP_PKTINFO;
+				cmsg->cmsg_len = CMSG_LEN(sizeof(struct in_pktinfo));
+				pi = (struct in_pktinfo *) CMSG_DATA(cmsg);
+				pi->ipi_spec_dst = e->from;
+			}
+
+			n++;
+		}
+
+		done = 0;
+
+		while (done < n)
+		{
+			int r;
+
+			r = sendmmsg(fd, &(msgs[done]), n - done, MSG_DONTWAIT);
+
+			udp_tx_calls++;
+
+			if (r <= 0) // Whatever is left in this batch is lost, just as it would have been from sendto()
+			{
+				if (pkt_debug) econet_debug ("Error %d (%s) on sending UDP batch to socket %d - %d datagram(s) dropped\n", errno, strerror(errno), fd, n - done);
+				udp_tx_errors += (n - done);
+				break;
+			}
+
+			udp_tx_datagrams += r;
+			done += r;
+		}
+	}
+
+	udp_tx.count = 0;
+	udp_tx.used = 0;
+
+}
+
+char * econet_strtxerr(int e)
+{
+	switch (-1 * e)
+	{
+		case ECONET_TX_SUCCESS: return (char *)"No error"; 
+		case ECONET_TX_BUSY: return (char *)"Module busy";
+		case ECONET_TX_JAMMED: return (char *)"Line jammed";
+		case ECONET_TX_HANDSHAKEFAIL: return (char *)"Handshake failure";
+		case ECONET_TX_NOCLOCK: return (char *)"No clock";
+		case ECONET_TX_UNDERRUN: return (char *)"Transmit underrun";
+		case ECONET_TX_TDRAFULL: return (char *)"Data register full on tx";
+		case ECONET_TX_NOIRQ: return (char *)"No IRQ received to being/continue transmit";
+		case ECONET_TX_NOCOPY: return (char *)"Could not copy packet from userspace";
+		case ECONET_TX_NOTSTART: return (char *)"Transmission never begun";
+		case ECONET_TX_COLLISION: return (char *)"Collision during transmission";
+		case ECONET_TX_INPROGRESS: return (char *)"Transmission in progress";
+		default: return (char *)"Unknown error";
+	}	
+
+}
+
+void aun_acknowledge (struct __econet_packet_aun *a, unsigned char ptype)
+{
+
+	struct __econet_packet_aun reply;
+	int ptr;
+
+	reply.p.aun_ttype = ptype;
+	reply.p.port = a->p.port;
+	reply.p.ctrl = a->p.ctrl;
+	reply.p.padding = 0x00;
+	reply.p.seq = a->p.seq;
+	reply.p.srcnet = a->p.dstnet;
+	reply.p.srcstn = a->p.dststn;
+	reply.p.dstnet = a->p.srcnet;
+	reply.p.dststn = a->p.srcstn;
+
+	econet_write_general(&reply, 12);
+
+	ptr = econet_ptr[a->p.srcnet][a->p.srcstn]; // src used here because that's the src in the packet we are acknowledging, so the src is actually the station we're sending the ack *to* - so it's that station's tracker we need to look at
+		
+	if (ptr != -1 && (network[ptr].type & ECONET_HOSTTYPE_TDIS) && reply.p.seq == network[ptr].ackimm_seq_tosend)
+	{
+		network[ptr].ackimm_seq_tosend = 0; // We have just acknowledged a packet from this machine - clear off the tracker
+		if (queue_debug) econet_debug ("QUEUE: Clearing ACK tracker on network[%d] - seq 0x%08X\n", ptr, network[ptr].ackimm_seq_tosend);
+		if (network[ptr].aun_head)
+			econet_aun_ready(ptr); // Anything it was holding back can go now
+	}
+
+}
+
+// Tell the server threads which queue traffic to network 'net' goes on, if it's not in network[] - see econet_queue_room()
+void econet_queue_route_publish(unsigned char net)
+{
+
+	atomic_store_explicit(&(queue_route[net]), (wire_adv_in[net] == 0xff) ? ECONET_QUEUE_ROUTE_WIRE : trunk_route[net], memory_order_relaxed);
+
+}
+
+// Re-work which trunk (if any) network 'net' is reached by, after a change to some trunk's adv_in[net]
+void trunk_route_update(unsigned char net)
+{
+
+	short counter;
+
+	trunk_route[net] = -1;
+
+	for (counter = 0; counter < 256; counter++)
+	{
+		if ((trunks[counter].listensocket >= 0) && (trunks[counter].adv_in[net] == 0xff))
+		{
+			trunk_route[net] = counter;
+			break;
+		}
+	}
+
+	econet_queue_route_publish(net);
+
+}
+
+void trunk_route_rebuild(void)
+{
+
+	short net;
+
+	for (net = 0; net < 256; net++)
+		trunk_route_update(net);
+
+}
+
+void trunk_route_dump(FILE *out)
+{
+
+	short net;
+
+	fprintf (out, "\nTRUNK ROUTING TABLE\n\n");
+
+	for (net = 0; net < 256; net++)
+		if (trunk_route[net] != -1)
+			fprintf (out, "%3d via trunk %3d (%s:%d)\n", net, trunk_route[net], trunks[trunk_route[net]].hostname, trunks[trunk_route[net]].port);
+
+	fprintf (out, "\n");
+
+}
+
+// Trunk output queues, for the SIGUSR1 statistics
+
+void trunk_queue_dump(FILE *out)
+{
+
+	int trunk;
+
+	for (trunk = 1; trunk < 256; trunk++)
+		if (trunks[trunk].listensocket >= 0)
+			fprintf (out, "STATS: Trunk %3d (%s:%d) queue depth %u (%lu bytes); sent %lu packets in %lu flushes (%lu.%02lu per flush, most %lu)\n",
+				trunk, trunks[trunk].hostname, trunks[trunk].port,
+				trunks[trunk].q_len, trunks[trunk].q_bytes,
+				trunks[trunk].flushed_packets, trunks[trunk].flushes,
+				(trunks[trunk].flushes ? trunks[trunk].flushed_packets / trunks[trunk].flushes : 0),
+				(trunks[trunk].flushes ? ((trunks[trunk].flushed_packets * 100) / trunks[trunk].flushes) % 100 : 0),
+				trunks[trunk].flush_max);
+
+	for (trunk = 1; trunk < 256; trunk++)
+		if (trunks[trunk].listensocket >= 0 && (trunks[trunk].mtu || trunks[trunk].agg_rx))
+			fprintf (out, "STATS: Trunk %3d aggregation - MTU %u, far end %u; sent %lu frames in %lu aggregates, received %lu frames in %lu aggregates\n",
+				trunk, trunks[trunk].mtu, trunks[trunk].peer_mtu,
+				trunks[trunk].agg_tx_frames, trunks[trunk].agg_tx,
+				trunks[trunk].agg_rx_frames, trunks[trunk].agg_rx);
+
+	for (trunk = 1; trunk < 256; trunk++)
+		if (trunks[trunk].listensocket >= 0 && (trunks[trunk].compress || trunks[trunk].z_rx))
+			fprintf (out, "STATS: Trunk %3d compression%s - sent %lu frames compressed, %llu bytes saved of %llu, %" PRIu64 " us CPU; %lu sent as they were; received %lu compressed, %" PRIu64 " us CPU\n",
+				trunk, (trunks[trunk].compress && trunks[trunk].peer_compress) ? "" : " (not in use)",
+				trunks[trunk].z_tx, trunks[trunk].z_tx_in - trunks[trunk].z_tx_out, trunks[trunk].z_tx_in, trunks[trunk].z_tx_ns / 1000,
+				trunks[trunk].z_tx_skipped,
+				trunks[trunk].z_rx, trunks[trunk].z_rx_ns / 1000);
+
+	for (trunk = 1; trunk < 256; trunk++)
+		if (trunks[trunk].listensocket >= 0 && trunks[trunk].reliable)
+			fprintf (out, "STATS: Trunk %3d reliable%s - window %u (threshold %u), %u in flight, RTT %lu.%03lu ms, timeout %ld ms; sent %lu, %lu fast & %lu timed out retransmissions, %lu given up; received %lu, %lu duplicates\n",
+				trunk, trunk_rel_on(trunk) ? "" : " (not in use)",
+				trunks[trunk].cwnd, trunks[trunk].ssthresh, trunks[trunk].snd_nxt - trunks[trunk].snd_una,
+				trunks[trunk].srtt / 1000, trunks[trunk].srtt % 1000, trunk_rel_rto(trunk),
+				trunks[trunk].rel_sent, trunks[trunk].rel_fast_retx, trunks[trunk].rel_timeout_retx, trunks[trunk].rel_given_up,
+				trunks[trunk].rel_rcvd, trunks[trunk].rel_dups);
+
+}
+
+// Called when we receive a &80 bridge instruction from somewhere
+// Source will be set to 0 if wire (shouldn't be defining trunk 0), -1 if this is a self-initiated reset (e.g. on startup), otherwise a trunk number
+// p is a pointer to the incoming reset packet, and len is its data length
+// If this is self-originated, it is treated as a bridge reset (&80), otherwise it's a bridge update (&81) or reset (&80) depending on what is in *p->p.ctrl
+
+void econet_bridge_process(struct __econet_packet_aun *p, int len, int source)
+{
+
+	short counter;
+	unsigned char is_reset;
+	struct __econet_packet_aun out; // Packet structure for the packets we will send out
+
+	if (!bridge_query || !localnet) // Exit if we are not briding
+		return;
+
+	if (source == -1)
+		is_reset = 1;
+	else
+		is_reset = (p->p.ctrl == 0x80 ? 1 : 0);
+
+	if (pkt_debug)
+	{
+		econet_debug ("B-->B: Receive bridge %s from %s ", (is_reset ? "reset " : "update"), (source == -1 ? "internal" : (source == 0 ? "wire" : "trunk")));
+
+		if (source > 0) econet_debug ("%d ", source);
+
+		if (source >= 0)
+		{
+			econet_debug ("with nets ");
+			for (counter = 0; counter < len-12; counter++)
+				econet_debug ("%3d ", p->p.data[counter]);
+		}
+
+		econet_debug ("\n");
+	}
+
+	if (is_reset)
+	{
+
+		// First the ones for the wire
+	
+		memset(&wire_adv_in, 0, sizeof(wire_adv_in));
+		memcpy(&wire_adv_out, &wire_advertizable, sizeof(wire_advertizable));
+
+		// Then the trunks
+	
+		for (counter = 1; counter < 256; counter++)
+		{
+			if (trunks[counter].listensocket >= 0)
+			{
+				memset(&(trunks[counter].adv_in), 0, sizeof(trunks[counter].adv_in));
+				memset(&(trunks[counter].adv_out), 0, sizeof(trunks[counter].adv_out)); // This gets populated with local advertizables subject to nat lower down
+			}
+		}
+
+		nativebridgenet = 0; 
+
+		// If we have some networks advertizable to the wire, set our local bridge net to the first one we find that isn't the local network
+		for (counter = 1; counter < 255; counter++)
+		{
+			if (wire_advertizable[counter] == 0xff && (counter != localnet))
+			{
+				nativebridgenet = counter;
+				break;
+			}
+		}
+	}
+	
+	// Extract the advertised packets, filtering as we go
+
+	for (counter = 0; counter < len-12; counter++) 
+	{
+		if (source == 0) // Wire origin
+		{
+			wire_adv_in[p->p.data[counter]] = 0xff ^ wire_filter_in[p->p.data[counter]]; // Since the filter_in entry for a network will be 0xff if we are filtering it, this will result in 0 if the network is filtered.	
+			if (!is_reset)
+				econet_queue_route_publish(p->p.data[counter]);
+		}
+		else if (source > 0) // Not wire, but not self-originated either. (If self-originated, there will be no *p to look at)
+		{
+			trunks[source].adv_in[p->p.data[counter]] = 0xff ^ trunks[source].filter_in[p->p.data[counter]]; // Since the filter_in entry for a network will be 0xff if we are filtering it, this will result in 0 if the network is filtered.	
+			if (!nativebridgenet) // There wasn't anything we were already advertizing to the wire - so use this as our native network
+				nativebridgenet = (0xff ^ trunks[source].filter_in[p->p.data[counter]]) ? p->p.data[counter] : 0;  // If this network wasn't filtered, nativebridgenet is set to it. Otherwise 0 (which is what it was before)
+			if (!is_reset)
+				trunk_route_update(p->p.data[counter]);
+		}
+	}
+
+	if (is_reset) // Every trunk's adv_in will have been blanked off
+		trunk_route_rebuild();
+
+	// Now update the outbound advertizement tables
+
+	// Wire first - go through each trunk and pick up its inbound advert, and combine it with what we were advertizing anyway
+	// Remove any networks from outbound advert that were in the inbound advert *from* the wire
+
+	for (counter = 0; counter < 255; counter++)
+	{
+		if (trunks[counter].listensocket >= 0) // Active trunk
+		{
+			short net;
+			
+			for (net = 1; net < 255; net++)
+				if ((trunks[counter].adv_in[net] == 0xff) && (wire_adv_in[net] != 0xff) && (wire_filter_out[net] != 0xff)) // Copy trunk adverts to wire unless either (i) the wire was advertizing those networks to us, or (ii) there was an outbound filter on the wire advertizement for this network
+					wire_adv_out[net] = 0xff;
+		}
+
+	}
+
+	// Now rebuild the econet_stations structure
+
+	// Update for all local servers, AUN stations, and all stations in nets advertized out to the wire, together with nativebridgenet.0, and 255.255 for broadcasts
+	
+	ECONET_INIT_STATIONS(econet_stations);
+	ECONET_SET_STATION(econet_stations, 255, 255); // Broadcast
+	if (nativebridgenet)
+		ECONET_SET_STATION(econet_stations, nativebridgenet, 0); // Local bridge handshakes // Can't do this without a far side network
+
+	// First, known AUN & local stations
+	for (counter = 0; counter < stations; counter++)
+		if ((network[counter].type & ECONET_HOSTTYPE_TDIS) || (network[counter].type & ECONET_HOSTTYPE_TNAMEDPIPE) || (network[counter].type & ECONET_HOSTTYPE_TLOCAL)) // NB because our dynamic network is preallocated in here, this catches the dynamic net too. Also add named pipe stations in
+		{
+			//fprintf (stderr, "Adding station %3d.%3d\n", network[counter].network, network[counter].station);
+			ECONET_SET_STATION(econet_stations, network[counter].network, network[counter].station);
+		}
+
+	// Then everything we are advertising out as a bridge (except stn 0 & 255)
+	for (counter = 1; counter < 256; counter++)
+	{
+		unsigned char stn;
+		
+		if (wire_adv_out[counter] == 0xff) // Outbound advert
+			for (stn = 1; stn < 255; stn++)
+				ECONET_SET_STATION(econet_stations, counter, stn);
+	}
+
+	// Update the station set
+
+	ioctl(econet_fd, ECONETGPIO_IOC_SET_STATIONS, &econet_stations);
+
+	// Now update each trunk's outbound advert with what's come in on every other trunk, sifting out any loops (i.e. don't advertize back to a trunk that which it advertized to us). Do NAT here.
+	for (counter = 0; counter < 255; counter++)
+	{
+
+		short other; // Loop counter for other trunks
+
+		if (trunks[counter].listensocket >= 0) // Active trunk
+		{
+			// The wire & local stuff will already be there because we copied trunk_advertizable into it. BUT we need to do NAT on it. TODO.
+
+			for (other = 1; other < 255; other++)
+			{
+				if (trunk_advertizable[other] || wire_adv_in[other]) // Copy what's in trunk_advertizable, and what we've had from wire adverts
+				{
+					unsigned char xlated;
+
+					xlated = other;
+
+					if (trunks[counter].xlate_src[other] != 0xff)
+						xlated = trunks[counter].xlate_src[other];
+
+					trunks[counter].adv_out[xlated] = 0xff ^ trunks[counter].filter_out[xlated]; // Apply filter to translated net
+
+				}
+
+			}
+
+			// Now the other trunks. Note, we filter the outbound advert here but we need do no NAT here because these are advertizements from other trunks
+
+			for (other = 0; other < 255; other++)
+			{
+				if (other != counter) // Don't copy from same trunk!
+				{
+					if (trunks[other].listensocket >= 0)
+					{
+						unsigned char net;
+			
+						for (net = 1; net < 255; net++)
+							if ((trunks[other].adv_in[net] == 0xff) && (trunks[counter].adv_in[net] != 0xff) && (trunks[counter].filter_out[net] != 0xff)) // Other trunk advertising net 'n', and it wasn't advertized to us on this trunk, advertize it out, unless it was filtered outbound
+								trunks[counter].adv_out[net] = 0xff;
+
+					}	
+
+				}
+
+			}
+				
+		}
+
+	}
+
+	// Now spit out a broadcast with port &9C and ctrl byte as appropriate
+
+	// First to the wire
+	// Unless the source *was* the wire or it was a reset. So if this was a reset, or source > 0 (because wire is 0) then spit it out
+	if (nativebridgenet && (is_reset || (source > 0))) // Can't send this unless we have *something* on the far side of local...
+	{
+
+		unsigned char net, count;
+
+		out.p.srcnet = nativebridgenet;
+		out.p.srcstn = 0;
+		out.p.dstnet = out.p.dststn = 255;
+		out.p.port = 0x9c;
+		out.p.ctrl = (is_reset ? (source == 0 ? 0x81 : 0x80) : 0x81); // Send this as an update if the source was the wire, otherwise as an update
+		out.p.aun_ttype = ECONET_AUN_BCAST;
+		out.p.seq = (local_seq += 4);
+
+		count = 0;
+
+		if (pkt_debug) econet_debug ("B-->B: Sending bridge %s to   wire    with nets ", (is_reset ? "reset " : "update"));
+
+		for (net = 1; net < 255; net++)
+			if (wire_adv_out[net] == 0xff)
+			{
+				out.p.data[count++] = net;
+				if (pkt_debug) econet_debug ("%3d ", net);
+			}
+
+		if (pkt_debug) econet_debug ("\n");
+
+		econet_wire_send_now (&out, count+12);
+	}
+
+	// Then to the trunks
+	{
+
+		unsigned char net, trunk, count;
+
+		for (trunk = 1; trunk < 255; trunk++)
+		{
+			if (trunks[trunk].listensocket >= 0 && ((source == trunk && is_reset) || (source != trunk))) // Active trunk - but we only send to the source trunk if it's a reset, and the code switches that to an update
+			{
+		
+				out.p.srcnet = localnet;	
+				out.p.srcstn = 0;
+				out.p.dstnet = out.p.dststn = 255;
+				out.p.port = 0x9c;
+				out.p.ctrl = (is_reset ? (source == trunk ? 0x81 : 0x80) : 0x81); // If it's a reset but was from this trunk, send update not reset
+				out.p.aun_ttype = ECONET_AUN_BCAST;
+				out.p.seq = (local_seq += 4);
+
+				if (pkt_debug) econet_debug ("B-->B: Sending bridge %s on   trunk %d with nets ", (out.p.ctrl == 0x80 ? "reset " : "update"), trunk);
+
+				count = 0;
+
+				for (net = 1; net < 255; net++)
+					if (trunks[trunk].adv_out[net] == 0xff)
+					{
+						out.p.data[count++] = net;	
+						if (pkt_debug) econet_debug ("%3d ", net);
+					}
+
+				if (pkt_debug) econet_debug ("\n");
+
+				aun_trunk_send_internal (&out, count+12, trunk);
+			}
+
+		}
+
+	}
+}
+
+// a contains a packet received from somwhere, packlen is it's length. source is either 0 for the wire, > 0 for a trunk number, or -1 from anywhere else
+
+void econet_handle_local_aun (struct __econet_packet_aun *a, int packlen, int source)
+{
+
+	struct __econet_packet_aun reply;
+	int s_ptr, d_ptr;
+
+	//fprintf (stderr, "Local handler invoked; AUN type %d len %d\n", a->p.aun_ttype, packlen);
+
+	if (econet_thread == ECONET_THREAD_NET && (a->p.aun_ttype == ECONET_AUN_DATA || (a->p.aun_ttype == ECONET_AUN_BCAST && (a->p.port == 0x99 || a->p.port == 0x9f)))) // For the file, print or socket servers - they're on the other threads, which will call us back
+	{
+		econet_service_post(econet_fs_bound(a) ? econet_fs_worker(a->p.srcnet, a->p.srcstn) : 0, ECONET_SVC_PACKET, a, packlen, 0, source);
+		return;
+	}
+
+	s_ptr = econet_ptr[a->p.srcnet][a->p.srcstn];
+	d_ptr = econet_ptr[a->p.dstnet][a->p.dststn];
+
+	if (a->p.aun_ttype == ECONET_AUN_IMM) // Immediate
+	{
+		if (a->p.ctrl == 0x88) // Machinepeek
+		{
+			reply.p.srcnet = a->p.dstnet;
+			reply.p.srcstn = a->p.dststn;
+			reply.p.dstnet = a->p.srcnet;
+			reply.p.dststn = a->p.srcstn;
+			reply.p.aun_ttype = ECONET_AUN_IMMREP;
+			reply.p.seq = a->p.seq;
+			reply.p.port = 0;
+			reply.p.ctrl = 0x88;
+			reply.p.data[0] = ADVERTISED_MACHINETYPE & 0xff;
+			reply.p.data[1] = (ADVERTISED_MACHINETYPE & 0xff00) >> 8;
+			reply.p.data[2] = ADVERTISED_VERSION & 0xff;
+			reply.p.data[3] = (ADVERTISED_VERSION & 0xff00) >> 8;
+
+			aun_send (&reply, 16);
+		}	
+		else if (a->p.ctrl == 0x81 && (packlen > 16)) // Memory Peek (packlen will be 4 internal header, 8 AUN header, 4 special 0x85 bytes, and if there is nothing beyond those 16 (total) then don't bother)
+		{
+
+			if (beebmem) // If we managed to load it...
+			{
+				unsigned int start, end;
+
+				start = ((a->p.data[0]) + (256 * (a->p.data[1])));
+				end = ((a->p.data[4]) + (256 * (a->p.data[5])));
+
+				sprintf (beebmem + 0x7c5f, "%d", a->p.dststn);
+
+				reply.p.srcnet = a->p.dstnet;
+				reply.p.srcstn = a->p.dststn;
+				reply.p.dstnet = a->p.srcnet;
+				reply.p.dststn = a->p.srcstn;
+				reply.p.aun_ttype = ECONET_AUN_IMMREP;
+				reply.p.port = a->p.port;
+				reply.p.ctrl = a->p.ctrl;
+				reply.p.seq = a->p.seq;
+			
+				memcpy(&(reply.p.data), (beebmem + start), end-start);
+
+				aun_send (&reply, 12 + (end - start));
+
+			}
+		}
+	}
+	else if ((a->p.aun_ttype == ECONET_AUN_DATA || a->p.aun_ttype == ECONET_AUN_BCAST) && (a->p.port == 0x9f)) // Print server status protocol
+	{
+
+			int count;
+			unsigned char querytype;
+			unsigned char pname[7];
+
+			querytype = a->p.data[6]; // 1 == status request; 6 == name request
+	
+			for (count = 0; count < 6; count++)
+				pname[count] = a->p.data[count];
+		
+			pname[6] = 0; // NULL terminate
+
+			if (pkt_debug) econet_debug ("PRINT: to %3d.%3d from %3d.%3d Printer Status Query (%s) for printer %s ",
+				a->p.dstnet, a->p.dststn,
+				a->p.srcnet, a->p.srcstn,
+				(querytype == PRN_QUERY_STATUS) ? "status" : "name",
+				pname);
+
+			for (count = 0; count < stations; count++) // Search them all in case it's a broadcast. Otherwise, only reply from the one which was addressed
+			{
+				if ((network[count].servertype & ECONET_SERVER_PRINT) && (a->p.aun_ttype == ECONET_AUN_BCAST || (a->p.dstnet == network[count].network && a->p.dststn == network[count].station)))
+				{
+
+					reply.p.srcnet = network[count].network;
+					reply.p.srcstn = network[count].station;
+					reply.p.dstnet = a->p.srcnet;
+					reply.p.dststn = a->p.srcstn;
+					reply.p.aun_ttype = ECONET_AUN_DATA;
+					reply.p.port = 0x9e;
+					reply.p.ctrl = 0x80;
+
+					if (querytype == PRN_QUERY_STATUS) // Status enquiry
+					{
+						/* First need to compare the name */
+
+						short found = 0, printer;
+
+						if (!strncasecmp("PRINT ", (const char *) pname, 6))
+						{
+							found = 1;
+						}
+						else
+							for (printer = 0; printer < network[count].server->numprinters; printer++)
+							{
+								if (!strncasecmp((const char *) network[count].server->printers[printer].name, (const char *) pname, 6))
+									found++;	
+							}
+						
+						if (found)
+						{
+							
+							if (pkt_debug) econet_debug (" - responding with status\n");
+							reply.p.seq = get_local_seq(network[count].network, network[count].station);
+							reply.p.data[0] = 0x00; // Status byte 0 = Ready
+							reply.p.data[1] = 0x00; // Busy with station N (which we don't need if ready)
+							reply.p.data[2] = 0x00; // Busy with network N (which we don't need if ready)
+							aun_send (&reply, 15);
+						}
+						else if (pkt_debug) econet_debug (" - not responding\n");
+					}
+					else if (querytype == PRN_QUERY_NAME) // Name query - we can, apparently, send multiple replies to this.
+					{
+
+						int printer = 0;
+
+						// Loop through the printers on this station and reply. Update sequence number for each reply...
+
+						while (printer < network[count].server->numprinters)
+						{
+							reply.p.seq = get_local_seq(network[count].network, network[count].station);
+							snprintf((char * restrict) reply.p.data, 7, "%6s", network[count].server->printers[printer].name);
+							aun_send (&reply, 18);
+							if (printer == 0 && pkt_debug) econet_debug (" - responded with printer list\n");
+						}
+
+					}
+				}
+			}
+
+	}
+	else if (a->p.aun_ttype == ECONET_AUN_BCAST) // Broadcast - See if we need to do a bridge query reply 
+	{
+		if (bridge_query && (a->p.port == 0x9C) && (a->p.ctrl == 0x80 || a->p.ctrl == 0x81) && (source >= 0)) // bridge reset/update broadcast
+			econet_bridge_process (a, packlen, source);
+
+		else if (bridge_query && (a->p.port == 0x9c) && (!strncmp("BRIDGE", (const char *) a->p.data, 6)) && localnet && (network[econet_ptr[a->p.srcnet][a->p.srcstn]].type & (ECONET_HOSTTYPE_TWIRE | ECONET_HOSTTYPE_TNAMEDPIPE)))
+		{
+			short query_net, reply_port;
+			struct timeval now;
+
+			reply_port = a->p.data[6];
+			query_net = a->p.data[7];
+	
+			gettimeofday(&now, 0);
+
+			if (pkt_debug && !dumpmode_brief)
+				econet_debug ("LOC  : BRIDGE     from %3d.%3d, query 0x%02x, reply port 0x%02x, query net %d\n", a->p.srcnet, a->p.srcstn, a->p.ctrl, reply_port, query_net);
+
+			if (nativebridgenet && 
+				(
+					(a->p.ctrl == 0x82 
+					&& (timediffmsec(&(network[econet_ptr[a->p.srcnet][a->p.srcstn]].last_bridge_reply), &now) > 1000)
+					) 
+				|| 	(a->p.ctrl == 0x83 && (wire_advertizable[query_net] == 0xff))
+				) // Either a local network number query, or a query for a network in our known distant list
+			)
+			{
+				
+				if (a->p.ctrl == 0x82)
+					gettimeofday(&(network[econet_ptr[a->p.srcnet][a->p.srcstn]].last_bridge_reply),0); // Don't reply too quickly
+
+				reply.p.srcnet = nativebridgenet;
+				reply.p.srcstn = 0;
+				reply.p.dstnet = a->p.srcnet;
+				reply.p.dststn = a->p.srcstn;
+				reply.p.aun_ttype = ECONET_AUN_DATA;
+				reply.p.port = reply_port;
+				//reply.p.ctrl = a->p.ctrl;
+				reply.p.ctrl = 0x80;
+				reply.p.padding = 0x00;
+				reply.p.seq = (local_seq += 4);
+				reply.p.data[0] = localnet;
+				reply.p.data[1] = query_net; 
+				aun_send (&reply, 14);
+			}
+			else if (pkt_debug) econet_debug ("LOC  : BRIDGE     from %3d.%3d - didn't bother replying.\n", a->p.srcnet, a->p.srcstn);
+	
+		}
+		else if (a->p.port == 0x99) // Handle broadcasts to fileservers
+		{
+
+			int count;
+
+			for (count = 0; count < stations; count++)
+			{
+				if ((network[count].servertype & ECONET_SERVER_FILE) && (network[count].fileserver_index >= 0))
+					handle_fs_traffic(network[count].fileserver_index, a->p.srcnet, a->p.srcstn, a->p.ctrl, a->p.data, packlen-12);
+			}
+		}
+	}
+	else if (a->p.aun_ttype == ECONET_AUN_DATA) // Data packet
+	{
+		if ((a->p.port == 0x99) && (network[d_ptr].servertype & ECONET_SERVER_FILE) && (network[d_ptr].fileserver_index >= 0))
+			handle_fs_traffic(network[d_ptr].fileserver_index, a->p.srcnet, a->p.srcstn, a->p.ctrl, a->p.data, packlen-12);
+
+		else if ((a->p.port == 0x9f) && ((network[d_ptr].servertype) & ECONET_SERVER_PRINT)) // Looks like only ANFS does this... // Print server handling - this looks like it is just printer state query
+		{
+		
+			char printer_selected[10];
+			char *spaceptr;
+			//unsigned char querytype;
+
+			memset(printer_selected, 0, sizeof(printer_selected));
+
+			strncpy(printer_selected, (const char *) a->p.data, 6);
+
+			econet_log ("PRINT: to %3d.%3d from %3d.%3d Printer status enquiry %s\n", 
+				a->p.dstnet, a->p.dststn, a->p.srcnet, a->p.srcstn, printer_selected);
+
+			reply.p.srcnet = a->p.dstnet;
+			reply.p.srcstn = a->p.dststn;
+			reply.p.dstnet = a->p.srcnet;
+			reply.p.dststn = a->p.srcstn;
+			reply.p.aun_ttype = ECONET_AUN_DATA;
+			reply.p.port = 0x9e;
+			reply.p.ctrl = 0x80;
+			reply.p.seq = get_local_seq(a->p.dstnet, a->p.dststn);
+			reply.p.data[0] = 0x00; // Printer input state (Read) // We can change this when we can bar input etc.
+			reply.p.data[1] = 0x00; // Printer output state (Ready) // We can change this when we can put printers offline!
+
+
+			if ((spaceptr = strchr(printer_selected, ' ')))
+				*spaceptr = (char) 0; // Terminate
+		
+			//querytype = a->p.data[6]; // TODO - Implement the different queries
+
+			if (!strcmp(printer_selected, "PRINT"))
+			{
+				aun_send (&reply, 14);
+			}
+			else
+			{
+				// See if we have a matching printer
+				int count = 0, found = 0;
+
+				while (count < network[d_ptr].server->numprinters)
+				{
+					if (strlen(network[d_ptr].server->printers[count].name) != strlen(printer_selected))
+						count++;
+					else if (!strncasecmp(network[d_ptr].server->printers[count].name, printer_selected, strlen(printer_selected)))
+						found = 1;
+
+					else count++;
+				}	
+
+				if (found)
+				{
+					last_printers[a->p.srcnet][a->p.srcstn].printer_index = -1;
+					reply.p.data[0] = 0xff; // Error
+					aun_send (&reply, 14);
+				}
+				else	
+				{
+					reply.p.data[0] = 0xff;
+					strcpy((char *) &(reply.p.data[2]), "Unkonwn printer");
+					aun_send(&reply, 14 + strlen("Unknown printer") + 1);
+				}
+				
+			}
+
+
+		}
+		else if ((a->p.port == 0xd1) && (network[d_ptr].servertype & ECONET_SERVER_PRINT)) // Actual printing
+		{
+			int found = -1, count = 0;
+
+			// First locate the printjob entry
+
+			while (count < MAXPRINTJOBS && found == -1)
+			{
+				if (printjobs[count].net == a->p.srcnet && 
+				    printjobs[count].stn == a->p.srcstn)
+					found = count;
+				else count++;
+			}
+
+			if (found == -1) // New Print Job
+			{
+				char filename[100];
+
+				count = 0;
+
+				// Move this to a function at some stage
+				while (count < MAXPRINTJOBS && found == -1)
+				{
+					if (printjobs[count].net == 0 && printjobs[count].stn == 0) // Found one
+						found = count;
+					else	count++;
+				}
+	
+				if (found != -1)
+				{
+
+					printjobs[found].stn = a->p.srcstn;
+					printjobs[found].net = a->p.srcnet;
+					//printjobs[found].ctrl = 0x80; 
+					printjobs[found].ctrlbit = (a->p.ctrl & 0x01) ^ 0x01; // So ctrlbit stores what we are expecting
+					
+					sprintf(filename, SPOOLFILESPEC, found);
+	
+					printjobs[found].spoolfile = fopen(filename, "w");
+					
+					if (!printjobs[found].spoolfile)
+					{
+						printjobs[count].net = printjobs[count].stn = 0;  // Free this up - couldn't open file	
+						econet_log ("Unable to open spool file for print job from station %d.%d\n", a->p.srcnet, a->p.srcstn);
+					}
+					else
+					{
+
+						unsigned char printer_index = 0xff;
+						int fserver, active_id; // active_id is an internal FS index to the logged in user table
+
+						// Which printer?
+
+						if (network[d_ptr].servertype & ECONET_SERVER_FILE) // Is fileserver, so it might have a printer selected
+							printer_index = fs_get_user_printer(network[d_ptr].fileserver_index, a->p.srcnet, a->p.srcstn);
+
+						if (printer_index == 0xff)
+							printer_index = network[d_ptr].server->printer_priorities[0];
+
+						econet_log ("PRINT: Starting spooler job for %d.%d - %s (%s)\n", a->p.srcnet, a->p.srcstn, network[d_ptr].server->printers[printer_index].name, network[d_ptr].server->printers[printer_index].unixname);
+
+						// If we are using the new external print handler, we don't do the headers internally any more. They are configured.
+
+						strcpy(printjobs[found].name, network[d_ptr].server->printers[printer_index].name);
+
+						// Are we a fileserver as well as a print server? If so, is this station logged into it?
+						if ((fserver = fs_get_server_id(a->p.dstnet, a->p.dststn)) != -1)
+						{
+							fs_server_lock(fserver); // Its workers could be logging stations on or off
+							if ((active_id = fs_stn_logged_in(fserver, a->p.srcnet, a->p.srcstn)) != -1)
+							{
+								fs_get_username(fserver, active_id, printjobs[found].username);
+								if (printjobs[found].username == 0) strcpy(printjobs[found].username, "ANONYMOUS");
+							
+							}
+							else	strcpy(printjobs[found].username, "ANONYMOUS");
+							fs_server_unlock(fserver);
+						}
+						else	strcpy(printjobs[found].username, "ANONYMOUS");
+
+						if (!printhandler && strstr(network[d_ptr].server->printers[printer_index].unixname, "@")) // Email print job, not send to printer
+						{
+							fprintf(printjobs[count].spoolfile, "To: %s\n", network[d_ptr].server->printers[printer_index].unixname);
+							fprintf(printjobs[count].spoolfile, "Subject: Econet print job from station %d.%d\n\n", a->p.srcnet, a->p.srcstn);
+						}
+						if (!printhandler) fprintf (printjobs[count].spoolfile, PRINTHEADER, a->p.srcnet, a->p.srcstn);
+
+						strcpy (printjobs[count].unixname, network[d_ptr].server->printers[printer_index].unixname);
+					}
+
+				}
+
+			}
+
+			if (found != -1)
+			{
+				reply.p.srcnet = a->p.dstnet;
+				reply.p.srcstn = a->p.dststn;
+				reply.p.dstnet = a->p.srcnet;
+				reply.p.dststn = a->p.srcstn;
+				reply.p.aun_ttype = ECONET_AUN_DATA;
+				reply.p.port = 0xd1;
+				reply.p.ctrl = a->p.ctrl;
+
+				reply.p.seq = get_local_seq(a->p.dstnet, a->p.dststn);
+
+				// The control low bit alternation is to avoid duplicated packets. Need to implement a check... TODO.
+
+				if ((printjobs[count].ctrlbit == (a->p.ctrl & 0x01)) || ((a->p.ctrl & 0xfe) == 0x82)) // Either matches the ctrl bit, OR is 0x82 (job start)
+				{
+					printjobs[count].ctrlbit = (a->p.ctrl & 0x01) ^ 0x01;
+
+					switch (a->p.ctrl & 0xfe)
+					{
+						case 0x82: // Print job start
+						{
+							reply.p.data[0] = 0x2a;
+						}
+						break;
+						case 0x80: // Print data
+						{
+							fwrite(&(a->p.data), packlen-12, 1, printjobs[count].spoolfile);
+							reply.p.data[0] = a->p.data[0];	
+						}
+						break;
+						case 0x86: // Final packet
+						{
+							char command_string[2000];
+							char filename_string[200];
+	
+							// There is a rogue byte on the end of the last printjob packet it would seem
+							fwrite(&(a->p.data), packlen-12-1, 1, printjobs[count].spoolfile);
+
+							if (!printhandler)	
+								fprintf(printjobs[count].spoolfile, PRINTFOOTER);
+
+							reply.p.data[0] = a->p.data[0];	
+	
+							fclose(printjobs[count].spoolfile);
+							sprintf(filename_string, SPOOLFILESPEC, found);
+							
+							if (!printhandler)
+							{
+								if (strstr(printjobs[count].unixname, "@")) // Email address not printername
+									sprintf(command_string, MAILCMDSPEC, printjobs[count].unixname, filename_string);
+								else
+									sprintf(command_string, PRINTCMDSPEC, printjobs[count].unixname, filename_string);
+		
+								econet_log ("PRINT: Sending print job with %s\n", command_string);
+							
+								if (!fork())
+									execl("/bin/sh", "sh", "-c", command_string, (char *)0);
+							}
+							else
+							{
+								sprintf(command_string, "%s %d %d %d %d %s %s %s %s",
+									printhandler,
+									a->p.dstnet, a->p.dststn,
+									a->p.srcnet, a->p.srcstn,
+									printjobs[count].username,
+									printjobs[count].unixname,
+									printjobs[count].name,
+									filename_string);
+				
+								if (pkt_debug) econet_debug ("PRINT: Command string: %s\n", command_string);
+
+								if (!fork())	execl("/bin/bash", "bash", "-c", command_string, (char *) 0);
+	
+							}
+	
+							printjobs[count].stn = printjobs[count].net = 0; // Free the resource	
+
+						}
+						break;
+					}
+
+				}
+
+				aun_send (&reply, 13);
+			}
+			else
+				econet_log ("PRINT: Spooler not found for print request from %d.%d\n", network[s_ptr].network, network[s_ptr].station);
+			
+		}
+		else if ((a->p.port == 0xdf) && (network[d_ptr].servertype & ECONET_SERVER_SOCKET) && (network[d_ptr].sks_index >= 0))
+			sks_handle_traffic(network[d_ptr].sks_index, a->p.srcnet, a->p.srcstn, a->p.ctrl, a->p.data, packlen-12);
+		else if ((network[d_ptr].servertype & ECONET_SERVER_FILE) && (network[d_ptr].fileserver_index >= 0)) // Could be fileserver bulk transfer traffic
+			handle_fs_bulk_traffic(network[d_ptr].fileserver_index, a->p.srcnet, a->p.srcstn, a->p.port, a->p.ctrl, a->p.data, packlen-12);
+		else
+			econet_log ("LOCAL: Unhandled traffic.\n");
+	}
+	else if (a->p.aun_ttype == ECONET_AUN_ACK)
+	{
+	}
+	else
+	{
+		econet_log ("Ignoring AUN type %d to local station %d.%d\n", a->p.aun_ttype, network[d_ptr].network, network[d_ptr].station);
+	}
+
+}
+
+// Preset dictionary for trunk compression - bits of the sort of traffic fileservers and print servers send, so that
+// even a short frame has something to refer back to. zlib looks hardest at the end, so the commonest things go last.
+
+static const char trunk_z_dict[] =
+	"Bad command\rNot found\rInsufficient access\rAlready open\rNot a directory\rDisc full\rWho are you?\r"
+	"Bad password\rWrong password\rNot logged on\rBad file name\rChannel\rDirectory not empty\r"
+	"$.Library$.Library1$.ArthurLib$.SYST$.GUEST!BOOT!ArthurLib"
+	"\x0d\x00\x0a\x0d\x00\x14\x0d\x00\x1e\x0d\x00\x28 \xf1\"\xf1 \xe7 \x8c \xe3 \xfd \xf4 \xde \xeb \xe5 \xd6 \xf5 "
+	"PRINT \"INPUT \"REM DEFPROC ENDPROC IF THEN ELSE FOR TO NEXT GOTO GOSUB RETURN\r\n"
+	"Owner\rPublic\rOption 00 (Off)Option 02 (Run)Option 03 (Exec)Dir. Lib. "
+	"     WR/     LWR/      DLWR/     LWR/r     WR/r      D/        DL/       "
+	"          \r\n          \r\n                    ";
+
+z_stream trunk_zc, trunk_zd; // Compressor & decompressor - set up in trunk_z_init()
+unsigned char trunk_z_ready = 0;
+
+void trunk_z_init(void)
+{
+	memset(&trunk_zc, 0, sizeof(trunk_zc));
+	memset(&trunk_zd, 0, sizeof(trunk_zd));
+
+	if (deflateInit2(&trunk_zc, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK || inflateInit2(&trunk_zd, -15) != Z_OK)
+	{
+		fprintf (stderr, "Unable to initialize trunk compression\n");
+		exit(EXIT_FAILURE);
+	}
+
+	trunk_z_ready = 1;
+}
+
+// Nanoseconds of CPU the calling (network) thread has had, for timing compression - not the whole process, whose
+// clock would count the wire, service and fileserver threads as well
+
+static inline uint64_t trunk_z_cpu(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t);
+
+	return ((uint64_t) t.tv_sec * 1000000000) + t.tv_nsec;
+}
+
+// Compress frame p, length len, if trunk t should and it's worth it. Returns the length to send, and points *z at what
+// to send - either p as it was, or an ECONET_TRUNK_COMPRESSED frame in a static buffer which stays good until the next call.
+// Bridge traffic (port &9C) is left alone, since the far end has to be able to read that whatever it can take.
+
+int trunk_compress(int t, struct __econet_packet_aun *p, int len, struct __econet_packet_aun **z)
+{
+	static struct __econet_packet_aun out;
+	uint64_t start;
+	int zlen;
+
+	*z = p;
+
+	if (!trunks[t].compress || !trunks[t].peer_compress || p->p.port == 0x9c)
+		return len;
+
+	if ((len - 12) < ECONET_TRUNK_COMPRESS_MIN)
+	{
+		trunks[t].z_tx_skipped++;
+		return len;
+	}
+
+	start = trunk_z_cpu();
+
+	deflateReset(&trunk_zc);
+	deflateSetDictionary(&trunk_zc, (const Bytef *) trunk_z_dict, sizeof(trunk_z_dict) - 1);
+
+	trunk_zc.next_in = p->p.data;
+	trunk_zc.avail_in = len - 12;
+	trunk_zc.next_out = &(out.p.data[1]);
+	trunk_zc.avail_out = len - 14; // Anything bigger than the original isn't worth having
+
+	zlen = (deflate(&trunk_zc, Z_FINISH) == Z_STREAM_END) ? (13 + trunk_zc.total_out) : 0;
+
+	trunks[t].z_tx_ns += trunk_z_cpu() - start;
+
+	if (!zlen) // Didn't fit - incompressible
+	{
+		trunks[t].z_tx_skipped++;
+		return len;
+	}
+
+	memcpy(&out, p, 12);
+	out.p.aun_ttype = ECONET_TRUNK_COMPRESSED;
+	out.p.data[0] = p->p.aun_ttype;
+
+	trunks[t].z_tx++;
+	trunks[t].z_tx_in += len;
+	trunks[t].z_tx_out += zlen;
+
+	*z = &out;
+
+	return zlen;
+}
+
+// Undo trunk_compress() - p (length len) arrived on trunk t, and is decompressed into out. Returns its length, or -1 if it was duff
+
+int trunk_decompress(int t, struct __econet_packet_aun *p, int len, struct __econet_packet_aun *out)
+{
+	uint64_t start;
+	int r;
+
+	if (len < 13)
+		return -1;
+
+	if (!trunk_z_ready)
+		trunk_z_init();
+
+	start = trunk_z_cpu();
+
+	inflateReset(&trunk_zd);
+	inflateSetDictionary(&trunk_zd, (const Bytef *) trunk_z_dict, sizeof(trunk_z_dict) - 1);
+
+	trunk_zd.next_in = &(p->p.data[1]);
+	trunk_zd.avail_in = len - 13;
+	trunk_zd.next_out = out->p.data;
+	trunk_zd.avail_out = sizeof(out->p.data);
+
+	r = inflate(&trunk_zd, Z_FINISH);
+
+	trunks[t].z_rx_ns += trunk_z_cpu() - start;
+
+	if (r != Z_STREAM_END)
+	{
+		econet_log ("TRUNK: to %3d.%3d from %3d.%3d Bad compressed frame received on trunk %d\n", p->p.dstnet, p->p.dststn, p->p.srcnet, p->p.srcstn, t);
+		return -1;
+	}
+
+	memcpy(out, p, 12);
+	out->p.aun_ttype = p->p.data[0];
+
+	trunks[t].z_rx++;
+
+	return (12 + trunk_zd.total_out);
+}
+
+// Trunk send internal - send packet p of length len on trunk t - used once we've found which trunk we want
+int aun_trunk_send_internal (struct __econet_packet_aun *p, int len, int t)
+{
+
+	int result = 0;
+
+	if (trunk_xlate_fw(p, t, 1) == FW_ACCEPT) // returns 0 for drop traffic (param 3 = 1 means outbound)
+	{
+		struct __econet_packet_aun *z = p;
+		int zlen;
+
+		zlen = trunk_compress(t, p, len, &z);
+		if (udp_send_batched(trunks[t].listensocket, z, zlen, trunks[t].addr->ai_addr, trunks[t].addr->ai_addrlen, NULL) > 0)
+		{
+			result = len;
+			trunks[t].tx_frames++;
+			trunks[t].tx_bytes += len;
+		}
+	}
+	else
+		econet_log ("ERROR: to %3d.%3d from %3d.%3d Unknown destination\n", 
+			p->p.dstnet, p->p.dststn, p->p.srcnet, p->p.srcstn);
+
+	return result;
+}
+
+// Send AUN format packet (including our 4 byte magic header) over a trunk. Return 0 if it hasn't worked, otherwise packet length.
+// For now, the firewall is not implemented.
+
+int aun_trunk_send(struct __econet_packet_aun *p, int len)
+{
+
+	short trunk;
+	int result = 0;
+
+	// First, see which trunk this destination might be on.
+
+	trunk = trunk_find(p->p.dstnet);
+
+	if (trunk >= 0)
+		result = aun_trunk_send_internal(p, len, trunk);
+	else
+	{
+		if (pkt_debug) econet_debug ("TRUNK: to %3d.%3d from %3d.%3d Trunk destination not found\n", p->p.dstnet, p->p.dststn, p->p.srcnet, p->p.srcstn);
+		econet_drops[ECONET_DROP_NOROUTE]++;
+	}
+
+	return result;
+
+}
+
+// Put trunk t on the ready list, if it isn't already
+
+static inline void trunk_make_ready(int t)
+{
+	if (!trunks[t].ready)
+	{
+		trunks[t].ready = 1;
+		trunks[t].ready_next = trunk_ready_head;
+		trunk_ready_head = t;
+	}
+}
+
+// Queue packet p to go over whichever trunk its destination is down. The trunk is looked up, and its address
+// translation done, here and only here - aun_trunk_flush() just sends what is on the queue.
+// Returns len if queued, 0 if not (no route, queue full or pool exhausted). sheddable - see econet_queue_admit()
+
+int aun_trunk_enqueue(struct __econet_packet_aun *p, int len, unsigned char sheddable)
+{
+	struct __trunk *t;
+	short trunk;
+
+	if ((trunk = trunk_find(p->p.dstnet)) < 0)
+	{
+		if (pkt_debug) econet_debug ("TRUNK: to %3d.%3d from %3d.%3d Trunk destination not found\n", p->p.dstnet, p->p.dststn, p->p.srcnet, p->p.srcstn);
+		econet_drops[ECONET_DROP_NOROUTE]++;
+		return 0;
+	}
+
+	t = &(trunks[trunk]);
+
+	if (!econet_queue_admit(ECONET_QUEUE_TRUNK, &(t->q_codel), t->q_len, t->q_bytes, len, sheddable) || !econet_general_enqueue(&(t->q_head), &(t->q_tail), p, len))
+		return 0;
+
+	trunk_xlate_fw(t->q_tail->p, trunk, 1); // Outbound - translation only, so always FW_ACCEPT. Done on our copy, since p may be the caller's
+
+	t->q_len++;
+	t->q_bytes += len;
+	trunk_queued++;
+	econet_queue_publish(ECONET_QUEUE_TRUNK, &(t->q_codel), t->q_len, t->q_bytes);
+
+	trunk_make_ready(trunk);
+
+	return len;
+}
+
+// Reliable trunks. Each datagram trunk_datagram_send() puts on the trunk goes in an ECONET_TRUNK_RELIABLE envelope with
+// a sequence number, and is kept in rel_tx[] until the far end says it has arrived. The far end hands everything on as
+// soon as it arrives (trunk traffic was never in order anyway), throws away duplicates, and sends back an ECONET_TRUNK_RACK
+// for each batch it receives, saying which it has had. Lost datagrams are sent again after ECONET_TRUNK_REL_DUPACKS ACKs
+// which show later ones arriving, or on the retransmission timer, worked out from the ACK round trip time as for AUN hosts.
+// How many can be in flight is limited by a congestion window which grows by one per ACKed datagram until the first loss,
+// then by one per window's worth, and halves on each loss (to one on a timeout). Anything which still hasn't arrived
+// after ECONET_QUEUE_MAX_AGE is given up on, as it would have been if it had been waiting in the queue that long.
+
+int trunk_rel_on(int t)
+{
+	return (trunks[t].reliable && trunks[t].peer_reliable);
+}
+
+// Whether trunk t can send another datagram now
+
+static inline int trunk_rel_window_open(int t)
+{
+	struct __trunk *tr = &(trunks[t]);
+
+	if (!trunk_rel_on(t))
+		return 1;
+
+	return ((tr->snd_nxt - tr->snd_una) < (tr->cwnd < ECONET_TRUNK_REL_WINDOW ? tr->cwnd : ECONET_TRUNK_REL_WINDOW));
+}
+
+// Current retransmission timeout for trunk t, in ms
+
+long trunk_rel_rto(int t)
+{
+	long rto;
+
+	rto = trunks[t].rto ? trunks[t].rto : ECONET_AUN_ACK_WAIT_TIME;
+	rto <<= trunks[t].backoff;
+
+	return (rto > ECONET_AUN_MAX_RTO) ? ECONET_AUN_MAX_RTO : rto;
+}
+
+// Forget everything in flight on trunk t, and start the congestion window again. Sequence numbers carry on from where
+// they were - the far end catches up from the envelope of the next datagram.
+
+void trunk_rel_reset(int t)
+{
+	struct __trunk *tr = &(trunks[t]);
+	int i;
+
+	for (i = 0; i < ECONET_TRUNK_REL_WINDOW; i++)
+	{
+		econet_pool_free(tr->rel_tx[i].d);
+		tr->rel_tx[i].d = NULL;
+	}
+
+	tr->snd_una = tr->snd_nxt;
+	tr->cwnd = ECONET_TRUNK_REL_INIT_CWND;
+	tr->ssthresh = ECONET_TRUNK_REL_WINDOW;
+	tr->cwnd_acc = tr->dupacks = tr->in_recovery = 0;
+	tr->backoff = 0;
+
+	econet_timer_cancel(&(tr->rel_timer));
+}
+
+// Move snd_una past anything at the front which has arrived or been given up on
+
+void trunk_rel_advance(int t)
+{
+	struct __trunk *tr = &(trunks[t]);
+
+	while (tr->snd_una != tr->snd_nxt && !(tr->rel_tx[tr->snd_una % ECONET_TRUNK_REL_WINDOW].d))
+		tr->snd_una++;
+}
+
+// Send datagram seq on trunk t again, unless it has had its chance. Returns 1 if it was sent
+
+int trunk_rel_retransmit(int t, uint32_t seq)
+{
+	struct __trunk *tr = &(trunks[t]);
+	struct __trunk_rel_tx *x = &(tr->rel_tx[seq % ECONET_TRUNK_REL_WINDOW]);
+	struct timeval now;
+
+	if (!x->d)
+		return 0;
+
+	gettimeofday(&now, 0);
+
+	if (timediffmsec(&(x->first_tx), &now) >= ECONET_QUEUE_MAX_AGE)
+	{
+		if (pkt_debug) econet_debug ("TRUNK: Giving up on datagram %u on trunk %d after %d transmissions\n", seq, t, x->tx_count);
+		econet_pool_free(x->d);
+		x->d = NULL;
+		tr->rel_given_up++;
+		return 0;
+	}
+
+	x->d[12] = tr->snd_una & 0xff; // Bring the envelope up to date
+	x->d[13] = (tr->snd_una >> 8) & 0xff;
+	x->d[14] = (tr->snd_una >> 16) & 0xff;
+	x->d[15] = (tr->snd_una >> 24) & 0xff;
+
+	if (x->tx_count < 255)
+		x->tx_count++;
+
+	udp_send_batched(tr->listensocket, x->d, x->len, tr->addr->ai_addr, tr->addr->ai_addrlen, NULL);
+
+	return 1;
+}
+
+// Put datagram d, len bytes, on trunk t - in an envelope if it's reliable. The flush has already checked the window.
+
+void trunk_datagram_send(int t, void *d, int len)
+{
+	struct __trunk *tr = &(trunks[t]);
+	struct __trunk_rel_tx *x;
+	struct __econet_packet_aun *env;
+
+	if (!trunk_rel_on(t) || !(env = econet_pool_alloc(len + 16)))
+	{
+		udp_send_batched(tr->listensocket, d, len, tr->addr->ai_addr, tr->addr->ai_addrlen, NULL);
+		return;
+	}
+
+	memset(env, 0, 12);
+	env->p.aun_ttype = ECONET_TRUNK_RELIABLE;
+	env->p.port = 0x9c;
+	env->p.seq = tr->snd_nxt;
+	env->p.data[0] = tr->snd_una & 0xff;
+	env->p.data[1] = (tr->snd_una >> 8) & 0xff;
+	env->p.data[2] = (tr->snd_una >> 16) & 0xff;
+	env->p.data[3] = (tr->snd_una >> 24) & 0xff;
+	memcpy(&(env->p.data[4]), d, len);
+
+	x = &(tr->rel_tx[tr->snd_nxt % ECONET_TRUNK_REL_WINDOW]);
+	econet_pool_free(x->d); // Can only be left over if the window was overrun - which the flush doesn't do
+	x->d = (unsigned char *) env;
+	x->len = len + 16;
+	x->tx_count = 1;
+	gettimeofday(&(x->first_tx), 0);
+
+	tr->snd_nxt++;
+	tr->rel_sent++;
+
+	udp_send_batched(tr->listensocket, env, len + 16, tr->addr->ai_addr, tr->addr->ai_addrlen, NULL);
+
+	if (!econet_timer_armed(&(tr->rel_timer)))
+		econet_timer_arm(&(tr->rel_timer), trunk_rel_rto(t));
+}
+
+// Timer handler - nothing has moved snd_una on trunk t for a retransmission timeout
+
+void trunk_rel_expired(int t)
+{
+	struct __trunk *tr = &(trunks[t]);
+	unsigned int flight;
+
+	trunk_rel_advance(t);
+
+	if (tr->snd_una == tr->snd_nxt)
+		return;
+
+	flight = tr->snd_nxt - tr->snd_una;
+	tr->ssthresh = (flight / 2) > 2 ? (flight / 2) : 2;
+	tr->cwnd = 1;
+	tr->cwnd_acc = tr->dupacks = tr->in_recovery = 0;
+
+	if (tr->backoff < ECONET_AUN_MAX_BACKOFF)
+		tr->backoff++;
+
+	while (tr->snd_una != tr->snd_nxt && !trunk_rel_retransmit(t, tr->snd_una)) // Anything given up on is skipped
+		trunk_rel_advance(t);
+
+	if (tr->snd_una != tr->snd_nxt)
+	{
+		tr->rel_timeout_retx++;
+		econet_timer_arm(&(tr->rel_timer), trunk_rel_rto(t));
+	}
+
+	if (tr->q_head && trunk_rel_window_open(t))
+		trunk_make_ready(t);
+}
+
+// An ECONET_TRUNK_RACK, p (len bytes), has arrived on trunk t
+
+void trunk_rel_ack_receive(struct __econet_packet_aun *p, int len, int t)
+{
+	struct __trunk *tr = &(trunks[t]);
+	uint32_t cum, seq;
+	uint64_t sack = 0;
+	unsigned int acked = 0, i;
+	struct timeval now;
+
+	if (len < 20 || !trunk_rel_on(t))
+		return;
+
+	cum = p->p.seq;
+	for (i = 0; i < 8; i++)
+		sack |= ((uint64_t) p->p.data[i]) << (8 * i);
+
+	gettimeofday(&now, 0);
+
+	if ((int32_t) (cum - tr->snd_una) > 0 && (int32_t) (cum - tr->snd_nxt) <= 0) // Moves things on
+	{
+		for (seq = tr->snd_una; seq != cum; seq++)
+		{
+			struct __trunk_rel_tx *x = &(tr->rel_tx[seq % ECONET_TRUNK_REL_WINDOW]);
+
+			if (!x->d)
+				continue;
+
+			if (x->tx_count == 1) // Only time datagrams sent once - we can't tell which copy of the others got there
+				tr->rto = econet_rtt_update(&(tr->srtt), &(tr->rttvar), &(tr->rtt_samples),
+					((now.tv_sec - x->first_tx.tv_sec) * 1000000) + (now.tv_usec - x->first_tx.tv_usec));
+
+			econet_pool_free(x->d);
+			x->d = NULL;
+			acked++;
+		}
+
+		tr->snd_una = cum;
+	}
+
+	for (i = 0; i < 64; i++) // Then anything later which has arrived
+		if (sack & (((uint64_t) 1) << i))
+		{
+			struct __trunk_rel_tx *x;
+
+			seq = cum + 1 + i;
+
+			if ((int32_t) (seq - tr->snd_una) < 0 || (int32_t) (seq - tr->snd_nxt) >= 0)
+				continue;
+
+			x = &(tr->rel_tx[seq % ECONET_TRUNK_REL_WINDOW]);
+			econet_pool_free(x->d);
+			x->d = NULL;
+		}
+
+	trunk_rel_advance(t);
+
+	if (acked)
+	{
+		tr->dupacks = 0;
+		tr->backoff = 0;
+
+		if (tr->in_recovery)
+		{
+			if ((int32_t) (tr->snd_una - tr->recover) >= 0) // Everything up to the loss has arrived
+			{
+				tr->in_recovery = 0;
+				tr->cwnd = tr->ssthresh;
+			}
+			else if (trunk_rel_retransmit(t, tr->snd_una)) // More than one went missing - send the next gap straight away
+				tr->rel_fast_retx++;
+		}
+		else if (tr->cwnd < tr->ssthresh) // Slow start
+			tr->cwnd += acked;
+		else if ((tr->cwnd_acc += acked) >= tr->cwnd) // Congestion avoidance
+		{
+			tr->cwnd_acc -= tr->cwnd;
+			tr->cwnd++;
+		}
+
+		if (tr->cwnd > ECONET_TRUNK_REL_WINDOW)
+			tr->cwnd = ECONET_TRUNK_REL_WINDOW;
+	}
+	else if (sack && tr->snd_una != tr->snd_nxt && ++(tr->dupacks) == ECONET_TRUNK_REL_DUPACKS && !tr->in_recovery) // Something's gone missing
+	{
+		unsigned int flight = tr->snd_nxt - tr->snd_una;
+
+		tr->ssthresh = (flight / 2) > 2 ? (flight / 2) : 2;
+		tr->cwnd = tr->ssthresh;
+		tr->cwnd_acc = 0;
+		tr->in_recovery = 1;
+		tr->recover = tr->snd_nxt;
+
+		if (trunk_rel_retransmit(t, tr->snd_una))
+			tr->rel_fast_retx++;
+		trunk_rel_advance(t); // In case we gave up on it
+	}
+
+	if (tr->snd_una == tr->snd_nxt)
+		econet_timer_cancel(&(tr->rel_timer));
+	else if (acked)
+		econet_timer_arm(&(tr->rel_timer), trunk_rel_rto(t));
+
+	if (tr->q_head && trunk_rel_window_open(t))
+		trunk_make_ready(t);
+}
+
+// Tell the far end of trunk t what has arrived
+
+void trunk_rel_ack_send(int t)
+{
+	struct __trunk *tr = &(trunks[t]);
+	struct __econet_packet_aun out;
+	uint64_t sack;
+	int i;
+
+	tr->ack_due = 0;
+
+	memset(&out, 0, 12);
+	out.p.aun_ttype = ECONET_TRUNK_RACK;
+	out.p.port = 0x9c;
+	out.p.seq = tr->rcv_next;
+
+	sack = tr->rcv_map >> 1;
+	for (i = 0; i < 8; i++)
+		out.p.data[i] = (sack >> (8 * i)) & 0xff;
+
+	udp_send_batched(tr->listensocket, &out, 20, tr->addr->ai_addr, tr->addr->ai_addrlen, NULL);
+}
+
+// Slide the receive window on trunk t forward n places
+
+static inline void trunk_rel_slide(struct __trunk *tr, uint32_t n)
+{
+	tr->rcv_map = (n >= 64) ? 0 : (tr->rcv_map >> n);
+	tr->rcv_next += n;
+}
+
+// An ECONET_TRUNK_RELIABLE envelope, p (len bytes), has arrived on trunk t. Note it, and deal with what's in it unless we've had it before
+
+void trunk_rel_receive(struct __econet_packet_aun *p, int len, int t)
+{
+	struct __trunk *tr = &(trunks[t]);
+	struct __econet_packet_aun *inner;
+	uint32_t una, seq, d;
+
+	if (len < 28 || !tr->reliable) // Too short to hold a frame, or we never said we could do this
+		return;
+
+	seq = p->p.seq;
+	una = p->p.data[0] + (p->p.data[1] << 8) + (p->p.data[2] << 16) + ((uint32_t) p->p.data[3] << 24);
+
+	if (!tr->rcv_sync)
+	{
+		tr->rcv_next = una;
+		tr->rcv_map = 0;
+		tr->rcv_sync = 1;
+	}
+
+	if ((int32_t) (una - tr->rcv_next) > 0) // The far end has given up on some - stop waiting for them
+		trunk_rel_slide(tr, una - tr->rcv_next);
+
+	tr->ack_due = 1;
+
+	if ((int32_t) (seq - tr->rcv_next) < 0)
+	{
+		tr->rel_dups++;
+		return;
+	}
+
+	d = seq - tr->rcv_next;
+
+	if (d >= 64) // Can't happen with a well behaved far end, since it never has more than ECONET_TRUNK_REL_WINDOW in flight
+	{
+		trunk_rel_slide(tr, d - 63);
+		d = 63;
+	}
 
-				if (network[(entry == -1) ? networkp : entry].numprinters == MAX_PRINTERS)
-				{
-					fprintf (stderr, "Maximum number of printers exceeded for this emulated server.\n");
-					exit(EXIT_FAILURE);
-				}
+	if (tr->rcv_map & (((uint64_t) 1) << d))
+	{
+		tr->rel_dups++;
+		return;
+	}
 
-				colon = strchr(datastring, ':');
+	tr->rcv_map |= ((uint64_t) 1) << d;
 
-				if (colon)
-				{
-					strncpy(pname, colon+1, 6);
-					*colon = (char) '\0'; // Terminate the data string early now we have the pname
-				}
-				else if ((at = strchr(datastring, '@')) && (*(at+1) != (char) '\0')) // Email address and @ is not last char
-					strncpy(pname, at+1, 6);
-				else
-					strncpy(pname, datastring, 6);
+	while (tr->rcv_map & 1)
+		trunk_rel_slide(tr, 1);
 
-				// Convert pname to upper
-				index = 0;
-				while (pname[index] != (char) 0x00 && index < 7)
-				{
-					pname[index] = toupper(pname[index]);
-					index++;
-				}
+	tr->rel_rcvd++;
 
-				strcpy(network[(entry == -1) ? networkp : entry].print_serverparam, datastring); // Old printer code
-				strcpy(network[(entry == -1) ? networkp : entry].printers[network[(entry == -1) ? networkp : entry].numprinters].unixname, datastring); // If there was a colon, then this will have terminated where the colon was
-				snprintf(network[(entry == -1) ? networkp : entry].printers[network[(entry == -1) ? networkp : entry].numprinters].name, 7, "%-6.6s", pname); // copies first up to six characters and pads with spaces
-				network[(entry == -1) ? networkp : entry].printers[network[(entry == -1) ? networkp : entry].numprinters].control = PRNCTRL_DEFAULT;
-				network[(entry == -1) ? networkp : entry].printers[network[(entry == -1) ? networkp : entry].numprinters].status = PRN_STATUS_DEFAULT;
-				strncpy(network[(entry == -1) ? networkp : entry].printers[network[(entry == -1) ? networkp : entry].numprinters].banner, "", 23);
-				network[(entry == -1) ? networkp : entry].printer_priorities[network[(entry == -1) ? networkp : entry].numprinters] = network[(entry == -1) ? networkp : entry].numprinters; // Initially set the priority list to match the order in the file
-				network[(entry == -1) ? networkp : entry].numprinters++;
-				
-			}
-/*
-			else if (servertype == ECONET_SERVER_SOCKET)
-				strcpy(network[(entry == -1) ? networkp : entry].socket_serverparam, datastring);
-*/
+	inner = (struct __econet_packet_aun *) &(p->p.data[4]);
 
-			if (servertype & ECONET_SERVER_FILE)
-			{
-				int f;
+	if (inner->p.aun_ttype == ECONET_TRUNK_AGGREGATE)
+		trunk_agg_receive(inner, len - 16, t);
+	else
+		econet_handle_trunk_frame(inner, len - 16, t);
+}
 
-				f = fs_initialize(net, stn, (char *) &datastring);
-				if (f >= 0)
-					network[(entry == -1 ? networkp : entry)].fileserver_index = f;
-				else f = -1;
-			}
+// How big an aggregate we can send on trunk t - 0 if we can't, because one end or the other hasn't got an MTU
 
-/*
-			if (servertype & ECONET_SERVER_SOCKET)
-			{
-				int f;
+static inline unsigned short trunk_agg_mtu(int t)
+{
+	if (!trunks[t].mtu || !trunks[t].peer_mtu)
+		return 0;
 
-				f = sks_initialize(net, stn, (char *) &datastring);
-				if (f >= 0)
-					network[(entry == -1 ? networkp : entry)].sks_index = f;
-				else f = -1;
-			}
-*/
-			// Set up bridge adverts
-			if (network[networkp].network !=0)
-			{
-				wire_advertizable[network[networkp].network] = 0xff;
-				trunk_advertizable[network[networkp].network] = 0xff;
-			}
+	return (trunks[t].mtu < trunks[t].peer_mtu ? trunks[t].mtu : trunks[t].peer_mtu);
+}
 
-			// Set up the listener
+// Put the aggregate built up in agg (used bytes, holding frames frames) into the UDP batch for trunk t.
+// A lone frame goes as it is - there's nothing to be saved by wrapping it.
 
-			if (entry == -1) // Doesn't presently exist
-			{
-				if ( (network[networkp].listensocket = socket(AF_INET, SOCK_DGRAM, 0)) == -1)
-				{
-					fprintf(stderr, "Failed to open listening socket for local emulation %d/%d: %s.", network[networkp].network, network[networkp].station, strerror(errno));
-					exit(EXIT_FAILURE);
-				}
-	
-				service.sin_family = AF_INET;
-				if (*basenet && port == 0)
-				{
-					sprintf(tmp,"%s.%d",basenet,network[networkp].station);
-					service.sin_addr.s_addr = inet_addr(tmp);
-					port = 32768;
-				}
-				else
-				{
-					service.sin_addr.s_addr = INADDR_ANY;
-				}
-				network[networkp].port = port;
-				service.sin_port = htons(network[networkp].port);
-	
-				if (bind(network[networkp].listensocket, (struct sockaddr *) &service, sizeof(service)) != 0)
-				{
-					fprintf(stderr, "Failed to bind listening socket for local emulation %d/%d: %s.", network[networkp].network, network[networkp].station, strerror(errno));
-					exit(EXIT_FAILURE);
-				}
+void trunk_agg_send(int t, unsigned char *agg, int used, int frames)
+{
+	if (frames == 1)
+		trunk_datagram_send(t, agg + 14, used - 14);
+	else
+	{
+		trunk_datagram_send(t, agg, used);
+		trunks[t].agg_tx++;
+		trunks[t].agg_tx_frames += frames;
+	}
+}
 
-				network[networkp].pind = pmax; // Index into pset from the network[] array
+// Timer handler - a part-filled aggregate on trunk t has waited ECONET_TRUNK_AGG_DELAY, so send it
 
-				fd_ptr[network[networkp].listensocket] = networkp; // Create the index to find a station from its FD
+void trunk_agg_expired(int t)
+{
+	trunks[t].agg_due = 1;
 
-				pset[pmax++].fd = network[networkp].listensocket; // Fill in our poll structure
+	if (trunks[t].q_head)
+		trunk_make_ready(t);
+}
 
-				ECONET_SET_STATION(econet_stations, net, stn); // Put it in our list of AUN bridges
+// Send what is queued on each trunk on the ready list, up to ECONET_TRUNK_FLUSH_BUDGET bytes each, dropping anything
+// which has been waiting more than ECONET_QUEUE_MAX_AGE. The datagrams go into the UDP transmit batch, so they go out
+// in a sendmmsg() per trunk socket when the main loop calls udp_flush(). Trunks left with nothing queued come off the list.
+// Where the far end takes aggregates, frames are packed together up to the MTU, and a trunk with less than a datagram's
+// worth queued comes off the list until its agg_timer says the oldest frame has waited ECONET_TRUNK_AGG_DELAY.
 
-				if (net != 0)
-				{
-					wire_advertizable[net] = 0xff;
-					trunk_advertizable[net] = 0xff;
-				}
+void aun_trunk_flush(void)
+{
+	static unsigned char agg[ECONET_TRUNK_MAX_MTU];
+	struct timeval now;
+	int *link, trunk;
 
-				econet_ptr[net][stn] = networkp;
+	gettimeofday(&now, 0);
 
-				networkp++;
+	link = &trunk_ready_head;
+
+	while ((trunk = *link) != -1)
+	{
+		struct __trunk *t;
+		struct __econet_packet_aun_cache *e;
+		struct __econet_packet_aun *z;
+		unsigned long budget = ECONET_TRUNK_FLUSH_BUDGET, sent = 0;
+		unsigned short mtu;
+		int zlen;
+		int used = 0, frames = 0; // Aggregate being built in agg
+
+		t = &(trunks[trunk]);
+
+		mtu = trunk_agg_mtu(trunk);
+
+		if (mtu && !t->agg_due && t->q_head && (t->q_bytes + (2 * t->q_len) + 12) < mtu)
+		{
+			unsigned long waited = timediffmsec(&(t->q_head->tstamp), &now);
+
+			if (waited < ECONET_TRUNK_AGG_DELAY) // Not a datagram's worth yet - give it a moment for more
+			{
+				if (!econet_timer_armed(&(t->agg_timer)))
+					econet_timer_arm(&(t->agg_timer), ECONET_TRUNK_AGG_DELAY - waited);
+				t->ready = 0;
+				*link = t->ready_next;
+				continue;
 			}
-	
 		}
-		else if (regexec(&r_entry_wire, linebuf, 5, matches, 0) == 0)
+
+		while ((e = t->q_head) && budget >= e->size && (used || trunk_rel_window_open(trunk)))
 		{
-			char	tmp[300];
-			int	ptr;
-			short this_type;
-			unsigned char this_stn, this_net;
-			unsigned int this_port;
+			t->q_head = e->next;
+			if (!t->q_head)
+				t->q_tail = NULL;
 
-			/* Find our matches */
-			for (count = 1; count <= 4; count++)
+			t->q_len--;
+			t->q_bytes -= e->size;
+			trunk_queued--;
+			budget -= e->size;
+
+			if (timediffmsec(&(e->tstamp), &now) < ECONET_QUEUE_MAX_AGE) // Dump traffic older than 2s
 			{
-				ptr = 0;
-				while (ptr < (matches[count].rm_eo - matches[count].rm_so))
+				if (queue_debug) econet_debug ("QUEUE: to %3d.%3d from %3d.%3d length 0x%04X retrieved from trunk %d queue\n",
+					e->p->p.dstnet, e->p->p.dststn, e->p->p.srcnet, e->p->p.srcstn, e->size, trunk);
+
+				econet_codel_dequeued(ECONET_QUEUE_TRUNK, &(t->q_codel), &(e->tstamp), t->q_bytes);
+
+				z = e->p;
+				zlen = trunk_compress(trunk, e->p, e->size, &z);
+
+				if (mtu && (zlen + 14) <= mtu) // Goes in an aggregate
 				{
-					tmp[ptr] = linebuf[ptr + matches[count].rm_so];
-					ptr++;
-				}
-				tmp[ptr] = 0x00;
+					if (used && (used + 2 + zlen) > mtu) // This one's full
+					{
+						trunk_agg_send(trunk, agg, used, frames);
+						used = 0;
+					}
 
-				switch (count)
+					if (!used)
+					{
+						memset(agg, 0, 12);
+						agg[4] = ECONET_TRUNK_AGGREGATE;
+						agg[5] = 0x9c; // Bridge port, like the CAPS frame
+						used = 12;
+						frames = 0;
+					}
+
+					agg[used++] = zlen & 0xff;
+					agg[used++] = (zlen >> 8) & 0xff;
+					memcpy(&(agg[used]), z, zlen);
+					used += zlen;
+					frames++;
+				}
+				else
 				{
-					case 1: // W (Wire machine, listen for RAW packets), X (Wire machine, listen for AUN)
-						switch (tmp[0]) {
-							case 'W':
-							case 'w':
-								this_type = ECONET_HOSTTYPE_WIRE_AUN;
-								break;
-						}
-						break;
-					case 2:
-						this_net = atoi(tmp);
-						break;
-					case 3:
-						// We cheat and let station 0 mean *
-						this_stn = atoi(tmp);
-						break;
-					case 4:
-						// We cheat and let port 0 mean AUTO
-						this_port = atoi(tmp);
-						if (this_port == 0 && this_net > 127)
-						{
-							fprintf(stderr, "Network must be under 128 for AUTO to work: %s\n",linebuf);
-							exit(EXIT_FAILURE);
-						}
-						break;
+					if (used) // Keep things in order
+					{
+						trunk_agg_send(trunk, agg, used, frames);
+						used = 0;
+					}
+
+					trunk_datagram_send(trunk, z, zlen);
 				}
-			}
 
-			// Build a simple array of all defined stations on this network
-			unsigned char inuse[255] = {'\0'};
-			for (short i=0;i<networkp;i++)
-			{
-				if (network[i].network == this_net)
-				inuse[network[i].station]=1;
+				sent++;
+				t->tx_frames++;
+				t->tx_bytes += e->size;
 			}
+			else	queue_age_drops[ECONET_QUEUE_TRUNK]++;
 
-			// Now if a station has not been specificed we want to set all possible
-			// unused stations, otherwise we just set the one asked
-			// We can simplify the logic by using a loop in both
-			// cases and just set the range accordingly.
-			unsigned char stn_low=this_stn?this_stn:1, stn_high=this_stn?this_stn:254;
+			econet_pool_free(e);
+		}
 
-			for (this_stn=stn_low;this_stn<=stn_high;this_stn++)
-			{
-				if (inuse[this_stn])
-				{
-					if (!fs_quiet) fprintf(stderr, "   Skipping station %d because previously defined\n", this_stn);
-					continue;
-				}
+		econet_queue_publish(ECONET_QUEUE_TRUNK, &(t->q_codel), t->q_len, t->q_bytes);
 
-				// Stop this being a server
-				network[networkp].servertype = 0;
+		if (used)
+			trunk_agg_send(trunk, agg, used, frames);
 
-				network[networkp].port = this_port;
-				if (this_port == 0 && !*basenet)
-				{
-					network[networkp].port = 10000+this_net*256+this_stn;
-				}
+		t->agg_due = 0;
+		econet_timer_cancel(&(t->agg_timer));
 
-				network[networkp].station = this_stn;
-				network[networkp].network = this_net;
-				network[networkp].type = this_type;
+		if (sent)
+		{
+			t->flushes++;
+			t->flushed_packets += sent;
+			if (sent > t->flush_max)
+				t->flush_max = sent;
+		}
 
-				econet_ptr[network[networkp].network][network[networkp].station] = networkp;
+		if (t->q_head && trunk_rel_window_open(trunk)) // Still more to go - stays on the list. If the window is shut, an ACK puts it back
+			link = &(t->ready_next);
+		else
+		{
+			t->ready = 0;
+			*link = t->ready_next;
+		}
+	}
+}
 
-				// Set up the listener
+// Tell the far end of trunk t we can take aggregates of up to its MTU, compressed frames if it has COMPRESS, and do
+// reliable mode if it has RELIABLE. flags - ECONET_TRUNK_CAPS_REPLY if we want to know what it can take in return. A trunk with none says nothing,
+// which looks to the far end like an old bridge.
 
-				if ( (network[networkp].listensocket = socket(AF_INET, SOCK_DGRAM, 0)) == -1)
-				{
-					fprintf(stderr, "Failed to open listening socket for econet net/stn %d/%d: %s.", network[networkp].network, network[networkp].station, strerror(errno));
-					exit(EXIT_FAILURE);
-				}
+void trunk_caps_send(int t, unsigned char flags)
+{
+	struct __econet_packet_aun out;
 
-				service.sin_family = AF_INET;
-				if (*basenet && network[networkp].port == 0)
-				{
-					sprintf(tmp,"%s.%d",basenet,network[networkp].station);
-					service.sin_addr.s_addr = inet_addr(tmp);
-					service.sin_port = htons(32768);
-				}
-				else
-				{
-					service.sin_addr.s_addr = INADDR_ANY;
-					service.sin_port = htons(network[networkp].port);
-				}
+	if (!trunks[t].mtu && !trunks[t].compress && !trunks[t].reliable)
+		return;
 
-				if (bind(network[networkp].listensocket, (struct sockaddr *) &service, sizeof(service)) != 0)
-				{
-					fprintf(stderr, "Failed to bind listening socket for econet net/stn %d/%d: %s.", network[networkp].network, network[networkp].station, strerror(errno));
-					exit(EXIT_FAILURE);
-				}
+	if (trunks[t].compress)
+		flags |= ECONET_TRUNK_CAPS_COMPRESS;
+	if (trunks[t].reliable)
+		flags |= ECONET_TRUNK_CAPS_RELIABLE;
+
+	out.p.srcnet = out.p.srcstn = out.p.dstnet = out.p.dststn = 0;
+	out.p.aun_ttype = ECONET_TRUNK_CAPS;
+	out.p.port = 0x9c; // So that bridges which predate this don't moan about traffic from an unadvertised network
+	out.p.ctrl = 0;
+	out.p.padding = 0;
+	out.p.seq = (local_seq += 4);
+	out.p.data[0] = ECONET_TRUNK_CAPS_VERSION;
+	out.p.data[1] = flags;
+	out.p.data[2] = trunks[t].mtu & 0xff;
+	out.p.data[3] = (trunks[t].mtu >> 8) & 0xff;
+	out.p.data[4] = trunk_epoch & 0xff;
+	out.p.data[5] = (trunk_epoch >> 8) & 0xff;
+	out.p.data[6] = (trunk_epoch >> 16) & 0xff;
+	out.p.data[7] = (trunk_epoch >> 24) & 0xff;
+
+	if (pkt_debug) econet_debug ("TRUNK: Sending capabilities on trunk %d - MTU %d%s%s%s\n", t, trunks[t].mtu, (flags & ECONET_TRUNK_CAPS_COMPRESS) ? ", compression" : "", (flags & ECONET_TRUNK_CAPS_RELIABLE) ? ", reliable" : "", (flags & ECONET_TRUNK_CAPS_REPLY) ? ", reply wanted" : "");
+
+	udp_send_batched(trunks[t].listensocket, &out, 20, trunks[t].addr->ai_addr, trunks[t].addr->ai_addrlen, NULL);
+
+	if ((flags & ECONET_TRUNK_CAPS_REPLY) && trunks[t].caps_tries)
+	{
+		trunks[t].caps_tries--;
+		econet_timer_arm(&(trunks[t].caps_timer), ECONET_TRUNK_CAPS_RETRY);
+	}
+}
+
+// Ask the far end of trunk t what it can take, and keep asking every ECONET_TRUNK_CAPS_RETRY until it tells us
+// or we've asked ECONET_TRUNK_CAPS_TRIES times
+
+void trunk_caps_ask(int t)
+{
+	trunks[t].caps_tries = ECONET_TRUNK_CAPS_TRIES;
+	trunk_caps_send(t, ECONET_TRUNK_CAPS_REPLY);
+}
+
+// Timer handler - no CAPS has come back from trunk t since we asked. Once we've asked ECONET_TRUNK_CAPS_TRIES times,
+// the far end is taken to be a bridge which can't do any of it - perhaps one which has restarted as an older version -
+// so stop using what it told us before.
+
+void trunk_caps_expired(int t)
+{
+	if (!trunks[t].caps_tries)
+	{
+		if (trunks[t].peer_mtu || trunks[t].peer_compress || trunks[t].peer_reliable)
+		{
+			econet_log ("TRUNK: No capabilities from trunk %d after %d tries - no longer aggregating, compressing or sequencing\n", t, ECONET_TRUNK_CAPS_TRIES);
+			trunks[t].peer_mtu = 0;
+			trunks[t].peer_compress = 0;
+			trunks[t].peer_reliable = 0;
+			trunk_rel_reset(t);
+		}
+		trunks[t].peer_epoch = 0;
+		return;
+	}
+
+	if (pkt_debug) econet_debug ("TRUNK: No capabilities yet from trunk %d - asking again\n", t);
+
+	trunk_caps_send(t, ECONET_TRUNK_CAPS_REPLY);
+}
+
+// A CAPS frame of length len has arrived on trunk t
 
-				network[networkp].pind = pmax;
-				network[networkp].seq = 0x00004000;
+void trunk_caps_receive(struct __econet_packet_aun *p, int len, int t)
+{
+	unsigned short mtu;
+	uint32_t epoch = 0;
+	unsigned char restarted;
 
-				gettimeofday(&(network[networkp].last_bridge_reply),0);
-				clock_gettime (CLOCK_MONOTONIC, &(network[networkp].last_wire_tx));
-				fd_ptr[network[networkp].listensocket] = networkp; // Create the index to find a station from its FD
+	if (len < 16 || p->p.data[0] < 1) // Not one we understand
+		return;
 
-				if (network[networkp].network != 0)
-					trunk_advertizable[network[networkp].network] = 0xff;
-	
-				pset[pmax++].fd = network[networkp].listensocket; // Fill in our poll structure
+	mtu = p->p.data[2] + (p->p.data[3] << 8);
 
-				networkp++;
-			}
-		}
-		else if (regexec(&r_entry_learn, linebuf, 3, matches, 0) == 0) // Learn. Unknown sources will get put into this network temporarily, and garbage-collected out when they have been idle for a while
-		{
+	if (mtu < ECONET_TRUNK_MIN_MTU)
+		mtu = 0;
 
-			char	tmp[300];
-			int	ptr;
+	if (p->p.data[0] >= 2 && len >= 20)
+		epoch = p->p.data[4] + (p->p.data[5] << 8) + (p->p.data[6] << 16) + ((uint32_t) p->p.data[7] << 24);
 
-			/* Find our match */
-			ptr = 0;
-			while (ptr < (matches[2].rm_eo - matches[2].rm_so))
-			{
-				tmp[ptr] = linebuf[ptr + matches[2].rm_so];	
-				ptr++;
-			}
-			tmp[ptr] = 0x00;
-			
-			learned_net = atoi(tmp);
+	// Without an epoch (a version 1 peer) we can't tell, so assume the worst
+	restarted = (!epoch || epoch != trunks[t].peer_epoch);
 
-			if (learned_net == 0)
-			{
-				fprintf (stderr, "Cannot set dynamic network number to 0 because it is used on the Econet wire.\n");
-				exit(EXIT_FAILURE);
-			}
+	if (pkt_debug) econet_debug ("TRUNK: Trunk %d peer takes aggregates up to %d bytes%s%s%s%s\n", t, mtu, (p->p.data[1] & ECONET_TRUNK_CAPS_COMPRESS) ? ", compression" : "", (p->p.data[1] & ECONET_TRUNK_CAPS_RELIABLE) ? ", reliable" : "", (p->p.data[1] & ECONET_TRUNK_CAPS_REPLY) ? ", reply wanted" : "", restarted ? " (new)" : "");
 
-			for (count = 1; count < 255; count++) // Put the entire network's worth of hosts into network[] and flag as dynamic	
-			{
-				econet_ptr[learned_net][count] = networkp;
+	trunks[t].caps_tries = 0; // No need to ask again
+	econet_timer_cancel(&(trunks[t].caps_timer));
 
-				network[networkp].network = learned_net;
-				network[networkp].station = count;
-				network[networkp].type = ECONET_HOSTTYPE_DIS_AUN;
-				network[networkp].pind = 0;
-				network[networkp].servertype = 0;
-				network[networkp].last_seq_ack = 0; // Tracks the last AUN data packet we acknowledged from this host.
-				network[networkp].listensocket = -2; // Distant - no socket
-				ECONET_SET_STATION(econet_stations, network[networkp].network, network[networkp].station);
+	trunks[t].peer_mtu = mtu;
+	trunks[t].peer_compress = (p->p.data[1] & ECONET_TRUNK_CAPS_COMPRESS) ? 1 : 0;
 
-				// Include the network in our list
-				wire_advertizable[network[networkp].network] = 0xff;
-			
-				if (nativebridgenet == 0 && network[networkp].network != 0)
-					nativebridgenet = network[networkp].network;
+	// The same far end answering again (e.g. after a bridge reset) knows where we'd got to, so what's in flight stays
+	// in flight. One which has restarted has forgotten, so start afresh and find out where its sequence numbers are
+	// from the next datagram.
+	if (restarted || (!trunks[t].peer_reliable && (p->p.data[1] & ECONET_TRUNK_CAPS_RELIABLE)))
+		trunk_rel_reset(t);
 
-				network[networkp].is_dynamic = 1;
-				networkp++;
-			}
+	if (restarted)
+		trunks[t].rcv_sync = 0;
 
+	trunks[t].peer_reliable = (p->p.data[1] & ECONET_TRUNK_CAPS_RELIABLE) ? 1 : 0;
+	trunks[t].peer_epoch = epoch;
 
-		}
-		else if (regexec(&r_entry_trunk, linebuf, 6, matches, 0) == 0)
-		{
-			char tmp[300];
-			int ptr;
-			unsigned short trunknum, localport, port;
-			char hostname[300], portname[6];
-			struct addrinfo hints;
+	if (p->p.data[1] & ECONET_TRUNK_CAPS_REPLY)
+		trunk_caps_send(t, 0);
+}
 
-			for (count = 2; count < 7; count++)
-			{
-				ptr = 0;
-				while (ptr < (matches[count].rm_eo - matches[count].rm_so))
-				{
-					tmp[ptr] = linebuf[ptr + matches[count].rm_so];
-					ptr++;
-				}
-				tmp[ptr] = 0x00;
+// Unpack an aggregate datagram p, length len, which came in on trunk t, and deal with each of the frames in it
 
-				switch (count)
-				{
-					case 2: // Trunk number
-						trunknum = atoi(tmp);
-						break;
-					case 3: // Local port
-						localport = atoi(tmp);
-						strcpy(portname, tmp);
-						break;
-					case 4: // hostname
-						strcpy(hostname, tmp);
-						break;
-					case 5: // port
-						port = atoi(tmp);
-						break;	
-				}
+void trunk_agg_receive(struct __econet_packet_aun *p, int len, int t)
+{
+	static struct __econet_packet_aun frame; // Frames are copied out so that their headers are aligned
+	unsigned char *d, *end;
+	unsigned short flen;
 
-			}
+	d = (unsigned char *) p + 12;
+	end = (unsigned char *) p + len;
 
-			trunks[trunknum].head = trunks[trunknum].tail = NULL;
-			trunks[trunknum].listenport = localport;
-			memset (trunks[trunknum].adv_in, 0x0, sizeof(trunks[trunknum].adv_in));
-			memset (trunks[trunknum].adv_out, 0x0, sizeof(trunks[trunknum].adv_out));
-			memset (trunks[trunknum].filter_in, 0x0, sizeof(trunks[trunknum].filter_in));
-			memset (trunks[trunknum].filter_out, 0x0, sizeof(trunks[trunknum].filter_out));
-			memset (trunks[trunknum].xlate_src, 0xff, sizeof(trunks[trunknum].xlate_src));
-			memset (trunks[trunknum].xlate_dst, 0xff, sizeof(trunks[trunknum].xlate_dst));
+	trunks[t].agg_rx++;
 
-			if ( (trunks[trunknum].listensocket = socket(AF_INET, SOCK_DGRAM, 0)) == -1)
-			{
-				fprintf(stderr, "Failed to open listening socket for trunk %d: %s.", trunknum, strerror(errno));
-				exit(EXIT_FAILURE);
-			}
+	while ((d + 2) <= end)
+	{
+		flen = d[0] + (d[1] << 8);
+		d += 2;
 
-			service.sin_family = AF_INET;
-			service.sin_addr.s_addr = INADDR_ANY;
-			service.sin_port = htons(localport);
+		if (flen < 12 || flen > sizeof(frame) || (d + flen) > end)
+		{
+			econet_log ("TRUNK: Malformed aggregate received on trunk %d\n", t);
+			return;
+		}
 
-			if (bind(trunks[trunknum].listensocket, (struct sockaddr *) &service, sizeof(service)) != 0)
-			{
-				fprintf(stderr, "Failed to bind listening socket for trunk %d: %s.", trunknum, strerror(errno));
-				exit(EXIT_FAILURE);
-			}
+		memcpy(&frame, d, flen);
+		d += flen;
 
-			memset (&hints, 0, sizeof(hints));
-			hints.ai_family=AF_INET;
-			hints.ai_socktype=SOCK_DGRAM;
-			hints.ai_protocol=0;
-			hints.ai_flags=0;
+		trunks[t].agg_rx_frames++;
 
-			// Now set up distant host structure
-			strcpy(trunks[trunknum].hostname, hostname);
-			
-			if (getaddrinfo(hostname, portname, &hints, &(trunks[trunknum].addr)))
-			{
-				fprintf(stderr, "Cannot resolve hostname %s\n", hostname);
-				exit (EXIT_FAILURE);
-			}
+		econet_handle_trunk_frame(&frame, flen, t);
+	}
+}
 
-			trunks[trunknum].port = port;
+// Source is only used to pass to local handler to process broadcasts so we know where they came from
+int aun_send_internal (struct __econet_packet_aun *p, int len, int source)
+{
 
-			pset[pmax++].fd = trunks[trunknum].listensocket; // Fill in our poll structure
-			trunk_fd_ptr[trunks[trunknum].listensocket] = trunknum; // Map the Trunk FD array
+	int d, s, result; // d, s are pointers into network[]; result is number of bytes written or error return
+	int is_on_wirebridge = 0;
+	unsigned char sheddable; // Whether a queue which is building up delay may turn this away - see econet_queue_admit()
 
-			// Populate our advertizable structure
-			// And set the module to listen for these distant stations
+	//fprintf (stderr, "aun_send_internal type %d, dst = %3d.%3d, len = %d\n", p->p.aun_ttype, p->p.dstnet, p->p.dststn, len);
 
-			numtrunks++;
+	if (p->p.aun_ttype == ECONET_AUN_BCAST)
+		p->p.dstnet = p->p.dststn = 0xff;
+		
+	d = econet_ptr[p->p.dstnet][p->p.dststn];
+	s = econet_ptr[p->p.srcnet][p->p.srcstn];
 
-		}
-		else if (regexec(&r_entry_xlate, linebuf, 5, matches, 0) == 0)
-		{
-			unsigned short trunknum, srcnet;
-			int ptr;
-			char tmp[300];
+	// Data from anywhere but our own emulated servers can be retried by whoever sent it. Our servers' replies can't.
+	sheddable = (p->p.aun_ttype == ECONET_AUN_DATA && (s == -1 || !(network[s].type & ECONET_HOSTTYPE_TLOCAL)));
 
-			for (count = 2; count < 5; count++)
-			{
-				ptr = 0;
-				while (ptr < (matches[count].rm_eo - matches[count].rm_so))
-				{
-					tmp[ptr] = linebuf[ptr + matches[count].rm_so];
-					ptr++;
-				}
-				tmp[ptr] = 0x00;
+	// Probably need to pick up here if the destination is on a network advertised to us by a wire bridge - if so, then if the source is not on the wire as well (and not on a wire bridge either!) then we should treat it as going onto the wire. Maybe a new variable wire_bridged which we can use in the logic below. Otherwise stuff which ought to go on the wire which has come from AUN (most likely via a trunk, but it could also be a W statement) will end up heading for an unknown trunk and failing.
 
-				switch (count)
-				{
-					case 2:  // Trunk number
-						trunknum = atoi(tmp);
-						break;
-					case 3: // Our side's network number
-						srcnet = atoi(tmp);
-						break;
-					case 4: // The number we are seen as at the far end of the trunk
-						trunks[trunknum].xlate_src[srcnet] = atoi(tmp);
-						trunks[trunknum].xlate_dst[atoi(tmp)] = srcnet;
-						break;
-				}
+	if (p->p.dstnet != 0xff && wire_adv_in[p->p.dstnet] == 0xff)  // If this is a network we know is via a bridge on the wire, flag that up.
+		is_on_wirebridge = 1;
+	
+	if (d != -1) network[d].last_transaction = time(NULL);
 
-			}	
-		}
-		else if (regexec(&r_entry_fw, linebuf, 8, matches, 0) == 0)
-		{
-			int ptr;
-			char tmp[300];
+	if (s != -1)
+	{
+		network[s].rx_packets++;
+		network[s].rx_bytes += len;
+	}
 
-			unsigned short trunknum;
+	p->p.ctrl |= 0x80; // In case we're going to wire or local
+	
+	p->p.padding = 0x00;
 
-			struct __fw_entry *e;
-			
-			e = malloc(sizeof(struct __fw_entry));
+	//fprintf (stderr, "Got here 1\n");
+	if (p->p.aun_ttype != ECONET_AUN_ACK && p->p.aun_ttype != ECONET_AUN_NAK) // Don't dump acks...
+		dump_udp_pkt_aun(p, len);
 
-			e->next = NULL;
+	//fprintf (stderr, "Got here 2\n");
+	result = -1;
 
-			for (count = 2; count < 8; count++)
-			{
-				ptr = 0;
-				while (ptr < (matches[count].rm_eo - matches[count].rm_so))
-				{
-					tmp[ptr] = linebuf[ptr + matches[count].rm_so];
-					ptr++;
-				}
-				tmp[ptr] = 0x00;
+	// Perform interlock - do not send between same type of endpoints, or between trunk<->AUN/IP, and drop any RAW traffic in bridge mode
 
-				switch (count)
-				{
-					case 2: // trunknum
-						trunknum = atoi(tmp);
-						break;
-					case 3: // incoming source net
-						e->srcnet = atoi(tmp);
-						break;
-					case 4: // incoming source stn 
-						e->srcstn = atoi(tmp);
-						break;
-					case 5: // incoming dest net
-						e->dstnet = atoi(tmp);
-						break;
-					case 6: // incoming dest stn
-						e->dststn = atoi(tmp);
-						break;
-					case 7:						
-						if (!strcasecmp(tmp, "DROP"))
-							e->action = FW_DROP;
-						else	e->action = FW_ACCEPT;
+	if ((d != -1) && (s != -1)) // Both are known particular stations - i.e. not trunk
+	{
+		if ((network[d].type & ECONET_HOSTTYPE_TAUN) == 0) // Raw destination - dump it
+		{
+			if (pkt_debug) econet_debug ("ILOCK: to %3d.%3d from %3d.%3d I refuse to forward traffic to a raw destination.\n", p->p.dstnet, p->p.dststn, p->p.srcnet, p->p.srcstn);
+			econet_drops[ECONET_DROP_INTERLOCK]++;
+			return result;
+		}
+		if ((network[s].type & ECONET_HOSTTYPE_TAUN) == 0) // Raw source - dump it
+		{
+			if (pkt_debug) econet_debug ("ILOCK: to %3d.%3d from %3d.%3d I refuse to forward traffic from a raw source.\n", p->p.dstnet, p->p.dststn, p->p.srcnet, p->p.srcstn);
+			econet_drops[ECONET_DROP_INTERLOCK]++;
+			return result;
+		}
+		if ((network[d].type & ~ECONET_HOSTTYPE_TAUN) == (network[s].type & ~ECONET_HOSTTYPE_TAUN)) // Same type - dump it
+		{
+			if (pkt_debug) econet_debug ("ILOCK: to %3d.%3d from %3d.%3d I refuse to forward betwen stations of the same type.\n", p->p.dstnet, p->p.dststn, p->p.srcnet, p->p.srcstn);
+			econet_drops[ECONET_DROP_INTERLOCK]++;
+			return result;
+		}
+	}
+	else
+	{
+		if (is_on_wirebridge && source == 0) // Wire to wire
+		{
+			if (pkt_debug) econet_debug ("ILOCK: to %3d.%3d from %3d.%3d I refuse to forward wire traffic via a wire bridge\n", p->p.dstnet, p->p.dststn, p->p.srcnet, p->p.srcstn);
+			econet_drops[ECONET_DROP_INTERLOCK]++;
+			return result;
+		}
+		if (d == -1 && (s != -1) && (network[s].type & ECONET_HOSTTYPE_TDIS)) // AUN/IP source to Trunk - dump it
+		{
+			if (pkt_debug) econet_debug ("ILOCK: to %3d.%3d from %3d.%3d I refuse to forward AUN traffic to trunk\n", p->p.dstnet, p->p.dststn, p->p.srcnet, p->p.srcstn);
+			econet_drops[ECONET_DROP_INTERLOCK]++;
+			return result;
+		}
+		if (s == -1 && (d != -1) && (network[d].type & ECONET_HOSTTYPE_TDIS)) // Trunk to AUN/IP - dump it
+		{
+			if (pkt_debug) econet_debug ("ILOCK: to %3d.%3d from %3d.%3d I refuse to forward trunk traffic to AUN.\n", p->p.dstnet, p->p.dststn, p->p.srcnet, p->p.srcstn);
+			econet_drops[ECONET_DROP_INTERLOCK]++;
+			return result;
+		}
+	}
+
+	if (s != -1 && (p->p.aun_ttype == ECONET_AUN_DATA || p->p.aun_ttype == ECONET_AUN_IMM)) // Particular source
+	{
+		if (network[s].type & ECONET_HOSTTYPE_TDIS || network[s].type & ECONET_HOSTTYPE_TNAMEDPIPE) // AUN or named Pipe
+		{
+			gettimeofday(&(network[s].aun_last_rx), 0); // Flag the packet receipt time so we know when to expire the ACK / IMMREP timer
+			network[s].ackimm_seq_tosend = p->p.seq;
+		}
 
-				}	
+	}
 
-			}		
+	// Broadcasts
 
-			// Update the list
-			if (trunks[trunknum].head == NULL)
-				trunks[trunknum].head = trunks[trunknum].tail = e;
-			else
-			{	
-				trunks[trunknum].tail->next = e;
-				trunks[trunknum].tail = e;
-			}
+	if (p->p.aun_ttype == ECONET_AUN_BCAST && p->p.port != 0x9c) // We don't retransmit bridge traffic because we tinker with that elsewhere
+	{
+
+		int trunk, count;
+
+		result = len;
+
+		//fprintf (stderr, "Broadcast retransmission - len = %d, s = %d\n", len, s);
 
+		// Dump it locally if it wasn't local
+		if ((s != -1 && (!(network[s].type & ECONET_HOSTTYPE_TLOCAL))) || (s == -1)) // Known source and it wasn't a local emulator,  or unknown source
+		{
+			//fprintf (stderr, "Sending broadcast to local\n");
+			econet_handle_local_aun(p, len, source);
 		}
-		else		
+
+		// Now dump it to all the named pipes we can find
+
+		for (count = 0; count < stations;  count++)
 		{
-			fprintf(stderr,    "Bad configuration line: %s\n", linebuf);
-			exit(EXIT_FAILURE);
+			if ((network[count].type & ECONET_HOSTTYPE_TNAMEDPIPE) && (s != -1 && s != count) && (network[count].pipewritesocket != -1)) // Is a named pipe, and not the one the packe came from
+				econet_pipe_write(network[count].pipewritesocket, p, len);
+
 		}
-	}
 
-	regfree(&r_entry_wire);
-	regfree(&r_entry_server);
-	regfree(&r_entry_local);
-	regfree(&r_entry_distant);
-	regfree(&r_entry_trunk);
-	regfree(&r_entry_xlate);
-	regfree(&r_entry_fw);
-	regfree(&r_entry_printhandler);
-	
-	fclose(configfile);
+		// if it didn't come from the wire, put it on the wire
+		if (source != 0)	
+		{
+			//fprintf (stderr, "Sending broadcast to wire\n");
+			econet_wire_send_now(p, len); // Was len+12
+		}
 
-	stations = networkp;
+		// And on every trunk it didn't come from
+	
+		for (trunk = 1; trunk < 256; trunk++)
+		{
+			if (trunks[trunk].listensocket >= 0 && trunk != source)
+			{	//fprintf (stderr, "Sending broadcast to trunk %d\n", trunk);
+				aun_trunk_send_internal (p, len, trunk);
+			}
+		}
 
-		
-} 
+	}
 
-short fs_get_server_id(unsigned char net, unsigned char stn)
-{
-	short result = -1;
+	// If trunk destination, the trunk send routine does NAT and works out which trunk
 
-	if (network[econet_ptr[net][stn]].fileserver_index != -1)
-		result = network[econet_ptr[net][stn]].fileserver_index;
+	// Now, where's it going?
 
-	return result;
-}
+	else if (p->p.aun_ttype == ECONET_AUN_BCAST || (d != -1 && (network[d].type & ECONET_HOSTTYPE_TLOCAL))) // Probably need to forward broadcasts received off the wire to AUN/IP hosts on same net, but we don't at the moment; We catch broadcasts here again because we don't process BRIDGE broadcasts above, so they need to go to the local handler
+	{
+		econet_handle_local_aun(p, len, source);
+		// probably need to forward broadcasts to trunks / wire depending on source - TODO
+		result = len;
+	}
+	else if (!is_on_wirebridge && d == -1) // Trunk send (we will now send broadcasts on trunks as well)
+	{
+		p->p.ctrl &= 0x7f; // Strip high bit from control an AUN transmission
 
-// Returns local/wire machine sequence number and increments it
-uint32_t get_local_seq(unsigned char net, unsigned char stn)
-{
+		if (s == -1) // Trunk to trunk - straight out
+			result = aun_trunk_send (p, len);
+		else
+			result = aun_trunk_enqueue (p, len, sheddable);
+	}
+	else if (is_on_wirebridge || network[d].type & ECONET_HOSTTYPE_TWIRE) // Wire - and we prevent material received from the wire going back onto the wire
+	{
+		// Is it a wired fileserver we might want to know about? To cope with wired filservers that are via wired bridges, we probably need a separate list of wired fileservers now - TODO
 
-	return (network[econet_ptr[net][stn]].seq += 4);
+		if (!is_on_wirebridge && (network[d].type & ECONET_HOSTTYPE_TWIRE) && (p->p.port == 0x99) && (!(network[d].is_wired_fs))) // Fileserver traffic on a wire station
+		{
+			network[d].is_wired_fs = 1;
+			econet_log ("  DYN:%12s             Station %d.%d identified as wired fileserver\n", "", p->p.dstnet, p->p.dststn);
+		}
 
-}
+		// Update this even if we don't get to transmit - what's the harm?
+		if (!is_on_wirebridge && p->p.aun_ttype == ECONET_AUN_IMM)
+			network[d].last_imm_seq_sent = p->p.seq;
 
-void dump_pkt_data(unsigned char *a, int len, unsigned long start_index)
-{
-	int count;
-	int packetsize = len;
+		if (econet_enqueue(p, len, sheddable))
+			result = len;
+		else	result = 0; // Full, or pool exhausted
 
-	count = 0;
-	while (count < packetsize)
+	}
+	else if ((network[d].type & ECONET_HOSTTYPE_TNAMEDPIPE)) // Named pipe client
 	{
-		char dbgstr[200];
-		char tmpstr[200];
-		int z;
-		sprintf (dbgstr, "%08lx ", count + start_index);
-		z = 0;
-		while (z < 16)
+		if (network[d].pipewritesocket != -1)
+			result = econet_pipe_write(network[d].pipewritesocket, p, len);
+		else	if (pkt_debug) econet_debug ("PIPE : Pipe write socket not open\n");
+	}
+	else if (network[d].type & ECONET_HOSTTYPE_TDIS)
+	{
+		p->p.ctrl &= 0x7f; // Strip high bit from control an AUN transmission
+
+		// We shouldn't see ACK or NAK here because they are caught on input and processed.
+
+		if (p->p.aun_ttype != ECONET_AUN_BCAST) // Ignore broadcasts to AUN for now
 		{
-			if ((count+z) < packetsize)
+			if (econet_queue_admit(ECONET_QUEUE_AUN, &(network[d].aun_codel), network[d].aun_queue_len, network[d].aun_queue_bytes, len, sheddable) && econet_general_enqueue(&(network[d].aun_head), &(network[d].aun_tail), p, len))
 			{
-				sprintf(tmpstr, "%02x ", *(a+count+z)); 
-				strcat(dbgstr, tmpstr);
+				result = len;
+				aun_queued++;
+				network[d].aun_queue_len++;
+				network[d].aun_queue_bytes += len;
+				econet_queue_publish(ECONET_QUEUE_AUN, &(network[d].aun_codel), network[d].aun_queue_len, network[d].aun_queue_bytes);
+				econet_aun_ready(d);
 			}
-			else	strcat(dbgstr, "   ");
-			z++;
+			else	result = 0; // Full, or pool exhausted
 		}
+		else result = len;
+	}
+	else // Unknown destination type
+	{
+		econet_log ("ERROR: to %3d.%3d from %3d.%3d Unknown destination\n", p->p.dstnet, p->p.dststn, p->p.srcnet, p->p.srcstn);
+		econet_drops[ECONET_DROP_NOROUTE]++;
+	}
 
-		z = 0;
-		while (z < 16)
+	if (d != -1 && p->p.aun_ttype != ECONET_AUN_BCAST)
+	{
+		if (result == len)
 		{
-			if ((count+z) < packetsize)
-			{
-				sprintf(tmpstr, "%c", (*(a+count+z) >= 32 && *(a+count+z) < 127) ? *(a+count+z) : '.');
-				strcat(dbgstr, tmpstr);
-			}
-			z++;
+			network[d].tx_packets++;
+			network[d].tx_bytes += len;
 		}
+		else	network[d].drops++;
+	}
 
-		fprintf(stderr, "%s\n", dbgstr);		
-
-		count += 16;
+	return result;
 
-	}
-	if (start_index == 0)
-		fprintf (stderr, "%08x --- END ---\n", packetsize);
 }
 
-void dump_udp_pkt_aun(struct __econet_packet_aun *a, int s)
+// Stub function to wrap around aun_send_internal for compatibility with code which does not send broadcasts to be handled by the local bridge handler
+int aun_send (struct __econet_packet_aun *p, int len)
 {
+	if (econet_thread >= ECONET_THREAD_SERVICE) // From a server - the network thread does the sending
+		return econet_service_send(p, len);
 
-	int count = 0;
-	int packetsize = s;
-	char ts[30];
-	int src, dst;
-	char src_c, dst_c;
+	return aun_send_internal(p, len, -1);
+}
 
-	if (pkt_debug == 0) return;
+// Map a sockaddr to a network[] entry - used to find source station of UDP packets
+// Returns 0xffff if not founD
 
-	src = econet_ptr[a->p.srcnet][a->p.srcstn];
-	dst = econet_ptr[a->p.dstnet][a->p.dststn];
+// A dynamically allocated station may have idled out. If it has, forget its address now, so that its
+// network[] entry is free for re-use; if not, look again when it would next be due to.
 
-#define sd_sift(x,y) {\
-	if ((x) == -1) \
-		y = 'T'; \
-	else if (network[(x)].type & ECONET_HOSTTYPE_TLOCAL)\
-		y = 'L';\
-	else if (network[(x)].type & ECONET_HOSTTYPE_TWIRE)\
-		y = 'E';\
-	else if (network[(x)].type & ECONET_HOSTTYPE_TNAMEDPIPE)\
-		y = 'N';\
-	else\
-		y = 'A';\
+void econet_dynamic_timer_expired(int index)
+{
+	time_t idle;
+
+	idle = time(NULL) - network[index].last_transaction;
+
+	if (idle < ECONET_LEARNED_HOST_IDLE_TIMEOUT)
+	{
+		econet_timer_arm(&(network[index].idle_timer), (ECONET_LEARNED_HOST_IDLE_TIMEOUT - idle) * 1000);
+		return;
 	}
 
-	sd_sift(src, src_c);
-	sd_sift(dst, dst_c);
-	
-	if (wire_adv_in[a->p.srcnet]) src_c = 'W';
-	if (wire_adv_in[a->p.dstnet]) dst_c = 'W';
+	if (pkt_debug) econet_debug ("  DYN: Station %3d.%3d idle - released\n", network[index].network, network[index].station);
 
-	if ((a->p.dstnet == 0xff && a->p.dststn == 0xff))
-		dst_c = 'B';
+	aun_hash_remove(network[index].s_addr, network[index].port, index);
+}
 
-	if (a->p.srcstn == 0) // Bridge query reply
-		src_c = 'Z';
+int econet_find_source_station (struct sockaddr_in *src_address)
+{
 
-	if (dumpmode_brief)
+	int b, index;
+
+	if ((b = aun_hash_find(src_address->sin_addr, ntohs(src_address->sin_port))) == -1)
 	{
-		fprintf (stderr, "%c-->%c: to %3d.%3d from %3d.%3d port 0x%02x ctrl 0x%02x seq 0x%08x len 0x%04x ", src_c, dst_c, a->p.dstnet, a->p.dststn, a->p.srcnet, a->p.srcstn, a->p.port, a->p.ctrl, le32toh(a->p.seq), s-12);
-		for (count = 0; count < ((s-12) < 40 ? (s-12) : 40); count++)
-			fprintf (stderr, "%02x %c ", a->p.data[count], (a->p.data[count] < 32 || a->p.data[count] > 126) ? '.' : a->p.data[count]);
-		fprintf (stderr, "%s\n", (s-12) < 40 ? "" : " ...");
-			
+		aun_hash_misses++;
+		return 0xffff;
 	}
-	else
+
+	index = aun_hash[b].index;
+
+	if (network[index].is_dynamic && (network[index].last_transaction <= (time(NULL) - ECONET_LEARNED_HOST_IDLE_TIMEOUT))) // Dynamic host which has idled out - forget it
 	{
-		fprintf (stderr, "\n%08x --- PACKET %s TO %s ---\n", packetsize, (src_c == 'T' ? "TRUNK" : (src_c == 'E' ? "ECONET" : (src_c == 'L' ? "LOCAL" : (src_c == 'W' ? "WIRE BRIDGED" : (src_c == 'Z' ? "BRIDGE" : "AUN"))))),
-			(dst_c == 'T' ? "TRUNK" : (dst_c == 'E' ? "ECONET" : (dst_c == 'L' ? "LOCAL" : (dst_c == 'W' ? "BDGED" : "AUN")))));
-		switch (a->p.aun_ttype)
-		{
-			case ECONET_AUN_DATA:
-				strcpy(ts, "DATA");
-				break;
-			case ECONET_AUN_IMM:
-				strcpy(ts, "IMMEDIATE");
-				break;
-			case ECONET_AUN_IMMREP:
-				strcpy(ts, "IMMEDIATE REPLY");
-				break;
-			case ECONET_AUN_BCAST:
-				strcpy(ts, "BROADCAST");
-				break;
-			case ECONET_AUN_ACK:
-				strcpy(ts, "ACKNOWLEDGMENT");
-				break;
-			case ECONET_AUN_NAK:
-				strcpy(ts, "NAK");
-				break;
-			default:
-				strcpy(ts, "UNKNOWN");
-		}
+		aun_hash_remove(src_address->sin_addr, ntohs(src_address->sin_port), index);
+		aun_hash_misses++;
+		return 0xffff;
+	}
 
-		if (a->p.aun_ttype == ECONET_AUN_DATA && (a->p.port == 0x00) && (a->p.ctrl == 0x85))
-			strcpy(ts, "IMMEDIATE - SPECIAL 0x85");
+	aun_hash_hits++;
+
+	return index;
+}
+
+// Find which trunk a given network is down
+short trunk_find (unsigned char net)
+{
+
+	return trunk_route[net];
+
+}
+
+// Trunk address translation and firewalling
+// dir = 0 means inbound on a trunk
+// dir = 1 means outbound on a trunk
+// Return is FW_ACCEPT; FW_DROP
+int trunk_xlate_fw(struct __econet_packet_aun *p, int trunk, unsigned char dir)
+{
+
+	struct __fw_compiled *fw;
+
+	int ret = FW_ACCEPT;
+
+	if (dir == 1) // Outbound
+	{
+		if ((p->p.dstnet != p->p.srcnet) && (p->p.srcnet == 0)) // If traffic coming from net 0 (as it will be until AUN devices have a "default route" system), and we are not sending to dstnet which is the same as srcnet, substitute the local network number. Note that this allows a trunk to carry net 0 from one wired econet to another.
+			p->p.srcnet = localnet;
+
+		// Next do address translation
+
+		if (trunks[trunk].xlate_src[p->p.srcnet] != 0xff) // Translate our network number if there is a translation entry
+			p->p.srcnet = trunks[trunk].xlate_src[p->p.srcnet];
+	}
+	else // Inbound - do firewalling here (no firewalling on outbound traffic)
+	{
 
-		fprintf (stderr, "         --- AUN TYPE %s\n", ts);
+		if (trunks[trunk].xlate_dst[p->p.dstnet] != 0xff) // Translate inbound
+			p->p.dstnet = trunks[trunk].xlate_dst[p->p.dstnet];
 
-		if (a->p.aun_ttype != ECONET_AUN_BCAST)
-			fprintf (stderr, "         DST Net/Stn 0x%02x/0x%02x\n", a->p.dstnet, a->p.dststn);
+		// Convert to net 0 if it is our local network number
 
-		fprintf (stderr, "         SRC Net/Stn 0x%02x/0x%02x\n", a->p.srcnet, a->p.srcstn);
-		fprintf (stderr, "         PORT/CTRL   0x%02x/0x%02x\n", a->p.port, a->p.ctrl);
-	
-		//fprintf (stderr, "         SEQ         0x%08X\n", a->p.seq);
-		fprintf (stderr, "         SEQ         0x%08" PRIx32 "\n", a->p.seq);
+		if (p->p.dstnet == localnet) p->p.dstnet = 0;
 
-		dump_pkt_data((unsigned char *) &(a->p.data), s-12, 0);
+		// Firewall - see trunk_fw_compile()
 
-	}
+		if ((fw = trunks[trunk].fw))
+		{
+			ret = fw->verdict[p->p.srcnet][p->p.dstnet];
 
-}
+			if (ret >= FW_STNLIST) // Station numbers matter for this pair of networks
+			{
+				struct __fw_stnlist *l;
+				unsigned short r;
 
-/* Receive from a particular UDP socket */
-int udp_receive(int fd, void *a, int maxlen, struct sockaddr * restrict addr)
-{
-	int  r;
-	socklen_t addrlen;
+				l = &(fw->lists[ret - FW_STNLIST]);
+				ret = l->dflt;
 
-	addrlen = sizeof(struct sockaddr);
+				for (r = 0; r < l->numrules; r++)
+				{
+					if (	((l->rules[r].srcstn == 255) || (l->rules[r].srcstn == p->p.srcstn))
+					&&	((l->rules[r].dststn == 255) || (l->rules[r].dststn == p->p.dststn))
+					)
+					{
+						ret = l->rules[r].action;
+						break;
+					}
+				}
+			}
+		}
+					
+	}
 
-	r = recvfrom(fd, a, maxlen, 0, addr, (socklen_t *) &addrlen);
+	if (pkt_debug && (ret == FW_DROP)) // log it
+		econet_debug ("FWALL: to %3d.%3d from %3d.%3d FORBIDDEN\n", p->p.dstnet, p->p.dststn, p->p.srcnet, p->p.srcstn);
+	
+	return ret;
 
-	if (r<0)
-		fprintf (stderr, "Error %d (%s) on receiving UDP from socket %d\n", errno, strerror(errno), fd);
+}
 
-	return r;
+// Returns 1 if net.stn is either AUN/IP or trunk (use is_on_trunk() to work out whether it's on a trunk)
 
+unsigned short is_aun(unsigned char net, unsigned char stn)
+{
+	if ((econet_ptr[net][stn] == -1) || (network[econet_ptr[net][stn]].type & ECONET_HOSTTYPE_TDIS))
+		return 1;
+		
+	return 0;
 }
 
-char * econet_strtxerr(int e)
+// Returns 1 if net.stn isn't in network[] - i.e. if it's anywhere it's on a trunk AND we can find a trunk that appears to advertise it the relevant network
+static inline unsigned short is_on_trunk(unsigned char net, unsigned char stn)
 {
-	switch (-1 * e)
-	{
-		case ECONET_TX_SUCCESS: return (char *)"No error"; 
-		case ECONET_TX_BUSY: return (char *)"Module busy";
-		case ECONET_TX_JAMMED: return (char *)"Line jammed";
-		case ECONET_TX_HANDSHAKEFAIL: return (char *)"Handshake failure";
-		case ECONET_TX_NOCLOCK: return (char *)"No clock";
-		case ECONET_TX_UNDERRUN: return (char *)"Transmit underrun";
-		case ECONET_TX_TDRAFULL: return (char *)"Data register full on tx";
-		case ECONET_TX_NOIRQ: return (char *)"No IRQ received to being/continue transmit";
-		case ECONET_TX_NOCOPY: return (char *)"Could not copy packet from userspace";
-		case ECONET_TX_NOTSTART: return (char *)"Transmission never begun";
-		case ECONET_TX_COLLISION: return (char *)"Collision during transmission";
-		case ECONET_TX_INPROGRESS: return (char *)"Transmission in progress";
-		default: return (char *)"Unknown error";
-	}	
-
+	return ((econet_ptr[net][stn] == -1) && (trunk_route[net] > 0));
 }
 
-void aun_acknowledge (struct __econet_packet_aun *a, unsigned char ptype)
-{
+// Called by the fileserver before it hands over the next packet of a bulk transfer from srcnet.srcstn to dstnet.dststn.
+// Returns 1 if the queue it would go on has room for it - see econet_queue_has_room(). If not, the fileserver holds
+// on to it and tries again later, rather than have it dropped. This runs on the server threads, so it goes only by
+// what the network thread has published (econet_queue_publish(), econet_queue_route_publish()) and by network[] and
+// econet_ptr[], which don't change once the config is read.
 
-	struct __econet_packet_aun reply;
-	int ptr;
+int econet_queue_room(unsigned char srcnet, unsigned char srcstn, unsigned char dstnet, unsigned char dststn)
+{
+	int d;
+	short route;
 
-	reply.p.aun_ttype = ptype;
-	reply.p.port = a->p.port;
-	reply.p.ctrl = a->p.ctrl;
-	reply.p.padding = 0x00;
-	reply.p.seq = a->p.seq;
-	reply.p.srcnet = a->p.dstnet;
-	reply.p.srcstn = a->p.dststn;
-	reply.p.dstnet = a->p.srcnet;
-	reply.p.dststn = a->p.srcstn;
+	if (econet_thread >= ECONET_THREAD_SERVICE && econet_ring_room(&(services[econet_thread - ECONET_THREAD_SERVICE].out)) < ECONET_SVC_HEADROOM) // The network thread hasn't caught up with what the servers have sent yet
+		return 0;
 
-	econet_write_general(&reply, 12);
+	d = econet_ptr[dstnet][dststn];
 
-	ptr = econet_ptr[a->p.srcnet][a->p.srcstn]; // src used here because that's the src in the packet we are acknowledging, so the src is actually the station we're sending the ack *to* - so it's that station's tracker we need to look at
-		
-	if (ptr != -1 && (network[ptr].type & ECONET_HOSTTYPE_TDIS) && reply.p.seq == network[ptr].ackimm_seq_tosend)
+	if (d == -1 && (route = atomic_load_explicit(&(queue_route[dstnet]), memory_order_relaxed)) != ECONET_QUEUE_ROUTE_WIRE) // Trunk
 	{
-		network[ptr].ackimm_seq_tosend = 0; // We have just acknowledged a packet from this machine - clear off the tracker
-		if (queue_debug) fprintf (stderr, "QUEUE: Clearing ACK tracker on network[%d] - seq 0x%08X\n", ptr, network[ptr].ackimm_seq_tosend);
+		if (route < 0)
+			return 1; // Nowhere to go - let it fail
+		return !atomic_load_explicit(&(trunks[route].q_codel.full), memory_order_relaxed);
 	}
 
+	if (d == -1 || (network[d].type & ECONET_HOSTTYPE_TWIRE)) // Wire, or via a bridge on the wire
+		return !atomic_load_explicit(&(wire_flows[econet_wire_flow(srcnet, srcstn, dstnet, dststn)].codel.full), memory_order_relaxed);
+
+	if (network[d].type & ECONET_HOSTTYPE_TDIS)
+		return !atomic_load_explicit(&(network[d].aun_codel.full), memory_order_relaxed);
+
+	return 1; // Local or named pipe - nothing queued
 }
 
-// Called when we receive a &80 bridge instruction from somewhere
-// Source will be set to 0 if wire (shouldn't be defining trunk 0), -1 if this is a self-initiated reset (e.g. on startup), otherwise a trunk number
-// p is a pointer to the incoming reset packet, and len is its data length
-// If this is self-originated, it is treated as a bridge reset (&80), otherwise it's a bridge update (&81) or reset (&80) depending on what is in *p->p.ctrl
+// Add fd to the epoll set, calling handler when it has traffic. Level triggered, so a handler should take one batch
+// each time round the main loop and leave the rest, which will be offered again next time - that keeps things fair
+// between stations. For a UDP socket a batch is everything one recvmmsg() brings in, and the handler must hand all
+// of it out (keep going while udp_rx_pending() says there is more) before it returns, since the batch buffer is
+// shared between sockets. For a ring it is whatever is on the ring when the handler looks.
 
-void econet_bridge_process(struct __econet_packet_aun *p, int len, int source)
+void econet_watch_fd(int fd, econet_fd_handler handler)
 {
 
-	short counter;
-	unsigned char is_reset;
-	struct __econet_packet_aun out; // Packet structure for the packets we will send out
+	struct epoll_event ev;
 
-	if (!bridge_query || !localnet) // Exit if we are not briding
-		return;
+	ev.events = EPOLLIN;
+	ev.data.fd = fd;
 
-	if (source == -1)
-		is_reset = 1;
-	else
-		is_reset = (p->p.ctrl == 0x80 ? 1 : 0);
+	fd_handlers[fd] = handler;
 
-	if (pkt_debug)
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1)
 	{
-		fprintf (stderr, "B-->B: Receive bridge %s from %s ", (is_reset ? "reset " : "update"), (source == -1 ? "internal" : (source == 0 ? "wire" : "trunk")));
-
-		if (source > 0) fprintf (stderr, "%d ", source);
-
-		if (source >= 0)
-		{
-			fprintf (stderr, "with nets ");
-			for (counter = 0; counter < len-12; counter++)
-				fprintf (stderr, "%3d ", p->p.data[counter]);
-		}
-
-		fprintf (stderr, "\n");
+		fprintf (stderr, "Unable to add fd %d to epoll set: %s\n", fd, strerror(errno));
+		exit(EXIT_FAILURE);
 	}
 
-	if (is_reset)
-	{
-
-		// First the ones for the wire
-	
-		memset(&wire_adv_in, 0, sizeof(wire_adv_in));
-		memcpy(&wire_adv_out, &wire_advertizable, sizeof(wire_advertizable));
-
-		// Then the trunks
-	
-		for (counter = 1; counter < 256; counter++)
-		{
-			if (trunks[counter].listensocket >= 0)
-			{
-				memset(&(trunks[counter].adv_in), 0, sizeof(trunks[counter].adv_in));
-				memset(&(trunks[counter].adv_out), 0, sizeof(trunks[counter].adv_out)); // This gets populated with local advertizables subject to nat lower down
-			}
-		}
+}
 
-		nativebridgenet = 0; 
+// Per-descriptor handlers, called from the main loop when epoll says the fd is readable (or has hung up)
 
-		// If we have some networks advertizable to the wire, set our local bridge net to the first one we find that isn't the local network
-		for (counter = 1; counter < 255; counter++)
-		{
-			if (wire_advertizable[counter] == 0xff && (counter != localnet))
-			{
-				nativebridgenet = counter;
-				break;
-			}
-		}
-	}
-	
-	// Extract the advertised packets, filtering as we go
+// Traffic off the Econet wire - packet rx, r bytes, which the wire thread has read
+void econet_wire_received(struct __econet_packet_aun *rx, int r)
+{
+	if (r < 12)
+		econet_log ("Runt packet length %d received off Econet wire\n", r);
 
-	for (counter = 0; counter < len-12; counter++) 
+	if (!wire_adv_in[rx->p.srcnet]) // This was not a network advertised inbound on the wire - i.e. we should have a network[] entry for it
 	{
-		if (source == 0) // Wire origin
-			wire_adv_in[p->p.data[counter]] = 0xff ^ wire_filter_in[p->p.data[counter]]; // Since the filter_in entry for a network will be 0xff if we are filtering it, this will result in 0 if the network is filtered.	
-		else if (source > 0) // Not wire, but not self-originated either. (If self-originated, there will be no *p to look at)
-		{
-			trunks[source].adv_in[p->p.data[counter]] = 0xff ^ trunks[source].filter_in[p->p.data[counter]]; // Since the filter_in entry for a network will be 0xff if we are filtering it, this will result in 0 if the network is filtered.	
-			if (!nativebridgenet) // There wasn't anything we were already advertizing to the wire - so use this as our native network
-				nativebridgenet = (0xff ^ trunks[source].filter_in[p->p.data[counter]]) ? p->p.data[counter] : 0;  // If this network wasn't filtered, nativebridgenet is set to it. Otherwise 0 (which is what it was before)
-		}
-	}
+		rx->p.seq = get_local_seq(rx->p.srcnet, rx->p.srcstn);
 
-	// Now update the outbound advertizement tables
+		if (rx->p.aun_ttype == ECONET_AUN_IMMREP) // Fudge - assume the immediate we have received is a reply to the last one we sent. Maybe make this more intelligent.
+			rx->p.seq = network[econet_ptr[rx->p.srcnet][rx->p.srcstn]].last_imm_seq_sent;
 
-	// Wire first - go through each trunk and pick up its inbound advert, and combine it with what we were advertizing anyway
-	// Remove any networks from outbound advert that were in the inbound advert *from* the wire
+		network[econet_ptr[rx->p.srcnet][rx->p.srcstn]].last_transaction = time(NULL);
 
-	for (counter = 0; counter < 255; counter++)
+	}
+	else
 	{
-		if (trunks[counter].listensocket >= 0) // Active trunk
-		{
-			short net;
-			
-			for (net = 1; net < 255; net++)
-				if ((trunks[counter].adv_in[net] == 0xff) && (wire_adv_in[net] != 0xff) && (wire_filter_out[net] != 0xff)) // Copy trunk adverts to wire unless either (i) the wire was advertizing those networks to us, or (ii) there was an outbound filter on the wire advertizement for this network
-					wire_adv_out[net] = 0xff;
-		}
+		// Need to track sequence and immediate sequence and last transaction somehow... TODO
 
 	}
 
-	// Now rebuild the econet_stations structure
+	// Fudge the AUN type on port 0 ctrl 0x85, which is done as some sort of weird special 4 way handshake with 4 data bytes on the Scout - done as "data" and the kernel module works out that the first 4 bytes in the packet go on the scout and the rest go in the 3rd packet in the 4-way
 
-	// Update for all local servers, AUN stations, and all stations in nets advertized out to the wire, together with nativebridgenet.0, and 255.255 for broadcasts
+	if (rx->p.aun_ttype == ECONET_AUN_IMM && rx->p.ctrl == 0x85) // Fudge-a-rama. This deals with the fact that NFS & ANFS in fact do a 4-way handshake on immediate $85, but with 4 data bytes on the "Scout". Those four bytes are put as the first four bytes in the data packet, and a receiving bridge will strip them off, detect the ctrl byte, and do a 4-way with the 4 bytes on the Scout, and the remainder of the data in the "data" packet (packet 3/4 in the 4-way). This enables things like *remote, *view and *notify to work.
+		rx->p.aun_ttype = ECONET_AUN_DATA;
+
+	// This will be from a known wire station or a station from over a bridge, flag priority output if need be (note - there is a concurrency issue with other wire stations since they have their own priority flags. maybe change that to a global wire priority?)
 	
-	ECONET_INIT_STATIONS(econet_stations);
-	ECONET_SET_STATION(econet_stations, 255, 255); // Broadcast
-	if (nativebridgenet)
-		ECONET_SET_STATION(econet_stations, nativebridgenet, 0); // Local bridge handshakes // Can't do this without a far side network
+	// Flag broadcasts incase the module isn't doing it
+	if (rx->p.dstnet == 0xff && rx->p.dststn == 0xff)
+		rx->p.aun_ttype = ECONET_AUN_BCAST;
 
-	// First, known AUN & local stations
-	for (counter = 0; counter < stations; counter++)
-		if ((network[counter].type & ECONET_HOSTTYPE_TDIS) || (network[counter].type & ECONET_HOSTTYPE_TNAMEDPIPE) || (network[counter].type & ECONET_HOSTTYPE_TLOCAL)) // NB because our dynamic network is preallocated in here, this catches the dynamic net too. Also add named pipe stations in
-		{
-			//fprintf (stderr, "Adding station %3d.%3d\n", network[counter].network, network[counter].station);
-			ECONET_SET_STATION(econet_stations, network[counter].network, network[counter].station);
-		}
+	aun_send_internal (rx, r, 0);
 
-	// Then everything we are advertising out as a bridge (except stn 0 & 255)
-	for (counter = 1; counter < 256; counter++)
-	{
-		unsigned char stn;
-		
-		if (wire_adv_out[counter] == 0xff) // Outbound advert
-			for (stn = 1; stn < 255; stn++)
-				ECONET_SET_STATION(econet_stations, counter, stn);
-	}
+}
 
-	// Update the station set
+// What the wire thread has passed back - packets off the wire, and how transmissions went
 
-	ioctl(econet_fd, ECONETGPIO_IOC_SET_STATIONS, &econet_stations);
+void econet_handle_wire_ring(int fd, uint32_t events)
+{
+	struct econet_ring_rec *rec;
 
-	// Now update each trunk's outbound advert with what's come in on every other trunk, sifting out any loops (i.e. don't advertize back to a trunk that which it advertized to us). Do NAT here.
-	for (counter = 0; counter < 255; counter++)
+	econet_ring_woken(&wire_rx_ring);
+
+	while ((rec = econet_ring_peek(&wire_rx_ring)))
 	{
+		if (rec->type == ECONET_WIRE_RX)
+			econet_wire_received((struct __econet_packet_aun *) (rec + 1), rec->len);
+		else if (rec->type == ECONET_WIRE_DONE)
+			econet_wire_done(rec->val, rec->err, *((uint32_t *) (rec + 1)));
 
-		short other; // Loop counter for other trunks
+		econet_ring_release(&wire_rx_ring, rec);
+	}
+}
 
-		if (trunks[counter].listensocket >= 0) // Active trunk
-		{
-			// The wire & local stuff will already be there because we copied trunk_advertizable into it. BUT we need to do NAT on it. TODO.
+// Packets from the servers on the service thread or a fileserver worker - whichever fd belongs to
 
-			for (other = 1; other < 255; other++)
-			{
-				if (trunk_advertizable[other] || wire_adv_in[other]) // Copy what's in trunk_advertizable, and what we've had from wire adverts
-				{
-					unsigned char xlated;
+void econet_handle_service_ring(int fd, uint32_t events)
+{
+	int svc;
 
-					xlated = other;
+	for (svc = 0; svc <= fs_workers && services[svc].out.efd != fd; svc++);
 
-					if (trunks[counter].xlate_src[other] != 0xff)
-						xlated = trunks[counter].xlate_src[other];
+	if (svc > fs_workers)
+		return;
 
-					trunks[counter].adv_out[xlated] = 0xff ^ trunks[counter].filter_out[xlated]; // Apply filter to translated net
+	econet_ring_woken(&(services[svc].out));
 
-				}
+	if (!econet_timer_armed(&(services[svc].retry_timer))) // Otherwise something is being held, and the timer will come back for it
+		econet_service_drain(svc);
+}
 
-			}
+// Traffic arriving on a trunk
+void econet_handle_trunk_datagram(int fd)
+{
 
-			// Now the other trunks. Note, we filter the outbound advert here but we need do no NAT here because these are advertizements from other trunks
+	struct __econet_packet_aun *p;
 
-			for (other = 0; other < 255; other++)
-			{
-				if (other != counter) // Don't copy from same trunk!
-				{
-					if (trunks[other].listensocket >= 0)
-					{
-						unsigned char net;
-			
-						for (net = 1; net < 255; net++)
-							if ((trunks[other].adv_in[net] == 0xff) && (trunks[counter].adv_in[net] != 0xff) && (trunks[counter].filter_out[net] != 0xff)) // Other trunk advertising net 'n', and it wasn't advertized to us on this trunk, advertize it out, unless it was filtered outbound
-								trunks[counter].adv_out[net] = 0xff;
+	int r, count, from_found = 0xffff;
 
-					}	
+	r = udp_receive (fd, &p, 0, (struct sockaddr * restrict) &src_address);
 
-				}
+	if (r < 0) return; // Debug produced in udp_receive
 
-			}
-				
-		}
+	// Which peer did it turn up from? Each trunk has its own listening socket, so there is only one peer it can legitimately be
 
-	}
+	count = trunk_fd_ptr[fd];
 
-	// Now spit out a broadcast with port &9C and ctrl byte as appropriate
+	if (	((((struct sockaddr_in *) (trunks[count].addr->ai_addr))->sin_addr.s_addr) == src_address.sin_addr.s_addr) // The peer we know about on this socket
+	&&	((((struct sockaddr_in *) (trunks[count].addr->ai_addr))->sin_port) == (src_address.sin_port))
+	)
+		from_found = count;
 
-	// First to the wire
-	// Unless the source *was* the wire or it was a reset. So if this was a reset, or source > 0 (because wire is 0) then spit it out
-	if (nativebridgenet && (is_reset || (source > 0))) // Can't send this unless we have *something* on the far side of local...
+	if (from_found == 0xffff) // Traffic arrived on a trunk but either not from someone friendly, or it was but not on a network we think should be arriving on that trunk
 	{
+		// Dump it.
+		trunk_unknown_drops++;
+		econet_log ("TRUNK: to %3d.%3d from %3d.%3d received on trunk %04X from unrecognized peer %s:%d\n", p->p.dstnet, p->p.dststn, p->p.srcnet, p->p.srcstn, count, inet_ntoa(src_address.sin_addr), ntohs(src_address.sin_port));
+		return;
+	}
 
-		unsigned char net, count;
-
-		out.p.srcnet = nativebridgenet;
-		out.p.srcstn = 0;
-		out.p.dstnet = out.p.dststn = 255;
-		out.p.port = 0x9c;
-		out.p.ctrl = (is_reset ? (source == 0 ? 0x81 : 0x80) : 0x81); // Send this as an update if the source was the wire, otherwise as an update
-		out.p.aun_ttype = ECONET_AUN_BCAST;
-		out.p.seq = (local_seq += 4);
-
-		count = 0;
-
-		if (pkt_debug) fprintf (stderr, "B-->B: Sending bridge %s to   wire    with nets ", (is_reset ? "reset " : "update"));
+	if (p->p.aun_ttype == ECONET_TRUNK_RELIABLE)
+		trunk_rel_receive(p, r, from_found);
+	else if (p->p.aun_ttype == ECONET_TRUNK_RACK)
+		trunk_rel_ack_receive(p, r, from_found);
+	else if (p->p.aun_ttype == ECONET_TRUNK_AGGREGATE)
+		trunk_agg_receive(p, r, from_found);
+	else
+		econet_handle_trunk_frame(p, r, from_found);
 
-		for (net = 1; net < 255; net++)
-			if (wire_adv_out[net] == 0xff)
-			{
-				out.p.data[count++] = net;
-				if (pkt_debug) fprintf (stderr, "%3d ", net);
-			}
+}
 
-		if (pkt_debug) fprintf (stderr, "\n");
+// One frame p, length r, from trunk from_found - either a datagram on its own or out of an aggregate
+void econet_handle_trunk_frame(struct __econet_packet_aun *p, int r, int from_found)
+{
+
+	static struct __econet_packet_aun unpacked;
+	unsigned char policy;
 
-		econet_write_wire (&out, count+12, 0);
+	if (p->p.aun_ttype == ECONET_TRUNK_COMPRESSED)
+	{
+		if ((r = trunk_decompress(from_found, p, r, &unpacked)) < 0)
+			return;
+		p = &unpacked;
 	}
 
-	// Then to the trunks
+	if (p->p.aun_ttype == ECONET_TRUNK_CAPS)
 	{
+		trunk_caps_receive(p, r, from_found);
+		return;
+	}
 
-		unsigned char net, trunk, count;
+	if (p->p.aun_ttype == ECONET_AUN_BCAST && p->p.port == 0x9c && p->p.ctrl == 0x80) // Bridge reset - usually routine, but the far end may have restarted (perhaps as something which can't take aggregates) and its CAPS frame been lost, so check. Its epoch in the reply tells us which, and what we've agreed stays in use meanwhile
+		trunk_caps_ask(from_found);
 
-		for (trunk = 1; trunk < 255; trunk++)
-		{
-			if (trunks[trunk].listensocket >= 0 && ((source == trunk && is_reset) || (source != trunk))) // Active trunk - but we only send to the source trunk if it's a reset, and the code switches that to an update
-			{
-		
-				out.p.srcnet = localnet;	
-				out.p.srcstn = 0;
-				out.p.dstnet = out.p.dststn = 255;
-				out.p.port = 0x9c;
-				out.p.ctrl = (is_reset ? (source == trunk ? 0x81 : 0x80) : 0x81); // If it's a reset but was from this trunk, send update not reset
-				out.p.aun_ttype = ECONET_AUN_BCAST;
-				out.p.seq = (local_seq += 4);
+	trunks[from_found].rx_frames++;
+	trunks[from_found].rx_bytes += r;
 
-				if (pkt_debug) fprintf (stderr, "B-->B: Sending bridge %s on   trunk %d with nets ", (out.p.ctrl == 0x80 ? "reset " : "update"), trunk);
+	if (trunks[from_found].adv_in[p->p.srcnet] != 0xff && (p->p.port != 0x9c)) // Check if this was a network we were expecting from that source, and it wasn't bridge traffic
+	{
+		econet_log ("FWALL: to %3d.%3d from %3d.%3d received on trunk %04X from unadvertized source network %d\n", p->p.dstnet, p->p.dststn, p->p.srcnet, p->p.srcstn, from_found, p->p.srcnet);
+		trunks[from_found].fw_drops++;
+		econet_drops[ECONET_DROP_FIREWALL]++;
+		return;
+	}
 
-				count = 0;
 
-				for (net = 1; net < 255; net++)
-					if (trunks[trunk].adv_out[net] == 0xff)
-					{
-						out.p.data[count++] = net;	
-						if (pkt_debug) fprintf (stderr, "%3d ", net);
-					}
+	policy = trunk_xlate_fw(p, from_found, 0); // 0 = inbound translation && firewalling
 
-				if (pkt_debug) fprintf (stderr, "\n");
+// Disabled - use aun_send_internal
+/*
+	if ((p->p.aun_ttype == ECONET_AUN_BCAST) && from_found != 0xffff) // Dump to local in case it's bridge stuff - but only if we knew where it came from
+		econet_handle_local_aun(p, r, from_found);
+*/
 
-				aun_trunk_send_internal (&out, count+12, trunk);
-			}
+	if (p->p.aun_ttype == ECONET_AUN_BCAST && from_found != 0xffff)
+		aun_send_internal (p, r, from_found);
 
-		}
+	// Note that aun_send now dumps traffic we refuse to forward so we don't need to check here
 
+	if ((policy == FW_ACCEPT) && ((p->p.aun_ttype == ECONET_AUN_DATA) || (p->p.aun_ttype == ECONET_AUN_IMM) || (p->p.aun_ttype == ECONET_AUN_IMMREP)))
+	{
+		if (p->p.aun_ttype == ECONET_AUN_DATA && (econet_ptr[p->p.dstnet][p->p.dststn] != -1)) // DATA, and it's going to a known host (can't be AUN because AUN hosts don't talk to trunks) - Proxy acknowledge, even for Named Pipes
+			aun_acknowledge(p, ECONET_AUN_ACK);
+		aun_send(p, r);
+	}
+	else if (policy != FW_ACCEPT && p->p.aun_ttype != ECONET_AUN_BCAST)
+	{
+		trunks[from_found].fw_drops++;
+		econet_drops[ECONET_DROP_FIREWALL]++;
 	}
-}
 
-// a contains a packet received from somwhere, packlen is it's length. source is either 0 for the wire, > 0 for a trunk number, or -1 from anywhere else
+}
 
-void econet_handle_local_aun (struct __econet_packet_aun *a, int packlen, int source)
+// Drain the batch udp_receive() pulled off a trunk
+void econet_handle_trunk_fd(int fd, uint32_t events)
 {
+	do econet_handle_trunk_datagram(fd);
+	while (udp_rx_pending(fd));
 
-	struct __econet_packet_aun reply;
-	int s_ptr, d_ptr;
-
-	//fprintf (stderr, "Local handler invoked; AUN type %d len %d\n", a->p.aun_ttype, packlen);
+	if (trunk_fd_ptr[fd] >= 0 && trunks[trunk_fd_ptr[fd]].ack_due) // One ACK for the lot
+		trunk_rel_ack_send(trunk_fd_ptr[fd]);
+}
 
-	s_ptr = econet_ptr[a->p.srcnet][a->p.srcstn];
-	d_ptr = econet_ptr[a->p.dstnet][a->p.dststn];
+// An ACK, NAK or IMM REP (or anything else, which is ignored) of len bytes from AUN host network[from_found] - see
+// whether it's what that host's queue has been waiting for
 
-	if (a->p.aun_ttype == ECONET_AUN_IMM) // Immediate
+void econet_aun_ack_rx(int from_found, struct __econet_packet_aun *p, int len)
+{
+	if (p->p.aun_ttype == ECONET_AUN_ACK || p->p.aun_ttype == ECONET_AUN_IMMREP || p->p.aun_ttype == ECONET_AUN_NAK)
 	{
-		if (a->p.ctrl == 0x88) // Machinepeek
+		if (network[from_found].aun_window > 1) // Sliding window host - could be for any packet in the window
 		{
-			reply.p.srcnet = a->p.dstnet;
-			reply.p.srcstn = a->p.dststn;
-			reply.p.dstnet = a->p.srcnet;
-			reply.p.dststn = a->p.srcstn;
-			reply.p.aun_ttype = ECONET_AUN_IMMREP;
-			reply.p.seq = a->p.seq;
-			reply.p.port = 0;
-			reply.p.ctrl = 0x88;
-			reply.p.data[0] = ADVERTISED_MACHINETYPE & 0xff;
-			reply.p.data[1] = (ADVERTISED_MACHINETYPE & 0xff00) >> 8;
-			reply.p.data[2] = ADVERTISED_VERSION & 0xff;
-			reply.p.data[3] = (ADVERTISED_VERSION & 0xff00) >> 8;
-
-			aun_send (&reply, 16);
-		}	
-		else if (a->p.ctrl == 0x81 && (packlen > 16)) // Memory Peek (packlen will be 4 internal header, 8 AUN header, 4 special 0x85 bytes, and if there is nothing beyond those 16 (total) then don't bother)
+			if (econet_aun_window_ack(from_found, p) && queue_debug)
+				econet_debug ("QUEUE: to %3d.%3d from %3d.%3d len 0x%04X seq 0x%08X found ack/nak/imm rep for window\n",
+					p->p.srcnet, p->p.srcstn, p->p.dstnet, p->p.dststn, len, p->p.seq);
+		}
+		else if (p->p.seq == network[from_found].ackimm_seq_awaited) // Found the ACK or IMMREP sequence this host was supposed to produce
 		{
+			if (queue_debug) econet_debug ("QUEUE: to %3d.%3d from %3d.%3d len 0x%04X seq 0x%08X found ack/imm rep which was awaited\n",
+				p->p.srcnet, p->p.srcstn, p->p.dstnet, p->p.dststn, len, p->p.seq);
 
-			if (beebmem) // If we managed to load it...
-			{
-				unsigned int start, end;
-
-				start = ((a->p.data[0]) + (256 * (a->p.data[1])));
-				end = ((a->p.data[4]) + (256 * (a->p.data[5])));
+			// Time it if it was an ACK for a data packet we only sent once
+			if (p->p.aun_ttype == ECONET_AUN_ACK && network[from_found].aun_head && p->p.seq == network[from_found].aun_head->p->p.seq && network[from_found].aun_head->tx_count == 1)
+				econet_aun_rtt_sample(from_found, &(network[from_found].aun_last_tx));
 
-				sprintf (beebmem + 0x7c5f, "%d", a->p.dststn);
+			network[from_found].ackimm_seq_awaited = 0;
+			network[from_found].aun_last_tx.tv_sec = network[from_found].aun_last_rx.tv_usec = 0;
 
-				reply.p.srcnet = a->p.dstnet;
-				reply.p.srcstn = a->p.dststn;
-				reply.p.dstnet = a->p.srcnet;
-				reply.p.dststn = a->p.srcstn;
-				reply.p.aun_ttype = ECONET_AUN_IMMREP;
-				reply.p.port = a->p.port;
-				reply.p.ctrl = a->p.ctrl;
-				reply.p.seq = a->p.seq;
-			
-				memcpy(&(reply.p.data), (beebmem + start), end-start);
+			econet_timer_cancel(&imm_reset_timer); // No need to reset the chip now we have the packet we wanted
 
-				aun_send (&reply, 12 + (end - start));
+			// And dump the packet off the head if it's the same sequence
 
+			if (network[from_found].aun_head && p->p.seq == network[from_found].aun_head->p->p.seq)
+			{
+				econet_aun_dumphead(from_found);
 			}
+
+			econet_aun_ready(from_found); // Stop waiting - it can have the next packet
+
 		}
 	}
-	else if ((a->p.aun_ttype == ECONET_AUN_DATA || a->p.aun_ttype == ECONET_AUN_BCAST) && (a->p.port == 0x9f)) // Print server status protocol
-	{
-
-			int count;
-			unsigned char querytype;
-			unsigned char pname[7];
+}
 
-			querytype = a->p.data[6]; // 1 == status request; 6 == name request
-	
-			for (count = 0; count < 6; count++)
-				pname[count] = a->p.data[count];
-		
-			pname[6] = 0; // NULL terminate
+// Traffic arriving on a UDP socket which is really just AUN for a named pipe client
+void econet_handle_pipeudp_datagram(int fd)
+{
 
-			if (pkt_debug) fprintf (stderr, "PRINT: to %3d.%3d from %3d.%3d Printer Status Query (%s) for printer %s ",
-				a->p.dstnet, a->p.dststn,
-				a->p.srcnet, a->p.srcstn,
-				(querytype == PRN_QUERY_STATUS) ? "status" : "name",
-				pname);
+	int netptr, r, from_found = 0xffff;
+	struct __econet_packet_aun *p;
 
-			for (count = 0; count < stations; count++) // Search them all in case it's a broadcast. Otherwise, only reply from the one which was addressed
-			{
-				if ((network[count].servertype & ECONET_SERVER_PRINT) && (a->p.aun_ttype == ECONET_AUN_BCAST || (a->p.dstnet == network[count].network && a->p.dststn == network[count].station)))
-				{
+	r = udp_receive (fd, &p, 4, (struct sockaddr * restrict) &src_address);
 
-					reply.p.srcnet = network[count].network;
-					reply.p.srcstn = network[count].station;
-					reply.p.dstnet = a->p.srcnet;
-					reply.p.dststn = a->p.srcstn;
-					reply.p.aun_ttype = ECONET_AUN_DATA;
-					reply.p.port = 0x9e;
-					reply.p.ctrl = 0x80;
+	if (r < 0) return; // Debug produced in udp_receive
 
-					if (querytype == PRN_QUERY_STATUS) // Status enquiry
-					{
-						/* First need to compare the name */
+	/* Look up where it came from */
 
-						short found = 0, printer;
+	from_found = econet_find_source_station (&src_address); // 0xffff;
 
-						if (!strncasecmp("PRINT ", (const char *) pname, 6))
-						{
-							found = 1;
-						}
-						else
-							for (printer = 0; printer < network[count].numprinters; printer++)
-							{
-								if (!strncasecmp((const char *) network[count].printers[printer].name, (const char *) pname, 6))
-									found++;	
-							}
-						
-						if (found)
-						{
-							
-							if (pkt_debug) fprintf (stderr, " - responding with status\n");
-							reply.p.seq = get_local_seq(network[count].network, network[count].station);
-							reply.p.data[0] = 0x00; // Status byte 0 = Ready
-							reply.p.data[1] = 0x00; // Busy with station N (which we don't need if ready)
-							reply.p.data[2] = 0x00; // Busy with network N (which we don't need if ready)
-							aun_send (&reply, 15);
-						}
-						else if (pkt_debug) fprintf (stderr, " - not responding\n");
-					}
-					else if (querytype == PRN_QUERY_NAME) // Name query - we can, apparently, send multiple replies to this.
-					{
+	netptr = pipeudpsockets[fd]; // And this is where it's to
 
-						int printer = 0;
+	p->p.dstnet = network[netptr].network;
+	p->p.dststn = network[netptr].station;
 
-						// Loop through the printers on this station and reply. Update sequence number for each reply...
+	if (from_found == 0xffff)
+		econet_log ("*PIPE: to %3d.%3d              traffic from unknown AUN source.\n", p->p.dstnet, p->p.dststn);
+	else
+	{
+		p->p.srcnet = network[from_found].network;
+		p->p.srcstn = network[from_found].station;
 
-						while (printer < network[count].numprinters)
-						{
-							reply.p.seq = get_local_seq(network[count].network, network[count].station);
-							snprintf((char * restrict) reply.p.data, 7, "%6s", network[count].printers[printer].name);
-							aun_send (&reply, 18);
-							if (printer == 0 && pkt_debug) fprintf (stderr, " - responded with printer list\n");
-						}
+		p->p.ctrl |= 0x80; // Put the high bit back on the ctrl 
 
-					}
-				}
-			}
+		network[from_found].rx_packets++;
+		network[from_found].rx_bytes += r+4;
 
-	}
-	else if (a->p.aun_ttype == ECONET_AUN_BCAST) // Broadcast - See if we need to do a bridge query reply 
-	{
-		if (bridge_query && (a->p.port == 0x9C) && (a->p.ctrl == 0x80 || a->p.ctrl == 0x81) && (source >= 0)) // bridge reset/update broadcast
-			econet_bridge_process (a, packlen, source);
+		econet_aun_ack_rx(from_found, p, r+4); // The pipe client's traffic is queued for the AUN host like anyone else's
 
-		else if (bridge_query && (a->p.port == 0x9c) && (!strncmp("BRIDGE", (const char *) a->p.data, 6)) && localnet && (network[econet_ptr[a->p.srcnet][a->p.srcstn]].type & (ECONET_HOSTTYPE_TWIRE | ECONET_HOSTTYPE_TNAMEDPIPE)))
+		if (network[netptr].pipewritesocket != -1) // We have a live writer socket
 		{
-			short query_net, reply_port;
-			struct timeval now;
+			dump_udp_pkt_aun(p, r+4);
+			if (econet_pipe_write(network[netptr].pipewritesocket, p, r+4) == r+4)
+			{
+				network[netptr].tx_packets++;
+				network[netptr].tx_bytes += r+4;
+			}
+			else	network[netptr].drops++;
+		}
+		else
+		{
+			econet_log ("*PIPE: to %3d.%3d from %3d.%3d traffic received on UDP for named pipe but pipe not connected\n", p->p.dstnet, p->p.dststn, p->p.srcnet, p->p.srcstn );
+			network[netptr].drops++;
+		}
+	}
 
-			reply_port = a->p.data[6];
-			query_net = a->p.data[7];
-	
-			gettimeofday(&now, 0);
+}
 
-			if (pkt_debug && !dumpmode_brief)
-				fprintf (stderr, "LOC  : BRIDGE     from %3d.%3d, query 0x%02x, reply port 0x%02x, query net %d\n", a->p.srcnet, a->p.srcstn, a->p.ctrl, reply_port, query_net);
+// Drain the batch udp_receive() pulled off a named pipe client's UDP socket
+void econet_handle_pipeudp_fd(int fd, uint32_t events)
+{
+	do econet_handle_pipeudp_datagram(fd);
+	while (udp_rx_pending(fd));
+}
 
-			if (nativebridgenet && 
-				(
-					(a->p.ctrl == 0x82 
-					&& (timediffmsec(&(network[econet_ptr[a->p.srcnet][a->p.srcstn]].last_bridge_reply), &now) > 1000)
-					) 
-				|| 	(a->p.ctrl == 0x83 && (wire_advertizable[query_net] == 0xff))
-				) // Either a local network number query, or a query for a network in our known distant list
-			)
-			{
-				
-				if (a->p.ctrl == 0x82)
-					gettimeofday(&(network[econet_ptr[a->p.srcnet][a->p.srcstn]].last_bridge_reply),0); // Don't reply too quickly
+// Traffic from a named pipe client, or the client going away
+void econet_handle_pipe_fd(int fd, uint32_t events)
+{
 
-				reply.p.srcnet = nativebridgenet;
-				reply.p.srcstn = 0;
-				reply.p.dstnet = a->p.srcnet;
-				reply.p.dststn = a->p.srcstn;
-				reply.p.aun_ttype = ECONET_AUN_DATA;
-				reply.p.port = reply_port;
-				//reply.p.ctrl = a->p.ctrl;
-				reply.p.ctrl = 0x80;
-				reply.p.padding = 0x00;
-				reply.p.seq = (local_seq += 4);
-				reply.p.data[0] = localnet;
-				reply.p.data[1] = query_net; 
-				aun_send (&reply, 14);
-			}
-			else if (pkt_debug) fprintf (stderr, "LOC  : BRIDGE     from %3d.%3d - didn't bother replying.\n", a->p.srcnet, a->p.srcstn);
-	
+	if ((events & EPOLLHUP) && (network[fd_ptr[fd]].pipewritesocket != -1))
+	{
+		int np;
+		char file[250];
+		unsigned char buffer[1024];
+
+		np = fd_ptr[fd];
+		// Client went away - close the writer pipe
+		close(network[np].pipewritesocket);
+		network[np].pipewritesocket = -1;
+		if (pkt_debug) econet_debug ("*PIPE:                 %3d.%3d client pipe went away.\n", 
+			network[np].network, network[np].station);
+		// Close the reader & re-open it - closing it takes it out of the epoll set too
+		fd_ptr[fd] = -1;
+		close(fd);
+		snprintf(file, 249, "%s.tobridge", network[np].named_pipe_filename);
+		fd = open (file, O_RDONLY | O_NONBLOCK);
+		if (fd != -1)
+		{
+			fd_ptr[fd] = np;
+			econet_watch_fd(fd, econet_handle_pipe_fd);
 		}
-		else if (a->p.port == 0x99) // Handle broadcasts to fileservers
+		else 	// Barf!
 		{
+			econet_log ("*PIPE: Reader socket for %3d.%3d went away. Quitting.\n", network[np].network, network[np].station);
+			exit(EXIT_FAILURE);
+		}
 
-			int count;
+		network[np].listensocket = fd;
 
-			for (count = 0; count < stations; count++)
-			{
-				if ((network[count].servertype & ECONET_SERVER_FILE) && (network[count].fileserver_index >= 0))
-					handle_fs_traffic(network[count].fileserver_index, a->p.srcnet, a->p.srcstn, a->p.ctrl, a->p.data, packlen-12);
-			}
-		}
+		// Empty the pipe
+
+		while (read(network[np].listensocket, buffer, 1023) > 0);
+		
 	}
-	else if (a->p.aun_ttype == ECONET_AUN_DATA) // Data packet
+	else if (events & EPOLLIN)
 	{
-		if ((a->p.port == 0x99) && (network[d_ptr].servertype & ECONET_SERVER_FILE) && (network[d_ptr].fileserver_index >= 0))
-			handle_fs_traffic(network[d_ptr].fileserver_index, a->p.srcnet, a->p.srcstn, a->p.ctrl, a->p.data, packlen-12);
+		int r;
+		struct __econet_packet_aun p;
 
-		else if ((a->p.port == 0x9f) && ((network[d_ptr].servertype) & ECONET_SERVER_PRINT)) // Looks like only ANFS does this... // Print server handling - this looks like it is just printer state query
-		{
+		int length;
+		unsigned char c;
+
+		length = 0;
 		
-			char printer_selected[10];
-			char *spaceptr;
-			//unsigned char querytype;
+		read(fd, &c, 1);
+		length = c;
+		read(fd, &c, 1);
+		length += (c << 8);
 
-			memset(printer_selected, 0, sizeof(printer_selected));
+		r = read(fd, &(p.raw), length);
 
-			strncpy(printer_selected, (const char *) a->p.data, 6);
+		if (r < 0) return; // Something went wrong
 
-			fprintf (stderr, "PRINT: to %3d.%3d from %3d.%3d Printer status enquiry %s\n", 
-				a->p.dstnet, a->p.dststn, a->p.srcnet, a->p.srcstn, printer_selected);
+		// The received packet will have a valid destination on it, but we will need to fill in the source
 
-			reply.p.srcnet = a->p.dstnet;
-			reply.p.srcstn = a->p.dststn;
-			reply.p.dstnet = a->p.srcnet;
-			reply.p.dststn = a->p.srcstn;
-			reply.p.aun_ttype = ECONET_AUN_DATA;
-			reply.p.port = 0x9e;
-			reply.p.ctrl = 0x80;
-			reply.p.seq = get_local_seq(a->p.dstnet, a->p.dststn);
-			reply.p.data[0] = 0x00; // Printer input state (Read) // We can change this when we can bar input etc.
-			reply.p.data[1] = 0x00; // Printer output state (Ready) // We can change this when we can put printers offline!
+		p.p.srcnet = network[fd_ptr[fd]].network;
+		p.p.srcstn = network[fd_ptr[fd]].station;
+
+		network[fd_ptr[fd]].last_transaction = time(NULL);
+		
+		// If the pipewritesocket is not open, open it because we've received traffic
+
+		if (network[fd_ptr[fd]].pipewritesocket == -1)
+		{
+			char writerfilename[250];
+
+			snprintf(writerfilename, 249, "%s.frombridge", network[fd_ptr[fd]].named_pipe_filename);
+
+			network[fd_ptr[fd]].pipewritesocket = open(writerfilename, O_WRONLY | O_NONBLOCK | O_SYNC);
+			if (pkt_debug) econet_debug ("*PIPE: to %3d.%3d from %3d.%3d traffic caused write pipe to open (normal) - fd %d\n", p.p.dstnet, p.p.dststn, p.p.srcnet, p.p.srcstn, network[fd_ptr[fd]].pipewritesocket);
+		}
+
+		/* This sends ACK & NAK that might arise from the named pipe - they can ignore it if they want */
+		aun_send(&p, r); // Send ACK & NAK as well because that's handled properly now.
+
+	}
+
+}
+
+// Boggo standard AUN/IP traffic to a wire station or local emulation
+void econet_handle_aun_datagram(int fd)
+{
 
+	int r, sent;
+	unsigned short from_found, to_found; // Used to see if we know a station or not
+	struct __econet_packet_aun *p;
 
-			if ((spaceptr = strchr(printer_selected, ' ')))
-				*spaceptr = (char) 0; // Terminate
-		
-			//querytype = a->p.data[6]; // TODO - Implement the different queries
+	// This is all UDP receiver code - AUN only (trunks dealt with above)
 
-			if (!strcmp(printer_selected, "PRINT"))
-			{
-				aun_send (&reply, 14);
-			}
-			else
-			{
-				// See if we have a matching printer
-				int count = 0, found = 0;
+	r = udp_receive(fd, &p, 4, (struct sockaddr * restrict) &src_address);
 
-				while (count < network[d_ptr].numprinters)
-				{
-					if (strlen(network[d_ptr].printers[count].name) != strlen(printer_selected))
-						count++;
-					else if (!strncasecmp(network[d_ptr].printers[count].name, printer_selected, strlen(printer_selected)))
-						found = 1;
+	if (r< 0) return; // Debug produced in udp_receive
 
-					else count++;
-				}	
+	/* Look up where it came from */
 
-				if (found)
-				{
-					last_printers[a->p.srcnet][a->p.srcstn].printer_index = -1;
-					reply.p.data[0] = 0xff; // Error
-					aun_send (&reply, 14);
-				}
-				else	
-				{
-					reply.p.data[0] = 0xff;
-					strcpy((char *) &(reply.p.data[2]), "Unkonwn printer");
-					aun_send(&reply, 14 + strlen("Unknown printer") + 1);
-				}
-				
-			}
+	from_found = econet_find_source_station (&src_address); // 0xffff;
 
+	/* Now where did was it going /to/ ? We can find that by the listening socket number */
 
-		}
-		else if ((a->p.port == 0xd1) && (network[d_ptr].servertype & ECONET_SERVER_PRINT)) // Actual printing
+	if (fd == aun_shared_socket) // Shared listener - look at the address it was sent to
+	{
+		aun_shared_rx++;
+		if ((to_found = aun_shared_lookup(udp_rx_dst)) == 0xffff)
 		{
-			int found = -1, count = 0;
+			aun_shared_unknown++;
+			if (pkt_debug) econet_debug ("ERROR: UDP packet received on shared AUN socket for %s, which is not a station we know\n", inet_ntoa(udp_rx_dst));
+			return;
+		}
+	}
+	else
+		to_found = fd_ptr[fd];
 
-			// First locate the printjob entry
+	/* TODO - If this is an ACK for something we sent, check it against ackimm_seq_awaited */
 
-			while (count < MAXPRINTJOBS && found == -1)
-			{
-				if (printjobs[count].net == a->p.srcnet && 
-				    printjobs[count].stn == a->p.srcstn)
-					found = count;
-				else count++;
-			}
+	if ((from_found == 0xFFFF) && (learned_net != -1) & (to_found != 0xFFFF)) // See if we can dynamically allocate a station number to this unknown traffic source, since we know where the traffic going, and we have learning mode on, but we don't know where the traffic came *from* 
+	{
+		unsigned short stn_count;
+		struct sockaddr_in *s;
 
-			if (found == -1) // New Print Job
+		stn_count = 0; 
+
+		s = &src_address;
+
+		while (stn_count < stations && from_found == 0xFFFF)
+		{
+			if (network[stn_count].is_dynamic && (network[stn_count].last_transaction < (time(NULL) - ECONET_LEARNED_HOST_IDLE_TIMEOUT))) // Found a dynamic station which has idled out
 			{
-				char filename[100];
 
-				count = 0;
+				struct __econet_packet_aun bye;
+				int netcount, b, indexed;
 
-				// Move this to a function at some stage
-				while (count < MAXPRINTJOBS && found == -1)
+				indexed = ((b = aun_hash_find(network[stn_count].s_addr, network[stn_count].port)) != -1 && aun_hash[b].index == stn_count);
+				aun_hash_remove(network[stn_count].s_addr, network[stn_count].port, stn_count); // Forget whoever had it last
+
+				if (!aun_hash_insert(s->sin_addr, ntohs(src_address.sin_port), stn_count)) // Table full - it would never be found again, so leave the station with whoever had it
 				{
-					if (printjobs[count].net == 0 && printjobs[count].stn == 0) // Found one
-						found = count;
-					else	count++;
+					if (indexed)
+						aun_hash_insert(network[stn_count].s_addr, network[stn_count].port, stn_count); // (Goes back in the slot it has just left)
+					aun_hash_full++;
+					econet_log ("  DYN: Cannot index %s:%d for source lookup - not allocating it a station\n", inet_ntoa(s->sin_addr), ntohs(src_address.sin_port));
+					break;
 				}
-	
-				if (found != -1)
+
+				econet_aun_rtt_reset(stn_count); // And how quickly they answered
+
+				memcpy(&(network[stn_count].s_addr), &(s->sin_addr), sizeof(struct in_addr));
+
+				network[stn_count].port = ntohs(src_address.sin_port);
+				from_found = stn_count;
+				econet_timer_arm(&(network[stn_count].idle_timer), ECONET_LEARNED_HOST_IDLE_TIMEOUT * 1000);
+				if (pkt_debug) econet_debug ("  DYN: Allocated station number %3d.%3d to incoming traffic from %d.%d.%d.%d:%d\n", network[stn_count].network, network[stn_count].station, 
+					(ntohl(network[stn_count].s_addr.s_addr) & 0xff000000) >> 24,
+					(ntohl(network[stn_count].s_addr.s_addr) & 0xff0000) >> 16,
+					(ntohl(network[stn_count].s_addr.s_addr) & 0xff00) >> 8,
+					(ntohl(network[stn_count].s_addr.s_addr) & 0xff),
+					network[stn_count].port);
+
+				// Log out from FS & SKS here as necessary : TODO SKS
+				econet_service_post(econet_fs_worker(network[stn_count].network, network[stn_count].station), ECONET_SVC_EJECT, NULL, 0, (network[stn_count].network << 8) | network[stn_count].station, 0);
+
+				// Spoof a bye to wire FS's we've found
+				bye.p.srcstn = network[stn_count].station;
+				bye.p.srcnet = network[stn_count].network;
+				bye.p.port = 0x99;
+				bye.p.ctrl = 0x80;
+				bye.p.aun_ttype = ECONET_AUN_DATA;
+				bye.p.seq = 0x00;
+				bye.p.data[0] = 0x90; // Reply port
+				bye.p.data[1] = 0x17; // End session
+				bye.p.data[2] = 1; // Dummy CWD
+				bye.p.data[3] = 2; // Dummy LIB
+				
+				if (wired_eject)
 				{
+					if (pkt_debug) econet_debug ("  DYN:%12s             Spoofing *bye to known wired fileservers...", "");
 
-					printjobs[found].stn = a->p.srcstn;
-					printjobs[found].net = a->p.srcnet;
-					//printjobs[found].ctrl = 0x80; 
-					printjobs[found].ctrlbit = (a->p.ctrl & 0x01) ^ 0x01; // So ctrlbit stores what we are expecting
-					
-					sprintf(filename, SPOOLFILESPEC, found);
-	
-					printjobs[found].spoolfile = fopen(filename, "w");
-					
-					if (!printjobs[found].spoolfile)
+					for (netcount = 0; netcount < stations; netcount++)
 					{
-						printjobs[count].net = printjobs[count].stn = 0;  // Free this up - couldn't open file	
-						fprintf (stderr, "Unable to open spool file for print job from station %d.%d\n", a->p.srcnet, a->p.srcstn);
+						if (network[netcount].is_wired_fs)
+						{
+							if (pkt_debug) econet_debug ("%d.%d ",  network[netcount].network, network[netcount].station);
+							bye.p.dststn = network[netcount].station;
+							bye.p.dstnet = network[netcount].network;
+							
+							aun_send(&bye, 16);
+						}
+
 					}
-					else
-					{
 
-						unsigned char printer_index = 0xff;
-						int fserver, active_id; // active_id is an internal FS index to the logged in user table
+					if (pkt_debug) econet_debug ("\n");
 
-						// Which printer?
+				}	
+				
 
-						if (network[d_ptr].servertype & ECONET_SERVER_FILE) // Is fileserver, so it might have a printer selected
-							printer_index = fs_get_user_printer(network[d_ptr].fileserver_index, a->p.srcnet, a->p.srcstn);
+			}
 
-						if (printer_index == 0xff)
-							printer_index = network[d_ptr].printer_priorities[0];
+			stn_count++;
+		}
 
-						fprintf (stderr, "PRINT: Starting spooler job for %d.%d - %s (%s)\n", a->p.srcnet, a->p.srcstn, network[d_ptr].printers[printer_index].name, network[d_ptr].printers[printer_index].unixname);
+	}
 
-						// If we are using the new external print handler, we don't do the headers internally any more. They are configured.
+	if ((from_found != 0xffff) && (to_found != 0xffff)) // We know source & destination stations (necessary because this is AUN traffic, so it can't be going to a trunk!)
+	{
 
-						strcpy(printjobs[found].name, network[d_ptr].printers[printer_index].name);
+		// Complete the internal format packet
 
-						// Are we a fileserver as well as a print server? If so, is this station logged into it?
-						if (((fserver = fs_get_server_id(a->p.dstnet, a->p.dststn)) != -1) && ((active_id = fs_stn_logged_in(fserver, a->p.srcnet, a->p.srcstn)) != -1))
-						{
-							fs_get_username(fserver, active_id, printjobs[found].username);
-							if (printjobs[found].username == 0) strcpy(printjobs[found].username, "ANONYMOUS");
-							
-						}
-						else	strcpy(printjobs[found].username, "ANONYMOUS");
+		p->p.srcnet = network[from_found].network;
+		p->p.srcstn = network[from_found].station;
+		p->p.dstnet = network[to_found].network;
+		p->p.dststn = network[to_found].station;
 
-						if (!printhandler && strstr(network[d_ptr].printers[printer_index].unixname, "@")) // Email print job, not send to printer
-						{
-							fprintf(printjobs[count].spoolfile, "To: %s\n", network[d_ptr].printers[printer_index].unixname);
-							fprintf(printjobs[count].spoolfile, "Subject: Econet print job from station %d.%d\n\n", a->p.srcnet, a->p.srcstn);
-						}
-						if (!printhandler) fprintf (printjobs[count].spoolfile, PRINTHEADER, a->p.srcnet, a->p.srcstn);
+		network[from_found].last_transaction = time(NULL);
+		
+		econet_aun_ack_rx(from_found, p, r+4);
 
-						strcpy (printjobs[count].unixname, network[d_ptr].printers[printer_index].unixname);
-					}
+		/* Put it on the queue using AUN_SEND() */
+		sent = 1;
+		if ((network[to_found].type & ECONET_HOSTTYPE_TNAMEDPIPE) || (!( (p->p.aun_ttype == ECONET_AUN_ACK) || (p->p.aun_ttype == ECONET_AUN_NAK) ))) // Ignore those sorts of packets unless going to named pipe. (I.e. if going to local emulation or wire, we drop them)
+			sent = aun_send(p, r+4);
+/* DISABLED. We now acknowledge all incoming AUN data because otherwise we get too rapid retransmits on a busy Econet wire 
+		if (p->p.aun_ttype == ECONET_AUN_DATA && (network[to_found].type & ECONET_HOSTTYPE_TNAMEDPIPE || network[to_found].type & ECONET_HOSTTYPE_TLOCAL)) // If AUN was sending to local or named pipe, we'll do the ACK (wire and trunk do their own)
+*/
+		if (p->p.aun_ttype == ECONET_AUN_DATA)
+			aun_acknowledge(p, (sent == 0 ? ECONET_AUN_NAK : ECONET_AUN_ACK)); // 0 means we couldn't queue it (out of pool memory) - NAK so the sender backs off and tries again
 
-				}
+	}
+	else	
+		if (pkt_debug) econet_debug ("ERROR: UDP packet received on FD %d; From%s found, To%s found (pointer %d)!\n", fd, ((from_found != 0xffff) ? "" : " not"), ((to_found != 0xffff) ? "" : " not"), to_found);
 
-			}
+}
 
-			if (found != -1)
-			{
-				reply.p.srcnet = a->p.dstnet;
-				reply.p.srcstn = a->p.dststn;
-				reply.p.dstnet = a->p.srcnet;
-				reply.p.dststn = a->p.srcstn;
-				reply.p.aun_ttype = ECONET_AUN_DATA;
-				reply.p.port = 0xd1;
-				reply.p.ctrl = a->p.ctrl;
+// Drain the batch udp_receive() pulled off an AUN socket
+void econet_handle_aun_fd(int fd, uint32_t events)
+{
+	do econet_handle_aun_datagram(fd);
+	while (udp_rx_pending(fd));
+}
 
-				reply.p.seq = get_local_seq(a->p.dstnet, a->p.dststn);
+// SIGUSR1 handler - just flag it, and the main loop will dump the statistics when it next goes round
+void econet_sigusr1(int sig)
+{
+	dump_stats = 1;
+}
 
-				// The control low bit alternation is to avoid duplicated packets. Need to implement a check... TODO.
+// Charge the time since the last call to the main loop phase which has just finished, if the loop is being timed
 
-				if ((printjobs[count].ctrlbit == (a->p.ctrl & 0x01)) || ((a->p.ctrl & 0xfe) == 0x82)) // Either matches the ctrl bit, OR is 0x82 (job start)
-				{
-					printjobs[count].ctrlbit = (a->p.ctrl & 0x01) ^ 0x01;
+static inline void econet_loop_phase(int phase)
+{
+	uint64_t now, t;
 
-					switch (a->p.ctrl & 0xfe)
-					{
-						case 0x82: // Print job start
-						{
-							reply.p.data[0] = 0x2a;
-						}
-						break;
-						case 0x80: // Print data
-						{
-							fwrite(&(a->p.data), packlen-12, 1, printjobs[count].spoolfile);
-							reply.p.data[0] = a->p.data[0];	
-						}
-						break;
-						case 0x86: // Final packet
-						{
-							char command_string[2000];
-							char filename_string[200];
-	
-							// There is a rogue byte on the end of the last printjob packet it would seem
-							fwrite(&(a->p.data), packlen-12-1, 1, printjobs[count].spoolfile);
+	if (!loop_timing)
+		return;
 
-							if (!printhandler)	
-								fprintf(printjobs[count].spoolfile, PRINTFOOTER);
+	now = econet_clock_ns(CLOCK_MONOTONIC);
+	t = now - loop_phase_mark;
+	loop_phase_mark = now;
 
-							reply.p.data[0] = a->p.data[0];	
-	
-							fclose(printjobs[count].spoolfile);
-							sprintf(filename_string, SPOOLFILESPEC, found);
-							
-							if (!printhandler)
-							{
-								if (strstr(printjobs[count].unixname, "@")) // Email address not printername
-									sprintf(command_string, MAILCMDSPEC, printjobs[count].unixname, filename_string);
-								else
-									sprintf(command_string, PRINTCMDSPEC, printjobs[count].unixname, filename_string);
-		
-								fprintf (stderr, "PRINT: Sending print job with %s\n", command_string);
-							
-								if (!fork())
-									execl("/bin/sh", "sh", "-c", command_string, (char *)0);
-							}
-							else
-							{
-								sprintf(command_string, "%s %d %d %d %d %s %s %s %s",
-									printhandler,
-									a->p.dstnet, a->p.dststn,
-									a->p.srcnet, a->p.srcstn,
-									printjobs[count].username,
-									printjobs[count].unixname,
-									printjobs[count].name,
-									filename_string);
-				
-								if (pkt_debug) fprintf(stderr, "PRINT: Command string: %s\n", command_string);
+	loop_phase_ns[phase] += t;
+	if (t > loop_phase_max[phase])
+		loop_phase_max[phase] = t;
+}
 
-								if (!fork())	execl("/bin/bash", "bash", "-c", command_string, (char *) 0);
-	
-							}
-	
-							printjobs[count].stn = printjobs[count].net = 0; // Free the resource	
+// Called by the fileserver workers as each operation finishes - fsop is its function code, us how long it took
 
-						}
-						break;
-					}
+void econet_fs_op_timed(unsigned char fsop, uint64_t us)
+{
+	econet_hist_add_shared(&(fs_op_hist[fsop]), us);
+}
 
-				}
+// One line of the latency percentiles, for h - if it has anything in it
 
-				aun_send (&reply, 13);
-			}
-			else
-				fprintf (stderr, "PRINT: Spooler not found for print request from %d.%d\n", network[s_ptr].network, network[s_ptr].station);
-			
-		}
-		else if ((a->p.port == 0xdf) && (network[d_ptr].servertype & ECONET_SERVER_SOCKET) && (network[d_ptr].sks_index >= 0))
-			sks_handle_traffic(network[d_ptr].sks_index, a->p.srcnet, a->p.srcstn, a->p.ctrl, a->p.data, packlen-12);
-		else if ((network[d_ptr].servertype & ECONET_SERVER_FILE) && (network[d_ptr].fileserver_index >= 0)) // Could be fileserver bulk transfer traffic
-			handle_fs_bulk_traffic(network[d_ptr].fileserver_index, a->p.srcnet, a->p.srcstn, a->p.port, a->p.ctrl, a->p.data, packlen-12);
-		else
-			fprintf(stderr, "LOCAL: Unhandled traffic.\n");
-	}
-	else if (a->p.aun_ttype == ECONET_AUN_ACK)
-	{
-	}
-	else
+void econet_hist_line(FILE *out, char *name, struct econet_hist *h)
+{
+	struct econet_hist_summary s;
+
+	if (econet_hist_summarise(h, &s))
+		fprintf (out, "STATS:     %-22s %9lu %9" PRIu64 " %9" PRIu64 " %9" PRIu64 " %9" PRIu64 " %9" PRIu64 " %9" PRIu64 "\n",
+			name, s.count, s.mean, s.p50, s.p90, s.p99, s.p999, s.max);
+}
+
+// The latency histograms' percentiles as text - part of the statistics, and HIST on the statistics socket
+
+void econet_hist_text(FILE *out)
+{
+	char name[32];
+	int count;
+
+	fprintf (out, "STATS: Latency (us) since the histograms were last reset:\n");
+	fprintf (out, "STATS:     %-22s %9s %9s %9s %9s %9s %9s %9s\n", "", "count", "average", "p50", "p90", "p99", "p99.9", "longest");
+
+	econet_hist_line(out, "wire transmit", &wire_tx_hist);
+
+	for (count = 0; count < ECONET_QUEUE_TYPES; count++)
 	{
-		fprintf (stderr, "Ignoring AUN type %d to local station %d.%d\n", a->p.aun_ttype, network[d_ptr].network, network[d_ptr].station);
+		snprintf (name, sizeof(name), "%s queue wait", queue_names[count]);
+		econet_hist_line(out, name, &(queue_sojourn_hist[count]));
 	}
 
+	for (count = 0; count < stations; count++)
+		if (network[count].aun_rtt_hist)
+		{
+			snprintf (name, sizeof(name), "ACK from %3d.%3d", network[count].network, network[count].station);
+			econet_hist_line(out, name, network[count].aun_rtt_hist);
+		}
+
+	for (count = 0; count < 256; count++)
+		if (__atomic_load_n(&(fs_ops[count]), __ATOMIC_RELAXED)) // Don't bother with the ones which have never been used
+		{
+			snprintf (name, sizeof(name), "FS operation &%02X", count);
+			econet_hist_line(out, name, &(fs_op_hist[count]));
+		}
 }
 
-// Trunk send internal - send packet p of length len on trunk t - used once we've found which trunk we want
-int aun_trunk_send_internal (struct __econet_packet_aun *p, int len, int t)
+// Empty all the latency histograms - RESET on the statistics socket
+
+void econet_hist_reset_all(void)
 {
+	int count;
 
-	int result;
+	econet_hist_reset(&wire_tx_hist);
 
-	if (trunk_xlate_fw(p, t, 1) == FW_ACCEPT) // returns 0 for drop traffic (param 3 = 1 means outbound)
-		result = sendto(trunks[t].listensocket, p, len, MSG_DONTWAIT, trunks[t].addr->ai_addr, trunks[t].addr->ai_addrlen); 
-	else
-		fprintf (stderr, "ERROR: to %3d.%3d from %3d.%3d Unknown destination\n", 
-			p->p.dstnet, p->p.dststn, p->p.srcnet, p->p.srcstn);
+	for (count = 0; count < ECONET_QUEUE_TYPES; count++)
+		econet_hist_reset(&(queue_sojourn_hist[count]));
 
-	return result;
+	for (count = 0; count < stations; count++)
+		if (network[count].aun_rtt_hist)
+			econet_hist_reset(network[count].aun_rtt_hist);
+
+	for (count = 0; count < 256; count++)
+		econet_hist_reset(&(fs_op_hist[count]));
+}
+
+// One entry in the JSON "latency" list, for h - if it has anything in it. what is the rest of the entry, saying which it is
+
+void econet_hist_json(FILE *out, char *what, struct econet_hist *h, int *first)
+{
+	struct econet_hist_summary s;
+
+	if (!econet_hist_summarise(h, &s))
+		return;
+
+	fprintf (out, "%s\n  {%s, \"count\": %lu, \"mean_us\": %" PRIu64 ", \"p50_us\": %" PRIu64 ", \"p90_us\": %" PRIu64 ", \"p99_us\": %" PRIu64 ", \"p999_us\": %" PRIu64 ", \"max_us\": %" PRIu64 "}",
+		*first ? "" : ",", what, s.count, s.mean, s.p50, s.p90, s.p99, s.p999, s.max);
+	*first = 0;
 }
 
-// Send AUN format packet (including our 4 byte magic header) over a trunk. Return 0 if it hasn't worked, otherwise packet length.
-// For now, the firewall is not implemented.
+// The statistics, as text - for SIGUSR1 (out = stderr), and TEXT on the statistics socket
+
+void econet_stats_text(FILE *out)
+{
+	unsigned long lookups, fsops;
+	int count;
+
+	lookups = aun_hash_hits + aun_hash_misses;
+
+	fprintf (out, "STATS: AUN source lookups %lu, hits %lu (%lu%%), misses %lu, collisions %lu (%lu.%02lu extra probes per lookup), %lu dynamic hosts not indexed (table full)\n",
+		lookups,
+		aun_hash_hits, (lookups ? (aun_hash_hits * 100) / lookups : 0),
+		aun_hash_misses,
+		aun_hash_collisions, (lookups ? aun_hash_collisions / lookups : 0), (lookups ? ((aun_hash_collisions * 100) / lookups) % 100 : 0),
+		aun_hash_full);
+
+	fprintf (out, "STATS: UDP receive %lu datagrams in %lu recvmmsg() calls (%lu.%02lu per call)\n",
+		udp_rx_datagrams, udp_rx_calls, (udp_rx_calls ? udp_rx_datagrams / udp_rx_calls : 0), (udp_rx_calls ? ((udp_rx_datagrams * 100) / udp_rx_calls) % 100 : 0));
+	fprintf (out, "STATS: UDP transmit %lu datagrams in %lu sendmmsg() calls (%lu.%02lu per call), %lu dropped on error\n",
+		udp_tx_datagrams, udp_tx_calls, (udp_tx_calls ? udp_tx_datagrams / udp_tx_calls : 0), (udp_tx_calls ? ((udp_tx_datagrams * 100) / udp_tx_calls) % 100 : 0), udp_tx_errors);
+
+	fprintf (out, "STATS: Station table %d entries (%lu bytes), %d server configurations (%lu bytes)\n",
+		stations, (unsigned long) stations * sizeof(struct econet_hosts),
+		network_servers, (unsigned long) network_servers * sizeof(struct econet_server_config));
+
+	fprintf (out, "STATS: Wire output %lu packets queued; immediate replies %lu sent, %lu ms average / %lu ms worst wait; others %lu sent, %lu ms average / %lu ms worst wait\n",
+		wire_queued,
+		wire_sent[0], (wire_sent[0] ? wire_sojourn_total[0] / wire_sent[0] : 0), wire_sojourn_max[0],
+		wire_sent[1], (wire_sent[1] ? wire_sojourn_total[1] / wire_sent[1] : 0), wire_sojourn_max[1]);
+
+	for (count = wire_active_head; count != -1; count = wire_flows[count].next)
+		fprintf (out, "STATS:     flow %2d queue depth %u (next %3d.%3d from %3d.%3d)\n", count, wire_flows[count].len,
+			wire_flows[count].head->p->p.dstnet, wire_flows[count].head->p->p.dststn,
+			wire_flows[count].head->p->p.srcnet, wire_flows[count].head->p->p.srcstn);
+
+	for (count = 0; count < 256; count++)
+		if (wire_tx_results[count])
+			fprintf (out, "STATS:     transmit %-30s (0x%02X) %8lu\n", econet_strtxerr(-1 * count), count, wire_tx_results[count]);
+
+	fprintf (out, "STATS: AUN output %lu packets queued, queues serviced %lu times looking at %lu hosts (%lu.%02lu per pass)\n",
+		aun_queued, aun_service_passes, aun_service_hosts,
+		(aun_service_passes ? aun_service_hosts / aun_service_passes : 0), (aun_service_passes ? ((aun_service_hosts * 100) / aun_service_passes) % 100 : 0));
+
+	for (count = 0; count < stations; count++)
+		if (network[count].aun_ready || network[count].aun_parked)
+		{
+			fprintf (out, "STATS:     %3d.%3d queue depth %u", network[count].network, network[count].station, network[count].aun_queue_len);
+			if (network[count].aun_window > 1)
+				fprintf (out, ", %u of %u in flight", network[count].aun_inflight, network[count].aun_window);
+			fprintf (out, "%s\n", network[count].aun_parked ? " (waiting)" : "");
+		}
+
+	fprintf (out, "STATS: Queue limits (packets / KB), traffic turned away when full, shed for delay (over %u ms for %u ms), and expired:\n", codel_target, codel_interval);
+	for (count = 0; count < ECONET_QUEUE_TYPES; count++)
+		fprintf (out, "STATS:     %-5s %5u / %5lu  %8lu full  %8lu shed  %8lu expired\n", queue_names[count],
+			queue_limits[count].packets, queue_limits[count].bytes / 1024,
+			queue_full_drops[count], queue_delay_drops[count], queue_age_drops[count]);
+
+	fprintf (out, "STATS: Other traffic dropped -");
+	for (count = 0; count < ECONET_DROP_REASONS; count++)
+		fprintf (out, " %s %lu", drop_names[count], econet_drops[count]);
+	fprintf (out, "\n");
 
-int aun_trunk_send(struct __econet_packet_aun *p, int len)
-{
+	fprintf (out, "STATS: Host traffic - packets / bytes from the host, and taken on for it; retransmissions and drops:\n");
 
-	short trunk;
-	int result = 0;
+	for (count = 0; count < stations; count++)
+		if (network[count].rx_packets || network[count].tx_packets || network[count].drops)
+			fprintf (out, "STATS:     %3d.%3d in %8lu / %10lu  out %8lu / %10lu  %6lu retransmitted  %6lu dropped\n",
+				network[count].network, network[count].station,
+				network[count].rx_packets, network[count].rx_bytes,
+				network[count].tx_packets, network[count].tx_bytes,
+				network[count].retx, network[count].drops);
 
-	// First, see which trunk this destination might be on.
+	fprintf (out, "STATS: AUN round trip times (smoothed / deviation / retransmission timeout):\n");
 
-	trunk = trunk_find(p->p.dstnet);
+	for (count = 0; count < stations; count++)
+		if (network[count].aun_rtt_samples)
+			fprintf (out, "STATS:     %3d.%3d %lu.%03lu / %lu.%03lu / %ld ms from %lu ACKs%s\n",
+				network[count].network, network[count].station,
+				network[count].aun_srtt / 1000, network[count].aun_srtt % 1000,
+				network[count].aun_rttvar / 1000, network[count].aun_rttvar % 1000,
+				econet_aun_rto(count), network[count].aun_rtt_samples,
+				network[count].aun_backoff ? " (backing off)" : "");
 
-	if (trunk >= 0)
-		result = aun_trunk_send_internal(p, len, trunk);
-	else	if (pkt_debug) fprintf (stderr, "TRUNK: to %3d.%3d from %3d.%3d Trunk destination not found\n", p->p.dstnet, p->p.dststn, p->p.srcnet, p->p.srcstn);
+	fprintf (out, "STATS: AUN windows - %lu selective retransmissions, %lu NAKs, %lu packets given up on\n", aun_window_retx, aun_window_naks, aun_window_drops);
 
-	return result;
+	fprintf (out, "STATS: Main loop woke %lu times, %lu of them just for timers; %lu timers have gone off, %lu armed\n",
+		loop_wakeups, loop_idle_wakeups, tw_fired, tw_pending);
 
-}
+	if (loop_timed)
+	{
+		fprintf (out, "STATS: Main loop time per trip over %lu trips (average / longest, us) -", loop_timed);
+		for (count = 0; count < ECONET_PHASES; count++)
+			fprintf (out, " %s %" PRIu64 ".%03" PRIu64 " / %" PRIu64, phase_names[count],
+				loop_phase_ns[count] / loop_timed / 1000, (loop_phase_ns[count] / loop_timed) % 1000, loop_phase_max[count] / 1000);
+		fprintf (out, "\n");
+	}
 
-// Source is only used to pass to local handler to process broadcasts so we know where they came from
-int aun_send_internal (struct __econet_packet_aun *p, int len, int source)
-{
+	for (count = 0, fsops = 0; count < 256; count++)
+		fsops += __atomic_load_n(&(fs_ops[count]), __ATOMIC_RELAXED);
 
-	int d, s, result; // d, s are pointers into network[]; result is number of bytes written or error return
-	int is_on_wirebridge = 0;
+	if (fsops)
+	{
+		int n = 0;
 
-	//fprintf (stderr, "aun_send_internal type %d, dst = %3d.%3d, len = %d\n", p->p.aun_ttype, p->p.dstnet, p->p.dststn, len);
+		fprintf (out, "STATS: Fileserver operations by function code:");
 
-	if (p->p.aun_ttype == ECONET_AUN_BCAST)
-		p->p.dstnet = p->p.dststn = 0xff;
-		
-	d = econet_ptr[p->p.dstnet][p->p.dststn];
-	s = econet_ptr[p->p.srcnet][p->p.srcstn];
+		for (count = 0; count < 256; count++)
+		{
+			unsigned long ops = __atomic_load_n(&(fs_ops[count]), __ATOMIC_RELAXED);
 
-	// Probably need to pick up here if the destination is on a network advertised to us by a wire bridge - if so, then if the source is not on the wire as well (and not on a wire bridge either!) then we should treat it as going onto the wire. Maybe a new variable wire_bridged which we can use in the logic below. Otherwise stuff which ought to go on the wire which has come from AUN (most likely via a trunk, but it could also be a W statement) will end up heading for an unknown trunk and failing.
+			if (ops)
+				fprintf (out, "%s &%02X %-8lu", (n++ % 8) ? "" : "\nSTATS:    ", count, ops);
+		}
 
-	if (p->p.dstnet != 0xff && wire_adv_in[p->p.dstnet] == 0xff)  // If this is a network we know is via a bridge on the wire, flag that up.
-		is_on_wirebridge = 1;
-	
-	if (d != -1) network[d].last_transaction = time(NULL);
+		fprintf (out, "\n");
+	}
 
-	p->p.ctrl |= 0x80; // In case we're going to wire or local
-	
-	p->p.padding = 0x00;
+	econet_hist_text(out);
 
-	//fprintf (stderr, "Got here 1\n");
-	if (p->p.aun_ttype != ECONET_AUN_ACK && p->p.aun_ttype != ECONET_AUN_NAK) // Don't dump acks...
-		dump_udp_pkt_aun(p, len);
+	econet_thread_dump(out);
 
-	//fprintf (stderr, "Got here 2\n");
-	result = -1;
+	econet_pool_dump(out);
 
-	// Perform interlock - do not send between same type of endpoints, or between trunk<->AUN/IP, and drop any RAW traffic in bridge mode
+	if (aun_shared_socket != -1)
+		fprintf (out, "STATS: Shared AUN listener received %lu datagrams, %lu for unknown stations\n", aun_shared_rx, aun_shared_unknown);
 
-	if ((d != -1) && (s != -1)) // Both are known particular stations - i.e. not trunk
+	if (numtrunks > 0)
 	{
-		if ((network[d].type & ECONET_HOSTTYPE_TAUN) == 0) // Raw destination - dump it
-		{
-			if (pkt_debug) fprintf (stderr, "ILOCK: to %3d.%3d from %3d.%3d I refuse to forward traffic to a raw destination.\n", p->p.dstnet, p->p.dststn, p->p.srcnet, p->p.srcstn);
-			return result;
-		}
-		if ((network[s].type & ECONET_HOSTTYPE_TAUN) == 0) // Raw source - dump it
-		{
-			if (pkt_debug) fprintf (stderr, "ILOCK: to %3d.%3d from %3d.%3d I refuse to forward traffic from a raw source.\n", p->p.dstnet, p->p.dststn, p->p.srcnet, p->p.srcstn);
-			return result;
-		}
-		if ((network[d].type & ~ECONET_HOSTTYPE_TAUN) == (network[s].type & ~ECONET_HOSTTYPE_TAUN)) // Same type - dump it
-		{
-			if (pkt_debug) fprintf (stderr, "ILOCK: to %3d.%3d from %3d.%3d I refuse to forward betwen stations of the same type.\n", p->p.dstnet, p->p.dststn, p->p.srcnet, p->p.srcstn);
-			return result;
-		}
+		fprintf (out, "STATS: Trunk datagrams dropped from unrecognized peers %lu\n", trunk_unknown_drops);
+		trunk_queue_dump(out);
+		trunk_route_dump(out);
 	}
-	else
+}
+
+// Write string s to out as a JSON string
+
+void econet_json_string(FILE *out, char *s)
+{
+	fputc('"', out);
+
+	for (; *s; s++)
 	{
-		if (is_on_wirebridge && source == 0) // Wire to wire
-		{
-			if (pkt_debug) fprintf (stderr, "ILOCK: to %3d.%3d from %3d.%3d I refuse to forward wire traffic via a wire bridge\n", p->p.dstnet, p->p.dststn, p->p.srcnet, p->p.srcstn);
-			return result;
-		}
-		if (d == -1 && (s != -1) && (network[s].type & ECONET_HOSTTYPE_TDIS)) // AUN/IP source to Trunk - dump it
-		{
-			if (pkt_debug) fprintf (stderr, "ILOCK: to %3d.%3d from %3d.%3d I refuse to forward AUN traffic to trunk\n", p->p.dstnet, p->p.dststn, p->p.srcnet, p->p.srcstn);
-			return result;
-		}
-		if (s == -1 && (d != -1) && (network[d].type & ECONET_HOSTTYPE_TDIS)) // Trunk to AUN/IP - dump it
-		{
-			if (pkt_debug) fprintf (stderr, "ILOCK: to %3d.%3d from %3d.%3d I refuse to forward trunk traffic to AUN.\n", p->p.dstnet, p->p.dststn, p->p.srcnet, p->p.srcstn);
-			return result;
-		}
+		if (*s == '"' || *s == '\\')
+			fprintf (out, "\\%c", *s);
+		else if ((unsigned char) *s < 0x20)
+			fprintf (out, "\\u%04x", *s);
+		else	fputc(*s, out);
 	}
 
-	if (s != -1 && (p->p.aun_ttype == ECONET_AUN_DATA || p->p.aun_ttype == ECONET_AUN_IMM)) // Particular source
+	fputc('"', out);
+}
+
+// The statistics as a JSON object - JSON on the statistics socket. Counts only go up (until the bridge restarts), so
+// whatever reads them can work out rates for itself.
+
+void econet_stats_json(FILE *out)
+{
+	unsigned long pool_failures = 0;
+	int count, first;
+
+	for (count = 0; count < POOL_CLASSES; count++)
+		pool_failures += pool_class[count].failures;
+
+	fprintf (out, "{\n\"hosts\": [");
+
+	for (count = 0, first = 1; count < stations; count++)
 	{
-		if (network[s].type & ECONET_HOSTTYPE_TDIS || network[s].type & ECONET_HOSTTYPE_TNAMEDPIPE) // AUN or named Pipe
-		{
-			gettimeofday(&(network[s].aun_last_rx), 0); // Flag the packet receipt time so we know when to expire the ACK / IMMREP timer
-			network[s].ackimm_seq_tosend = p->p.seq;
-		}
+		struct econet_hosts *h = &(network[count]);
+		char *type;
 
-		if (network[s].type & ECONET_HOSTTYPE_TWIRE && p->p.aun_ttype == ECONET_AUN_IMM) // Wire host sending immediate - prioritise the reply
-		{
-			wire_prio_out_srcnet = p->p.dstnet;
-			wire_prio_out_srcstn = p->p.dststn;
-			wire_prio_out_dstnet = p->p.srcnet;
-			wire_prio_out_dststn = p->p.srcstn;
-			wire_prio_out_port = 0;
-			wire_prio_out_auntype = ECONET_AUN_IMMREP;
-		}
+		if (!(h->rx_packets || h->tx_packets || h->drops || h->aun_queue_len))
+			continue;
 
+		if (h->type & ECONET_HOSTTYPE_TNAMEDPIPE)
+			type = "pipe";
+		else if (h->type & ECONET_HOSTTYPE_TLOCAL)
+			type = "local";
+		else if (h->type & ECONET_HOSTTYPE_TDIS)
+			type = "aun";
+		else	type = "wire";
+
+		fprintf (out, "%s\n  {\"net\": %d, \"stn\": %d, \"type\": \"%s\", \"rx_packets\": %lu, \"rx_bytes\": %lu, \"tx_packets\": %lu, \"tx_bytes\": %lu, \"retransmits\": %lu, \"drops\": %lu, \"queue_packets\": %u, \"queue_bytes\": %lu, \"rtt_us\": %lu, \"rttvar_us\": %lu, \"rtt_samples\": %lu}",
+			first ? "" : ",", h->network, h->station, type,
+			h->rx_packets, h->rx_bytes, h->tx_packets, h->tx_bytes, h->retx, h->drops,
+			h->aun_queue_len, h->aun_queue_bytes,
+			h->aun_srtt, h->aun_rttvar, h->aun_rtt_samples);
+		first = 0;
 	}
 
-	// Broadcasts
+	fprintf (out, "\n],\n\"trunks\": [");
 
-	if (p->p.aun_ttype == ECONET_AUN_BCAST && p->p.port != 0x9c) // We don't retransmit bridge traffic because we tinker with that elsewhere
+	for (count = 1, first = 1; count < 256; count++)
 	{
+		struct __trunk *t = &(trunks[count]);
 
-		int trunk, count;
-
-		result = len;
+		if (t->listensocket < 0)
+			continue;
 
-		//fprintf (stderr, "Broadcast retransmission - len = %d, s = %d\n", len, s);
+		fprintf (out, "%s\n  {\"trunk\": %d, \"host\": ", first ? "" : ",", count);
+		econet_json_string(out, t->hostname);
+		fprintf (out, ", \"port\": %d, \"tx_frames\": %lu, \"tx_bytes\": %lu, \"rx_frames\": %lu, \"rx_bytes\": %lu, \"firewall_drops\": %lu, \"queue_packets\": %u, \"queue_bytes\": %lu, \"retransmits\": %lu, \"rtt_us\": %lu}",
+			t->port, t->tx_frames, t->tx_bytes, t->rx_frames, t->rx_bytes, t->fw_drops,
+			t->q_len, t->q_bytes, t->rel_fast_retx + t->rel_timeout_retx, t->srtt);
+		first = 0;
+	}
 
-		// Dump it locally if it wasn't local
-		if ((s != -1 && (!(network[s].type & ECONET_HOSTTYPE_TLOCAL))) || (s == -1)) // Known source and it wasn't a local emulator,  or unknown source
-		{
-			//fprintf (stderr, "Sending broadcast to local\n");
-			econet_handle_local_aun(p, len, source);
-		}
+	fprintf (out, "\n],\n\"queues\": [");
 
-		// Now dump it to all the named pipes we can find
+	for (count = 0; count < ECONET_QUEUE_TYPES; count++)
+		fprintf (out, "%s\n  {\"name\": \"%s\", \"limit_packets\": %u, \"limit_bytes\": %lu, \"full\": %lu, \"shed\": %lu, \"expired\": %lu}",
+			count ? "," : "", queue_names[count], queue_limits[count].packets, queue_limits[count].bytes,
+			queue_full_drops[count], queue_delay_drops[count], queue_age_drops[count]);
 
-		for (count = 0; count < stations;  count++)
-		{
-			if ((network[count].type & ECONET_HOSTTYPE_TNAMEDPIPE) && (s != -1 && s != count) && (network[count].pipewritesocket != -1)) // Is a named pipe, and not the one the packe came from
-			{
-				struct __econet_packet_pipe delivery;
+	fprintf (out, "\n],\n\"drops\": {");
 
-				delivery.length_low = len & 0xff;
-				delivery.length_high = (len >> 8) & 0xff;
-				
-				memcpy(&(delivery.dststn), p, len);
-				write(network[count].pipewritesocket, &delivery, len+2);
-			}
+	for (count = 0; count < ECONET_DROP_REASONS; count++)
+		fprintf (out, "\"%s\": %lu, ", drop_names[count], econet_drops[count]);
 
-		}
+	fprintf (out, "\"no_memory\": %lu, \"udp_send_error\": %lu, \"unknown_trunk_peer\": %lu},\n", pool_failures, udp_tx_errors, trunk_unknown_drops);
 
-		// if it didn't come from the wire, put it on the wire
-		if (source != 0)	
-		{
-			//fprintf (stderr, "Sending broadcast to wire\n");
-			econet_write_wire(p, len, 0); // Was len+12
-		}
+	fprintf (out, "\"wire\": {\"queued\": %lu, \"sent\": %lu, \"tx_results\": [", wire_queued, wire_sent[0] + wire_sent[1]);
 
-		// And on every trunk it didn't come from
-	
-		for (trunk = 1; trunk < 256; trunk++)
+	for (count = 0, first = 1; count < 256; count++)
+		if (wire_tx_results[count])
 		{
-			if (trunks[trunk].listensocket >= 0 && trunk != source)
-			{	//fprintf (stderr, "Sending broadcast to trunk %d\n", trunk);
-				aun_trunk_send_internal (p, len, trunk);
-			}
+			fprintf (out, "%s{\"code\": %d, \"name\": \"%s\", \"count\": %lu}", first ? "" : ", ", count, econet_strtxerr(-1 * count), wire_tx_results[count]);
+			first = 0;
 		}
 
-	}
+	fprintf (out, "]},\n\"aun\": {\"queued\": %lu, \"window_retransmits\": %lu, \"window_naks\": %lu, \"unindexed_dynamic\": %lu},\n", aun_queued, aun_window_retx, aun_window_naks, aun_hash_full);
 
-	// If trunk destination, the trunk send routine does NAT and works out which trunk
+	fprintf (out, "\"udp\": {\"rx_datagrams\": %lu, \"rx_calls\": %lu, \"tx_datagrams\": %lu, \"tx_calls\": %lu},\n",
+		udp_rx_datagrams, udp_rx_calls, udp_tx_datagrams, udp_tx_calls);
 
-	// Now, where's it going?
+	fprintf (out, "\"fileserver_ops\": [");
 
-	else if (p->p.aun_ttype == ECONET_AUN_BCAST || (d != -1 && (network[d].type & ECONET_HOSTTYPE_TLOCAL))) // Probably need to forward broadcasts received off the wire to AUN/IP hosts on same net, but we don't at the moment; We catch broadcasts here again because we don't process BRIDGE broadcasts above, so they need to go to the local handler
+	for (count = 0, first = 1; count < 256; count++)
 	{
-		econet_handle_local_aun(p, len, source);
-		// probably need to forward broadcasts to trunks / wire depending on source - TODO
-		result = len;
-	}
-	else if (!is_on_wirebridge && d == -1) // Trunk send (we will now send broadcasts on trunks as well)
-	{
-		p->p.ctrl &= 0x7f; // Strip high bit from control an AUN transmission
+		unsigned long ops = __atomic_load_n(&(fs_ops[count]), __ATOMIC_RELAXED);
 
-		if (s == -1) // Trunk to trunk - straight out
-			result = aun_trunk_send (p, len);
-		else
+		if (ops)
 		{
-			econet_general_enqueue(&trunk_head, &trunk_tail, p, len);
-			result = len;
+			fprintf (out, "%s{\"op\": %d, \"count\": %lu}", first ? "" : ", ", count, ops);
+			first = 0;
 		}
 	}
-	else if (is_on_wirebridge || network[d].type & ECONET_HOSTTYPE_TWIRE) // Wire - and we prevent material received from the wire going back onto the wire
-	{
-		// Is it a wired fileserver we might want to know about? To cope with wired filservers that are via wired bridges, we probably need a separate list of wired fileservers now - TODO
 
-		if (!is_on_wirebridge && (network[d].type & ECONET_HOSTTYPE_TWIRE) && (p->p.port == 0x99) && (!(network[d].is_wired_fs))) // Fileserver traffic on a wire station
-		{
-			network[d].is_wired_fs = 1;
-			fprintf (stderr, "  DYN:%12s             Station %d.%d identified as wired fileserver\n", "", p->p.dstnet, p->p.dststn);
-		}
+	fprintf (out, "],\n\"loop\": {\"wakeups\": %lu, \"idle_wakeups\": %lu, \"timers_fired\": %lu, \"timers_armed\": %lu, \"timed_trips\": %lu, \"phases\": [",
+		loop_wakeups, loop_idle_wakeups, tw_fired, tw_pending, loop_timed);
 
-		// Update this even if we don't get to transmit - what's the harm?
-		if (!is_on_wirebridge && p->p.aun_ttype == ECONET_AUN_IMM)
-			network[d].last_imm_seq_sent = p->p.seq;
+	for (count = 0; count < ECONET_PHASES; count++)
+		fprintf (out, "%s{\"name\": \"%s\", \"total_ns\": %" PRIu64 ", \"max_ns\": %" PRIu64 "}", count ? ", " : "", phase_names[count], loop_phase_ns[count], loop_phase_max[count]);
 
-		econet_enqueue(p, len, QUEUE_AUTO);
-		result = len;
+	fprintf (out, "]},\n\"latency\": [");
 
-	}
-	else if ((network[d].type & ECONET_HOSTTYPE_TNAMEDPIPE)) // Named pipe client
+	first = 1;
+	econet_hist_json(out, "\"what\": \"wire_transmit\"", &wire_tx_hist, &first);
+
+	for (count = 0; count < ECONET_QUEUE_TYPES; count++)
 	{
-		if (network[d].pipewritesocket != -1)
-		{
-			struct __econet_packet_pipe delivery;
-		
-			delivery.length_low = len & 0xff;
-			delivery.length_high = (len >> 8) & 0xff;
-			memcpy(&(delivery.dststn), p, len);
-			result = write(network[d].pipewritesocket, &delivery, len+2);
-			if (result == len+2) result -= 2;
-		}
-		else	if (pkt_debug) fprintf (stderr, "PIPE : Pipe write socket not open\n");
+		char what[64];
+
+		snprintf (what, sizeof(what), "\"what\": \"queue_wait\", \"queue\": \"%s\"", queue_names[count]);
+		econet_hist_json(out, what, &(queue_sojourn_hist[count]), &first);
 	}
-	else if (network[d].type & ECONET_HOSTTYPE_TDIS)
-	{
-		p->p.ctrl &= 0x7f; // Strip high bit from control an AUN transmission
 
-		// We shouldn't see ACK or NAK here because they are caught on input and processed.
+	for (count = 0; count < stations; count++)
+		if (network[count].aun_rtt_hist)
+		{
+			char what[64];
 
-		if (p->p.aun_ttype != ECONET_AUN_BCAST) // Ignore broadcasts to AUN for now
+			snprintf (what, sizeof(what), "\"what\": \"aun_ack\", \"net\": %d, \"stn\": %d", network[count].network, network[count].station);
+			econet_hist_json(out, what, network[count].aun_rtt_hist, &first);
+		}
+
+	for (count = 0; count < 256; count++)
+		if (__atomic_load_n(&(fs_ops[count]), __ATOMIC_RELAXED))
 		{
-			if (econet_general_enqueue(&(network[d].aun_head), &(network[d].aun_tail), p, len))
-			{
-				result = len;
-				aun_queued++;
-			}
-			else	result = 0;
+			char what[64];
+
+			snprintf (what, sizeof(what), "\"what\": \"fs_operation\", \"op\": %d", count);
+			econet_hist_json(out, what, &(fs_op_hist[count]), &first);
 		}
-		else result = len;
-	}
-	else // Unknown destination type
-	{
-		fprintf (stderr, "ERROR: to %3d.%3d from %3d.%3d Unknown destination\n", p->p.dstnet, p->p.dststn, p->p.srcnet, p->p.srcstn);
-	}
 
-	return result;
+	fprintf (out, "\n]\n}\n");
+}
+
+// Statistics socket ('STATS /path' in the config). A client connects, sends TEXT or JSON and a newline, and gets the
+// statistics back in that form, after which the bridge hangs up. Everything is counted anyway and nothing is formatted
+// until somebody asks, so it costs nothing whilst nobody is looking - except the main loop phase timings, which start
+// when the first client connects. The reply goes out as fast as the client takes it, so a slow one holds nothing up,
+// and one which goes quiet for ECONET_STATS_IDLE is hung up on, so that it doesn't keep a slot from anyone else.
+
+#define ECONET_STATS_CLIENTS 4 // Most connected at once
+#define ECONET_STATS_IDLE 5000 // ms
 
+struct econet_stats_client {
+	int fd; // -1 = slot free
+	char cmd[32]; // What it has sent so far
+	int cmdlen;
+	char *buf; // Its reply, from open_memstream() - NULL until the whole command has arrived
+	size_t len, done; // How long the reply is, and how much of it has gone
+	struct econet_timer idle_timer; // Re-armed each time it sends or takes something
+} stats_clients[ECONET_STATS_CLIENTS];
+
+int stats_socket = -1;
+
+void econet_stats_close(struct econet_stats_client *c)
+{
+	close(c->fd); // Takes it out of the epoll set too
+	c->fd = -1;
+	free(c->buf);
+	c->buf = NULL;
+	econet_timer_cancel(&(c->idle_timer));
 }
 
-// Stub function to wrap around aun_send_internal for compatibility with code which does not send broadcasts to be handled by the local bridge handler
-int aun_send (struct __econet_packet_aun *p, int len)
+void econet_stats_idle_expired(int i)
 {
-	return aun_send_internal(p, len, -1);
+	if (stats_clients[i].fd != -1)
+		econet_stats_close(&(stats_clients[i]));
 }
 
-// Map a sockaddr to a network[] entry - used to find source station of UDP packets
-// Returns 0xffff if not founD
+// Send client c as much of its reply as it will take. Returns 1 once it has all gone (or the client has gone away)
 
-int econet_find_source_station (struct sockaddr_in *src_address)
+int econet_stats_send(struct econet_stats_client *c)
 {
+	ssize_t w;
 
-	int from_found = 0xffff;
-	int count = 0;
-
-	while ((from_found == 0xffff) && (count < stations))
+	while (c->done < c->len)
 	{
+		if ((w = send(c->fd, c->buf + c->done, c->len - c->done, MSG_DONTWAIT | MSG_NOSIGNAL)) < 0)
+			return (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR);
 
-		if ( (network[count].s_addr.s_addr == src_address->sin_addr.s_addr) &&
-			(network[count].port == ntohs(src_address->sin_port)) &&
-			(	network[count].is_dynamic == 0 ||
-				(network[count].last_transaction > (time(NULL) - ECONET_LEARNED_HOST_IDLE_TIMEOUT))
-			)
-		   )
-			from_found = count;
-
-		 count++;
+		c->done += w;
+		econet_timer_arm(&(c->idle_timer), ECONET_STATS_IDLE);
 	}
 
-	return from_found;
+	return 1;
 }
 
-// Find which trunk a given network is down
-short trunk_find (unsigned char net)
+void econet_handle_stats_client(int fd, uint32_t events)
 {
+	struct econet_stats_client *c = NULL;
+	int i;
 
-	int found = 0;
-	int counter = 0;
+	for (i = 0; i < ECONET_STATS_CLIENTS; i++)
+		if (stats_clients[i].fd == fd)
+			c = &(stats_clients[i]);
 
-	while (!found && (counter < 256))
+	if (!c) // Not one of ours
+		return;
+
+	if (!c->buf) // Still waiting for it to say what it wants
 	{
-		if ((trunks[counter].listensocket >= 0) && (trunks[counter].adv_in[net] == 0xff))
-			found = 1;
-		else	counter++;
-	}
+		struct epoll_event ev;
+		FILE *out;
+		ssize_t r;
+		char *eol;
+
+		r = read(fd, c->cmd + c->cmdlen, sizeof(c->cmd) - 1 - c->cmdlen);
+
+		if (r <= 0)
+		{
+			if (r == 0 || (errno != EAGAIN && errno != EINTR))
+				econet_stats_close(c);
+			return;
+		}
+
+		c->cmdlen += r;
+		c->cmd[c->cmdlen] = 0;
+		econet_timer_arm(&(c->idle_timer), ECONET_STATS_IDLE);
+
+		if (!(eol = strpbrk(c->cmd, "\r\n")))
+		{
+			if (c->cmdlen == sizeof(c->cmd) - 1) // That's not a command we know
+				econet_stats_close(c);
+			return;
+		}
 
-	return (found ? counter : -1);	
+		*eol = 0;
 
+		if (!(out = open_memstream(&(c->buf), &(c->len))))
+		{
+			econet_stats_close(c);
+			return;
+		}
+
+		if (!strcasecmp(c->cmd, "JSON"))
+			econet_stats_json(out);
+		else if (!strcasecmp(c->cmd, "TEXT") || !c->cmd[0])
+			econet_stats_text(out);
+		else if (!strcasecmp(c->cmd, "HIST"))
+			econet_hist_text(out);
+		else if (!strcasecmp(c->cmd, "RESET"))
+		{
+			econet_hist_reset_all();
+			fprintf (out, "Latency histograms reset\n");
+		}
+		else	fprintf (out, "Unknown request '%s' - try TEXT, JSON, HIST or RESET\n", c->cmd);
+
+		fclose(out);
+
+		if (!econet_stats_send(c)) // The rest when it has room for it
+		{
+			ev.events = EPOLLOUT;
+			ev.data.fd = fd;
+			epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &ev);
+			return;
+		}
+	}
+	else if (!econet_stats_send(c))
+		return;
+
+	econet_stats_close(c);
 }
 
-// Trunk address translation and firewalling
-// dir = 0 means inbound on a trunk
-// dir = 1 means outbound on a trunk
-// Return is FW_ACCEPT; FW_DROP
-int trunk_xlate_fw(struct __econet_packet_aun *p, int trunk, unsigned char dir)
+void econet_handle_stats_listen(int fd, uint32_t events)
 {
+	int s, i;
 
-	struct __fw_entry *fw;
+	if ((s = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) == -1)
+		return;
 
-	int ret = FW_ACCEPT;
+	for (i = 0; i < ECONET_STATS_CLIENTS && stats_clients[i].fd != -1; i++);
 
-	if (dir == 1) // Outbound
+	if (i == ECONET_STATS_CLIENTS) // Too many at once
 	{
-		if ((p->p.dstnet != p->p.srcnet) && (p->p.srcnet == 0)) // If traffic coming from net 0 (as it will be until AUN devices have a "default route" system), and we are not sending to dstnet which is the same as srcnet, substitute the local network number. Note that this allows a trunk to carry net 0 from one wired econet to another.
-			p->p.srcnet = localnet;
+		close(s);
+		return;
+	}
 
-		// Next do address translation
+	stats_clients[i].fd = s;
+	stats_clients[i].cmdlen = 0;
+	stats_clients[i].done = stats_clients[i].len = 0;
+	econet_timer_arm(&(stats_clients[i].idle_timer), ECONET_STATS_IDLE);
 
-		if (trunks[trunk].xlate_src[p->p.srcnet] != 0xff) // Translate our network number if there is a translation entry
-			p->p.srcnet = trunks[trunk].xlate_src[p->p.srcnet];
-	}
-	else // Inbound - do firewalling here (no firewalling on outbound traffic)
+	if (!loop_timing) // Somebody's interested - start timing the main loop
 	{
+		loop_timing = 1;
+		loop_phase_mark = econet_clock_ns(CLOCK_MONOTONIC);
+	}
 
-		if (trunks[trunk].xlate_dst[p->p.dstnet] != 0xff) // Translate inbound
-			p->p.dstnet = trunks[trunk].xlate_dst[p->p.dstnet];
+	econet_watch_fd(s, econet_handle_stats_client);
+}
 
-		// Convert to net 0 if it is our local network number
+// Open the statistics socket, if the config asked for one
 
-		if (p->p.dstnet == localnet) p->p.dstnet = 0;
+void econet_stats_open(void)
+{
+	struct sockaddr_un a;
+	int i;
 
-		// Firewall
+	for (i = 0; i < ECONET_STATS_CLIENTS; i++)
+	{
+		stats_clients[i].fd = -1;
+		econet_timer_init(&(stats_clients[i].idle_timer), econet_stats_idle_expired, i);
+	}
 
-		fw = trunks[trunk].head;
-			
-		while (fw)
-		{
-			// Matching entry?
-			if (	((fw->srcnet == 255) || (fw->srcnet == p->p.srcnet))	
-			&&	((fw->srcstn == 255) || (fw->srcstn == p->p.srcstn))
-			&&	((fw->dstnet == 255) || (fw->dstnet == p->p.dstnet))
-			&&	((fw->dststn == 255) || (fw->dststn == p->p.dststn))
-			)
-			{
-				ret = fw->action;
-				break;
-			}
-			else	fw = fw->next;
-		}
-					
+	if (!stats_path)
+		return;
+
+	if (strlen(stats_path) >= sizeof(a.sun_path))
+	{
+		fprintf (stderr, "Statistics socket name %s is too long.\n", stats_path);
+		exit(EXIT_FAILURE);
 	}
 
-	if (pkt_debug && (ret == FW_DROP)) // log it
-		fprintf (stderr, "FWALL: to %3d.%3d from %3d.%3d FORBIDDEN\n", p->p.dstnet, p->p.dststn, p->p.srcnet, p->p.srcstn);
-	
-	return ret;
+	memset(&a, 0, sizeof(a));
+	a.sun_family = AF_UNIX;
+	strcpy(a.sun_path, stats_path);
+
+	unlink(stats_path); // Left behind last time
+
+	if ((stats_socket = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) == -1
+	||	bind(stats_socket, (struct sockaddr *) &a, sizeof(a)) == -1
+	||	listen(stats_socket, ECONET_STATS_CLIENTS) == -1)
+	{
+		fprintf (stderr, "Unable to open statistics socket %s: %s\n", stats_path, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
 
+	econet_watch_fd(stats_socket, econet_handle_stats_listen);
+
+	if (pkt_debug) econet_debug ("STATS: Statistics available on %s\n", stats_path);
 }
 
-// Returns 1 if net.stn is either AUN/IP or trunk (use is_on_trunk() to work out whether it's on a trunk)
+// Timer handlers for the main loop
 
-unsigned short is_aun(unsigned char net, unsigned char stn)
+// Reset the module - an Immediate to AUN went unresponded to, so the chip will not be in read mode any more
+
+void econet_imm_reset_expired(int arg)
 {
-	if ((econet_ptr[net][stn] == -1) || (network[econet_ptr[net][stn]].type & ECONET_HOSTTYPE_TDIS))
-		return 1;
-		
-	return 0;
+	if (wire_queued || aun_queued || trunk_queued) // Not quiet yet
+		econet_timer_arm(&imm_reset_timer, ECONET_AUN_IMM_RESET_TIME);
+	else
+		econet_wire_readmode();
 }
 
-// Returns 1 if net.stn isn't in network[] - i.e. if it's anywhere it's on a trunk AND we can find a trunk that appears to advertise it the relevant network
-static inline unsigned short is_on_trunk(unsigned char net, unsigned char stn)
+// Fileserver garbage collection, and polling the socket servers - on the service thread
+
+void econet_housekeeping(int arg)
 {
-	if (econet_ptr[net][stn] == -1) 
-	{
-		unsigned short count = 1;
-	
-		while (count < 256)
-		{
-			if (trunks[count].listensocket >= 0 && trunks[count].adv_in[net] == 0xff)
-				return 1;
-			else count++;
-		}
-	}
-	return 0;
+	econet_service_post(0, ECONET_SVC_HOUSEKEEPING, NULL, 0, 0, 0);
+
+	econet_timer_arm(&housekeeping_timer, ECONET_HOUSEKEEPING_TIME);
 }
 
+// Periodic full bridge reset, so that we re-learn the topology
+
+void econet_bridge_reset_expired(int arg)
+{
+	if (pkt_debug) econet_debug ("BRIDGE: Periodic reset\n");
+
+	econet_bridge_process (NULL, 0, -1); // Self-initiated reset
+	gettimeofday(&last_bridge_reset, 0);
+
+	econet_timer_arm(&bridge_reset_timer, ECONET_BRIDGE_RESET_FREQ * 1000);
+}
 
 int main(int argc, char **argv)
 {
@@ -3001,15 +8708,7 @@ int main(int argc, char **argv)
 	int s;
 	int opt;
 	int dump_station_table = 0;
-	short fs_bulk_traffic = 0;
-	int last_active_fd = 0;
-	int poll_timeout; // Used in order to reset the chip if we send an immediate to an AUN station and it doesn't reply
 
-	unsigned short from_found, to_found; // Used to see if we know a station or not
-
-	struct __econet_packet_aun rx;
-
-	memset(&network, 0, sizeof(network));
 	memset(&econet_ptr, 0xff, sizeof(econet_ptr));
 	memset(&fd_ptr, 0xff, sizeof(fd_ptr));
 	memset(&pipeudpsockets, 0xff, sizeof(pipeudpsockets));
@@ -3078,6 +8777,11 @@ Options:\n\
 		}
 	}
 
+#ifdef ECONET_NO_DEBUG
+	if (pkt_debug || queue_debug || fs_noisy)
+		fprintf (stderr, "Built without debug output (ECONET_NO_DEBUG) - -d, -r, -n and -m only turn on ordinary logging\n");
+#endif
+
 	ECONET_INIT_STATIONS(econet_stations);
 	ECONET_SET_STATION(econet_stations, 255, 255); // Put broadcasts into the AUN pool
 
@@ -3123,16 +8827,16 @@ Options:\n\
 							(network[p].type & ECONET_HOSTTYPE_TWIRE) ? "Wire" : 
 							(network[p].type & ECONET_HOSTTYPE_TNAMEDPIPE) ? "Unix" : "Local",
 						(network[p].type & ECONET_HOSTTYPE_TAUN ? "AUN" : "RAW"),
-						(network[p].type & ECONET_HOSTTYPE_TDIS) ? network[p].hostname : "",
+						((network[p].type & ECONET_HOSTTYPE_TDIS) && network[p].hostname) ? network[p].hostname : "",
 						network[p].port,
 						((network[p].servertype & ECONET_SERVER_FILE) ? 'F' : ' '),
 						((network[p].servertype & ECONET_SERVER_PRINT) ? 'P' : ' '),
 						((network[p].servertype & ECONET_SERVER_SOCKET) ? 'S' : ' '),
-						((network[p].servertype & ECONET_SERVER_FILE) ? network[p].fs_serverparam : ""),
+						((network[p].servertype & ECONET_SERVER_FILE) ? network[p].server->fs_serverparam : ""),
 						((network[p].servertype & ECONET_SERVER_FILE) ? " " : ""),
-						//((network[p].servertype & ECONET_SERVER_PRINT) ? network[p].print_serverparam : ""),
+						//((network[p].servertype & ECONET_SERVER_PRINT) ? network[p].server->print_serverparam : ""),
 						//((network[p].servertype & ECONET_SERVER_PRINT) ? " " : ""),
-						((network[p].servertype & ECONET_SERVER_SOCKET) ? network[p].socket_serverparam : ""),
+						((network[p].servertype & ECONET_SERVER_SOCKET) ? network[p].server->socket_serverparam : ""),
 						((network[p].servertype & ECONET_SERVER_SOCKET) ? " " : ""),
 						((network[p].type & ECONET_HOSTTYPE_TNAMEDPIPE) ? network[p].named_pipe_filename : "")
 					);
@@ -3141,8 +8845,8 @@ Options:\n\
 					{
 						int c;
 
-						for (c = 0; c < network[p].numprinters; c++)
-							fprintf(stderr, "%64s%c %1d %s : %s\n", "", 'P', c, network[p].printers[c].name, network[p].printers[c].unixname);
+						for (c = 0; c < network[p].server->numprinters; c++)
+							fprintf(stderr, "%64s%c %1d %s : %s\n", "", 'P', c, network[p].server->printers[c].name, network[p].server->printers[c].unixname);
 
 					}
 				}
@@ -3173,6 +8877,8 @@ Options:\n\
 						}
 						fprintf (stderr, "\n");
 					}
+
+					trunk_fw_dump(n);
 					
 				}
 
@@ -3206,10 +8912,24 @@ Options:\n\
 		ioctl(econet_fd, ECONETGPIO_IOC_IMMSPOOF, 1);
 	else	ioctl(econet_fd, ECONETGPIO_IOC_IMMSPOOF, 0);
 	
-	pset[pmax].fd = econet_fd;
+	econet_log_start(); // Before the other threads start, so that all their output goes through it
+
+	econet_ring_init(&wire_tx_ring, 128 * 1024, "wire transmit");
+	econet_ring_init(&wire_rx_ring, 256 * 1024, "wire receive");
+
+	if (wire_enabled) // With -l, econet_fd is /dev/null, and writes to it just go straight there
+		econet_watch_fd(wire_rx_ring.efd, econet_handle_wire_ring);
+
+	for (s = 0; s <= fs_workers; s++)
+	{
+		char name[24];
 
-	for (s = 0; s <= pmax; s++)
-		pset[s].events = POLLIN;
+		snprintf (name, sizeof(name), "%s request", (s ? thread_names[ECONET_THREAD_SERVICE + s] : "service"));
+		econet_ring_init(&(services[s].in), (s ? 128 : 256) * 1024, name);
+		snprintf (name, sizeof(name), "%s reply", (s ? thread_names[ECONET_THREAD_SERVICE + s] : "service"));
+		econet_ring_init(&(services[s].out), 512 * 1024, name);
+		econet_watch_fd(services[s].out.efd, econet_handle_service_ring);
+	}
 
 	// Set up our fake BeebMem if available
 
@@ -3248,516 +8968,165 @@ Options:\n\
 	}
 	
 	if (pkt_debug)
-		fprintf(stderr, "Awaiting traffic.\n\n");
+		econet_debug ("Awaiting traffic.\n\n");
 
 	/* Wait for traffic */
 
-	fs_bulk_traffic = fs_dequeuable();
-
 	// Do a bridge reset - Announce our presence
 
 	econet_bridge_process (NULL, 0, -1); // Self-initiated reset
 	gettimeofday(&last_bridge_reset, 0);
 
-	srand(time(NULL));
-
-   while (1) // Loop to allow reset of chip if we have an immediate timeout
-   {
-
-	poll_timeout = -1;
-
-	while (wire_head || aun_queued || trunk_head || poll((struct pollfd *)&pset, pmax+(wire_enabled ? 1 : 0), poll_timeout)) // AUN queued packets, wire queued packets, or something arriving. The 1 is because we now have a timeout on poll() in case we need to reset the module to make sure that immediates to AUN stations which are not present doesn't cause a hang!
-	{
-	
-		//fprintf (stderr, "DEBUG: wire_haed = %p, aun_queued = %ld, trunk_head = %p\n", wire_head, aun_queued, trunk_head);
-
-		if (wire_head || aun_queued || trunk_head) // Do a poll just in case something turns up, but do it quickly
-			poll((struct pollfd *) &pset, pmax+(wire_enabled ? 1 : 0), 10);
+	trunk_epoch = (uint32_t) last_bridge_reset.tv_sec ^ ((uint32_t) last_bridge_reset.tv_usec << 12) ^ ((uint32_t) getpid() << 20);
+	if (!trunk_epoch) trunk_epoch = 1; // 0 means 'not known'
 
-		if (wire_enabled && (pset[pmax].revents & POLLIN)) // Let the wire take a back seat sometimes
+	for (s = 1; s < 256; s++) // Find out which trunk peers can take aggregates or compression
+		if (trunks[s].listensocket >= 0)
 		{
-			int r;
-
-
-			// Collect the packet
-			r = read(econet_fd, &rx, ECONET_MAX_PACKET_SIZE);
-
-			if (r > 0) // Ding dong, traffic arriving off the wire  (and if it's -1, the module was busy on read - try next time)
-			{
-				if (r < 12)
-					fprintf(stderr, "Runt packet length %d received off Econet wire\n", r);
-
-				if (!wire_adv_in[rx.p.srcnet]) // This was not a network advertised inbound on the wire - i.e. we should have a network[] entry for it
-				{
-					rx.p.seq = get_local_seq(rx.p.srcnet, rx.p.srcstn);
-
-					if (rx.p.aun_ttype == ECONET_AUN_IMMREP) // Fudge - assume the immediate we have received is a reply to the last one we sent. Maybe make this more intelligent.
-						rx.p.seq = network[econet_ptr[rx.p.srcnet][rx.p.srcstn]].last_imm_seq_sent;
-
-					network[econet_ptr[rx.p.srcnet][rx.p.srcstn]].last_transaction = time(NULL);
-
-				}
-				else
-				{
-					// Need to track sequence and immediate sequence and last transaction somehow... TODO
-
-				}
-
-				// Fudge the AUN type on port 0 ctrl 0x85, which is done as some sort of weird special 4 way handshake with 4 data bytes on the Scout - done as "data" and the kernel module works out that the first 4 bytes in the packet go on the scout and the rest go in the 3rd packet in the 4-way
-
-				if (rx.p.aun_ttype == ECONET_AUN_IMM && rx.p.ctrl == 0x85) // Fudge-a-rama. This deals with the fact that NFS & ANFS in fact do a 4-way handshake on immediate $85, but with 4 data bytes on the "Scout". Those four bytes are put as the first four bytes in the data packet, and a receiving bridge will strip them off, detect the ctrl byte, and do a 4-way with the 4 bytes on the Scout, and the remainder of the data in the "data" packet (packet 3/4 in the 4-way). This enables things like *remote, *view and *notify to work.
-					rx.p.aun_ttype = ECONET_AUN_DATA;
-
-				// This will be from a known wire station or a station from over a bridge, flag priority output if need be (note - there is a concurrency issue with other wire stations since they have their own priority flags. maybe change that to a global wire priority?)
-				
-				// Flag broadcasts incase the module isn't doing it
-				if (rx.p.dstnet == 0xff && rx.p.dststn == 0xff)
-					rx.p.aun_ttype = ECONET_AUN_BCAST;
-
-				aun_send_internal (&rx, r, 0);
-
-			}
+			if (trunks[s].compress && !trunk_z_ready)
+				trunk_z_init();
+			trunk_caps_ask(s);
 		}
 
-		/* See if anything turned up on UDP */
-
-		for (s = 0; s < pmax; s++) /* not the last fd - which is the econet hardware */
-		{
-			int realfd;
-	
-			realfd = (s + start_fd) % pmax; // Offset our start to "start_fd"
-
-			if (pset[realfd].revents & POLLIN)
-				last_active_fd = realfd;
-
-			if ((pset[realfd].revents & POLLHUP) && (network[fd_ptr[pset[realfd].fd]].type & ECONET_HOSTTYPE_TNAMEDPIPE) && (network[fd_ptr[pset[realfd].fd]].pipewritesocket != -1))
-			{
-				int fd, np;
-				char file[250];
-				unsigned char buffer[1024];
-
-				fd = pset[realfd].fd;
-				np = fd_ptr[fd];
-				// Client went away - close the writer pipe
-				close(network[np].pipewritesocket);
-				network[np].pipewritesocket = -1;
-				if (pkt_debug) fprintf (stderr, "*PIPE:                 %3d.%3d client pipe went away.\n", 
-					network[np].network, network[np].station);
-				// Close the reader & re-open it
-				fd_ptr[network[np].listensocket] = -1;
-				snprintf(file, 249, "%s.tobridge", network[np].named_pipe_filename);
-				pset[realfd].fd = open (file, O_RDONLY | O_NONBLOCK);
-				if (pset[realfd].fd != -1)
-					fd_ptr[pset[realfd].fd] = np;
-				else 	// Barf!
-				{
-					fprintf (stderr, "*PIPE: Reader socket for %3d.%3d went away. Quitting.\n", network[np].network, network[np].station);
-					exit(EXIT_FAILURE);
-				}
-
-				network[np].listensocket = pset[realfd].fd;
-
-				// Empty the pipe
-
-				while (read(network[np].listensocket, buffer, 1023) > 0);
-				
-			}
-			else if ((pset[realfd].revents & POLLIN) && (trunk_fd_ptr[pset[realfd].fd] != -1)) // Traffic arriving on trunk
-			{
-				struct __econet_packet_aun p;
-
-				int r, count, from_found = 0xffff;
-				unsigned char policy;
-	
-				r = udp_receive (pset[realfd].fd, (void *) &p, sizeof(p), (struct sockaddr * restrict) &src_address);
-
-				if (r < 0) continue; // Debug produced in udp_receive
-
-				// Which peer did it turn up from?
-
-				count = 1;
-
-				while ((from_found == 0xffff) && (count < 256))
-				{
-
-//					fprintf (stderr, "Checking trunk %d\n", count);
-
-					if (
-// May need some ntohs or ntohl here somewhere..?? TODO
-						trunks[count].listensocket >= 0 // Active trunk
-					&&	((((struct sockaddr_in *) (trunks[count].addr->ai_addr))->sin_addr.s_addr) == src_address.sin_addr.s_addr) // Someone we know about
-					&&	((((struct sockaddr_in *) (trunks[count].addr->ai_addr))->sin_port) == (src_address.sin_port))
-					)
-						from_found = count;
-					else	count++;
-
-				}
-
-				if (from_found == 0xffff) // Traffic arrived on a trunk but either not from someone friendly, or it was but not on a network we think should be arriving on that trunk
-				{
-					// Dump it.
-					fprintf (stderr, "TRUNK: to %3d.%3d from %3d.%3d received on trunk %04X unrecognized\n", p.p.dstnet, p.p.dststn, p.p.srcnet, p.p.srcstn, (from_found == 0xffff ? 0xffff : count));
-					continue;
-				}
-				else if (trunks[from_found].adv_in[p.p.srcnet] != 0xff && (p.p.port != 0x9c)) // Check if this was a network we were expecting from that source, and it wasn't bridge traffic
-				{
-					fprintf (stderr, "FWALL: to %3d.%3d from %3d.%3d received on trunk %04X from unadvertized source network %d\n", p.p.dstnet, p.p.dststn, p.p.srcnet, p.p.srcstn, from_found, p.p.srcnet);
-					continue;
-				}
-			
-
-				policy = trunk_xlate_fw(&p, count, 0); // 0 = inbound translation && firewalling
-
-// Disabled - use aun_send_internal
-/*
-				if ((p.p.aun_ttype == ECONET_AUN_BCAST) && from_found != 0xffff) // Dump to local in case it's bridge stuff - but only if we knew where it came from
-					econet_handle_local_aun(&p, r, from_found);
-*/
-		
-				if (p.p.aun_ttype == ECONET_AUN_BCAST && from_found != 0xffff)
-					aun_send_internal (&p, r, from_found);
-
-				// Note that aun_send now dumps traffic we refuse to forward so we don't need to check here
-
-				if ((policy == FW_ACCEPT) && ((p.p.aun_ttype == ECONET_AUN_DATA) || (p.p.aun_ttype == ECONET_AUN_IMM) || (p.p.aun_ttype == ECONET_AUN_IMMREP)))
-				{
-					if (p.p.aun_ttype == ECONET_AUN_DATA && (econet_ptr[p.p.dstnet][p.p.dststn] != -1)) // DATA, and it's going to a known host (can't be AUN because AUN hosts don't talk to trunks) - Proxy acknowledge, even for Named Pipes
-						aun_acknowledge(&p, ECONET_AUN_ACK);
-					aun_send(&p, r);
-				}
-			}
-			else if (pset[realfd].revents & POLLIN  && (pipeudpsockets[pset[realfd].fd] != -1)) // Traffic arriving on a UDP socket which is really just AUN for a named pipe client
-			{
-				int netptr, r, from_found = 0xffff;
-				struct __econet_packet_aun p;
-
-				r = udp_receive (pset[realfd].fd, (void *) &(p.p.aun_ttype), sizeof(p)-4, (struct sockaddr * restrict) &src_address);
-
-				if (r < 0) continue; // Debug produced in udp_receive
-
-				/* Look up where it came from */
-
-				from_found = econet_find_source_station (&src_address); // 0xffff;
-
-				netptr = pipeudpsockets[pset[realfd].fd]; // And this is where it's to
-	
-				p.p.dstnet = network[netptr].network;
-				p.p.dststn = network[netptr].station;
-
-				if (from_found == 0xffff)
-					fprintf (stderr, "*PIPE: to %3d.%3d              traffic from unknown AUN source.\n", p.p.dstnet, p.p.dststn);
-				else
-				{
-					p.p.srcnet = network[from_found].network;
-					p.p.srcstn = network[from_found].station;
-
-					p.p.ctrl |= 0x80; // Put the high bit back on the ctrl 
-
-					if (network[netptr].pipewritesocket != -1) // We have a live writer socket
-					{
-						struct __econet_packet_pipe delivery;
-
-						dump_udp_pkt_aun(&p, r+4);
-						
-						delivery.length_low = (r+4) & 0xff;
-						delivery.length_high = ((r+4) >> 8) & 0xff;
-						
-						write (network[netptr].pipewritesocket, &delivery, r+4+2);
-					}
-					else
-						fprintf (stderr, "*PIPE: to %3d.%3d from %3d.%3d traffic received on UDP for named pipe but pipe not connected\n", p.p.dstnet, p.p.dststn, p.p.srcnet, p.p.srcstn );
-				}
-
-			}
-			else if (pset[realfd].revents & POLLIN) // Boggo standard AUN/IP traffic from single station, or on a named pipe
-			{
-				/* Read packet off UDP here */
-				int  r;
-				struct __econet_packet_aun p;
+	udp_flush();
 
-				//int count;
-
-				if (network[fd_ptr[pset[realfd].fd]].type & ECONET_HOSTTYPE_TNAMEDPIPE)
-				{
+	srand(time(NULL));
 
-					int length;
-					unsigned char c;
+	signal(SIGUSR1, econet_sigusr1);
+	signal(SIGTERM, econet_sigquit);
+	signal(SIGINT, econet_sigquit);
 
-					length = 0;
-					
-					read(pset[realfd].fd, &c, 1);
-					length = c;
-					read(pset[realfd].fd, &c, 1);
-					length += (c << 8);
+	econet_stats_open();
 
-					r = read(pset[realfd].fd, &(p.raw), length);
+	econet_timer_init(&imm_reset_timer, econet_imm_reset_expired, 0);
+	econet_timer_init(&wire_retry_timer, NULL, 0); // Just wakes us up so the wire queue gets another go
+	econet_timer_init(&housekeeping_timer, econet_housekeeping, 0);
+	econet_timer_init(&bridge_reset_timer, econet_bridge_reset_expired, 0);
 
-					if (r < 0) continue; // Something went wrong
+	for (s = 0; s <= fs_workers; s++)
+		econet_timer_init(&(services[s].retry_timer), econet_service_retry, s);
 
-					// The received packet will have a valid destination on it, but we will need to fill in the source
+	econet_timer_arm(&housekeeping_timer, ECONET_HOUSEKEEPING_TIME);
+	econet_timer_arm(&bridge_reset_timer, ECONET_BRIDGE_RESET_FREQ * 1000);
 
-					p.p.srcnet = network[fd_ptr[pset[realfd].fd]].network;
-					p.p.srcstn = network[fd_ptr[pset[realfd].fd]].station;
+	econet_thread_start(ECONET_THREAD_NET, NULL);
+	for (s = 0; s <= fs_workers; s++)
+		econet_thread_start(ECONET_THREAD_SERVICE + s, econet_service_thread);
+	if (wire_enabled)
+		econet_thread_start(ECONET_THREAD_WIRE, econet_wire_thread);
+	thread_wall_last = econet_clock_ns(CLOCK_MONOTONIC);
 
-					network[fd_ptr[realfd]].last_transaction = time(NULL);
-					
-					// If the pipewritesocket is not open, open it because we've received traffic
+	while (1)
+	{
+		struct epoll_event events[ECONET_MAX_EVENTS];
+		struct __econet_packet_aun_cache *wire_entry;
+		int nfds, timeout;
 
-					if (network[fd_ptr[pset[realfd].fd]].pipewritesocket == -1)
-					{
-						char writerfilename[250];
-		
-						snprintf(writerfilename, 249, "%s.frombridge", network[fd_ptr[pset[realfd].fd]].named_pipe_filename);
+		if (trunk_ready_head != -1 || aun_ready_head != -1) // Work we can get on with straight away
+			timeout = 0;
+		else	timeout = econet_timer_next(); // Otherwise sleep until something turns up or the next timer is due
 
-						network[fd_ptr[pset[realfd].fd]].pipewritesocket = open(writerfilename, O_WRONLY | O_NONBLOCK | O_SYNC);
-						if (pkt_debug) fprintf (stderr, "*PIPE: to %3d.%3d from %3d.%3d traffic caused write pipe to open (normal) - fd %d\n", p.p.dstnet, p.p.dststn, p.p.srcnet, p.p.srcstn, network[fd_ptr[pset[realfd].fd]].pipewritesocket);
-					}
+		nfds = epoll_wait(epoll_fd, events, ECONET_MAX_EVENTS, timeout);
 
-					/* This sends ACK & NAK that might arise from the named pipe - they can ignore it if they want */
-					aun_send(&p, r); // Send ACK & NAK as well because that's handled properly now.
+		econet_loop_phase(ECONET_PHASE_WAIT);
 
-				}
-				else
-				{
+		loop_wakeups++;
 
-					// This is all UDP receiver code - AUN only (trunks dealt with above)
-	
-					r = udp_receive(pset[realfd].fd, (void *) &(p.p.aun_ttype), sizeof(p)-4, (struct sockaddr * restrict) &src_address);
-	
-					if (r< 0) continue; // Debug produced in udp_receive
-	
-					/* Look up where it came from */
-	
-					from_found = econet_find_source_station (&src_address); // 0xffff;
-	
-					/* Now where did was it going /to/ ? We can find that by the listening socket number */
-		
-					to_found = fd_ptr[pset[realfd].fd];
-	
-					/* TODO - If this is an ACK for something we sent, check it against ackimm_seq_awaited */
+		if (nfds == 0 && timeout != 0)
+			loop_idle_wakeups++;
+		else if (nfds > 0 && econet_timer_armed(&imm_reset_timer)) // The chip only gets reset once things have gone quiet after an unanswered immediate
+			econet_timer_arm(&imm_reset_timer, ECONET_AUN_IMM_RESET_TIME);
 
-					if ((from_found == 0xFFFF) && (learned_net != -1) & (to_found != 0xFFFF)) // See if we can dynamically allocate a station number to this unknown traffic source, since we know where the traffic going, and we have learning mode on, but we don't know where the traffic came *from* 
-					{
-						unsigned short stn_count;
-						struct sockaddr_in *s;
-	
-						stn_count = 0; 
-			
-						s = &src_address;
-	
-						while (stn_count < stations && from_found == 0xFFFF)
-						{
-							if (network[stn_count].is_dynamic && (network[stn_count].last_transaction < (time(NULL) - ECONET_LEARNED_HOST_IDLE_TIMEOUT))) // Found a dynamic station which has idled out
-							{
-	
-								struct __econet_packet_aun bye;
-								int netcount;
-	
-								memcpy(&(network[stn_count].s_addr), &(s->sin_addr), sizeof(struct sockaddr_in));
-	
-								network[stn_count].port = ntohs(src_address.sin_port);
-								from_found = stn_count;
-								if (pkt_debug) fprintf (stderr, "  DYN: Allocated station number %3d.%3d to incoming traffic from %d.%d.%d.%d:%d\n", network[stn_count].network, network[stn_count].station, 
-									(ntohl(network[stn_count].s_addr.s_addr) & 0xff000000) >> 24,
-									(ntohl(network[stn_count].s_addr.s_addr) & 0xff0000) >> 16,
-									(ntohl(network[stn_count].s_addr.s_addr) & 0xff00) >> 8,
-									(ntohl(network[stn_count].s_addr.s_addr) & 0xff),
-									network[stn_count].port);
-	
-								// Log out from FS & SKS here as necessary : TODO SKS
-								fs_eject_station(network[stn_count].network, network[stn_count].station);
-	
-								// Spoof a bye to wire FS's we've found
-								bye.p.srcstn = network[stn_count].station;
-								bye.p.srcnet = network[stn_count].network;
-								bye.p.port = 0x99;
-								bye.p.ctrl = 0x80;
-								bye.p.aun_ttype = ECONET_AUN_DATA;
-								bye.p.seq = 0x00;
-								bye.p.data[0] = 0x90; // Reply port
-								bye.p.data[1] = 0x17; // End session
-								bye.p.data[2] = 1; // Dummy CWD
-								bye.p.data[3] = 2; // Dummy LIB
-								
-								if (wired_eject)
-								{
-									if (pkt_debug) fprintf (stderr, "  DYN:%12s             Spoofing *bye to known wired fileservers...", "");
-	
-									for (netcount = 0; netcount < stations; netcount++)
-									{
-										if (network[netcount].is_wired_fs)
-										{
-											if (pkt_debug) fprintf (stderr, "%d.%d ",  network[netcount].network, network[netcount].station);
-											bye.p.dststn = network[netcount].station;
-											bye.p.dstnet = network[netcount].network;
-											
-											aun_send(&bye, 16);
-										}
-			
-									}
-			
-									if (pkt_debug) fprintf (stderr, "\n");
-	
-								}	
-								
-	
-							}
-	
-							stn_count++;
-						}
-	
-					}
-	
-					if ((from_found != 0xffff) && (to_found != 0xffff)) // We know source & destination stations (necessary because this is AUN traffic, so it can't be going to a trunk!)
-					{
-	
-						// Complete the internal format packet
-	
-						p.p.srcnet = network[from_found].network;
-						p.p.srcstn = network[from_found].station;
-						p.p.dstnet = network[to_found].network;
-						p.p.dststn = network[to_found].station;
-	
-						network[from_found].last_transaction = time(NULL);
-						
-						if (p.p.aun_ttype == ECONET_AUN_ACK || p.p.aun_ttype == ECONET_AUN_IMMREP || p.p.aun_ttype == ECONET_AUN_NAK)
-						{
-							if (p.p.seq == network[from_found].ackimm_seq_awaited) // Found the ACK or IMMREP sequence this host was supposed to produce
-							{
-								if (queue_debug) fprintf (stderr, "QUEUE: to %3d.%3d from %3d.%3d len 0x%04X seq 0x%08X found ack/imm rep which was awaited\n",
-									p.p.srcnet, p.p.srcstn, p.p.dstnet, p.p.dststn, r+4, p.p.seq);
+		econet_timer_run();
 
-								network[from_found].ackimm_seq_awaited = 0;
-								network[from_found].aun_last_tx.tv_sec = network[from_found].aun_last_rx.tv_usec = 0;
-			
-								poll_timeout = -1;  // Go back to normal timeout if we find the packet we want
+		econet_loop_phase(ECONET_PHASE_TIMERS);
 
-								// And dump the packet off the head if it's the same sequence
-	
-								if (network[from_found].aun_head && p.p.seq == network[from_found].aun_head->p->p.seq)
-									econet_general_dumphead (&(network[from_found].aun_head), &(network[from_found].aun_tail));
+		// Dispatch whatever turned up. Start at a different point in the list each time round so that all stations get an even chance
 
-							}
-						}
+		for (s = 0; s < nfds; s++)
+		{
+			struct epoll_event *e;
 
-						/* Put it on the queue using AUN_SEND() */
-						if ((network[to_found].type & ECONET_HOSTTYPE_TNAMEDPIPE) || (!( (p.p.aun_ttype == ECONET_AUN_ACK) || (p.p.aun_ttype == ECONET_AUN_NAK) ))) // Ignore those sorts of packets unless going to named pipe. (I.e. if going to local emulation or wire, we drop them)
-							aun_send(&p, r+4);
-/* DISABLED. We now acknowledge all incoming AUN data because otherwise we get too rapid retransmits on a busy Econet wire 
-						if (p.p.aun_ttype == ECONET_AUN_DATA && (network[to_found].type & ECONET_HOSTTYPE_TNAMEDPIPE || network[to_found].type & ECONET_HOSTTYPE_TLOCAL)) // If AUN was sending to local or named pipe, we'll do the ACK (wire and trunk do their own)
-*/
-						if (p.p.aun_ttype == ECONET_AUN_DATA)
-							aun_acknowledge(&p, ECONET_AUN_ACK);
-	
-					}
-					else	
-						if (pkt_debug) fprintf (stderr, "ERROR: UDP packet received on FD %d; From%s found, To%s found (pointer %d)!\n", pset[realfd].fd, ((from_found != 0xffff) ? "" : " not"), ((to_found != 0xffff) ? "" : " not"), to_found);
-				}
-			}
-		
+			e = &(events[(s + start_event) % nfds]);
+			fd_handlers[e->data.fd](e->data.fd, e->events);
 		}
-	
-		fs_bulk_traffic = fs_dequeuable(); // In case something got put there from UDP/Wire/Local above
 
-		if (fs_bulk_traffic)	fs_dequeue(); // Do bulk transfers out.
-	
-		fs_bulk_traffic = fs_dequeuable(); // Reset flag for next while() loop check
+		start_event++;
 
+		econet_loop_phase(ECONET_PHASE_EVENTS);
 
 		// Now see if we have queues to empty
 
 		// First the wire
 
-		if (wire_head) // On successful TX, we'll send an ACK if the source was AUN or trunk & dump the packet off the queue. Unsuccessful tx, we'll increment the tx counter. We dump packets that are more than 2s old or have had 10 tx attempts
+		if (!wire_tx_entry && (wire_entry = econet_wire_next())) // Nothing already on its way to the wire. On successful TX, we'll dump the packet off the queue. Unsuccessful tx, we'll increment the tx counter. We dump packets that are more than 2s old or have had 10 tx attempts
 		{
 			struct timeval now;
 
 			gettimeofday(&now, 0);
 
-			if (queue_debug) fprintf (stderr, "QUEUE: to %3d.%3d from %3d.%3d len 0x%04X retrieved from wire queue (tx count %02d) ", 
-				wire_head->p->p.dstnet,
-				wire_head->p->p.dststn,
-				wire_head->p->p.srcnet,
-				wire_head->p->p.srcstn,
-				wire_head->size,
-				wire_head->tx_count);
-
-			if (wire_head->tx_count++ < ECONET_WIRE_MAX_TX) // we'll have a go at transmitting
-			{
-				int err;
-
-				if (econet_write_wire(wire_head->p, wire_head->size, 0) == wire_head->size || (ioctl(econet_fd, ECONETGPIO_IOC_TXERR) == 0)) // successful tx
-				{
-					if (queue_debug) fprintf (stderr, "Sent ");
-					if (is_aun(wire_head->p->p.srcnet, wire_head->p->p.srcstn) && wire_head->p->p.aun_ttype == ECONET_AUN_DATA) // Send ACK if we've just successfully sent a DATA packet and the sender is AUN
-					{
-/* Disabled because we ack an AUN on receipt now to avoid rapid retransmits from BeebEm
-						if (queue_debug) fprintf (stderr, " AUN ack sent ");
-						aun_acknowledge(wire_head->p, ECONET_AUN_ACK);	
-*/
-					}
-					if (queue_debug) fprintf (stderr, "\n");
-					econet_general_dumphead(&wire_head, &wire_tail);
-					wire_tx_errors = 0;
-				}
-				else 
-				{
-					err = ioctl(econet_fd, ECONETGPIO_IOC_TXERR);
-					if (err == ECONET_TX_HANDSHAKEFAIL) // Receiver not present
-						econet_general_dumphead(&wire_head, &wire_tail);
-
-					/* Inserted because on *REMOTE traffic where the remoted station is talking to the server, we tend to get lots of module busy for some reason, so we'll pretend they didn't happen. */
-
-					if (err == ECONET_TX_BUSY) wire_head->tx_count--;
-
-					if (wire_tx_errors++ > 300)
-						ioctl(econet_fd, ECONETGPIO_IOC_READMODE);
-
-					if (queue_debug) fprintf (stderr, "TX FAIL - %s (0x%02X)\n", econet_strtxerr(-1 * err), err);
-				}
-			}
+			if (wire_entry->tx_count++ < ECONET_WIRE_MAX_TX && timediffmsec(&(wire_entry->tstamp), &now) < ECONET_QUEUE_MAX_AGE) // we'll have a go at transmitting
+				econet_wire_submit(wire_entry);
 			else	
 			{
-				if (queue_debug) fprintf (stderr, "DUMPED - old or tx count exceeded\n");
+				if (queue_debug) econet_debug ("QUEUE: to %3d.%3d from %3d.%3d len 0x%04X retrieved from wire queue (tx count %02d) DUMPED - old or tx count exceeded\n", 
+					wire_entry->p->p.dstnet,
+					wire_entry->p->p.dststn,
+					wire_entry->p->p.srcnet,
+					wire_entry->p->p.srcstn,
+					wire_entry->size,
+					wire_entry->tx_count);
+
+				if (wire_entry->tx_count <= ECONET_WIRE_MAX_TX) // It was the age
+					queue_age_drops[ECONET_QUEUE_WIRE]++;
 /*
-				if (wire_head->tx_count >= ECONET_WIRE_MAX_TX) // Reset the chip just in case
+				if (wire_entry->tx_count >= ECONET_WIRE_MAX_TX) // Reset the chip just in case
 					ioctl(econet_fd, ECONETGPIO_IOC_READMODE);
 */
 
-				econet_general_dumphead(&wire_head, &wire_tail);
+				econet_wire_dumphead(0);
 				
 			}
 	
 
 		}
 
+		econet_loop_phase(ECONET_PHASE_WIRE);
+
 		// AUN traffic
 	
-		if (aun_queued)
+		if (aun_ready_head != -1)
 		{
 			int count;
 
 			//if (queue_debug) fprintf (stderr, "QUEUE: Attempting to find AUN output entries\n");
 
-			for (count = 0; count < stations; count++)
+			aun_service_passes++;
+
+			for (count = aun_ready_head; count != -1; count = network[count].aun_ready_next) // Only AUN hosts with something queued are on this list
 			{
-				if ((network[count].type & ECONET_HOSTTYPE_TDIS) && (network[count].aun_head)) // This is an AUN host and it has queued packets
+				aun_service_hosts++;
+
+				if (network[count].aun_window > 1) // Sliding window host
+					econet_aun_window_service(count);
+				else if (network[count].aun_head) // Could have been emptied by an ACK since it went on the list
 				{
 					struct timeval now;
-					long tdiff; // , rx_tdiff;
+					long tdiff, rto; // , rx_tdiff;
 
 					gettimeofday(&now, 0);
 
 					tdiff = timediffmsec(&(network[count].aun_last_tx), &now);
+					rto = econet_aun_rto(count);
 					//rx_tdiff = timediffmsec(&(network[count].aun_last_rx), &now); // Used so that when we want to transmit, it is not too close to the last received packet from this host, because it seems to cause problems
 
 					//if (queue_debug) fprintf (stderr, "QUEUE: Examining queue on AUN host at network[%d]\n", count);
 
 					// First, if there is a sequence number this host is waiting for an ACK on and this packet is not an IMMREP with that sequence number, don't send anything - just move on, unless it's timed out.
 
-					if ((network[count].ackimm_seq_tosend) && (timediffmsec(&(network[count].aun_last_rx), &now) > 2000)) // Ditch the last RX / Seq tracker
+					if ((network[count].ackimm_seq_tosend) && (timediffmsec(&(network[count].aun_last_rx), &now) > ECONET_AUN_TOSEND_EXPIRY)) // Ditch the last RX / Seq tracker
 					{
-						if (queue_debug) fprintf (stderr, "QUEUE: Last receipt from station > 2s ago - dumping ACK tracker (seq %08X) for packets to network[%d]\n", network[count].ackimm_seq_tosend, count);
+						if (queue_debug) econet_debug ("QUEUE: Last receipt from station > 2s ago - dumping ACK tracker (seq %08X) for packets to network[%d]\n", network[count].ackimm_seq_tosend, count);
 						network[count].aun_last_rx.tv_sec = network[count].aun_last_rx.tv_usec = 0;
 						network[count].ackimm_seq_tosend = 0;
 					}
@@ -3765,6 +9134,7 @@ Options:\n\
 					if (network[count].ackimm_seq_tosend && (network[count].aun_head->p->p.aun_ttype != ECONET_AUN_IMMREP || network[count].aun_head->p->p.seq != network[count].ackimm_seq_tosend)) // If this host is waiting for an IMM REP, and this one either isn't one of those, or isn't the right sequence number, then ignore it.
 					{
 						//if (queue_debug) fprintf (stderr, "QUEUE: network[%d] expecting sequence 0x%08X but this wasn't it\n", count, network[count].ackimm_seq_tosend);
+						econet_aun_park(count, ECONET_AUN_TOSEND_EXPIRY + 1 - (long) timediffmsec(&(network[count].aun_last_rx), &now)); // Until the tracker expires, unless the reply turns up first
 						continue; // Next host please!
 					}
 
@@ -3772,9 +9142,10 @@ Options:\n\
 		
 					if (network[count].ackimm_seq_awaited) // If we are waiting for an ACK or IMMREP *from* this host, don't send it anything unless we need to re-tx a data packet
 					{
-						if (tdiff > 0 && tdiff < ECONET_AUN_ACK_WAIT_TIME)
+						if (tdiff >= 0 && tdiff < rto) // tdiff can be 0 now that an enqueue can wake the host straight after a send
 						{
-							if (queue_debug) fprintf (stderr, "QUEUE: network[%d] hasn't yet acked sequence 0x%08X - skipping\n", count, network[count].ackimm_seq_awaited);
+							if (queue_debug) econet_debug ("QUEUE: network[%d] hasn't yet acked sequence 0x%08X - skipping\n", count, network[count].ackimm_seq_awaited);
+							econet_aun_park(count, rto - tdiff);
 							continue;
 						}
 
@@ -3785,7 +9156,7 @@ Options:\n\
 
 					if (network[count].aun_head) // This might have broken things && (network[count].ackimm_seq_awaited == 0 || network[count].ackimm_seq_awaited == network[count].aun_head->p->p.seq)) // If we have a queue for this host and either we aren't waiting for a particular ACK to come back OR the one we ARE waiting for matches the packet on the queue head so that we might need to retransmit it...
 					{
-						if (queue_debug) fprintf (stderr, "QUEUE: to %3d.%3d from %3d.%3d len 0x%04X type 0x%02X seq 0x%08X retrieved from network[%d] queue (tx count %02X) (tdiff = %ld)", 
+						if (queue_debug) econet_debug ("QUEUE: to %3d.%3d from %3d.%3d len 0x%04X type 0x%02X seq 0x%08X retrieved from network[%d] queue (tx count %02X) (tdiff = %ld)", 
 							network[count].aun_head->p->p.dstnet,
 							network[count].aun_head->p->p.dststn,
 							network[count].aun_head->p->p.srcnet,
@@ -3798,7 +9169,9 @@ Options:\n\
 						if (network[count].aun_head->tx_count++ > ECONET_AUN_MAX_TX) // Dump
 						{
 
-							if (queue_debug) fprintf (stderr, " - dumped (too many retries)\n");
+							if (queue_debug) econet_debug (" - dumped (too many retries)\n");
+							network[count].drops++;
+							econet_drops[ECONET_DROP_RETRIES]++;
 							/* Next two lines commented because if we dump the head packet on the queue, the comparison in the if statement below is meaningless */
 							//econet_general_dumphead(&(network[count].aun_head), &(network[count].aun_tail));
 							//aun_queued--;
@@ -3809,23 +9182,20 @@ Options:\n\
 								network[count].ackimm_seq_awaited = 0;
 								// And dump the rest of the queue because it probably won't respond
 								while (network[count].aun_head)
-								{
-									struct __econet_packet_aun_cache *p;
-
-									p = network[count].aun_head->next;
-									free (network[count].aun_head->p); // Free the packet
-									free (network[count].aun_head); // And the structure itself
-									network[count].aun_head = p;
-									aun_queued--;
-								}
+									econet_aun_dumphead(count);
 
 								network[count].aun_head = network[count].aun_tail = NULL; // Reset
 							}
+							else // Not what we were waiting for, so nothing is going to ACK it - just lose it
+							{
+								econet_aun_dumphead(count);
+							}
 
 						}
-						else if (network[count].ackimm_seq_awaited && (network[count].ackimm_seq_awaited != network[count].aun_head->p->p.seq) && tdiff > 0 && tdiff < ECONET_AUN_ACK_WAIT_TIME) // Waiting for an ACK from this host and this wasn't it and we haven't waited long enough yet and the packet on the head of the queue is not the same one, so not to be retransmitted (the timeout check is done above!)
+						else if (network[count].ackimm_seq_awaited && (network[count].ackimm_seq_awaited != network[count].aun_head->p->p.seq) && tdiff >= 0 && tdiff < rto) // Waiting for an ACK from this host and this wasn't it and we haven't waited long enough yet and the packet on the head of the queue is not the same one, so not to be retransmitted (the timeout check is done above!)
 						{
-							if (queue_debug) fprintf (stderr, "\n");
+							if (queue_debug) econet_debug ("\n");
+							econet_aun_park(count, rto - tdiff);
 							continue;
 						}
 						else if ( 	
@@ -3837,42 +9207,61 @@ Options:\n\
 							econet_write_general(network[count].aun_head->p, network[count].aun_head->size) == network[count].aun_head->size
 						)
 						{
-							if (queue_debug) fprintf (stderr, " - sent ");
+							if (queue_debug) econet_debug (" - sent ");
+
+							if (network[count].aun_head->tx_count == 1) // First time out of the queue
+							{
+								econet_codel_dequeued(ECONET_QUEUE_AUN, &(network[count].aun_codel), &(network[count].aun_head->tstamp), network[count].aun_queue_bytes - network[count].aun_head->size);
+								econet_queue_publish(ECONET_QUEUE_AUN, &(network[count].aun_codel), network[count].aun_queue_len, network[count].aun_queue_bytes);
+							}
+
 							if (network[count].aun_head->p->p.aun_ttype == ECONET_AUN_DATA || network[count].aun_head->p->p.aun_ttype == ECONET_AUN_IMM)
 							{
-								if (queue_debug) fprintf (stderr, " - tracking seq for ack from AUN ");
+								if (queue_debug) econet_debug (" - tracking seq for ack from AUN ");
+								if (network[count].aun_head->tx_count > 1) // Retransmission - wait longer this time
+								{
+									network[count].retx++;
+									econet_aun_rto_backoff(count);
+									rto = econet_aun_rto(count);
+								}
 								network[count].ackimm_seq_awaited = network[count].aun_head->p->p.seq; // This is the Ack we are waiting for before we send anything else
 								gettimeofday(&(network[count].aun_last_tx), 0);
 					
-								if (network[count].aun_head->p->p.aun_ttype == ECONET_AUN_IMM) // If we just sent an immediate to an AUN host, set the poll_timeout
-									poll_timeout = 500;
+								if (network[count].aun_head->p->p.aun_ttype == ECONET_AUN_IMM) // If we just sent an immediate to an AUN host, reset the chip if it doesn't answer
+									econet_timer_arm(&imm_reset_timer, ECONET_AUN_IMM_RESET_TIME);
 							}
 
 							// If this was the priority packet, clear ackimm_seq_tosend
 							if (network[count].aun_head->p->p.seq == network[count].ackimm_seq_tosend)
 							{
-								if (queue_debug) fprintf (stderr, " - found seq the AUN machine was awaiting ");
+								if (queue_debug) econet_debug (" - found seq the AUN machine was awaiting ");
 								network[count].ackimm_seq_tosend = 0; // Blank off
 							}
 
 							// Dump the queue entry if we don't need to retransmit it
 							if (network[count].aun_head->p->p.aun_ttype != ECONET_AUN_DATA)
 							{
-								if (queue_debug) fprintf (stderr, " - dumping from queue (not a data packet we might re-tx) ");
-								econet_general_dumphead(&(network[count].aun_head), &(network[count].aun_tail));
-								aun_queued--;
+								if (queue_debug) econet_debug (" - dumping from queue (not a data packet we might re-tx) ");
+								econet_aun_dumphead(count);
 							}
 
 							// If we are more than the ACK time since transmitting a packet we were waiting on an ACK for, and that packet isn't on the queue head, then ditch the 'awaited' tracker because it's not going to come
-							if (tdiff > ECONET_AUN_ACK_WAIT_TIME && ((!network[count].aun_head) || (network[count].ackimm_seq_awaited != network[count].aun_head->p->p.seq)))
+							if (tdiff > rto && ((!network[count].aun_head) || (network[count].ackimm_seq_awaited != network[count].aun_head->p->p.seq)))
 							{
 								network[count].aun_last_tx.tv_sec = network[count].aun_last_tx.tv_usec = 0;
 								network[count].ackimm_seq_awaited = 0;
 							}
 
-							if (queue_debug) fprintf (stderr, "\n");
+							if (network[count].ackimm_seq_awaited) // Nothing more for it until the ACK turns up or it's time to retransmit
+								econet_aun_park(count, rto);
+
+							if (queue_debug) econet_debug ("\n");
+						}
+						else
+						{
+							if (queue_debug) econet_debug ("FAILED\n");
+							econet_aun_park(count, ECONET_QUEUE_RETRY_TIME);
 						}
-						else if (queue_debug) fprintf (stderr, "FAILED\n");
 
 					}
 
@@ -3880,59 +9269,56 @@ Options:\n\
 
 			}
 
+			econet_aun_ready_prune();
+
 		}
 
-		// Then trunks - One packet at a time for now. Maybe more sophisticated later
+		econet_loop_phase(ECONET_PHASE_AUN);
 
-		if (trunk_head)
-		{
-			struct timeval now;
+		// Then trunks - each one sends what it has queued, up to ECONET_TRUNK_FLUSH_BUDGET, in the same UDP batch
 
-			if (queue_debug) fprintf (stderr, "QUEUE: to %3d.%3d from %3d.%3d length 0x%04X retrieved from trunk queue\n", 
-				trunk_head->p->p.dstnet,
-				trunk_head->p->p.dststn,
-				trunk_head->p->p.srcnet,
-				trunk_head->p->p.srcstn,
-				trunk_head->size);
+		if (trunk_ready_head != -1)
+			aun_trunk_flush();
 
-			gettimeofday(&now, 0);
+		econet_loop_phase(ECONET_PHASE_TRUNK);
 
-			if (timediffmsec(&(trunk_head->tstamp), &now) < 2000) // Dump traffic older than 2s
-				aun_trunk_send(trunk_head->p, trunk_head->size);
+		if (wire_queued && !wire_tx_entry && !econet_timer_armed(&wire_retry_timer)) // Come back for another go at the wire soon (if something's being sent, the wire thread will wake us when it's done)
+			econet_timer_arm(&wire_retry_timer, ECONET_QUEUE_RETRY_TIME);
 
-			// We're going to dump it either way - if the send didn't work, we don't want to hold the trunk up
+		for (s = 0; s <= fs_workers; s++)
+			if (services[s].held_since) // A server's traffic was held back for want of room on a queue - there may be some now
+				econet_service_drain(s);
 
-			econet_general_dumphead(&trunk_head, &trunk_tail);
+		udp_flush(); // Send whatever UDP traffic was generated this time round
+
+		econet_ring_wake(&wire_tx_ring); // And let the other threads know what's been passed to them
+		for (s = 0; s <= fs_workers; s++)
+		{
+			if (atomic_exchange_explicit(&(services[s].wants_room), 0, memory_order_relaxed)) // Something may have left the queue its *LOAD traffic is waiting for
+				services[s].in.unsignalled = 1;
+			econet_ring_wake(&(services[s].in));
 		}
 
-		// Fileserver garbage collection
+		if (loop_timing)
+		{
+			econet_loop_phase(ECONET_PHASE_FLUSH);
+			loop_timed++;
+		}
 
-		for (s = 0; s < stations; s++)
+		if (dump_stats)
 		{
-			if (network[s].servertype & ECONET_SERVER_FILE) 
-			{
-				//if (fs_noisy) fprintf(stderr, "   FS: Garbage collect on server %d\n", network[s].fileserver_index);
-				fs_garbage_collect(network[s].fileserver_index);
-			}
-		
-			if (network[s].servertype & ECONET_SERVER_SOCKET)
-				sks_poll(network[s].sks_index);
+			dump_stats = 0;
+			econet_stats_text(stderr);
 		}
 
-		// Reset our poll structure
-		for (s = 0; s <= pmax; s++)
+		if (quit_signal) // Get the log out, then go the way the signal would have taken us
 		{
-			pset[s].events = POLLIN;
-			pset[s].revents = 0; // Need to re-set because we might go round the loop because of the cache not poll()
+			econet_log_finish(1);
+			signal(quit_signal, SIG_DFL);
+			raise(quit_signal);
 		}
-		
-		start_fd = last_active_fd;
 	}
 
-
-	ioctl(econet_fd, ECONETGPIO_IOC_READMODE); // Reset the module - we have got here because an Immediate to AUN went unresponded to, so the chip will not be in read mode any more.
-
-   }
 }
 
 // Printer information functions for the fileserver (but we have all the variables...)
@@ -3953,14 +9339,14 @@ uint8_t get_printer_info(unsigned char net, unsigned char stn, uint8_t printer,
 	if (!(network[p].servertype & ECONET_SERVER_PRINT)) // not a print server at all
 		return 0; 
 
-	if (network[p].numprinters < printer) // Unknown printer index
+	if (network[p].server->numprinters < printer) // Unknown printer index
 		return 0;
 
-	snprintf(pname, 7, "%6.6s", network[p].printers[printer].name);
-	snprintf(banner, 24, "%23.23s", network[p].printers[printer].banner);
-	*control = network[p].printers[printer].control;
-	*status = network[p].printers[printer].status;
-	*user = network[p].printers[printer].user;
+	snprintf(pname, 7, "%6.6s", network[p].server->printers[printer].name);
+	snprintf(banner, 24, "%23.23s", network[p].server->printers[printer].banner);
+	*control = network[p].server->printers[printer].control;
+	*status = network[p].server->printers[printer].status;
+	*user = network[p].server->printers[printer].user;
 
 	return 1;
 
@@ -3973,13 +9359,13 @@ uint8_t set_printer_info(unsigned char net, unsigned char stn, uint8_t printer,
 
 	p = econet_ptr[net][stn]; // Look up the network entry
 
-	if ((p == -1) || (!(network[p].servertype & ECONET_SERVER_PRINT)) || (network[p].numprinters < printer)) // See logic in get_printer_info()
+	if ((p == -1) || (!(network[p].servertype & ECONET_SERVER_PRINT)) || (network[p].server->numprinters < printer)) // See logic in get_printer_info()
 		return 0;
 
-	snprintf(network[p].printers[printer].name, 7, "%6.6s", pname);
-	snprintf(network[p].printers[printer].banner, 24, "%23.23s", banner);
-	network[p].printers[printer].control = control;
-	network[p].printers[printer].user = user;
+	snprintf(network[p].server->printers[printer].name, 7, "%6.6s", pname);
+	snprintf(network[p].server->printers[printer].banner, 24, "%23.23s", banner);
+	network[p].server->printers[printer].control = control;
+	network[p].server->printers[printer].user = user;
 
 	return 1;
 }
@@ -3994,6 +9380,6 @@ uint8_t get_printer_total(unsigned char net, unsigned char stn)
 	if ((p == -1) || (!(network[p].servertype & ECONET_SERVER_PRINT))) // See logic in get_printer_info()
 		return 0;
 
-	return network[p].numprinters;
+	return network[p].server->numprinters;
 
 }
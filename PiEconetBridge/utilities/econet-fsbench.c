@@ -0,0 +1,503 @@
+/*
+  (c) 2021 Chris Royle
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+// Measures how long the bridge takes to forward traffic, first with nothing else going on and then while a number
+// of stations hammer its fileserver with *LOADs - so that it can be seen whether fileserver work holds up bridging.
+// We are an AUN station sending DATA packets, with timestamps in them, to a named pipe station on the same bridge,
+// whose pipe we read; plus (in the second half) the AUN stations doing the *LOADs.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <errno.h>
+#include <time.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include "../include/econet-gpio-consumer.h"
+
+#define FSBENCH_MAX_LOADERS 32
+#define FSBENCH_PORT 0x55 // Port the timed packets go to
+#define FSBENCH_REPLY_PORT 0x90 // Where the loaders want fileserver replies
+#define FSBENCH_DATA_PORT 0x92 // And *LOAD data
+#define FSBENCH_STALL 2000 // ms a loader waits for the fileserver before starting again
+
+// Needed by the named pipe library
+uint32_t seq = 0x4000;
+int tobridge, frombridge;
+char pipebase[256];
+
+extern void econet_setbase(char *);
+extern int econet_openreader();
+extern int econet_openwriter();
+extern int aun_send (struct __econet_packet_aun *, int);
+extern int aun_read (struct __econet_packet_aun *);
+
+struct fsbench_loader {
+	int sock;
+	uint32_t seq; // Our AUN sequence number
+	unsigned char state; // FSBENCH_LOGIN or FSBENCH_LOAD
+	unsigned char csd, lib; // Handles from the login
+	uint64_t last_heard; // ms
+	unsigned long loads, bytes, stalls; // *LOADs completed, and data bytes received
+} loaders[FSBENCH_MAX_LOADERS];
+
+#define FSBENCH_LOGIN 1
+#define FSBENCH_LOAD 2
+
+struct fsbench_phase {
+	char *name;
+	uint64_t *lat; // Forwarding latency of each timed packet that arrived (us)
+	unsigned long sent, received;
+	unsigned long loads, bytes, stalls;
+};
+
+struct sockaddr_in bridge_fs, bridge_pipe; // Where the bridge listens for its fileserver and the named pipe station
+int ping_sock;
+uint32_t ping_seq = 4;
+unsigned char ping_net, ping_stn; // Our address as the bridge has it
+int numloaders = 4, loading = 0;
+char *filename = NULL, *username = "SYST";
+
+int usage(char *name)
+{
+
+	fprintf(stderr, " \n\
+Copyright (c) 2021 Chris Royle\n\
+This program comes with ABSOLUTELY NO WARRANTY; for details see\n\
+the GPL v3.0 licence at https://www.gnu.org/licences/ \n\
+\n\
+Usage: %s -p pipe -P port -s net.stn -S port -F port -l port -f file [options] \n\
+Options:\n\
+\n\
+\t-p path\tBase path of a named pipe (UNIX) station on the bridge\n\
+\t-P port\tUDP port the bridge listens on for that station\n\
+\t-s n.s\tEconet address of an AUN station (A line) we send as\n\
+\t-S port\tUDP port that station is at\n\
+\t-F port\tUDP port the bridge listens on for its fileserver\n\
+\t-l port\tUDP port of the first loading station - the rest follow on,\n\
+\t\tand each needs an A line in the bridge's configuration\n\
+\t-f name\tFile each loading station *LOADs over and over\n\
+\n\
+\t-b host\tWhere the bridge is (default 127.0.0.1)\n\
+\t-n n\tNumber of loading stations (default 4, up to %d)\n\
+\t-u user\tWho the loading stations log in as (default SYST)\n\
+\t-t n\tSeconds to measure for, with and without load (default 10)\n\
+\t-r n\tTimed packets a second (default 100)\n\
+\n\
+\nHelp:\n\
+\t-h\tThis help message.\n\n\
+", name, FSBENCH_MAX_LOADERS);
+
+	exit(EXIT_FAILURE);
+}
+
+uint64_t fsbench_now(void) // us
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+
+	return ((uint64_t) t.tv_sec * 1000000) + (t.tv_nsec / 1000);
+}
+
+int fsbench_socket(int port)
+{
+	int s;
+	struct sockaddr_in service;
+
+	if ((s = socket(AF_INET, SOCK_DGRAM, 0)) == -1)
+	{
+		fprintf(stderr, "Failed to open socket: %s\n", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	memset(&service, 0, sizeof(service));
+	service.sin_family = AF_INET;
+	service.sin_addr.s_addr = INADDR_ANY;
+	service.sin_port = htons(port);
+
+	if (bind(s, (struct sockaddr *) &service, sizeof(service)) != 0)
+	{
+		fprintf(stderr, "Failed to bind port %d: %s\n", port, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	return s;
+}
+
+// Send an AUN packet - header fields, then len bytes of data
+
+void fsbench_send(int sock, struct sockaddr_in *to, unsigned char type, unsigned char port, unsigned char ctrl, uint32_t seq, unsigned char *data, int len)
+{
+	struct __econet_packet_udp u;
+
+	u.p.ptype = type;
+	u.p.port = port;
+	u.p.ctrl = ctrl;
+	u.p.pad = 0;
+	u.p.seq = seq;
+	memcpy(u.p.data, data, len);
+
+	sendto(sock, &u, len + 8, MSG_DONTWAIT, (struct sockaddr *) to, sizeof(struct sockaddr_in));
+}
+
+// A loading station logs in, or asks for the file, and waits for what comes back
+
+void fsbench_loader_start(int l)
+{
+	struct fsbench_loader *ld = &(loaders[l]);
+	unsigned char data[256];
+	int len;
+
+	data[0] = FSBENCH_REPLY_PORT;
+
+	if (ld->state == FSBENCH_LOGIN)
+	{
+		data[1] = 0; // OSCLI
+		data[2] = data[3] = data[4] = 0;
+		len = 5 + snprintf((char *) &(data[5]), 200, "I AM %s\r", username);
+	}
+	else
+	{
+		data[1] = 2; // *LOAD
+		data[2] = FSBENCH_DATA_PORT;
+		data[3] = ld->csd;
+		data[4] = ld->lib;
+		len = 5 + snprintf((char *) &(data[5]), 200, "%s\r", filename);
+	}
+
+	fsbench_send(ld->sock, &bridge_fs, ECONET_AUN_DATA, 0x99, 0x80, (ld->seq += 4), data, len);
+	ld->last_heard = fsbench_now() / 1000;
+}
+
+// Something for loading station l from the fileserver
+
+void fsbench_loader_rx(int l, struct __econet_packet_udp *u, int len, struct sockaddr_in *from)
+{
+	struct fsbench_loader *ld = &(loaders[l]);
+
+	if (u->p.ptype != ECONET_AUN_DATA)
+		return;
+
+	fsbench_send(ld->sock, from, ECONET_AUN_ACK, u->p.port, u->p.ctrl, u->p.seq, NULL, 0);
+
+	ld->last_heard = fsbench_now() / 1000;
+	len -= 8;
+
+	if (u->p.port == FSBENCH_DATA_PORT)
+	{
+		ld->bytes += len;
+		return;
+	}
+
+	if (u->p.port != FSBENCH_REPLY_PORT || len < 2)
+		return;
+
+	if (u->p.data[1] != 0) // Error
+	{
+		fprintf (stderr, "Loading station %d: fileserver said %.*s\n", l + 1, len - 2, &(u->p.data[2]));
+		exit(EXIT_FAILURE);
+	}
+
+	if (ld->state == FSBENCH_LOGIN)
+	{
+		ld->csd = u->p.data[3];
+		ld->lib = u->p.data[4];
+		ld->state = FSBENCH_LOAD;
+	}
+	else if (len > 2) // The file's attributes - the data comes next
+		return;
+	else	ld->loads++; // The end of it
+
+	if (loading)
+		fsbench_loader_start(l);
+}
+
+// Timed packet has come out of the named pipe
+
+void fsbench_pipe_rx(struct fsbench_phase *ph)
+{
+	struct __econet_packet_aun p;
+	uint64_t sent;
+	int len;
+
+	if ((len = aun_read(&p)) < 20 || p.p.port != FSBENCH_PORT || p.p.aun_ttype != ECONET_AUN_DATA)
+		return;
+
+	memcpy(&sent, p.p.data, sizeof(sent));
+
+	if (ph && ph->received < ph->sent)
+		ph->lat[ph->received++] = fsbench_now() - sent;
+}
+
+int fsbench_cmp(const void *a, const void *b)
+{
+	uint64_t x = *((uint64_t *) a), y = *((uint64_t *) b);
+
+	return (x > y) - (x < y);
+}
+
+void fsbench_report(struct fsbench_phase *ph, int secs)
+{
+	uint64_t *l = ph->lat;
+	unsigned long n = ph->received;
+
+	qsort(l, n, sizeof(uint64_t), fsbench_cmp);
+
+	printf ("%-14s %6lu sent %6lu arrived  ", ph->name, ph->sent, n);
+
+	if (n)
+		printf ("latency us: p50 %6" PRIu64 " p90 %6" PRIu64 " p99 %6" PRIu64 " max %6" PRIu64,
+			l[n / 2], l[(n * 9) / 10], l[(n * 99) / 100], l[n - 1]);
+
+	if (ph->loads || ph->bytes)
+		printf ("\n%14s %6lu *LOADs, %lu KB/s from the fileserver, %lu stalls", "", ph->loads, (ph->bytes / 1024) / secs, ph->stalls);
+
+	printf ("\n");
+}
+
+// Run one phase of the test for secs seconds, sending rate timed packets a second
+
+void fsbench_run(struct fsbench_phase *ph, int secs, int rate)
+{
+	struct pollfd fds[2 + FSBENCH_MAX_LOADERS];
+	uint64_t start, next, gap, now;
+	unsigned long loads = 0, bytes = 0, stalls = 0;
+	int l;
+
+	if (!(ph->lat = malloc(sizeof(uint64_t) * ((unsigned long) secs * rate + 1))))
+	{
+		fprintf (stderr, "Out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+
+	for (l = 0; l < numloaders; l++)
+	{
+		loads -= loaders[l].loads;
+		bytes -= loaders[l].bytes;
+		stalls -= loaders[l].stalls;
+	}
+
+	fds[0].fd = frombridge;
+	fds[1].fd = ping_sock;
+	for (l = 0; l < numloaders; l++)
+		fds[2 + l].fd = loaders[l].sock;
+	for (l = 0; l < 2 + numloaders; l++)
+		fds[l].events = POLLIN;
+
+	gap = 1000000 / rate;
+	start = next = fsbench_now();
+
+	while ((now = fsbench_now()) < start + ((uint64_t) secs * 1000000) + 500000) // Half a second at the end for stragglers
+	{
+		int timeout;
+
+		if (now >= next && now < start + ((uint64_t) secs * 1000000))
+		{
+			unsigned char data[12];
+
+			memcpy(data, &now, sizeof(now));
+			memcpy(&(data[8]), &(ph->sent), 4);
+			fsbench_send(ping_sock, &bridge_pipe, ECONET_AUN_DATA, FSBENCH_PORT, 0x80, (ping_seq += 4), data, 12);
+			ph->sent++;
+			next += gap;
+		}
+
+		timeout = (next > now) ? ((next - now) / 1000) : 0;
+		if (timeout > 100) timeout = 100;
+
+		if (poll(fds, 2 + (loading ? numloaders : 0), timeout) < 0)
+			continue;
+
+		if (fds[0].revents & POLLIN)
+			fsbench_pipe_rx(ph);
+
+		if (fds[0].revents & POLLHUP)
+		{
+			fprintf (stderr, "Bridge has gone away.\n");
+			exit(EXIT_FAILURE);
+		}
+
+		if (fds[1].revents & POLLIN) // Just the bridge's ACKs to us
+		{
+			unsigned char buf[ECONET_MAX_PACKET_SIZE];
+
+			while (recv(ping_sock, buf, sizeof(buf), MSG_DONTWAIT) > 0);
+		}
+
+		for (l = 0; loading && l < numloaders; l++)
+		{
+			if (fds[2 + l].revents & POLLIN)
+			{
+				struct __econet_packet_udp u;
+				struct sockaddr_in from;
+				socklen_t fromlen = sizeof(from);
+				int len;
+
+				while ((len = recvfrom(loaders[l].sock, &u, sizeof(u), MSG_DONTWAIT, (struct sockaddr *) &from, &fromlen)) >= 8)
+				{
+					fsbench_loader_rx(l, &u, len, &from);
+					fromlen = sizeof(from);
+				}
+			}
+
+			if ((fsbench_now() / 1000) - loaders[l].last_heard > FSBENCH_STALL) // Lost something - start again from the login
+			{
+				loaders[l].stalls++;
+				loaders[l].state = FSBENCH_LOGIN;
+				fsbench_loader_start(l);
+			}
+		}
+	}
+
+	for (l = 0; l < numloaders; l++)
+	{
+		loads += loaders[l].loads;
+		bytes += loaders[l].bytes;
+		stalls += loaders[l].stalls;
+	}
+
+	ph->loads = loads;
+	ph->bytes = bytes;
+	ph->stalls = stalls;
+}
+
+int fsbench_resolve(char *host, int port, struct sockaddr_in *a)
+{
+	struct addrinfo hints, *res;
+	char portstr[8];
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_DGRAM;
+
+	snprintf (portstr, sizeof(portstr), "%d", port);
+
+	if (getaddrinfo(host, portstr, &hints, &res))
+		return 0;
+
+	memcpy(a, res->ai_addr, sizeof(struct sockaddr_in));
+	freeaddrinfo(res);
+
+	return 1;
+}
+
+int main(int argc, char **argv)
+{
+
+	int opt, l, secs = 10, rate = 100;
+	int pipe_port = 0, ping_port = 0, fs_port = 0, load_port = 0;
+	unsigned int net, stn;
+	char *host = "127.0.0.1", *pipe = NULL;
+	struct fsbench_phase quiet, busy;
+	struct __econet_packet_aun hello;
+
+	ping_net = ping_stn = 0;
+
+	while ((opt = getopt(argc, argv, "hp:P:s:S:F:l:f:b:n:u:t:r:")) != -1)
+	{
+		switch (opt) {
+			case 'p': pipe = optarg; break;
+			case 'P': pipe_port = atoi(optarg); break;
+			case 's':
+				if (sscanf(optarg, "%u.%u", &net, &stn) != 2)
+					usage(argv[0]);
+				ping_net = net; ping_stn = stn;
+				break;
+			case 'S': ping_port = atoi(optarg); break;
+			case 'F': fs_port = atoi(optarg); break;
+			case 'l': load_port = atoi(optarg); break;
+			case 'f': filename = optarg; break;
+			case 'b': host = optarg; break;
+			case 'n': numloaders = atoi(optarg); break;
+			case 'u': username = optarg; break;
+			case 't': secs = atoi(optarg); break;
+			case 'r': rate = atoi(optarg); break;
+			case 'h':
+			default: usage(argv[0]); break;
+		}
+	}
+
+	if (!pipe || !pipe_port || !ping_stn || !ping_port || !fs_port || !load_port || !filename)
+	{
+		fprintf(stderr, "Must specify -p, -P, -s, -S, -F, -l and -f.\n\n");
+		usage(argv[0]);
+	}
+
+	if (numloaders < 1 || numloaders > FSBENCH_MAX_LOADERS || secs < 1 || rate < 1 || rate > 100000)
+		usage(argv[0]);
+
+	if (!fsbench_resolve(host, fs_port, &bridge_fs) || !fsbench_resolve(host, pipe_port, &bridge_pipe))
+	{
+		fprintf(stderr, "Cannot resolve %s\n", host);
+		exit(EXIT_FAILURE);
+	}
+
+	ping_sock = fsbench_socket(ping_port);
+
+	memset(&loaders, 0, sizeof(loaders));
+
+	for (l = 0; l < numloaders; l++)
+	{
+		loaders[l].sock = fsbench_socket(load_port + l);
+		loaders[l].seq = 4;
+		loaders[l].state = FSBENCH_LOGIN;
+	}
+
+	econet_setbase(pipe);
+	econet_openreader();
+	econet_openwriter();
+
+	// The bridge only opens its end of the pipe once the station has said something
+
+	hello.p.dstnet = ping_net;
+	hello.p.dststn = ping_stn;
+	hello.p.aun_ttype = ECONET_AUN_DATA;
+	hello.p.port = FSBENCH_PORT;
+	hello.p.ctrl = 0x80;
+	aun_send(&hello, 12);
+	usleep(200000);
+
+	quiet.name = "Quiet";
+	quiet.sent = quiet.received = 0;
+	busy.name = "Fileserver busy";
+	busy.sent = busy.received = 0;
+
+	printf ("Forwarding latency, AUN station %d.%d to named pipe %s: %d packets a second for %d seconds, then the same with %d stations *LOADing %s\n",
+		ping_net, ping_stn, pipe, rate, secs, numloaders, filename);
+
+	fsbench_run(&quiet, secs, rate);
+	fsbench_report(&quiet, secs);
+
+	loading = 1;
+	for (l = 0; l < numloaders; l++)
+		fsbench_loader_start(l);
+
+	fsbench_run(&busy, secs, rate);
+	fsbench_report(&busy, secs);
+
+	exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,312 @@
+/*
+  (c) 2021 Chris Royle
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+// Sits in the middle of a trunk between two bridges and makes the link worse - drops, delays and
+// reorders datagrams - so that trunk behaviour over a poor WAN link can be tried out on one machine.
+// Each bridge's TRUNK line points at one of our ports instead of at the other bridge.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <stdint.h>
+
+#define IMPAIR_MAX_HELD 4096 // Most datagrams waiting out their delay at once
+#define IMPAIR_MAX_DGRAM 65536
+
+struct impair_held {
+	uint64_t due; // When it goes, in us
+	int side; // Which of our sockets it goes out of
+	int len;
+	unsigned char *data;
+};
+
+struct impair_side {
+	int sock; // Our socket facing this bridge
+	struct sockaddr_in peer; // The bridge
+	unsigned long rx, dropped, sent; // Datagrams from this bridge, of those dropped, and datagrams sent to it
+} sides[2];
+
+struct impair_held held[IMPAIR_MAX_HELD]; // In the order they're due to go - ones due at the same time in the order they arrived
+int numheld = 0;
+
+double loss = 0.0; // Probability of dropping each datagram
+unsigned int delay = 0, jitter = 0; // ms - each datagram is delayed by delay plus up to jitter more
+uint64_t lossfrom = 0; // No losses before this (us) - bridges only advertise their networks when they start
+volatile sig_atomic_t finished = 0;
+
+int usage(char *name)
+{
+
+	fprintf(stderr, " \n\
+Copyright (c) 2021 Chris Royle\n\
+This program comes with ABSOLUTELY NO WARRANTY; for details see\n\
+the GPL v3.0 licence at https://www.gnu.org/licences/ \n\
+\n\
+Usage: %s -a port -A host:port -b port -B host:port [options] \n\
+Options:\n\
+\n\
+\t-a port\tOur UDP port facing bridge A\n\
+\t-A h:p\tWhere bridge A's trunk is listening\n\
+\t-b port\tOur UDP port facing bridge B\n\
+\t-B h:p\tWhere bridge B's trunk is listening\n\
+\n\
+\nImpairments (applied in both directions)\n\
+\t-l n\tDrop n%% of datagrams (may be fractional, e.g. 0.5)\n\
+\t-d n\tDelay each datagram by n ms\n\
+\t-j n\tAdd up to n ms more at random (which will reorder some)\n\
+\t-s n\tSeed for the random number generator\n\
+\t-w n\tDon't lose anything for the first n seconds, so that the\n\
+\t\tbridges can exchange their network advertisements\n\
+\n\
+\nHelp:\n\
+\t-h\tThis help message.\n\n\
+\nBridge A's TRUNK line should give this machine and port -a as the\n\
+distant end, and bridge B's this machine and port -b. Counts are\n\
+printed on exit.\n\n\
+", name);
+
+	exit(EXIT_FAILURE);
+}
+
+uint64_t impair_now(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+
+	return ((uint64_t) t.tv_sec * 1000000) + (t.tv_nsec / 1000);
+}
+
+void impair_finish(int sig)
+{
+	finished = 1;
+}
+
+// Turn host:port into an address, or exit
+
+void impair_resolve(char *arg, struct sockaddr_in *a)
+{
+	char host[256], *colon;
+	struct addrinfo hints, *res;
+
+	strncpy(host, arg, 255);
+	host[255] = 0;
+
+	if (!(colon = strrchr(host, ':')))
+	{
+		fprintf(stderr, "%s should be host:port\n", arg);
+		exit(EXIT_FAILURE);
+	}
+
+	*(colon++) = 0;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_DGRAM;
+
+	if (getaddrinfo(host, colon, &hints, &res))
+	{
+		fprintf(stderr, "Cannot resolve %s\n", arg);
+		exit(EXIT_FAILURE);
+	}
+
+	memcpy(a, res->ai_addr, sizeof(struct sockaddr_in));
+	freeaddrinfo(res);
+}
+
+int impair_socket(int port)
+{
+	int s;
+	struct sockaddr_in service;
+
+	if ((s = socket(AF_INET, SOCK_DGRAM, 0)) == -1)
+	{
+		fprintf(stderr, "Failed to open socket: %s\n", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	memset(&service, 0, sizeof(service));
+	service.sin_family = AF_INET;
+	service.sin_addr.s_addr = INADDR_ANY;
+	service.sin_port = htons(port);
+
+	if (bind(s, (struct sockaddr *) &service, sizeof(service)) != 0)
+	{
+		fprintf(stderr, "Failed to bind port %d: %s\n", port, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	return s;
+}
+
+// Datagram data (len bytes) has arrived from the bridge on side 'from' - lose it, or hold it until it's due to go out of the other side
+
+void impair_arrived(int from, unsigned char *data, int len)
+{
+	struct impair_held *h;
+	unsigned char *data_copy;
+	uint64_t due;
+	int pos;
+
+	sides[from].rx++;
+
+	if (impair_now() >= lossfrom && (((double) rand()) / RAND_MAX) * 100.0 < loss)
+	{
+		sides[from].dropped++;
+		return;
+	}
+
+	due = impair_now() + (delay * 1000);
+	if (jitter)
+		due += rand() % (jitter * 1000);
+
+	if (numheld == IMPAIR_MAX_HELD || !(data_copy = malloc(len)))
+	{
+		sides[from].dropped++;
+		return;
+	}
+
+	for (pos = numheld; pos > 0 && held[pos - 1].due > due; pos--);
+
+	memmove(&(held[pos + 1]), &(held[pos]), (numheld - pos) * sizeof(struct impair_held));
+
+	h = &(held[pos]);
+	h->data = data_copy;
+	memcpy(h->data, data, len);
+	h->len = len;
+	h->due = due;
+	h->side = 1 - from;
+	numheld++;
+}
+
+// Send everything whose time has come, and return how long until the next one does (ms), or -1 if nothing is waiting
+
+int impair_release(void)
+{
+	uint64_t now;
+	int i = 0;
+
+	now = impair_now();
+
+	while (i < numheld && held[i].due <= now)
+	{
+		struct impair_held *h = &(held[i++]);
+
+		sendto(sides[h->side].sock, h->data, h->len, MSG_DONTWAIT, (struct sockaddr *) &(sides[h->side].peer), sizeof(struct sockaddr_in));
+		sides[h->side].sent++;
+		free(h->data);
+	}
+
+	if (i)
+	{
+		numheld -= i;
+		memmove(&(held[0]), &(held[i]), numheld * sizeof(struct impair_held));
+	}
+
+	if (!numheld)
+		return -1;
+
+	return ((held[0].due - now) + 999) / 1000;
+}
+
+int main(int argc, char **argv)
+{
+
+	int opt, port_a = 0, port_b = 0, got_a = 0, got_b = 0;
+	unsigned int seed, warmup = 0;
+	struct pollfd fds[2];
+	unsigned char buf[IMPAIR_MAX_DGRAM];
+
+	seed = time(NULL);
+
+	while ((opt = getopt(argc, argv, "ha:A:b:B:l:d:j:s:w:")) != -1)
+	{
+		switch (opt) {
+			case 'a': port_a = atoi(optarg); break;
+			case 'b': port_b = atoi(optarg); break;
+			case 'A': impair_resolve(optarg, &(sides[0].peer)); got_a = 1; break;
+			case 'B': impair_resolve(optarg, &(sides[1].peer)); got_b = 1; break;
+			case 'l': loss = atof(optarg); break;
+			case 'd': delay = atoi(optarg); break;
+			case 'j': jitter = atoi(optarg); break;
+			case 's': seed = atoi(optarg); break;
+			case 'w': warmup = atoi(optarg); break;
+			case 'h':
+			default: usage(argv[0]); break;
+		}
+	}
+
+	if (!port_a || !port_b || !got_a || !got_b)
+	{
+		fprintf(stderr, "Must specify -a, -A, -b and -B.\n\n");
+		usage(argv[0]);
+	}
+
+	srand(seed);
+	lossfrom = impair_now() + ((uint64_t) warmup * 1000000);
+
+	sides[0].sock = impair_socket(port_a);
+	sides[1].sock = impair_socket(port_b);
+
+	signal(SIGINT, impair_finish);
+	signal(SIGTERM, impair_finish);
+
+	fds[0].fd = sides[0].sock;
+	fds[1].fd = sides[1].sock;
+	fds[0].events = fds[1].events = POLLIN;
+
+	while (!finished)
+	{
+		int side, timeout;
+
+		timeout = impair_release();
+
+		if (poll(fds, 2, timeout) < 0)
+			continue; // Probably a signal
+
+		for (side = 0; side < 2; side++)
+			if (fds[side].revents & POLLIN)
+			{
+				struct sockaddr_in from;
+				socklen_t fromlen = sizeof(from);
+				int len;
+
+				while ((len = recvfrom(sides[side].sock, buf, sizeof(buf), MSG_DONTWAIT, (struct sockaddr *) &from, &fromlen)) >= 0)
+				{
+					if (from.sin_addr.s_addr == sides[side].peer.sin_addr.s_addr && from.sin_port == sides[side].peer.sin_port) // Only pass on traffic from the bridge we expect
+						impair_arrived(side, buf, len);
+					fromlen = sizeof(from);
+				}
+			}
+	}
+
+	fprintf(stderr, "A -> B: %lu datagrams, %lu dropped\n", sides[0].rx, sides[0].dropped);
+	fprintf(stderr, "B -> A: %lu datagrams, %lu dropped\n", sides[1].rx, sides[1].dropped);
+
+	exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,134 @@
+/*
+  (c) 2021 Chris Royle
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+*/
+
+// Reads the statistics from a running bridge's statistics socket ('STATS' in its config) and prints them,
+// once or every so often.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <errno.h>
+
+int usage(char *name)
+{
+
+	fprintf(stderr, " \n\
+Copyright (c) 2021 Chris Royle\n\
+This program comes with ABSOLUTELY NO WARRANTY; for details see\n\
+the GPL v3.0 licence at https://www.gnu.org/licences/ \n\
+\n\
+Usage: %s -s path [options] \n\
+Options:\n\
+\n\
+\t-s path\tThe bridge's statistics socket (STATS in its config)\n\
+\t-j\tJSON rather than text\n\
+\t-H\tJust the latency percentiles\n\
+\t-R\tEmpty the latency histograms, so that they start again\n\
+\t-i n\tPrint them again every n seconds until interrupted\n\
+\n\
+\nHelp:\n\
+\t-h\tThis help message.\n\n\
+", name);
+
+	exit(EXIT_FAILURE);
+}
+
+// Ask the bridge at path for request, and copy what comes back to stdout. Returns 0 if all is well.
+
+int stats_fetch(char *path, char *request)
+{
+	struct sockaddr_un a;
+	char buf[8192];
+	int s, r;
+
+	if (strlen(path) >= sizeof(a.sun_path))
+	{
+		fprintf(stderr, "%s is too long for a socket name\n", path);
+		return -1;
+	}
+
+	memset(&a, 0, sizeof(a));
+	a.sun_family = AF_UNIX;
+	strcpy(a.sun_path, path);
+
+	if ((s = socket(AF_UNIX, SOCK_STREAM, 0)) == -1 || connect(s, (struct sockaddr *) &a, sizeof(a)) == -1)
+	{
+		fprintf(stderr, "Cannot connect to %s: %s\n", path, strerror(errno));
+		if (s != -1)
+			close(s);
+		return -1;
+	}
+
+	if (send(s, request, strlen(request), MSG_NOSIGNAL) != strlen(request)) // The bridge hangs up at once if it has too many clients already
+	{
+		fprintf(stderr, "Cannot send request to %s: %s\n", path, strerror(errno));
+		close(s);
+		return -1;
+	}
+
+	while ((r = read(s, buf, sizeof(buf))) > 0)
+		fwrite(buf, 1, r, stdout);
+
+	fflush(stdout);
+	close(s);
+
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+
+	int opt, interval = 0;
+	char *path = NULL, *request = "TEXT\n";
+
+	while ((opt = getopt(argc, argv, "hs:ji:HR")) != -1)
+	{
+		switch (opt) {
+			case 's': path = optarg; break;
+			case 'j': request = "JSON\n"; break;
+			case 'H': request = "HIST\n"; break;
+			case 'R': request = "RESET\n"; break;
+			case 'i': interval = atoi(optarg); break;
+			case 'h':
+			default: usage(argv[0]); break;
+		}
+	}
+
+	if (!path)
+	{
+		fprintf(stderr, "Must specify -s.\n\n");
+		usage(argv[0]);
+	}
+
+	while (1)
+	{
+		if (stats_fetch(path, request))
+			exit(EXIT_FAILURE);
+
+		if (interval <= 0)
+			break;
+
+		sleep(interval);
+		printf("\n");
+	}
+
+	exit(EXIT_SUCCESS);
+}
@@ -44,8 +44,10 @@
 #include <sys/sendfile.h>
 #include <ctype.h>
 #include <stdint.h>
+#include <pthread.h>
 
 #include "../include/econet-gpio-consumer.h"
+#include "../include/econet-bridge-debug.h"
 
 // the ] as second character is a special location for that character - it loses its
 // special meaning as 'end of character class' so you can match on it.
@@ -55,6 +57,14 @@ extern int aun_send (struct __econet_packet_aun *, int);
 
 extern uint32_t get_local_seq(unsigned char, unsigned char);
 
+// packet pool routines in econet-bridge.c
+extern void * econet_pool_alloc(unsigned int);
+extern void econet_pool_free(void *);
+extern int econet_queue_room(unsigned char, unsigned char, unsigned char, unsigned char);
+
+// statistics routine in econet-bridge.c - how long each operation took
+extern void econet_fs_op_timed(unsigned char, uint64_t);
+
 // routine in econet-bridge.c to find a printer definition
 extern int8_t get_printer(unsigned char, unsigned char, char*);
 
@@ -240,7 +250,7 @@ struct path {
 // Structures used to queue bulk transfers on *LOAD/*RUN. May be adapted later to work on getbytes(), but the latter typically uses smaller number of packets and so doesn't interrupt FS flow like repeated *LOAD does
 // When fs_load_queue is not null (see below), the main loop in the bridge will call fs_execute_load_queue to dump one packet off the head of each queue to the destination station
 struct __pq {
-	struct __econet_packet_udp *packet; // Don't bother with internal 4 byte src/dest header - they are given as parameters to aun_send.
+	struct __econet_packet_udp *packet; // Internal 4 byte src/dest header is filled in at send time - but there are 4 bytes of room for it in front of the packet so that fs_aun_send_inplace() needn't copy it.
 	int len; // Packet data length
 	struct __pq *next;
 };
@@ -256,12 +266,29 @@ struct load_queue {
 
 };
 
-struct load_queue *fs_load_queue = NULL; // Pointer to first load_queue entry. If NULL, there are no load queues to execute. The load queue entries are enqueued so as to be sorted in server, net, stn order. 
+__thread struct load_queue *fs_load_queue = NULL; // Pointer to first load_queue entry. If NULL, there are no load queues to execute. The load queue entries are enqueued so as to be sorted in server, net, stn order. Each bridge thread has its own, so a station's *LOAD data goes out in order behind the reply to the *LOAD, and nobody else needs to touch it.
+
+regex_t r_pathname, r_discname;
+__thread regex_t r_wildcard; // Compiled & freed within one call, but two servers can be busy at once on different threads
 
-regex_t r_pathname, r_discname, r_wildcard;
+// The bridge runs the fileservers on a pool of worker threads. Each server's state is shared between them, so a worker
+// holds that server's lock for the whole of an operation - except while fs_load() reads the file off the disc.
+pthread_mutex_t fs_locks[ECONET_MAX_FS_SERVERS] = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER };
+
+void fs_server_lock(int server)
+{
+	pthread_mutex_lock(&(fs_locks[server]));
+}
+
+void fs_server_unlock(int server)
+{
+	pthread_mutex_unlock(&(fs_locks[server]));
+}
 
 int fs_count = 0;
 
+unsigned long fs_ops[256]; // Operations handled (on all servers), by function code - for the bridge's statistics, which read it from another thread
+
 unsigned short fs_quiet = 0, fs_noisy = 0;
 
 // Find username if it exists in server's userbase
@@ -341,7 +368,7 @@ unsigned char fs_perm_to_acorn(unsigned char fs_perm, unsigned char ftype)
 	r |= ((fs_perm & (FS_PERM_OWN_R | FS_PERM_OWN_W)) << 2);
 	r |= ((fs_perm & (FS_PERM_OTH_R | FS_PERM_OTH_W)) >> 4);
 	
-	//if (!fs_quiet) fprintf (stderr, "Converted perms %02X (ftype %02d) to Acorn %02X\n", fs_perm, ftype, r);
+	//if (!fs_quiet) econet_log ("Converted perms %02X (ftype %02d) to Acorn %02X\n", fs_perm, ftype, r);
 	return r;
 	
 
@@ -380,19 +407,19 @@ void fs_date_to_two_bytes(unsigned short day, unsigned short month, unsigned sho
 
 	year_internal = year  - 81;
 
-	//fprintf (stderr, "7 bit bodge is %s\n", (fs_sevenbitbodge ? "on" : "off"));
+	//econet_debug ("7 bit bodge is %s\n", (fs_sevenbitbodge ? "on" : "off"));
 	if (!fs_sevenbitbodge)
 	{
 		year_internal -= 40;
 		year_internal = year_internal << 4;
 		*monthyear |= (year_internal & 0x0f);
-		//fprintf (stderr, "Converted %02d/%02d/%02d to MY=%02X, D=%02X\n", day, month, year, *monthyear, *dday);
+		//econet_debug ("Converted %02d/%02d/%02d to MY=%02X, D=%02X\n", day, month, year, *monthyear, *dday);
 	}
 	else // use top three bits of day as low three bits of year
 	{
 		*dday |= ((year_internal & 0x70) << 1);
 		*monthyear |= ((year_internal & 0x0f) << 4);
-		//fprintf (stderr, "Converted %02d/%02d/%04d to MY=%02X, D=%02X\n", day, month, year, *monthyear, *dday);
+		//econet_debug ("Converted %02d/%02d/%04d to MY=%02X, D=%02X\n", day, month, year, *monthyear, *dday);
 	}
 
 }
@@ -407,7 +434,7 @@ unsigned short fs_year_from_two_bytes(unsigned char day, unsigned char monthyear
 	else
 		r = ((( ((monthyear & 0xf0) >> 4) | ((day & 0xe0) >> 1) ) + 81) % 100);
 
-	//fprintf (stderr, "year_from2byte (%02x, %02x) = %02d\n", day, monthyear, r);
+	//econet_debug ("year_from2byte (%02x, %02x) = %02d\n", day, monthyear, r);
 
 	return r;
 
@@ -450,20 +477,27 @@ void fs_copy_to_cr(unsigned char *dest, unsigned char *src, unsigned short len)
 	*(dest+count) = '\0';	
 }
 
+// Send a packet which is already in AUN format (i.e. has room for the 4 byte address header in front of the UDP-style packet) - just fills in the header, no copying.
+int fs_aun_send_inplace(struct __econet_packet_aun *a, int server, int len, unsigned short net, unsigned short stn)
+{
+	a->p.padding = 0x00;
+	a->p.seq = get_local_seq(fs_stations[server].net, fs_stations[server].stn);
+		
+	a->p.srcnet = fs_stations[server].net;
+	a->p.srcstn = fs_stations[server].stn;
+	a->p.dstnet = net;
+	a->p.dststn = stn;
+
+	return aun_send (a, len + 8 + 4);
+}
+
 int fs_aun_send(struct __econet_packet_udp *p, int server, int len, unsigned short net, unsigned short stn)
 {
-	struct __econet_packet_aun a;
+	uint32_t a[(len + 8 + 4 + 3) / 4]; // Only as big as it needs to be (4 byte header + packet), rather than a 32K __econet_packet_aun
 
-	memcpy(&(a.p.aun_ttype), p, len+8);
-	a.p.padding = 0x00;
-	a.p.seq = get_local_seq(fs_stations[server].net, fs_stations[server].stn);
-		
-	a.p.srcnet = fs_stations[server].net;
-	a.p.srcstn = fs_stations[server].stn;
-	a.p.dstnet = net;
-	a.p.dststn = stn;
+	memcpy(((unsigned char *) a) + 4, p, len+8);
 
-	return aun_send (&a, len + 8 + 4);
+	return fs_aun_send_inplace((struct __econet_packet_aun *) a, server, len, net, stn);
 }
 
 unsigned short fs_get_dir_handle(int server, unsigned int active_id, unsigned char *path)
@@ -713,7 +747,7 @@ void fs_write_attr_to_file(unsigned char *path, int owner, short perm, unsigned
 		fclose(f);
 	}
 	else
-		fprintf(stderr, "Could not open %s for writing: %s\n", path, strerror(errno));
+		econet_log ("Could not open %s for writing: %s\n", path, strerror(errno));
 
 	free(dotfile);
 	return;
@@ -783,19 +817,19 @@ void fs_write_xattr(unsigned char *path, int owner, short perm, unsigned long lo
 
 	sprintf ((char * ) attrbuf, "%02x", perm);
 	if (setxattr((const char *) path, "user.econet_perm", (const void *) attrbuf, 2, 0)) // Flags = 0 means create if not exist, replace if does
-		fprintf (stderr, "   FS: Failed to set permission on %s\n", path);
+		econet_log ("   FS: Failed to set permission on %s\n", path);
 
 	sprintf((char * ) attrbuf, "%04x", owner);
 	if (setxattr((const char *) path, "user.econet_owner", (const void *) attrbuf, 4, 0))
-		fprintf (stderr, "   FS: Failed to set owner on %s\n", path);
+		econet_log ("   FS: Failed to set owner on %s\n", path);
 
 	sprintf((char * ) attrbuf, "%08lx", load);
 	if (setxattr((const char *) path, "user.econet_load", (const void *) attrbuf, 8, 0))
-		fprintf (stderr, "   FS: Failed to set load address on %s\n", path);
+		econet_log ("   FS: Failed to set load address on %s\n", path);
 
 	sprintf((char * ) attrbuf, "%08lx", exec);
 	if (setxattr((const char *) path, "user.econet_exec", (const void *) attrbuf, 8, 0))
-		fprintf (stderr, "   FS: Failed to set exec address on %s: %s\n", path, strerror(errno));
+		econet_log ("   FS: Failed to set exec address on %s: %s\n", path, strerror(errno));
 
 }
 
@@ -954,7 +988,7 @@ int fs_get_wildcard_entries (int server, int userid, char *haystack, char *needl
 	
 	while (counter < results)
 	{
-		//fprintf (stderr, "fs_get_wildcard_entries() loop counter %d of %d - %s\n", counter+1, results, namelist[counter]->d_name);
+		//econet_debug ("fs_get_wildcard_entries() loop counter %d of %d - %s\n", counter+1, results, namelist[counter]->d_name);
 
 		new_p = malloc(sizeof(struct path_entry));	
 		new_p->next = NULL;
@@ -990,7 +1024,7 @@ int fs_get_wildcard_entries (int server, int userid, char *haystack, char *needl
 
 		if (stat(new_p->unixpath, &statbuf) != 0) // Error
 		{
-			fprintf(stderr, "Unable to stat %s\n", p->unixpath);
+			econet_log ("Unable to stat %s\n", p->unixpath);
 			free (new_p);
 			counter++;
 			continue;
@@ -1098,8 +1132,8 @@ int fs_normalize_path_wildcard(int server, int user, unsigned char *received_pat
 	else if (relative_to != -1 && (path[0] != ':' && path[0] != '$') && path[0] != '&')
 		sprintf(path, "%s.%s", active[server][user].fhandles[relative_to].acornfullpath, received_path);
 
-	if (normalize_debug && relative_to != -1) fprintf (stderr, "Path provided: '%s', relative to '%s'\n", received_path, active[server][user].fhandles[relative_to].acornfullpath);
-	else if (normalize_debug) fprintf (stderr, "Path provided: '%s', relative to nowhere\n", received_path);
+	if (normalize_debug && relative_to != -1) econet_debug ("Path provided: '%s', relative to '%s'\n", received_path, active[server][user].fhandles[relative_to].acornfullpath);
+	else if (normalize_debug) econet_debug ("Path provided: '%s', relative to nowhere\n", received_path);
 
 	// Truncate any path provided that has spaces in it
 	count = 0; 
@@ -1179,9 +1213,9 @@ int fs_normalize_path_wildcard(int server, int user, unsigned char *received_pat
 	if (normalize_debug) 
 	{
 		if (relative_to > 0)
-			fprintf (stderr, "Normalize relative to handle %d, which has full acorn path %s\n", relative_to, active[server][user].fhandles[relative_to].acornfullpath);
+			econet_debug ("Normalize relative to handle %d, which has full acorn path %s\n", relative_to, active[server][user].fhandles[relative_to].acornfullpath);
 		else	
-			fprintf (stderr, "Normalize relative to nowhere.\n");
+			econet_debug ("Normalize relative to nowhere.\n");
 	}
 
 
@@ -1191,7 +1225,7 @@ int fs_normalize_path_wildcard(int server, int user, unsigned char *received_pat
 
 	if (path_internal[0] == '$') // Absolute path given
 	{
-		if (normalize_debug) fprintf (stderr, "Found $ specifier with %02x as next character\n", path_internal[1]);
+		if (normalize_debug) econet_debug ("Found $ specifier with %02x as next character\n", path_internal[1]);
 		switch (path_internal[1])
 		{
 			case '.': ptr = 2; break; 
@@ -1204,7 +1238,7 @@ int fs_normalize_path_wildcard(int server, int user, unsigned char *received_pat
 /* This section fails because for some reason active[server][user].root is garbage! - it is intended to let NFS clients (as opposed to ANFS) use the &.XXX path nomenclature
 	else if (path_internal[0] == '&') // Append home directory
 	{
-		if (normalize_debug) fprintf (stderr, "Found & specifier with %02x as next character\n", path_internal[1]);
+		if (normalize_debug) econet_debug ("Found & specifier with %02x as next character\n", path_internal[1]);
 		switch (path_internal[1])
 		{
 			case '.': ptr = 2; break;
@@ -1212,7 +1246,7 @@ int fs_normalize_path_wildcard(int server, int user, unsigned char *received_pat
 		}
 		if (normalize_debug)
 		{
-			fprintf (stderr, "User id = %d, active id = %d, root handle = %d, full acorn path = %s\n", active[server][user].userid, user, active[server][user].root, active[server][user].fhandles[active[server][user].root].acornfullpath);
+			econet_debug ("User id = %d, active id = %d, root handle = %d, full acorn path = %s\n", active[server][user].userid, user, active[server][user].root, active[server][user].fhandles[active[server][user].root].acornfullpath);
 		}
 		snprintf (adjusted, 1000, ":%s.%s.%s", fs_discs[server][users[server][active[server][user].userid].home_disc].name, active[server][user].fhandles[active[server][user].root].acornfullpath, path_internal + ptr);	
 	}
@@ -1248,19 +1282,19 @@ int fs_normalize_path_wildcard(int server, int user, unsigned char *received_pat
 	{
 		result->disc = active[server][user].current_disc; // Replace the rogue if we are not selecting a specific disc
 		strcpy ((char * ) result->discname, (const char * ) fs_discs[server][result->disc].name);
-		if (normalize_debug) fprintf (stderr, "No disc specified, choosing current disc: %d - %s\n", active[server][user].current_disc, fs_discs[server][result->disc].name);
+		if (normalize_debug) econet_debug ("No disc specified, choosing current disc: %d - %s\n", active[server][user].current_disc, fs_discs[server][result->disc].name);
 	}
 
-	if (normalize_debug) fprintf (stderr, "disc selected = %d, %s\n", result->disc, (result->disc != -1) ? (char *) fs_discs[server][result->disc].name : (char *) "");
-	if (normalize_debug) fprintf (stderr, "path_internal = %s (len %d)\n", path_internal, (int) strlen(path_internal));
+	if (normalize_debug) econet_debug ("disc selected = %d, %s\n", result->disc, (result->disc != -1) ? (char *) fs_discs[server][result->disc].name : (char *) "");
+	if (normalize_debug) econet_debug ("path_internal = %s (len %d)\n", path_internal, (int) strlen(path_internal));
 
 	sprintf (result->acornfullpath, ":%s.$", fs_discs[server][result->disc].name);
 
-	if (normalize_debug) fprintf (stderr, "Adjusted = %s / ptr = %d / path_internal = %s\n", adjusted, ptr, path_internal);
+	if (normalize_debug) econet_debug ("Adjusted = %s / ptr = %d / path_internal = %s\n", adjusted, ptr, path_internal);
 
 	strcpy ((char * ) result->path_from_root, (const char * ) adjusted);
 
-	if (normalize_debug) fprintf (stderr, "Adjusted = %s\n", adjusted);
+	if (normalize_debug) econet_debug ("Adjusted = %s\n", adjusted);
 
 	ptr = 0;
 
@@ -1316,8 +1350,8 @@ int fs_normalize_path_wildcard(int server, int user, unsigned char *received_pat
 
 	sprintf (result->unixpath, "%s/%1d%s", fs_stations[server].directory, result->disc, fs_discs[server][result->disc].name);
 
-	if (normalize_debug) fprintf (stderr, "Unix dir: %s\n", result->unixpath);
-	if (normalize_debug) fprintf (stderr, "npath = %d\n", result->npath);
+	if (normalize_debug) econet_debug ("Unix dir: %s\n", result->unixpath);
+	if (normalize_debug) econet_debug ("npath = %d\n", result->npath);
 
 	// Iterate through each directory looking for the next part of the path in a case insensitive matter, and if any of them lack extended attributes then add them in as we go (if the thing exists!)
 	// Also do the conversion from '/' in an Acorn path to ':' in a unix filename ...
@@ -1376,7 +1410,7 @@ int fs_normalize_path_wildcard(int server, int user, unsigned char *received_pat
 		char acorn_path[100];
 		struct path_entry *p; // Pointer for debug
 
-		if (normalize_debug) fprintf (stderr, "Processing wildcard path with %d elements\n", result->npath);
+		if (normalize_debug) econet_debug ("Processing wildcard path with %d elements\n", result->npath);
 
 		// Re-set path_from_root bceause we'll need to update it with the real acorn names
 		strcpy(result->path_from_root, "");
@@ -1385,7 +1419,7 @@ int fs_normalize_path_wildcard(int server, int user, unsigned char *received_pat
 		{
 
 			strcpy(acorn_path, result->path[count]); // Preserve result->path[count] as is, otherwise fs_get_wildcard_entries will convert it to unix, which we don't want
-			if (normalize_debug) fprintf(stderr, "Processing path element %d - %s (Acorn: %s) in directory %s\n", count, result->path[count], acorn_path, result->unixpath);
+			if (normalize_debug) econet_debug ("Processing path element %d - %s (Acorn: %s) in directory %s\n", count, result->path[count], acorn_path, result->unixpath);
 
 			num_entries = fs_get_wildcard_entries(server, active[server][user].userid, result->unixpath, // Current search dir
 					acorn_path, // Current segment in Acorn format (which the function will convert)
@@ -1393,11 +1427,11 @@ int fs_normalize_path_wildcard(int server, int user, unsigned char *received_pat
 
 			if (normalize_debug)
 			{
-				fprintf (stderr, "Wildcard search returned %d entries (result->paths = %8p):\n", num_entries, result->paths);
+				econet_debug ("Wildcard search returned %d entries (result->paths = %8p):\n", num_entries, result->paths);
 				p = result->paths;
 				while (p != NULL)
 				{
-					fprintf(stderr, "Type %02x Owner %04x Parent owner %04x Owner %10s Perm %02x Parent Perm %02x My Perm %02x Load %08lX Exec %08lX Length %08lX Int name %06lX Unixpath %s Unix fname %s Acorn Name %s Date %02d/%02d/%02d\n",
+					econet_debug ("Type %02x Owner %04x Parent owner %04x Owner %10s Perm %02x Parent Perm %02x My Perm %02x Load %08lX Exec %08lX Length %08lX Int name %06lX Unixpath %s Unix fname %s Acorn Name %s Date %02d/%02d/%02d\n",
 						p->ftype, p->owner, p->parent_owner, p->ownername,
 						p->perm, p->parent_perm, p->my_perm,
 						p->load, p->exec, p->length, p->internal,
@@ -1430,13 +1464,13 @@ int fs_normalize_path_wildcard(int server, int user, unsigned char *received_pat
 				// searched for wasn't there so that it can be written to. Obviously if it did contain wildcards then it can't be so we
 				// return 0
 
-				if (normalize_debug) fprintf (stderr, "Work out whether to return 1 or 0 when nothing found: num_entries returned %d, count = %d, result->npath-1=%d, search for wildcards is %s\n", num_entries, count, result->npath-1, (strchr(result->path[count], '*') == NULL && strchr(result->path[count], '#') == NULL) ? "in vain" : "successful");
+				if (normalize_debug) econet_debug ("Work out whether to return 1 or 0 when nothing found: num_entries returned %d, count = %d, result->npath-1=%d, search for wildcards is %s\n", num_entries, count, result->npath-1, (strchr(result->path[count], '*') == NULL && strchr(result->path[count], '#') == NULL) ? "in vain" : "successful");
 				if ((count == result->npath-1) && (num_entries != -1) // Soft error if on last path entry unless we got an error from the wildcard search
 					// && ((strchr(result->path[count], '*') == NULL) && (strchr(result->path[count], '#') == NULL))
 				) // Only give a hard fail if we are not in last path segment
 					return 1;
 
-				if (normalize_debug) fprintf (stderr, "Signal a hard fail\n");
+				if (normalize_debug) econet_debug ("Signal a hard fail\n");
 				result->error = FS_PATH_ERR_NODIR;
 				return 0; // If not on last segment, this is a hard fail.
 			}
@@ -1486,7 +1520,7 @@ int fs_normalize_path_wildcard(int server, int user, unsigned char *received_pat
 			count++;
 		}
 
-		if (normalize_debug) fprintf (stderr, "Returning full acorn path (wildcard - last path element to be added by caller) %s\n", result->acornfullpath);
+		if (normalize_debug) econet_debug ("Returning full acorn path (wildcard - last path element to be added by caller) %s\n", result->acornfullpath);
 
 		return 1;
 	}
@@ -1505,7 +1539,7 @@ int fs_normalize_path_wildcard(int server, int user, unsigned char *received_pat
 
 		found = 0;
 
-		if (normalize_debug) fprintf (stderr, "Examining %s\n", result->unixpath);
+		if (normalize_debug) econet_debug ("Examining %s\n", result->unixpath);
 
 		// Convert pathname so that / -> :
 
@@ -1533,7 +1567,7 @@ int fs_normalize_path_wildcard(int server, int user, unsigned char *received_pat
 
 		// if we are looking for last element in path (i.e. result->unixpath currently contains parent directory name)
 
-		if (normalize_debug) fprintf (stderr, "Calling fs_check_dir(..., %s, ...)\n", path_segment);
+		if (normalize_debug) econet_debug ("Calling fs_check_dir(..., %s, ...)\n", path_segment);
 
 		// If path_segment is found in dir, then it puts the unix name for that file in unix_segment
 		found = fs_check_dir (dir, path_segment, unix_segment);
@@ -1560,7 +1594,7 @@ int fs_normalize_path_wildcard(int server, int user, unsigned char *received_pat
 			)
 			&& !found) 
 		{
-			if (normalize_debug) fprintf (stderr, "This user cannot read dir %s\n", result->unixpath);
+			if (normalize_debug) econet_debug ("This user cannot read dir %s\n", result->unixpath);
 			result->ftype = FS_FTYPE_NOTFOUND;
 			return 0; // Was 1. Needs to be a hard failure if the user can't read the directory we're looking in
 		}
@@ -1586,7 +1620,7 @@ int fs_normalize_path_wildcard(int server, int user, unsigned char *received_pat
 				// Populate the acorn name we were looking for so that things like fs_save() can easily return it
 				strcpy(result->acornname, path_segment);
 				result->parent_owner = parent_owner; // Otherwise this doesn't get properly updated
-				if (normalize_debug) fprintf (stderr, "Non-Wildcard file (%s, unix %s) not found in dir %s - returning unixpath %s, acornname %s, parent_owner %04X\n", path_segment, unix_segment, result->unixpath, result->unixpath, result->acornname, result->parent_owner);
+				if (normalize_debug) econet_debug ("Non-Wildcard file (%s, unix %s) not found in dir %s - returning unixpath %s, acornname %s, parent_owner %04X\n", path_segment, unix_segment, result->unixpath, result->unixpath, result->acornname, result->parent_owner);
 				return 1;
 			}
 			else	
@@ -1596,7 +1630,7 @@ int fs_normalize_path_wildcard(int server, int user, unsigned char *received_pat
 			}
 		}
 
-		if (normalize_debug) fprintf (stderr, "Found path segment %s in unix world = %s\n", path_segment, unix_segment);
+		if (normalize_debug) econet_debug ("Found path segment %s in unix world = %s\n", path_segment, unix_segment);
 		strcat(result->unixpath, "/");
 		strcat(result->unixpath, unix_segment);
 
@@ -1604,7 +1638,7 @@ int fs_normalize_path_wildcard(int server, int user, unsigned char *received_pat
 		strcat(result->acornfullpath, ".");
 		strcat(result->acornfullpath, path_segment);
 
-		if (normalize_debug) fprintf (stderr, "Attempting to stat %s\n", result->unixpath);
+		if (normalize_debug) econet_debug ("Attempting to stat %s\n", result->unixpath);
 
 		if (!stat(result->unixpath, &s)) // Successful stat
 		{
@@ -1612,21 +1646,21 @@ int fs_normalize_path_wildcard(int server, int user, unsigned char *received_pat
 			//int owner;
 			char dirname[1024];
 
-			if (normalize_debug) fprintf (stderr, "stat(%s) succeeded\n", result->unixpath);
+			if (normalize_debug) econet_debug ("stat(%s) succeeded\n", result->unixpath);
 			if (!S_ISDIR(s.st_mode) && (count < (result->npath - 1))) // stat() follows symlinks so the first bit works across links; the second condition is because we only insist on directories for that part of the path except the last element, which might legitimately be FILE or DIR
 			{
 				result->ftype = FS_FTYPE_NOTFOUND; // Because something we encountered before end of path could not be a directory
 				return 1;
 			}
 
-			if (normalize_debug) fprintf (stderr, "Non-leaf node %s confirmed to be a directory\n", result->unixpath);
+			if (normalize_debug) econet_debug ("Non-leaf node %s confirmed to be a directory\n", result->unixpath);
 			if ((S_ISDIR(s.st_mode) == 0) && (S_ISREG(s.st_mode) == 0)) // Soemthing is wrong
 			{
 				result->error = FS_PATH_ERR_TYPE;
 				return 0; // Should either be file or directory - not block device etc.
 			}
 
-			if (normalize_debug) fprintf (stderr, "Proceeding to look at attributes on %s\n", result->unixpath);
+			if (normalize_debug) econet_debug ("Proceeding to look at attributes on %s\n", result->unixpath);
 			// Next, set internal name from inode number
 
 			result->internal = s.st_ino; // Internal name = Inode number
@@ -1641,10 +1675,10 @@ int fs_normalize_path_wildcard(int server, int user, unsigned char *received_pat
 
 			// If it's a directory with 0 permissions and we own it, set permissions to RW/
 
-			if (normalize_debug) fprintf (stderr, "Looking to see if this user (id %04X) is the owner (%04X), if this is a dir and if perms (%02X) are &00\n", active[server][user].userid, attr.owner, attr.perm);
+			if (normalize_debug) econet_debug ("Looking to see if this user (id %04X) is the owner (%04X), if this is a dir and if perms (%02X) are &00\n", active[server][user].userid, attr.owner, attr.perm);
 			if ((active[server][user].userid == attr.owner) && S_ISDIR(s.st_mode) && ((attr.perm & ~FS_PERM_L) == 0))
 			{
-				if (normalize_debug) fprintf (stderr, "Is a directory owned by the user with perm = 0 - setting permissions to WR/\n");
+				if (normalize_debug) econet_debug ("Is a directory owned by the user with perm = 0 - setting permissions to WR/\n");
 				attr.perm |= FS_PERM_OWN_W | FS_PERM_OWN_R;
 			}
 		
@@ -1664,7 +1698,7 @@ int fs_normalize_path_wildcard(int server, int user, unsigned char *received_pat
 
 			parent_owner = result->owner; // Ready for next loop
 
-			if (normalize_debug) fprintf (stderr, "Setting parent_owner = %04x, this object owned by %04x\n", result->parent_owner, result->owner);
+			if (normalize_debug) econet_debug ("Setting parent_owner = %04x, this object owned by %04x\n", result->parent_owner, result->owner);
 
 			// Are we on the last entry? If so, this is the leaf we're looking for
 
@@ -1722,7 +1756,7 @@ int fs_normalize_path_wildcard(int server, int user, unsigned char *received_pat
 
 	}
 	
-	if (normalize_debug) fprintf (stderr, "Returning full acorn path (non-wildcard) %s\n", result->acornfullpath);
+	if (normalize_debug) econet_debug ("Returning full acorn path (non-wildcard) %s\n", result->acornfullpath);
 
 	strncpy((char * ) result->ownername, (const char * ) users[server][result->owner].username, 10); // Populate readable owner name
 	result->ownername[10] = '\0';
@@ -1801,7 +1835,7 @@ void fs_write_user(int server, int user, unsigned char *d) // Writes the 256 byt
 	{
 		if (fseek(h, (256 * user), SEEK_SET))
 		{
-			if (!fs_quiet) fprintf (stderr, "   FS: Attempt to write beyond end of user file\n");
+			if (!fs_quiet) econet_log ("   FS: Attempt to write beyond end of user file\n");
 		}
 		else
 			fwrite(d, 256, 1, h);
@@ -1834,7 +1868,7 @@ int fs_initialize(unsigned char net, unsigned char stn, char *serverparam)
 
 		fs_date_to_two_bytes(5, 8, 2021, &monthyear, &day);
 
-		fprintf (stderr, "fs_date_to_two_bytes(5/8/2021) gave MY=%02X, D=%02X\n", monthyear, day);
+		econet_debug ("fs_date_to_two_bytes(5/8/2021) gave MY=%02X, D=%02X\n", monthyear, day);
 
 	}
 
@@ -1848,27 +1882,27 @@ int fs_initialize(unsigned char net, unsigned char stn, char *serverparam)
 	int sr;
 
 	strcpy(temp1, "FF12/3");
-	fprintf(stderr, "   FS: temp1 = %s\n", temp1);
+	econet_debug ("   FS: temp1 = %s\n", temp1);
 	fs_unix_to_acorn(temp1);
-	fprintf(stderr, "   FS: fs_unix_to_acorn(temp1) = %s\n", temp1);
+	econet_debug ("   FS: fs_unix_to_acorn(temp1) = %s\n", temp1);
 	fs_acorn_to_unix(temp1);
-	fprintf(stderr, "   FS: fs_acorn_to_unix(temp1) = %s\n", temp1);
+	econet_debug ("   FS: fs_acorn_to_unix(temp1) = %s\n", temp1);
 	
 	strcpy(temp1, "#e*");
-	fprintf(stderr, "   FS: Wildcard test = %s\n", temp1);
+	econet_debug ("   FS: Wildcard test = %s\n", temp1);
 
 	fs_wildcard_to_regex(temp1, temp2);
-	fprintf(stderr, "   FS: Wildcard regex = %s\n", temp2);
+	econet_debug ("   FS: Wildcard regex = %s\n", temp2);
 
-	fprintf(stderr, "   FS: Regex compile returned %d\n", fs_compile_wildcard_regex(temp2));
+	econet_debug ("   FS: Regex compile returned %d\n", fs_compile_wildcard_regex(temp2));
 	sr = scandir("/econet/0ECONET/CHRIS", &namelist, fs_scandir_filter, fs_alphacasesort);
 	
 	regfree(&r_wildcard);
 
-	if (sr == -1) fprintf(stderr, "   FS: scandir() test failed.\n");
+	if (sr == -1) econet_debug ("   FS: scandir() test failed.\n");
 	else while (sr--)
 	{
-		fprintf(stderr, "   FS: File index %d = %s\n", sr, namelist[sr]->d_name);
+		econet_debug ("   FS: File index %d = %s\n", sr, namelist[sr]->d_name);
 		free(namelist[sr]);	
 	}
 	free(namelist);
@@ -1876,7 +1910,7 @@ int fs_initialize(unsigned char net, unsigned char stn, char *serverparam)
 	
 // END OF WILDCARD TEST HARNESS
 
-	if (fs_noisy) fprintf (stderr, "   FS: Attempting to initialize server %d on %d.%d at directory %s\n", fs_count, net, stn, serverparam);
+	if (fs_noisy) econet_debug ("   FS: Attempting to initialize server %d on %d.%d at directory %s\n", fs_count, net, stn, serverparam);
 
 	// If there is a file in this directory called "auto_inf" then we
 	// automatically turn on "-x" mode.  This should work transparently
@@ -1887,7 +1921,7 @@ int fs_initialize(unsigned char net, unsigned char stn, char *serverparam)
 	strcat(autoinf,"/auto_inf");
 	if (access(autoinf, F_OK) == 0)
 	{
-		if (!fs_quiet) fprintf(stderr, "   FS: Automatically turned on -x mode because of %s\n",autoinf);
+		if (!fs_quiet) econet_log ("   FS: Automatically turned on -x mode because of %s\n",autoinf);
 		use_xattr = 0;
 	}
 	free(autoinf);
@@ -1896,21 +1930,21 @@ int fs_initialize(unsigned char net, unsigned char stn, char *serverparam)
 	//if (regcomp(&r_pathname, "^([A-Za-z0-9\\+_;\\?/\\£\\!\\@\\%\\\\\\^\\{\\}\\+\\~\\,\\=\\<\\>\\|\\-]{1,10})", REG_EXTENDED) != 0)
 	if (regcomp(&r_pathname, regex, REG_EXTENDED) != 0)
 	{
-		fprintf(stderr, "Unable to compile regex for file and directory names.\n");
+		econet_log ("Unable to compile regex for file and directory names.\n");
 		exit (EXIT_FAILURE);
 	}
 
 	sprintf(regex, "^(%s{1,16})", FSREGEX);
 	if (regcomp(&r_discname, regex, REG_EXTENDED) != 0)
 	{
-		fprintf(stderr, "Unable to compile regex for disc names.\n");
+		econet_log ("Unable to compile regex for disc names.\n");
 		exit (EXIT_FAILURE);
 	}
 
 	// Ensure serverparam begins with /
 	if (serverparam[0] != '/')
 	{
-		if (!fs_quiet) fprintf (stderr, "   FS: Bad directory name %s\n", serverparam);
+		if (!fs_quiet) econet_log ("   FS: Bad directory name %s\n", serverparam);
 		return -1;
 	}
 
@@ -1918,7 +1952,7 @@ int fs_initialize(unsigned char net, unsigned char stn, char *serverparam)
 
 	if (!d)
 	{
-		if (!fs_quiet) fprintf (stderr, "   FS: Unable to open root directory %s\n", serverparam);
+		if (!fs_quiet) econet_log ("   FS: Unable to open root directory %s\n", serverparam);
 	}
 	else
 	{
@@ -1930,11 +1964,11 @@ int fs_initialize(unsigned char net, unsigned char stn, char *serverparam)
 
 		// Clear state
 		/*
-		fprintf (stderr, "FS doing memset(%8p, 0, %d)\n", active[fs_count], sizeof(active)/ECONET_MAX_FS_SERVERS);
-		fprintf (stderr, "FS doing memset(%8p, 0, %d)\n", fs_discs[fs_count], sizeof(fs_discs)/ECONET_MAX_FS_SERVERS);
-		fprintf (stderr, "FS doing memset(%8p, 0, %d)\n", fs_files[fs_count], sizeof(fs_files)/ECONET_MAX_FS_SERVERS);
-		fprintf (stderr, "FS doing memset(%8p, 0, %d)\n", fs_dirs[fs_count], sizeof(fs_dirs)/ECONET_MAX_FS_SERVERS);
-		fprintf (stderr, "FS bulk ports array at %8p\n", fs_bulk_ports[fs_count]);
+		econet_debug ("FS doing memset(%8p, 0, %d)\n", active[fs_count], sizeof(active)/ECONET_MAX_FS_SERVERS);
+		econet_debug ("FS doing memset(%8p, 0, %d)\n", fs_discs[fs_count], sizeof(fs_discs)/ECONET_MAX_FS_SERVERS);
+		econet_debug ("FS doing memset(%8p, 0, %d)\n", fs_files[fs_count], sizeof(fs_files)/ECONET_MAX_FS_SERVERS);
+		econet_debug ("FS doing memset(%8p, 0, %d)\n", fs_dirs[fs_count], sizeof(fs_dirs)/ECONET_MAX_FS_SERVERS);
+		econet_debug ("FS bulk ports array at %8p\n", fs_bulk_ports[fs_count]);
 		*/
 		memset(active[fs_count], 0, sizeof(active)/ECONET_MAX_FS_SERVERS);
 		memset(fs_discs[fs_count], 0, sizeof(fs_discs)/ECONET_MAX_FS_SERVERS);
@@ -1954,7 +1988,7 @@ int fs_initialize(unsigned char net, unsigned char stn, char *serverparam)
 		
 		if (!passwd)
 		{
-			if (!fs_quiet) fprintf(stderr, "   FS: No password file - initializing %s with SYST\n", passwordfile);
+			if (!fs_quiet) econet_log ("   FS: No password file - initializing %s with SYST\n", passwordfile);
 			sprintf (users[fs_count][0].username, "%-10s", "SYST");
 			sprintf (users[fs_count][0].password, "%-6s", "");
 			sprintf (users[fs_count][0].fullname, "%-30s", "System User"); 
@@ -1966,7 +2000,7 @@ int fs_initialize(unsigned char net, unsigned char stn, char *serverparam)
 			users[fs_count][0].year = users[fs_count][0].month = users[fs_count][0].day = users[fs_count][0].hour = users[fs_count][0].min = users[fs_count][0].sec = 0; // Last login time
 			if ((passwd = fopen(passwordfile, "w+")))
 				fwrite(&(users[fs_count]), 256, 1, passwd);
-			else if (!fs_quiet) fprintf(stderr, "   FS: Unable to write password file at %s - not initializing\n", passwordfile);
+			else if (!fs_quiet) econet_log ("   FS: Unable to write password file at %s - not initializing\n", passwordfile);
 		}
 
 		if (passwd) // Successful file open somewhere along the line
@@ -1977,17 +2011,17 @@ int fs_initialize(unsigned char net, unsigned char stn, char *serverparam)
 	
 			if ((length % 256) != 0)
 			{
-				if (!fs_quiet) fprintf (stderr, "   FS: Password file not a multiple of 256 bytes!\n");
+				if (!fs_quiet) econet_log ("   FS: Password file not a multiple of 256 bytes!\n");
 			}
 			else if ((length > (256 * ECONET_MAX_FS_USERS)))
 			{
-				if (!fs_quiet) fprintf (stderr, "   FS: Password file too long!\n");
+				if (!fs_quiet) econet_log ("   FS: Password file too long!\n");
 			}
 			else	
 			{
 				int discs_found = 0;
 	
-				if (fs_noisy) fprintf (stderr, "   FS: Password file read - %d user(s)\n", (length / 256));
+				if (fs_noisy) econet_debug ("   FS: Password file read - %d user(s)\n", (length / 256));
 				fread (&(users[fs_count]), 256, (length / 256), passwd);
 				fs_stations[fs_count].total_users = (length / 256);
 				fs_stations[fs_count].total_discs = 0;
@@ -2011,7 +2045,7 @@ int fs_initialize(unsigned char net, unsigned char stn, char *serverparam)
 						}
 						fs_discs[fs_count][index].name[count] = 0;
 					
-						if (fs_noisy) fprintf (stderr, "   FS: Initialized disc name %s (%d)\n", fs_discs[fs_count][index].name, index);
+						if (fs_noisy) econet_debug ("   FS: Initialized disc name %s (%d)\n", fs_discs[fs_count][index].name, index);
 						discs_found++;
 	
 					}
@@ -2024,12 +2058,12 @@ int fs_initialize(unsigned char net, unsigned char stn, char *serverparam)
 		
 				if (discs_found > 0)
 					fs_count++; // Only now do we increment the counter, when everything's worked
-				else if (!fs_quiet) fprintf (stderr, "   FS: Server %d - failed to find any discs!\n", fs_count);
+				else if (!fs_quiet) econet_log ("   FS: Server %d - failed to find any discs!\n", fs_count);
 			}
 			fclose(passwd);
 	
 			//if (!fs_quiet)
-				//fprintf(stderr, "   FS: users = %8p, active = %8p, fs_stations = %8p, fs_discs = %8p, fs_files = %8p, fs_dirs = %8p, fs_bulk_ports = %8p\n",
+				//econet_debug ("   FS: users = %8p, active = %8p, fs_stations = %8p, fs_discs = %8p, fs_files = %8p, fs_dirs = %8p, fs_bulk_ports = %8p\n",
 					//users[fs_count], active[fs_count], fs_stations, fs_discs[fs_count], fs_files[fs_count], fs_dirs[fs_count], fs_bulk_ports[fs_count]);
 		}
 		
@@ -2054,7 +2088,7 @@ int fs_initialize(unsigned char net, unsigned char stn, char *serverparam)
 
 			while (e != NULL)
 			{
-					fprintf(stderr, "Type %02x Owner %04x Parent owner %04x Owner %10s Perm %02x Parent Perm %02x My Perm %02x Load %08lX Exec %08lX Length %08lX Int name %06lX Unixpath %s Unix fname %s Acorn Name %s Date %02d/%02d/%02d\n",
+					econet_debug ("Type %02x Owner %04x Parent owner %04x Owner %10s Perm %02x Parent Perm %02x My Perm %02x Load %08lX Exec %08lX Length %08lX Int name %06lX Unixpath %s Unix fname %s Acorn Name %s Date %02d/%02d/%02d\n",
 						e->ftype, e->owner, e->parent_owner, e->ownername,
 						e->perm, e->parent_perm, e->my_perm,
 						e->load, e->exec, e->length, e->internal,
@@ -2073,16 +2107,16 @@ int fs_initialize(unsigned char net, unsigned char stn, char *serverparam)
 
 		result = fs_normalize_path_wildcard(old_fs_count, 0, ":ECONET.$.R*.WOBBLE", -1, &p, 1); // Should give us 1 & FS_FTYPE_NOTFOUND
 
-		fprintf (stderr, "Normalize :ECONET.$.R*.WOBBLE returned %d and FTYPE %d\n", result, p.ftype);
+		econet_debug ("Normalize :ECONET.$.R*.WOBBLE returned %d and FTYPE %d\n", result, p.ftype);
 
 		result = fs_normalize_path_wildcard(old_fs_count, 0, ":ECONET.$.R*.WOBBLE*", -1, &p, 1); // Should give us 1 & FS_FTYPE_NOTFOUND
 
-		fprintf (stderr, "Normalize :ECONET.$.R*.WOBBLE* returned %d and FTYPE %d\n", result, p.ftype);
+		econet_debug ("Normalize :ECONET.$.R*.WOBBLE* returned %d and FTYPE %d\n", result, p.ftype);
 
 		// End of Wildcard test harness 
 */
 
-		if (!fs_quiet) fprintf (stderr, "   FS: Server %d successfully initialized\n", old_fs_count);
+		if (!fs_quiet) econet_log ("   FS: Server %d successfully initialized\n", old_fs_count);
 		return old_fs_count; // The index of the newly initialized server
 	}
 }
@@ -2189,7 +2223,7 @@ void fs_bye(int server, unsigned char reply_port, unsigned char net, unsigned ch
 
 	active_id = fs_stn_logged_in(server, net, stn);
 
-	if (!fs_quiet) fprintf (stderr, "   FS:            from %3d.%3d Bye\n", net, stn);
+	if (!fs_quiet) econet_log ("   FS:            from %3d.%3d Bye\n", net, stn);
 
 	// Close active files / handles
 
@@ -2215,8 +2249,8 @@ void fs_bye(int server, unsigned char reply_port, unsigned char net, unsigned ch
 		count++;
 	}
 
-	//fprintf (stderr, "FS doing memset(%8p, 0, %d)\n", &(active[fs_stn_logged_in(server, net, stn)]), sizeof(active)/ECONET_MAX_FS_SERVERS);
-	//fprintf (stderr, "FS bulk ports array at %8p\n", fs_bulk_ports[server]);
+	//econet_debug ("FS doing memset(%8p, 0, %d)\n", &(active[fs_stn_logged_in(server, net, stn)]), sizeof(active)/ECONET_MAX_FS_SERVERS);
+	//econet_debug ("FS bulk ports array at %8p\n", fs_bulk_ports[server]);
 	//memset(&(active[fs_stn_logged_in(server, net, stn)]), 0, sizeof(active) / ECONET_MAX_FS_SERVERS);
 	active[server][active_id].stn = active[server][active_id].net = 0; // Flag unused
 	
@@ -2297,7 +2331,7 @@ void fs_change_pw(int server, unsigned char reply_port, unsigned int userid, uns
 				fs_reply_success(server, reply_port, net, stn, 0, 0);
 				strncpy((char * ) username, (const char * ) users[server][userid].username, 10);
 				username[10] = 0;
-				if (!fs_quiet) fprintf (stderr, "   FS: User %s changed password\n", username);
+				if (!fs_quiet) econet_log ("   FS: User %s changed password\n", username);
 			}
 			else	fs_error(server, reply_port, net, stn, 0xB9, "Bad password");
 		}
@@ -2319,7 +2353,7 @@ void fs_set_bootopt(int server, unsigned char reply_port, unsigned int userid, u
 		return;
 	}
 
-	if (!fs_quiet) fprintf (stderr, "   FS:%12sfrom %3d.%3d Set boot option %d\n", "", net, stn, new_bootopt);
+	if (!fs_quiet) econet_log ("   FS:%12sfrom %3d.%3d Set boot option %d\n", "", net, stn, new_bootopt);
 	
 	users[server][userid].bootopt = new_bootopt;
 	active[server][fs_stn_logged_in(server,net,stn)].bootopt = new_bootopt;
@@ -2409,12 +2443,12 @@ void fs_login(int server, unsigned char reply_port, unsigned char net, unsigned
 		if (strncasecmp((const char *) users[server][counter].password, password, 6))
 		{
 			fs_error(server, reply_port, net, stn, 0xBC, "Wrong password");
-			if (!fs_quiet) fprintf (stderr, "   FS:            from %3d.%3d Login attempt - username '%s' - Wrong password\n", net, stn, username);
+			if (!fs_quiet) econet_log ("   FS:            from %3d.%3d Login attempt - username '%s' - Wrong password\n", net, stn, username);
 		}
 		else if (users[server][counter].priv & FS_PRIV_LOCKED)
 		{
 			fs_error(server, reply_port, net, stn, 0xBC, "Account locked");
-			if (!fs_quiet) fprintf (stderr, "   FS:            from %3d.%3d Login attempt - username '%s' - Account locked\n", net, stn, username);
+			if (!fs_quiet) econet_log ("   FS:            from %3d.%3d Login attempt - username '%s' - Account locked\n", net, stn, username);
 		}
 		else
 		{
@@ -2433,7 +2467,7 @@ void fs_login(int server, unsigned char reply_port, unsigned char net, unsigned
 
 			if (!found)
 			{
-				if (!fs_quiet) fprintf (stderr, "   FS:            from %3d.%3d Login attempt - username '%s' - server full\n", net, stn, username);
+				if (!fs_quiet) econet_log ("   FS:            from %3d.%3d Login attempt - username '%s' - server full\n", net, stn, username);
 				fs_error(server, reply_port, net, stn, 0xB8, "Too many users");
 			}
 			else
@@ -2507,7 +2541,7 @@ void fs_login(int server, unsigned char reply_port, unsigned char net, unsigned
 							sprintf (tmp_path, ":%s.$", fs_discs[server][0].name);
 							if (!(fs_normalize_path(server, usercount, tmp_path, -1, &p)) || p.ftype == FS_FTYPE_NOTFOUND) // Should NEVER happen....
 							{
-								if (!fs_quiet) fprintf (stderr, "   FS:%12sfrom %3d.%3d Login attempt - cannot find root dir %s\n", "", net, stn, home);
+								if (!fs_quiet) econet_log ("   FS:%12sfrom %3d.%3d Login attempt - cannot find root dir %s\n", "", net, stn, home);
 								fs_error (server, reply_port, net, stn, 0xFF, "Unable to map root.");
 								active[server][usercount].net = 0; active[server][usercount].stn = 0; return;
 							}
@@ -2575,7 +2609,7 @@ void fs_login(int server, unsigned char reply_port, unsigned char net, unsigned
 
 					// In default, go for root on disc 0
 
-					if (!fs_quiet) fprintf (stderr, "   FS:%12sfrom %3d.%3d Login attempt - cannot find lib dir %s\n", "", net, stn, lib);
+					if (!fs_quiet) econet_log ("   FS:%12sfrom %3d.%3d Login attempt - cannot find lib dir %s\n", "", net, stn, lib);
 					if (!fs_normalize_path(server, usercount, "$", -1, &p)) // Use root as library directory instead
 					{
 						fs_error (server, reply_port, net, stn, 0xA8, "Unable to map library");
@@ -2614,7 +2648,7 @@ void fs_login(int server, unsigned char reply_port, unsigned char net, unsigned
 				else
 					sprintf(active[server][usercount].lib_dir_tail, "%-10s", p.path[p.npath-1]);
 
-				if (!fs_quiet) fprintf (stderr, "   FS:            from %3d.%3d Login as %s, index %d, id %d, disc %d, URD %s, CWD %s, LIB %s, priv 0x%02x\n", net, stn, username, usercount, active[server][usercount].userid, active[server][usercount].current_disc, home, home, lib, active[server][usercount].priv);
+				if (!fs_quiet) econet_log ("   FS:            from %3d.%3d Login as %s, index %d, id %d, disc %d, URD %s, CWD %s, LIB %s, priv 0x%02x\n", net, stn, username, usercount, active[server][usercount].userid, active[server][usercount].current_disc, home, home, lib, active[server][usercount].priv);
 
 				// Tell the station
 			
@@ -2638,7 +2672,7 @@ void fs_login(int server, unsigned char reply_port, unsigned char net, unsigned
 	}
 	else
 	{
-		if (!fs_quiet) fprintf (stderr, "   FS:            from %3d.%3d Login attempt - username '%s' - Unknown user\n", net, stn, username);
+		if (!fs_quiet) econet_log ("   FS:            from %3d.%3d Login attempt - username '%s' - Unknown user\n", net, stn, username);
 		fs_error(server, reply_port, net, stn, 0xBC, "User not known");
 	}
 
@@ -2651,7 +2685,7 @@ void fs_read_user_env(int server, unsigned short reply_port, unsigned char net,
 	int replylen = 0;
 	unsigned short disclen;
 
-	if (fs_noisy) fprintf (stderr, "   FS:%12sfrom %3d.%3d Read user environment - current user handle %d, current lib handle %d\n", "", net, stn, active[server][active_id].current, active[server][active_id].lib);
+	if (fs_noisy) econet_debug ("   FS:%12sfrom %3d.%3d Read user environment - current user handle %d, current lib handle %d\n", "", net, stn, active[server][active_id].current, active[server][active_id].lib);
 
 	r.p.port = reply_port;
 	r.p.ctrl = 0x80;
@@ -2662,7 +2696,7 @@ void fs_read_user_env(int server, unsigned short reply_port, unsigned char net,
 
 	// If either current or library handle is invalid, barf massively.
 
-	if (fs_noisy) fprintf (stderr, "Current.is_dir = %d, handle = %d, Lib.is_dir = %d, handle = %d\n", active[server][active_id].fhandles[active[server][active_id].current].is_dir, active[server][active_id].fhandles[active[server][active_id].current].handle, active[server][active_id].fhandles[active[server][active_id].lib].is_dir, active[server][active_id].fhandles[active[server][active_id].lib].handle);
+	if (fs_noisy) econet_debug ("Current.is_dir = %d, handle = %d, Lib.is_dir = %d, handle = %d\n", active[server][active_id].fhandles[active[server][active_id].current].is_dir, active[server][active_id].fhandles[active[server][active_id].current].handle, active[server][active_id].fhandles[active[server][active_id].lib].is_dir, active[server][active_id].fhandles[active[server][active_id].lib].handle);
 
 	if (!(active[server][active_id].fhandles[active[server][active_id].current].is_dir) ||
 	    !(active[server][active_id].fhandles[active[server][active_id].lib].is_dir) ||
@@ -2737,7 +2771,7 @@ void fs_examine(int server, unsigned short reply_port, unsigned char net, unsign
 
 	*/
 
-	if (fs_noisy) fprintf(stderr, "   FS:%12sfrom %3d.%3d Examine %s relative to %d, start %d, extent %d, arg = %d\n", "", net, stn, path,
+	if (fs_noisy) econet_debug ("   FS:%12sfrom %3d.%3d Examine %s relative to %d, start %d, extent %d, arg = %d\n", "", net, stn, path,
 		relative_to, start, n, arg);
 
 	if (!fs_normalize_path_wildcard(server, active_id, path, relative_to, &p, 1) || p.ftype == FS_FTYPE_NOTFOUND)
@@ -2947,11 +2981,11 @@ void fs_examine(int server, unsigned short reply_port, unsigned char net, unsign
 
 			if ((attr.perm & FS_PERM_H) == 0 || (attr.owner == active[server][active_id].userid)) // not hidden
 				dirsize++;
-			//fprintf (stderr, "Skipped %s\n", entry->d_name);
+			//econet_debug ("Skipped %s\n", entry->d_name);
 		}
 	}
 
-	//fprintf (stderr, "After skipping, examined = %d, n = %d\n", examined, n);
+	//econet_debug ("After skipping, examined = %d, n = %d\n", examined, n);
 
 	while ((examined < n) && (entry = readdir(d)))
 	{
@@ -2966,7 +3000,7 @@ void fs_examine(int server, unsigned short reply_port, unsigned char net, unsign
 	
 			sprintf(fullpath, ":%s.%s%s%s", p.discname, p.path_from_root, (p.npath > 0) ? "." : "", acorn_name);
 
-			//fprintf(stderr, "Calling normalize() on %s\n", fullpath);
+			//econet_debug ("Calling normalize() on %s\n", fullpath);
 
 			if (!fs_normalize_path(server, active_id, fullpath, -1, &file))
 			{
@@ -3124,7 +3158,7 @@ void fs_set_object_info(int server, unsigned short reply_port, unsigned char net
 
 	fs_copy_to_cr(path, (data+filenameposition), 1023);
 
-	if (!fs_quiet) fprintf (stderr, "   FS:%12sfrom %3d.%3d Set Object Info %s relative to %s, command %d\n", "", net, stn, path, relative_to == active[server][active_id].root ? "Root" : relative_to == active[server][active_id].lib ? "Library" : "Current", command);
+	if (!fs_quiet) econet_log ("   FS:%12sfrom %3d.%3d Set Object Info %s relative to %s, command %d\n", "", net, stn, path, relative_to == active[server][active_id].root ? "Root" : relative_to == active[server][active_id].lib ? "Library" : "Current", command);
 	
 	if (!fs_normalize_path(server, active_id, path, relative_to, &p) || p.ftype == FS_FTYPE_NOTFOUND)
 		fs_error(server, reply_port, net, stn, 0xD6, "Not found");
@@ -3274,7 +3308,7 @@ void fs_get_object_info(int server, unsigned short reply_port, unsigned char net
 
 	path[replylen] = '\0'; // Null terminate instead of 0x0d in the packet
 
-	if (fs_noisy) fprintf (stderr, "   FS:%12sfrom %3d.%3d Get Object Info %s relative to %02X, command %d\n", "", net, stn, path, relative_to, command);
+	if (fs_noisy) econet_debug ("   FS:%12sfrom %3d.%3d Get Object Info %s relative to %02X, command %d\n", "", net, stn, path, relative_to, command);
 	
 
 	norm_return = fs_normalize_path_wildcard(server, active_id, path, relative_to, &p, 1);
@@ -3427,7 +3461,7 @@ void fs_save(int server, unsigned short reply_port, unsigned char net, unsigned
 	
 	length = (*(data+13)) + ((*(data+14)) << 8) + ((*(data+15)) << 16);
 
-	if (!fs_quiet) fprintf (stderr, "   FS:%12sfrom %3d.%3d %s %s %08lx %08lx %06lx\n", "", net, stn, (create_only ? "CREATE" : "SAVE"), filename, load, exec, length);
+	if (!fs_quiet) econet_log ("   FS:%12sfrom %3d.%3d %s %s %08lx %08lx %06lx\n", "", net, stn, (create_only ? "CREATE" : "SAVE"), filename, load, exec, length);
 
 	if (create_only || (incoming_port = fs_find_bulk_port(server)))
 	{
@@ -3578,7 +3612,7 @@ void fs_free(int server, unsigned short reply_port, unsigned char net, unsigned
 	fs_copy_to_cr(tmp, data+5, 16);
 	snprintf((char * ) discname, 17, "%-16s", (const char * ) tmp);
 
-	if (!fs_quiet) fprintf (stderr, "   FS:%12sfrom %3d.%3d Read free space on %s\n", "", net, stn, discname);
+	if (!fs_quiet) econet_log ("   FS:%12sfrom %3d.%3d Read free space on %s\n", "", net, stn, discname);
 
 	disc = 0;
 	while (disc < ECONET_MAX_FS_DISCS)
@@ -3639,7 +3673,7 @@ void fs_owner(int server, unsigned short reply_port, int active_id, unsigned cha
 
 	fs_copy_to_cr(path, command, 1023);
 
-	if (!fs_quiet) fprintf (stderr, "   FS:%12sfrom %3d.%3d *OWNER %s\n", "", net, stn, path);
+	if (!fs_quiet) econet_log ("   FS:%12sfrom %3d.%3d *OWNER %s\n", "", net, stn, path);
 
 	ptr = 0;
 
@@ -3688,7 +3722,7 @@ void fs_chown(int server, unsigned short reply_port, int active_id, unsigned cha
 
 	fs_copy_to_cr(path, command, 1023);
 
-	if (!fs_quiet) fprintf (stderr, "   FS:%12sfrom %3d.%3d *CHOWN %s\n", "", net, stn, path);
+	if (!fs_quiet) econet_log ("   FS:%12sfrom %3d.%3d *CHOWN %s\n", "", net, stn, path);
 
 	userid = active[server][active_id].userid;
 
@@ -3731,7 +3765,7 @@ void fs_chown(int server, unsigned short reply_port, int active_id, unsigned cha
 	
 	username[10] = '\0';
 	
-	if (!fs_quiet) fprintf(stderr, "   FS:%12sfrom %3d.%3d Change ownership on %s to '%s'\n", "", net, stn, path, (char *) (ptr_owner ? (char *) username : (char *) "self"));
+	if (!fs_quiet) econet_log ("   FS:%12sfrom %3d.%3d Change ownership on %s to '%s'\n", "", net, stn, path, (char *) (ptr_owner ? (char *) username : (char *) "self"));
 
 	if ((!(active[server][active_id].priv & FS_PRIV_SYSTEM)) && (ptr_owner != 0)) // Ordinary user tring to change ownership to someone other than themselves
 	{
@@ -3822,7 +3856,7 @@ short fs_open_interlock(int server, unsigned char *path, unsigned short mode, un
 				if (fs_files[server][count].writers == 0) // We can open this existing handle for reading
 				{
 					fs_files[server][count].readers++;
-					if (fs_noisy) fprintf (stderr, "   FS:%12sInterlock opened internal dup handle %d, mode %d. Readers = %d, Writers = %d, path %s\n", "", count, mode, fs_files[server][count].readers, fs_files[server][count].writers, fs_files[server][count].name);
+					if (fs_noisy) econet_debug ("   FS:%12sInterlock opened internal dup handle %d, mode %d. Readers = %d, Writers = %d, path %s\n", "", count, mode, fs_files[server][count].readers, fs_files[server][count].writers, fs_files[server][count].name);
 					return count; // Return the index into fs_files
 				}
 				else // We can't open for reading because someone else has it open for writing
@@ -3851,7 +3885,7 @@ short fs_open_interlock(int server, unsigned char *path, unsigned short mode, un
 			if (mode == 3) // Take ownereship on OPENOUT
 				fs_write_xattr(path, userid, FS_PERM_OWN_W | FS_PERM_OWN_R, 0, 0);
 	
-			if (fs_noisy) fprintf (stderr, "   FS:%12sInterlock opened internal handle %d, mode %d. Readers = %d, Writers = %d, path %s\n", "", count, mode, fs_files[server][count].readers, fs_files[server][count].writers, fs_files[server][count].name);
+			if (fs_noisy) econet_debug ("   FS:%12sInterlock opened internal handle %d, mode %d. Readers = %d, Writers = %d, path %s\n", "", count, mode, fs_files[server][count].readers, fs_files[server][count].writers, fs_files[server][count].name);
 			return count;
 		}
 		else count++;
@@ -3870,11 +3904,11 @@ void fs_close_interlock(int server, unsigned short index, unsigned short mode)
 		fs_files[server][index].readers--;
 	else	fs_files[server][index].writers--;
 
-	if (fs_noisy) fprintf (stderr, "   FS:%12sInterlock close internal handle %d, mode %d. Readers now = %d, Writers now = %d, path %s\n", "", index, mode, fs_files[server][index].readers, fs_files[server][index].writers, fs_files[server][index].name);
+	if (fs_noisy) econet_debug ("   FS:%12sInterlock close internal handle %d, mode %d. Readers now = %d, Writers now = %d, path %s\n", "", index, mode, fs_files[server][index].readers, fs_files[server][index].writers, fs_files[server][index].name);
 
 	if (fs_files[server][index].readers <= 0 && fs_files[server][index].writers <= 0)
 	{
-		if (fs_noisy) fprintf (stderr, "   FS:%12sInterlock closing internal handle %d in operating system\n", "", index);
+		if (fs_noisy) econet_debug ("   FS:%12sInterlock closing internal handle %d in operating system\n", "", index);
 		fclose(fs_files[server][index].handle);
 		fs_files[server][index].handle = NULL; // Flag unused
 	}
@@ -3909,7 +3943,7 @@ void fs_copy(int server, unsigned short reply_port, int active_id, unsigned char
 	struct path_entry *e;
 	unsigned short to_copy, all_files;
 
-	if (!fs_quiet) fprintf (stderr, "   FS:%12sfrom %3d.%3d COPY %s\n", "", net, stn, command);
+	if (!fs_quiet) econet_log ("   FS:%12sfrom %3d.%3d COPY %s\n", "", net, stn, command);
 
 	if (sscanf(command, "%s %s", source, destination) != 2)
 	{
@@ -3974,7 +4008,7 @@ void fs_copy(int server, unsigned short reply_port, int active_id, unsigned char
 
 		handle = fs_open_interlock(server, e->unixpath, 1, active[server][active_id].userid);
 
-		//fprintf (stderr, "fs_open_interlock(%s) returned %d\n", e->unixpath, handle);
+		//econet_debug ("fs_open_interlock(%s) returned %d\n", e->unixpath, handle);
 
 		if (handle == -3)
 		{
@@ -4004,7 +4038,7 @@ void fs_copy(int server, unsigned short reply_port, int active_id, unsigned char
 
 		out_handle = fs_open_interlock(server, destfile, 3, active[server][active_id].userid);
 
-		//fprintf (stderr, "fs_open_interlock(%s) returned %d\n", destfile, out_handle);
+		//econet_debug ("fs_open_interlock(%s) returned %d\n", destfile, out_handle);
 
 		if (out_handle == -3)
 		{
@@ -4028,7 +4062,7 @@ void fs_copy(int server, unsigned short reply_port, int active_id, unsigned char
 		fseek(fs_files[server][handle].handle, 0, SEEK_END);
 		length = ftell(fs_files[server][handle].handle);
 
-		if (!fs_quiet) fprintf (stderr, "   FS:%12sfrom %3d.%3d Copying %s to %s, length %06lX\n", "", net, stn, e->unixpath, destfile, length);
+		if (!fs_quiet) econet_log ("   FS:%12sfrom %3d.%3d Copying %s to %s, length %06lX\n", "", net, stn, e->unixpath, destfile, length);
 
 		readpos = 0; // Start at the start
 
@@ -4068,7 +4102,7 @@ void fs_link(int server, unsigned short reply_port, int active_id, unsigned char
 	char source[1024], destination[1024];
 	struct path p_src, p_dst;
 
-	if (!fs_quiet) fprintf (stderr, "   FS:%12sfrom %3d.%3d LINK %s\n", "", net, stn, command);
+	if (!fs_quiet) econet_log ("   FS:%12sfrom %3d.%3d LINK %s\n", "", net, stn, command);
 	if (sscanf(command, "%s %s", source, destination) != 2)
 	{
 		fs_error(server, reply_port, net, stn, 0xFF, "Bad parameters");
@@ -4090,7 +4124,7 @@ void fs_link(int server, unsigned short reply_port, int active_id, unsigned char
 		return;
 	}
 	
-	//fprintf (stderr, "Calling symlink(%s, %s)\n", p_src.unixpath, p_dst.unixpath);
+	//econet_debug ("Calling symlink(%s, %s)\n", p_src.unixpath, p_dst.unixpath);
 
 	if (symlink(p_src.unixpath, p_dst.unixpath) == -1)
 	{
@@ -4117,7 +4151,7 @@ void fs_unlink(int server, unsigned short reply_port, int active_id, unsigned ch
 	struct stat s;
 	struct path p;
 
-	if (!fs_quiet) fprintf (stderr, "   FS:%12sfrom %3d.%3d UNLINK %s\n", "", net, stn, command);
+	if (!fs_quiet) econet_log ("   FS:%12sfrom %3d.%3d UNLINK %s\n", "", net, stn, command);
 	if (sscanf(command, "%s", link) != 1)
 	{
 		fs_error(server, reply_port, net, stn, 0xFF, "Bad parameters");
@@ -4200,13 +4234,13 @@ void fs_sdisc(int server, unsigned short reply_port, int active_id, unsigned cha
 	sprintf(tmppath, ":%s.%s", discname, home_dir);
 	sprintf(tmppath2, ":%s.$", discname);
 
-	if (!fs_quiet) fprintf(stderr, "   FS:%12sfrom %3d.%3d Change disc to %s\n", "", net, stn, discname);
+	if (!fs_quiet) econet_log ("   FS:%12sfrom %3d.%3d Change disc to %s\n", "", net, stn, discname);
 
 	if (!fs_normalize_path(server, active_id, tmppath, -1, &p_root))
 	{
 		if (!fs_normalize_path(server, active_id, tmppath2, -1, &p_root))
 		{
-			if (!fs_quiet) fprintf(stderr, "   FS:%12sfrom %3d.%3d Failed to map URD %s on %s, even %s\n", "", net, stn, discname, tmppath, tmppath2);
+			if (!fs_quiet) econet_log ("   FS:%12sfrom %3d.%3d Failed to map URD %s on %s, even %s\n", "", net, stn, discname, tmppath, tmppath2);
 			fs_error(server, reply_port, net, stn, 0xFF, "Cannot map root directory on new disc");
 			return;
 		}
@@ -4214,7 +4248,7 @@ void fs_sdisc(int server, unsigned short reply_port, int active_id, unsigned cha
 
 	if (p_root.ftype == FS_FTYPE_NOTFOUND && !fs_normalize_path(server, active_id, tmppath2, -1, &p_root))
 	{
-		if (!fs_quiet) fprintf(stderr, "   FS:%12sfrom %3d.%3d Failed to map URD on %s, even %s\n", "", net, stn, discname, tmppath2);
+		if (!fs_quiet) econet_log ("   FS:%12sfrom %3d.%3d Failed to map URD on %s, even %s\n", "", net, stn, discname, tmppath2);
 		fs_error(server, reply_port, net, stn, 0xFF, "Cannot map root directory on new disc");
 		return;
 
@@ -4222,7 +4256,7 @@ void fs_sdisc(int server, unsigned short reply_port, int active_id, unsigned cha
 
 	if (p_root.ftype != FS_FTYPE_DIR)
 	{
-		if (!fs_quiet) fprintf(stderr, "   FS:%12sfrom %3d.%3d URD on %s, even %s, is not a dir!\n", "", net, stn, discname, tmppath2);
+		if (!fs_quiet) econet_log ("   FS:%12sfrom %3d.%3d URD on %s, even %s, is not a dir!\n", "", net, stn, discname, tmppath2);
 		fs_error(server, reply_port, net, stn, 0xFF, "Cannot map root directory on new disc");
 		return;
 	}
@@ -4261,13 +4295,13 @@ void fs_sdisc(int server, unsigned short reply_port, int active_id, unsigned cha
 	fs_store_tail_path(active[server][active_id].fhandles[root].acorntailpath, p_root.acornfullpath);
 	active[server][active_id].fhandles[root].mode = 1;
 
-	if (!fs_quiet) fprintf(stderr, "   FS:%12sfrom %3d.%3d Successfully mapped new URD - uHandle %02X, full path %s\n", "", net, stn, root, active[server][active_id].fhandles[root].acornfullpath);
+	if (!fs_quiet) econet_log ("   FS:%12sfrom %3d.%3d Successfully mapped new URD - uHandle %02X, full path %s\n", "", net, stn, root, active[server][active_id].fhandles[root].acornfullpath);
 
 	strcpy(active[server][active_id].fhandles[cur].acornfullpath, p_root.acornfullpath);
 	fs_store_tail_path(active[server][active_id].fhandles[cur].acorntailpath, p_root.acornfullpath);
 	active[server][active_id].fhandles[cur].mode = 1;
 
-	if (!fs_quiet) fprintf(stderr, "   FS:%12sfrom %3d.%3d Successfully mapped new CWD - uHandle %02X, full path %s\n", "", net, stn, cur, active[server][active_id].fhandles[cur].acornfullpath);
+	if (!fs_quiet) econet_log ("   FS:%12sfrom %3d.%3d Successfully mapped new CWD - uHandle %02X, full path %s\n", "", net, stn, cur, active[server][active_id].fhandles[cur].acornfullpath);
 
 	sprintf(tmppath, ":%s.%s", discname, lib_dir);
 
@@ -4308,12 +4342,12 @@ void fs_sdisc(int server, unsigned short reply_port, int active_id, unsigned cha
 
 		active[server][active_id].lib = lib;
 	
-		if (!fs_quiet) fprintf(stderr, "   FS:%12sfrom %3d.%3d Successfully mapped new Library - uHandle %02X, full path %s\n", "", net, stn, lib, active[server][active_id].fhandles[lib].acornfullpath);
+		if (!fs_quiet) econet_log ("   FS:%12sfrom %3d.%3d Successfully mapped new Library - uHandle %02X, full path %s\n", "", net, stn, lib, active[server][active_id].fhandles[lib].acornfullpath);
 	}
 	else	lib = active[server][active_id].lib;
 
 
-	if (fs_noisy) fprintf(stderr, "   FS:%12sfrom %3d.%3d Attempting to deallocate handles %d, %d, %d\n", "", net, stn, active[server][active_id].root, active[server][active_id].current, active[server][active_id].lib);
+	if (fs_noisy) econet_debug ("   FS:%12sfrom %3d.%3d Attempting to deallocate handles %d, %d, %d\n", "", net, stn, active[server][active_id].root, active[server][active_id].current, active[server][active_id].lib);
 	
 	fs_close_interlock(server, active[server][active_id].fhandles[active[server][active_id].root].handle, active[server][active_id].fhandles[active[server][active_id].root].mode);
 	fs_deallocate_user_dir_channel(server, active_id, active[server][active_id].root);
@@ -4326,7 +4360,7 @@ void fs_sdisc(int server, unsigned short reply_port, int active_id, unsigned cha
 	strncpy((char *) active[server][active_id].root_dir, (const char *) "", 11);
 	strncpy((char *) active[server][active_id].root_dir_tail, (const char *) "$         ", 11);
 
-	if (!fs_quiet) fprintf (stderr, "   FS:%12sfrom %3d.%3d New (URD, CWD) = (%s, %s)\n", "", net, stn, 
+	if (!fs_quiet) econet_log ("   FS:%12sfrom %3d.%3d New (URD, CWD) = (%s, %s)\n", "", net, stn, 
 		active[server][active_id].fhandles[root].acorntailpath, 
 		active[server][active_id].fhandles[cur].acorntailpath );
 
@@ -4421,7 +4455,7 @@ void fs_rename(int server, unsigned short reply_port, int active_id, unsigned ch
 	strncpy(to_path, (command+secondpath_start), (secondpath_end - secondpath_start + 1));
 	to_path[(secondpath_end - secondpath_start + 1)] = '\0';
 
-	if (!fs_quiet) fprintf(stderr, "   FS:%12sfrom %3d.%3d Rename from %s to %s\n", "", net, stn, from_path, to_path);	
+	if (!fs_quiet) econet_log ("   FS:%12sfrom %3d.%3d Rename from %s to %s\n", "", net, stn, from_path, to_path);	
 
 	if (!fs_normalize_path(server, active_id, from_path, active[server][active_id].current, &p_from) || !fs_normalize_path(server, active_id, to_path, active[server][active_id].current, &p_to) || p_from.ftype == FS_FTYPE_NOTFOUND)
 	{
@@ -4429,7 +4463,7 @@ void fs_rename(int server, unsigned short reply_port, int active_id, unsigned ch
 		return;
 	}
 
-	//fprintf (stderr, "Rename parms: from locked: %s, from_owner %04x, from_parent_owner %04x, to_ftype %02x, to_owner %04x, to_parent_owner %04x, to_perm %02x, to_parent_perm %02x\n", 
+	//econet_debug ("Rename parms: from locked: %s, from_owner %04x, from_parent_owner %04x, to_ftype %02x, to_owner %04x, to_parent_owner %04x, to_perm %02x, to_parent_perm %02x\n", 
 			//(p_from.perm & FS_PERM_L ? "Yes" : "No"), p_from.owner, p_from.parent_owner, p_to.ftype, p_to.owner, p_to.parent_owner, p_to.perm, p_to.parent_perm);
 
 	if (p_from.perm & FS_PERM_L) // Source locked
@@ -4473,7 +4507,7 @@ void fs_rename(int server, unsigned short reply_port, int active_id, unsigned ch
 		{
 			case -1: // Can't open
 			{
-				fprintf(stderr, "fs_open_interlock() returned -1");
+				econet_log ("fs_open_interlock() returned -1\n");
 				fs_error(server, reply_port, net, stn, 0xFF, "FS Error");
 				return;
 			}
@@ -4602,7 +4636,7 @@ void fs_delete(int server, unsigned short reply_port, int active_id, unsigned ch
 					((e->ftype == FS_FTYPE_FILE) && unlink((const char *) e->unixpath)) ||
 				((e->ftype == FS_FTYPE_DIR) && rmdir((const char *) e->unixpath))
 				) // Failed
-				{	if (!fs_quiet) fprintf (stderr, "   FS:%12sfrom %3d.%3d Failed to unlink %s\n", "", net, stn, e->unixpath);
+				{	if (!fs_quiet) econet_log ("   FS:%12sfrom %3d.%3d Failed to unlink %s\n", "", net, stn, e->unixpath);
 					fs_free_wildcard_list(&p);
 					fs_error(server, reply_port, net, stn, 0xFF, "FS Error");
 					return;
@@ -4641,7 +4675,7 @@ void fs_cdir(int server, unsigned short reply_port, int active_id, unsigned char
 
 	fs_copy_to_cr(path, command + count, 1023);
 
-	if (!fs_quiet) fprintf (stderr, "   FS:%12sfrom %3d.%3d CDIR %s relative to %02X (%s)\n", "", net, stn, path, relative_to, active[server][active_id].fhandles[relative_to].acornfullpath);
+	if (!fs_quiet) econet_log ("   FS:%12sfrom %3d.%3d CDIR %s relative to %02X (%s)\n", "", net, stn, path, relative_to, active[server][active_id].fhandles[relative_to].acornfullpath);
 
 	if (!fs_normalize_path(server, active_id, path, relative_to, &p))
 		fs_error(server, reply_port, net, stn, 0xD6, "Not found");
@@ -4686,7 +4720,7 @@ void fs_info(int server, unsigned short reply_port, int active_id, unsigned char
 	r.p.data[0] = 0x04; // Anything else and we get weird results. 0x05, for example, causes the client machine to *RUN the file immediately after getting the answer...
 	r.p.data[1] = 0;
 
-	if (!fs_quiet) fprintf (stderr, "   FS:%12sfrom %3d.%3d *INFO %s\n", "", net, stn, path);
+	if (!fs_quiet) econet_log ("   FS:%12sfrom %3d.%3d *INFO %s\n", "", net, stn, path);
 
 	if (!fs_normalize_path(server, active_id, path, relative_to, &p))
 		fs_error(server, reply_port, net, stn, 0xD6, "Not found");
@@ -4740,7 +4774,7 @@ void fs_access(int server, unsigned short reply_port, int active_id, unsigned ch
 
 	fs_copy_to_cr(path, command, 1023);
 
-	if (!fs_quiet) fprintf (stderr, "   FS:%12sfrom %3d.%3d *ACCESS %s\n", "", net, stn, path);
+	if (!fs_quiet) econet_log ("   FS:%12sfrom %3d.%3d *ACCESS %s\n", "", net, stn, path);
 
 	if (sscanf(command, "%s %8s", path, perm_str) != 2)
 	{
@@ -4824,7 +4858,7 @@ void fs_access(int server, unsigned short reply_port, int active_id, unsigned ch
 	}
 
 
-	//fprintf (stderr, "Command: %s, path_ptr = %d, ptr = %d\n", command, path_ptr, ptr);
+	//econet_debug ("Command: %s, path_ptr = %d, ptr = %d\n", command, path_ptr, ptr);
 
 	strncpy((char * ) path, (const char * ) command + path_ptr, (ptr - path_ptr));
 
@@ -4951,7 +4985,7 @@ void fs_read_discs(int server, unsigned short reply_port, unsigned char net, uns
 	r.p.data[0] = 10;
 	r.p.data[1] = 0;
 	
-	if (!fs_quiet) fprintf (stderr, "   FS:%12sfrom %3d.%3d Read Discs from %d (up to %d)\n", "", net, stn, start, number);
+	if (!fs_quiet) econet_log ("   FS:%12sfrom %3d.%3d Read Discs from %d (up to %d)\n", "", net, stn, start, number);
 
 	while (disc_ptr < ECONET_MAX_FS_DISCS && found < start)
 	{
@@ -4991,7 +5025,7 @@ void fs_read_time(int server, unsigned short reply_port, unsigned char net, unsi
 	time_t now;
 	unsigned char monthyear, day;
 
-	if (!fs_quiet) fprintf (stderr, "   FS:%12sfrom %3d.%3d Read FS time\n", "", net, stn);
+	if (!fs_quiet) econet_log ("   FS:%12sfrom %3d.%3d Read FS time\n", "", net, stn);
 
 	now = time(NULL);
 	t = *localtime(&now);
@@ -5036,7 +5070,7 @@ void fs_read_logged_on_users(int server, unsigned short reply_port, unsigned cha
 
 	ptr = 3;
 	
-	if (!fs_quiet) fprintf (stderr, "   FS:%12sfrom %3d.%3d Read logged on users\n", "", net, stn);
+	if (!fs_quiet) econet_log ("   FS:%12sfrom %3d.%3d Read logged on users\n", "", net, stn);
 
 	// Get to the start entry in active[server][]
 
@@ -5097,7 +5131,7 @@ void fs_read_user_info(int server, unsigned short reply_port, unsigned char net,
 
 	fs_copy_to_cr(username, (data+5), 14);
 
-	if (!fs_quiet) fprintf (stderr, "   FS:%12sfrom %3d.%3d Read user info for %s\n", "", net, stn, username);
+	if (!fs_quiet) econet_log ("   FS:%12sfrom %3d.%3d Read user info for %s\n", "", net, stn, username);
 
 	count = 0;
 
@@ -5139,7 +5173,7 @@ void fs_read_version(int server, unsigned short reply_port, unsigned char net, u
 	r.p.data[0] = r.p.data[1] = 0;
 	sprintf((char * ) &(r.p.data[2]), "%s%c", FS_VERSION_STRING, 0x0d);
 
-	if (!fs_quiet) fprintf (stderr, "   FS:%12sfrom %3d.%3d Read FS version\n", "", net, stn);
+	if (!fs_quiet) econet_log ("   FS:%12sfrom %3d.%3d Read FS version\n", "", net, stn);
 
 	fs_aun_send(&r, server, strlen(FS_VERSION_STRING)+3, net, stn);
 
@@ -5157,7 +5191,7 @@ void fs_cat_header(int server, unsigned short reply_port, int active_id, unsigne
 
 	fs_copy_to_cr(path, data+5, 1022);
 
-	if (!fs_quiet) fprintf (stderr, "   FS:%12sfrom %3d.%3d Read catalogue header %s\n", "", net, stn, path);
+	if (!fs_quiet) econet_log ("   FS:%12sfrom %3d.%3d Read catalogue header %s\n", "", net, stn, path);
 
 	if (!fs_normalize_path(server, active_id, path, relative_to, &p))
 		fs_error(server, reply_port, net, stn, 0xd6, "Not found");
@@ -5189,9 +5223,9 @@ void fs_cat_header(int server, unsigned short reply_port, int active_id, unsigne
 
 // load enqueue. net, stn are destinations. server parameter is to ensure queue is ordered. p & len are the packet to queue
 // Length is data portion length only, so add 8 for the header on a UDP packet, 12 for AUN
-// We do the malloc/free inside the enqueue/dequeue routines
+// The queue entry and its packet come out of the bridge's packet pool as a single block, allocated/freed inside the enqueue/dequeue routines
 // RETURNS:
-// -1 Failure - malloc
+// -1 Failure - pool exhausted or malloc
 // 1 Success
 
 char fs_load_enqueue(int server, struct __econet_packet_udp *p, int len, unsigned char net, unsigned char stn, unsigned char internal_handle, unsigned char mode)
@@ -5201,16 +5235,16 @@ char fs_load_enqueue(int server, struct __econet_packet_udp *p, int len, unsigne
 	struct __pq *q; // Queue entry within a host
 	struct load_queue *l, *l_parent, *n; // l_ used for searching, n is a new entry if we need one
 
-	if (fs_noisy) fprintf (stderr, "CACHE: to %3d.%3d              Enqueue packet length %04X type %d\n", net, stn, len, p->p.ptype);
+	if (fs_noisy) econet_debug ("CACHE: to %3d.%3d              Enqueue packet length %04X type %d\n", net, stn, len, p->p.ptype);
 
-	u = malloc(len + 8);
-	memcpy(u, p, len + 8); // Copy the packet data off
+	q = econet_pool_alloc(sizeof(struct __pq) + 4 + len + 8); // Make a new packet entry, with room for the AUN header and packet after it
 
-	q = malloc(sizeof(struct __pq)); // Make a new packet entry
+	if (!q) return -1;
 
-	if (!u || !q) return -1;
+	u = (struct __econet_packet_udp *) (((unsigned char *) (q + 1)) + 4);
+	memcpy(u, p, len + 8); // Copy the packet data off
 
-	//if (fs_noisy) fprintf (stderr, "CACHE: malloc() and copy succeeded\n");
+	//if (fs_noisy) econet_debug ("CACHE: malloc() and copy succeeded\n");
 
 	// First, see if there is an existing queue entry for this server to this destination, to which we will add the packet.
 	// If there is, there is no need to build a new load_queue entry.
@@ -5244,23 +5278,23 @@ char fs_load_enqueue(int server, struct __econet_packet_udp *p, int len, unsigne
 
 	// And similarly here, we will either have (l->server > server), or (servers equal but net >), or (servers and net equal, but stn >) or (servers and net and stn equal) or fell off end.
 
-	//if (fs_noisy) fprintf (stderr, "CACHE: Existing queue%s found at %p\n", (l ? "" : " not"), l);
+	//if (fs_noisy) econet_debug ("CACHE: Existing queue%s found at %p\n", (l ? "" : " not"), l);
 
 	if (!l || (l->server != server || l->net != net || l->stn != stn)) // No entry found - make a new one
 	{
 
 		// Make a new load queue entry
 
-		if (fs_noisy) fprintf (stderr, "CACHE: Making new packet queue entry for this server/net/src triple ");
+		if (fs_noisy) econet_debug ("CACHE: Making new packet queue entry for this server/net/src triple ");
 
 		n = malloc(sizeof(struct load_queue));
 
 		if (!n)
 		{
-			free (u); free (q); return -1;
+			econet_pool_free (q); return -1;
 		}
 
-		if (fs_noisy) fprintf (stderr, "at %p ", n);
+		if (fs_noisy) econet_debug ("at %p ", n);
 
 		n->net = net;
 		n->stn = stn;
@@ -5272,18 +5306,18 @@ char fs_load_enqueue(int server, struct __econet_packet_udp *p, int len, unsigne
 		n->pq_tail = NULL;
 		n->next = NULL; // Applies whether there was no list at all, or we fell off the end of it. We'll fix it below if we're inserting
 
-		if (fs_noisy) fprintf (stderr, "fs_load_queue = %p, l = %p ", fs_load_queue, l);
+		if (fs_noisy) econet_debug ("fs_load_queue = %p, l = %p ", fs_load_queue, l);
 
 		if (!fs_load_queue) // There was no queue at all
 		{
-			if (fs_noisy) fprintf(stderr, "as a new fs_load_queue\n");
+			if (fs_noisy) econet_debug ("as a new fs_load_queue\n");
 			fs_load_queue = n;
 		}
 		else // We are inserting, possibly at the end
 		{
 			if (!l) // We fell off the end
 			{
-				if (fs_noisy) fprintf (stderr, "on the end of the existing queue\n");
+				if (fs_noisy) econet_debug ("on the end of the existing queue\n");
 				l_parent->next = n;
 			}
 			else // Inserting in the middle or at queue head
@@ -5291,13 +5325,13 @@ char fs_load_enqueue(int server, struct __econet_packet_udp *p, int len, unsigne
 				if (!l_parent)
 				{
 					n->next = fs_load_queue;
-					if (fs_noisy) fprintf (stderr, "by inserting at queue head\n");
+					if (fs_noisy) econet_debug ("by inserting at queue head\n");
 					fs_load_queue = n;
 					
 				}
 				else
 				{
-					if (fs_noisy) fprintf (stderr, "by splice at %p\n", l_parent->next);
+					if (fs_noisy) econet_debug ("by splice at %p\n", l_parent->next);
 					n->next = l_parent->next; // Splice this one in
 					l_parent->next = n;
 				}
@@ -5322,15 +5356,15 @@ char fs_load_enqueue(int server, struct __econet_packet_udp *p, int len, unsigne
 	}
 
 /*
-	if (fs_noisy) fprintf (stderr, "CACHE: Queue state for %d to %3d.%3d:\n", server, net, stn);
+	if (fs_noisy) econet_debug ("CACHE: Queue state for %d to %3d.%3d:\n", server, net, stn);
 
-	if (fs_noisy) fprintf (stderr, "       Load_queue head at %p\n", n);
+	if (fs_noisy) econet_debug ("       Load_queue head at %p\n", n);
 */
 	q = n->pq_head;
 
 	while (q)
 	{
-		//if (fs_noisy) fprintf (stderr, "         Packet length %04X at %p, next at %p\n", q->len, q, q->next);
+		//if (fs_noisy) econet_debug ("         Packet length %04X at %p, next at %p\n", q->len, q, q->next);
 		q = q->next;
 	}
 
@@ -5367,29 +5401,24 @@ void fs_enqueue_dump(struct load_queue *l)
 	while (p)
 	{
 		p_next = p->next;
-		if (p->packet) 
-		{
-			if (fs_noisy) fprintf (stderr, "CACHE: Freeing bulk transfer packet at %p\n", p->packet);
-			free (p->packet); // Check it is not null, just in case...
-		}
-		if (fs_noisy) fprintf (stderr, "CACHE: Freeing bulk transfer queue entry at %p\n", p);
-		free(p);
+		if (fs_noisy) econet_debug ("CACHE: Freeing bulk transfer queue entry (and packet) at %p\n", p);
+		econet_pool_free(p);
 		p = p_next;
 
 	}
 	
 	if (h_parent) // Mid chain, not at start
 	{
-		if (fs_noisy) fprintf (stderr, "CACHE: Freed structure was not at head of chain. Spliced between %p and %p\n", h_parent, h->next);
+		if (fs_noisy) econet_debug ("CACHE: Freed structure was not at head of chain. Spliced between %p and %p\n", h_parent, h->next);
 		h_parent->next = h->next; // Drop this one out of the chain
 	}
 	else
 	{
-		if (fs_noisy) fprintf (stderr, "CACHE: Freed structure was at head of chain. fs_load_queue now %p\n", h->next);
+		if (fs_noisy) econet_debug ("CACHE: Freed structure was at head of chain. fs_load_queue now %p\n", h->next);
 		fs_load_queue = h->next; // Drop this one off the beginning of the chain
 	}
 
-	if (fs_noisy) fprintf (stderr, "CACHE: Freeing bulk transfer transaction queue head at %p\n", h);
+	if (fs_noisy) econet_debug ("CACHE: Freeing bulk transfer transaction queue head at %p\n", h);
 
 	free(h); // Free up this struct
 
@@ -5415,7 +5444,7 @@ char fs_load_dequeue(int server, unsigned char net, unsigned char stn)
 	l = fs_load_queue;
 	l_parent = NULL;
 
-	if (fs_noisy) fprintf (stderr, "CACHE: to %3d.%3d from %3d.%3d de-queuing bulk transfer\n", net, stn, fs_stations[server].net, fs_stations[server].stn);
+	if (fs_noisy) econet_debug ("CACHE: to %3d.%3d from %3d.%3d de-queuing bulk transfer\n", net, stn, fs_stations[server].net, fs_stations[server].stn);
 
 	while (l && (l->server != server || l->net != net || l->stn != stn))
 	{
@@ -5425,7 +5454,7 @@ char fs_load_dequeue(int server, unsigned char net, unsigned char stn)
 
 	if (!l) return 0; // Nothing found
 
-	if (fs_noisy) fprintf (stderr, "CACHE: to %3d.%3d from %3d.%3d queue head found at %p\n",  net, stn, fs_stations[server].net, fs_stations[server].stn, l);
+	if (fs_noisy) econet_debug ("CACHE: to %3d.%3d from %3d.%3d queue head found at %p\n",  net, stn, fs_stations[server].net, fs_stations[server].stn, l);
 
 	if (!(l->pq_head)) // There was an entry, but it had no packets in it!
 	{
@@ -5437,11 +5466,11 @@ char fs_load_dequeue(int server, unsigned char net, unsigned char stn)
 		free(l);
 	}
 
-	if (fs_noisy) fprintf (stderr, "CACHE: to %3d.%3d from %3d.%3d Sending packet from __pq %p, length %04X\n", net, stn, fs_stations[server].net, fs_stations[server].stn, l->pq_head, l->pq_head->len);
+	if (fs_noisy) econet_debug ("CACHE: to %3d.%3d from %3d.%3d Sending packet from __pq %p, length %04X\n", net, stn, fs_stations[server].net, fs_stations[server].stn, l->pq_head, l->pq_head->len);
 
-	if (fs_aun_send(l->pq_head->packet, server, l->pq_head->len, l->net, l->stn) <= 0) // If this fails, dump the rest of the enqueued traffic
+	if (fs_aun_send_inplace((struct __econet_packet_aun *) (((unsigned char *) l->pq_head->packet) - 4), server, l->pq_head->len, l->net, l->stn) <= 0) // If this fails, dump the rest of the enqueued traffic
 	{
-		if (fs_noisy) fprintf (stderr, "CACHE: fs_aun_send() failed in fs_load_sequeue() - dumping rest of queue\n");
+		if (fs_noisy) econet_debug ("CACHE: fs_aun_send() failed in fs_load_sequeue() - dumping rest of queue\n");
 		fs_enqueue_dump(l); // Also closes file
 		return -1;
 
@@ -5452,14 +5481,13 @@ char fs_load_dequeue(int server, unsigned char net, unsigned char stn)
 
 		p = l->pq_head;
 		l->pq_head = l->pq_head->next;
-		free(p->packet);
-		free(p);
+		econet_pool_free(p); // Packet is in the same block
 
-		if (fs_noisy) fprintf (stderr, "CACHE: Packet queue entry freed at %p\n", p);
+		if (fs_noisy) econet_debug ("CACHE: Packet queue entry freed at %p\n", p);
 
 		if (!(l->pq_head)) // Ran out of packets
 		{
-			if (fs_noisy) fprintf (stderr, "CACHE: End of packet queue - dumping queue head at %p\n", l);
+			if (fs_noisy) econet_debug ("CACHE: End of packet queue - dumping queue head at %p\n", l);
 			l->pq_tail = NULL;
 			fs_enqueue_dump(l);
 			return 2;
@@ -5471,44 +5499,48 @@ char fs_load_dequeue(int server, unsigned char net, unsigned char stn)
 }
 
 // Function called by the bridge when it knows there are things to dequeue
-// Dumps out one packet per bulk transfer per server->{net,stn} combo each time.
+// Dumps out one packet per bulk transfer per server->{net,stn} combo each time - unless the bridge's queue to that
+// station is already full enough, in which case that transfer waits its turn.
 void fs_dequeue(void) 
 {
-	struct load_queue *l;
+	struct load_queue *l, *n;
 
-	if (fs_noisy) fprintf (stderr, "CACHE: fs_dequeue() called\n");
+	if (fs_noisy) econet_debug ("CACHE: fs_dequeue() called\n");
 	l = fs_load_queue;
 
 	while (l)
 	{
-		if (fs_noisy) fprintf(stderr, "CACHE: Dequeue from %p\n", l);
+		n = l->next; // l may be freed if this was its last packet
 
-		fs_load_dequeue(l->server, l->net, l->stn);
-		l = l->next;
+		if (econet_queue_room(fs_stations[l->server].net, fs_stations[l->server].stn, l->net, l->stn))
+		{
+			int server = l->server;
+
+			if (fs_noisy) econet_debug ("CACHE: Dequeue from %p\n", l);
+			fs_server_lock(server); // The end of the transfer closes the file
+			fs_load_dequeue(server, l->net, l->stn);
+			fs_server_unlock(server);
+		}
+
+		l = n;
 	}
 
 }
 
-// Called by the bridge to see if there is traffic
+// Called by the bridge to see if there is traffic it can send now
 short fs_dequeuable(void)
 {
 	struct load_queue *l;
 
-	unsigned short count = 0;
-
 	l = fs_load_queue;
 
 	while (l)
 	{
-		count++;
+		if (econet_queue_room(fs_stations[l->server].net, fs_stations[l->server].stn, l->net, l->stn))
+			return 1;
 		l = l->next;
 	}
 
-	//if (fs_noisy)	fprintf (stderr, "CACHE: There is%s data in the bulk transfer queue (%d entries)\n", (fs_load_queue ? "" : " no"), count);
-
-	if (fs_load_queue)
-		 return 1;
-	
 	return 0;
 }
 
@@ -5519,7 +5551,9 @@ void fs_load(int server, unsigned short reply_port, unsigned char net, unsigned
 	struct path p;
 	struct __econet_packet_udp r;
 
-	FILE *f;
+	int fd;
+	off_t offset = 0;
+	int failed = 0, queued = 0;
 
 	unsigned char data_port = *(data+2);
 
@@ -5541,7 +5575,7 @@ void fs_load(int server, unsigned short reply_port, unsigned char net, unsigned
 		}
 	}
 
-	if (!fs_quiet) fprintf (stderr, "   FS:%12sfrom %3d.%3d %s %s\n", "", net, stn, (loadas ? "Run" : "Load"), command);
+	if (!fs_quiet) econet_log ("   FS:%12sfrom %3d.%3d %s %s\n", "", net, stn, (loadas ? "Run" : "Load"), command);
 
 	//if (!fs_normalize_path(server, active_id, command, active[server][active_id].current, &p) &&
 	if (!(result = fs_normalize_path(server, active_id, command, relative_to, &p)))
@@ -5586,8 +5620,6 @@ void fs_load(int server, unsigned short reply_port, unsigned char net, unsigned
 		return;
 	}
 	
-	f = fs_files[server][internal_handle].handle;
-
 	r.p.port = reply_port;
 	r.p.ctrl = rxctrl;
 	r.p.ptype = ECONET_AUN_DATA;
@@ -5614,27 +5646,39 @@ void fs_load(int server, unsigned short reply_port, unsigned char net, unsigned
 	{
 		// Send data burst
 
-		int collected, enqueue_result;
+		ssize_t collected;
 
 		r.p.ctrl = 0x80;
 		r.p.port = data_port;
 
+		// The file is read without holding the server, so that the other workers can get on with other stations'
+		// operations meanwhile. pread() on the interlock's own file leaves its FILE's cursor alone for anyone else
+		// who has it open, the interlock keeps writers out, and our reader count keeps it open until the dequeuer
+		// closes it.
 
-		fseek (f, 0, SEEK_SET);
+		fd = fileno(fs_files[server][internal_handle].handle);
 
-		while (!feof(f))
-		{
-			collected = fread(&(r.p.data), 1, 1280, f);
-			
-			if (collected > 0) enqueue_result = fs_load_enqueue(server, &r, collected, net, stn, internal_handle, 1); else enqueue_result = 0;
+		fs_server_unlock(server);
 
-			if (collected < 0 || enqueue_result < 0)
+		while (!failed && (collected = pread(fd, &(r.p.data), 1280, offset)) != 0)
+		{
+			if (collected < 0 || fs_load_enqueue(server, &r, collected, net, stn, internal_handle, 1) < 0)
+				failed = 1;
+			else
 			{
-				if (!fs_quiet)	fprintf(stderr, "   FS: Data burst enqueue failed\n");
-				return; // Failed in some way
+				offset += collected;
+				queued = 1;
 			}
-	
+		}
 
+		fs_server_lock(server);
+
+		if (failed)
+		{
+			if (!fs_quiet)	econet_log ("   FS: Data burst enqueue failed\n");
+			if (!queued) // Nothing for the dequeuer to close the interlock with
+				fs_close_interlock(server, internal_handle, 1);
+			return; // Failed in some way
 		}
 		
 		// Send the tail end packet
@@ -5643,11 +5687,11 @@ void fs_load(int server, unsigned short reply_port, unsigned char net, unsigned
 		r.p.port = reply_port;
 		r.p.ctrl = rxctrl;
 
-		fs_load_enqueue(server, &r, 2, net, stn, internal_handle, 1);
+		if (fs_load_enqueue(server, &r, 2, net, stn, internal_handle, 1) < 0 && !queued) // Empty file, and no room for the tail end either
+			fs_close_interlock(server, internal_handle, 1);
 
 	}
-	
-	//fs_close_interlock(server, internal_handle, 1); // Now closed by the dequeuer
+	else	fs_close_interlock(server, internal_handle, 1); // Closed by the dequeuer otherwise
 }
 
 // Get byte from current cursor position
@@ -5666,7 +5710,7 @@ void fs_getbyte(int server, unsigned char reply_port, unsigned char net, unsigne
 
 		h = fs_files[server][active[server][active_id].fhandles[handle].handle].handle;
 
-		if (!fs_quiet) fprintf (stderr, "   FS:%12sfrom %3d.%3d Get byte on channel %02x, cursor %04lX\n", "", net, stn, handle, active[server][active_id].fhandles[handle].cursor);
+		if (!fs_quiet) econet_log ("   FS:%12sfrom %3d.%3d Get byte on channel %02x, cursor %04lX\n", "", net, stn, handle, active[server][active_id].fhandles[handle].cursor);
 
 		if (active[server][active_id].fhandles[handle].is_dir) // Directory handle
 		{
@@ -5758,7 +5802,7 @@ void fs_putbyte(int server, unsigned char reply_port, unsigned char net, unsigne
 			clearerr(h);
 			fseek(h, active[server][active_id].fhandles[handle].cursor, SEEK_SET);
 
-			if (!fs_quiet) fprintf (stderr, "   FS:%12sfrom %3d.%3d Put byte %02X on channel %02x, cursor %06lX\n", "", net, stn, b, handle, active[server][active_id].fhandles[handle].cursor);
+			if (!fs_quiet) econet_log ("   FS:%12sfrom %3d.%3d Put byte %02X on channel %02x, cursor %06lX\n", "", net, stn, b, handle, active[server][active_id].fhandles[handle].cursor);
 
 			if (fwrite(buffer, 1, 1, h) != 1)
 			{
@@ -5771,7 +5815,7 @@ void fs_putbyte(int server, unsigned char reply_port, unsigned char net, unsigne
 			// Update cursor
 	
 			active[server][active_id].fhandles[handle].cursor = ftell(h);
-			if (!fs_quiet) fprintf (stderr, "   FS:%12sfrom %3d.%3d Put byte %02X on channel %02x, updated cursor %06lX\n", "", net, stn, b, handle, active[server][active_id].fhandles[handle].cursor);
+			if (!fs_quiet) econet_log ("   FS:%12sfrom %3d.%3d Put byte %02X on channel %02x, updated cursor %06lX\n", "", net, stn, b, handle, active[server][active_id].fhandles[handle].cursor);
 
 		}
 	
@@ -5805,7 +5849,7 @@ void fs_get_random_access_info(int server, unsigned char reply_port, unsigned ch
 	r.p.ptype = ECONET_AUN_DATA;
 	r.p.data[0] = r.p.data[1] = 0;
 
-	if (fs_noisy) fprintf (stderr, "   FS:%12sfrom %3d.%3d Get random access info on handle %02X, function %02X\n", "", net, stn, handle, function);
+	if (fs_noisy) econet_debug ("   FS:%12sfrom %3d.%3d Get random access info on handle %02X, function %02X\n", "", net, stn, handle, function);
 
 	switch (function) 
 	{
@@ -5813,7 +5857,7 @@ void fs_get_random_access_info(int server, unsigned char reply_port, unsigned ch
 			r.p.data[2] = (active[server][active_id].fhandles[handle].cursor & 0xff);
 			r.p.data[3] = (active[server][active_id].fhandles[handle].cursor & 0xff00) >> 8;
 			r.p.data[4] = (active[server][active_id].fhandles[handle].cursor & 0xff0000) >> 16;
-			if (fs_noisy) fprintf (stderr, "   FS:%12sfrom %3d.%3d  - cursor %06lX\n", "", net, stn, active[server][active_id].fhandles[handle].cursor);
+			if (fs_noisy) econet_debug ("   FS:%12sfrom %3d.%3d  - cursor %06lX\n", "", net, stn, active[server][active_id].fhandles[handle].cursor);
 			break;
 		case 1: // Fall through extent / allocation - going to assume this is file size but might be wrong
 		case 2:
@@ -5826,7 +5870,7 @@ void fs_get_random_access_info(int server, unsigned char reply_port, unsigned ch
 				return;
 			}
 		
-			if (fs_noisy) fprintf (stderr, "   FS:%12sfrom %3d.%3d  - extent %06lX\n", "", net, stn, s.st_size);
+			if (fs_noisy) econet_debug ("   FS:%12sfrom %3d.%3d  - extent %06lX\n", "", net, stn, s.st_size);
 
 			r.p.data[2] = s.st_size & 0xff;
 			r.p.data[3] = (s.st_size & 0xff00) >> 8;
@@ -5886,7 +5930,7 @@ void fs_set_random_access_info(int server, unsigned char reply_port, unsigned ch
 		case 0: // Set pointer
 		{
 
-			if (!fs_quiet) fprintf (stderr, "   FS:%12sfrom %3d.%3d Set file pointer on channel %02X to %06lX, current extent %06lX%s\n", "", net, stn, handle, value, extent, (value > extent) ? " which is beyond EOF" : "");
+			if (!fs_quiet) econet_log ("   FS:%12sfrom %3d.%3d Set file pointer on channel %02X to %06lX, current extent %06lX%s\n", "", net, stn, handle, value, extent, (value > extent) ? " which is beyond EOF" : "");
 			if (value > extent) // Need to expand file
 			{
 				unsigned char buffer[4096];
@@ -5906,12 +5950,12 @@ void fs_set_random_access_info(int server, unsigned char reply_port, unsigned ch
 					written = fwrite(buffer, 1, chunk, f);
 					if (written != chunk)
 					{
-						fprintf(stderr, "Tried to write %d, but fwrite returned %ld\n", chunk, written);
+						econet_log ("Tried to write %d, but fwrite returned %ld\n", chunk, written);
 						fs_error(server, reply_port, net, stn, 0xFF, "FS Error extending file");
 						return;
 					}
 					
-					if (!fs_quiet) fprintf (stderr, "   FS:%12sfrom %3d.%3d  - tried to write %06X bytes, actually wrote %06lX\n", "", net, stn, chunk, written);
+					if (!fs_quiet) econet_log ("   FS:%12sfrom %3d.%3d  - tried to write %06X bytes, actually wrote %06lX\n", "", net, stn, chunk, written);
 					to_write -= written;
 				}
 
@@ -5927,7 +5971,7 @@ void fs_set_random_access_info(int server, unsigned char reply_port, unsigned ch
 		break;
 		case 1: // Set file extent
 		{
-			if (!fs_quiet) fprintf (stderr, "   FS:%12sfrom %3d.%3d Set file extent on channel %02X to %06lX, current extent %06lX%s\n", "", net, stn, handle, value, extent, (value > extent) ? " so adding bytes to end of file" : "");
+			if (!fs_quiet) econet_log ("   FS:%12sfrom %3d.%3d Set file extent on channel %02X to %06lX, current extent %06lX%s\n", "", net, stn, handle, value, extent, (value > extent) ? " so adding bytes to end of file" : "");
 /*
 			if (value > extent)
 			{
@@ -5944,7 +5988,7 @@ void fs_set_random_access_info(int server, unsigned char reply_port, unsigned ch
 					written = fwrite(buffer, (to_write > 4096 ? 4096 : to_write), 1, f);
 					if (written != (to_write > 4096 ? 4096 : to_write))
 					{
-						if (!fs_quiet) fprintf (stderr, "   FS:%12sfrom %3d.%3d Attempted to write chunk size %ld to the file, but fwrite returned %ld\n", "", net, stn, (to_write > 4096 ? 4096 : to_write), written);
+						if (!fs_quiet) econet_log ("   FS:%12sfrom %3d.%3d Attempted to write chunk size %ld to the file, but fwrite returned %ld\n", "", net, stn, (to_write > 4096 ? 4096 : to_write), written);
 						fs_error(server, reply_port, net, stn, 0xFF, "FS Error extending file");
 						return;
 					}
@@ -5958,7 +6002,7 @@ void fs_set_random_access_info(int server, unsigned char reply_port, unsigned ch
 			if (value < extent)
 			{
 */
-				if (!fs_quiet) fprintf (stderr, "   FS:%12sfrom%3d.%3d   - %s file accordingly\n", "", net, stn, ((value < extent) ? "truncating" : "extending"));
+				if (!fs_quiet) econet_log ("   FS:%12sfrom%3d.%3d   - %s file accordingly\n", "", net, stn, ((value < extent) ? "truncating" : "extending"));
 				if (ftruncate(fileno(f), value)) // Error if non-zero
 				{
 					fs_error(server, reply_port, net, stn, 0xFF, "FS Error setting extent");
@@ -5990,7 +6034,8 @@ void fs_getbytes(int server, unsigned char reply_port, unsigned char net, unsign
 	unsigned short eofreached, fserroronread;
 	int received, total_received;
 
-	unsigned char readbuffer[0x500];
+	uint32_t bulkbuffer[(0x500 + 12 + 3) / 4]; // One bulk packet, AUN format so it can go straight to aun_send - read straight into it from the file
+	struct __econet_packet_aun *bulk = (struct __econet_packet_aun *) bulkbuffer;
 
 	struct __econet_packet_udp r;
 
@@ -5999,7 +6044,7 @@ void fs_getbytes(int server, unsigned char reply_port, unsigned char net, unsign
 	bytes = (((*(data+7))) + ((*(data+8)) << 8) + (*(data+9) << 16));
 	offset = (((*(data+10))) + ((*(data+11)) << 8) + (*(data+12) << 16));
 
-	if (fs_noisy) fprintf (stderr, "   FS:%12sfrom %3d.%3d fs_getbytes() %04lX from offset %04lX by user %04x on handle %02x\n", "", net, stn, bytes, offset, active[server][active_id].userid, handle);
+	if (fs_noisy) econet_debug ("   FS:%12sfrom %3d.%3d fs_getbytes() %04lX from offset %04lX by user %04x on handle %02x\n", "", net, stn, bytes, offset, active[server][active_id].userid, handle);
 
 	if (active[server][active_id].fhandles[handle].handle == -1) // Invalid handle
 	{
@@ -6027,7 +6072,7 @@ void fs_getbytes(int server, unsigned char reply_port, unsigned char net, unsign
 	else
 		eofreached = 0;
 
-	if (fs_noisy) fprintf (stderr, "   FS:%12sfrom %3d.%3d fs_getbytes() offset %04lX, file length %04lX, beyond EOF %s\n", "", net, stn, offset, length, (eofreached ? "Yes" : "No"));
+	if (fs_noisy) econet_debug ("   FS:%12sfrom %3d.%3d fs_getbytes() offset %04lX, file length %04lX, beyond EOF %s\n", "", net, stn, offset, length, (eofreached ? "Yes" : "No"));
 
 	fseek(fs_files[server][internal_handle].handle, offset, SEEK_SET);
 	active[server][active_id].fhandles[handle].cursor = offset;
@@ -6048,36 +6093,33 @@ void fs_getbytes(int server, unsigned char reply_port, unsigned char net, unsign
 	{
 		unsigned short readlen;
 
-		readlen = ((bytes - sent) > sizeof(readbuffer) ? sizeof(readbuffer) : (bytes - sent));
+		readlen = ((bytes - sent) > 0x500 ? 0x500 : (bytes - sent));
 
-		received = fread(readbuffer, 1, readlen, fs_files[server][internal_handle].handle);
+		received = fread(&(bulk->p.data), 1, readlen, fs_files[server][internal_handle].handle);
 
-		if (fs_noisy) fprintf(stderr, "   FS:%12sfrom %3d.%3d fs_getbytes() bulk transfer: bytes required %04lX, bytes already sent %04lX, buffer size %04X, bytes to read %04X, bytes actually read %04X\n", "", net, stn, bytes, sent, (unsigned short) sizeof(readbuffer), readlen, received);
+		if (fs_noisy) econet_debug ("   FS:%12sfrom %3d.%3d fs_getbytes() bulk transfer: bytes required %04lX, bytes already sent %04lX, buffer size %04X, bytes to read %04X, bytes actually read %04X\n", "", net, stn, bytes, sent, 0x500, readlen, received);
 
 		if (received != readlen) // Either FEOF or error
 		{
 			if (feof(fs_files[server][internal_handle].handle)) eofreached = 1;
 			else
 			{
-				if (fs_noisy) fprintf(stderr, "   FS:%12sfrom %3d.%3d fread returned %d, expected %d\n", "", net, stn, received, readlen);
+				if (fs_noisy) econet_debug ("   FS:%12sfrom %3d.%3d fread returned %d, expected %d\n", "", net, stn, received, readlen);
 				fserroronread = 1;
 			}
 		}
 
 		// Always send packets which total up to the amount of data the station requested, even if all the data is past EOF (because the station works that out from the closing packet)
-		r.p.ptype = ECONET_AUN_DATA;
-		r.p.port = txport;
-		r.p.ctrl = 0x80;
-
-		if (received > 0)
-			memcpy(&(r.p.data), readbuffer, received);	
+		bulk->p.aun_ttype = ECONET_AUN_DATA;
+		bulk->p.port = txport;
+		bulk->p.ctrl = 0x80;
 
 		if (received < readlen) // Pad rest of data
-			memset (&(r.p.data[received]), 0, readlen - received);
+			memset (&(bulk->p.data[received]), 0, readlen - received);
 
 		// The real FS pads a short packet to the length requested, but then sends a completion message (below) indicating how many bytes were actually valid
 
-		fs_aun_send(&r, server, readlen, net, stn);
+		fs_aun_send_inplace(bulk, server, readlen, net, stn);
 
 		sent += readlen;
 		total_received += received;
@@ -6092,7 +6134,7 @@ void fs_getbytes(int server, unsigned char reply_port, unsigned char net, unsign
 
 		received = fread(&(r.p.data), 1, (bytes > (ECONET_MAX_PACKET_SIZE) ? ECONET_MAX_PACKET_SIZE : bytes), fs_files[server][internal_handle].handle);
 
-		if (fs_noisy) fprintf(stderr, "   FS:%12sfrom %3d.%3d fs_getbytes() bytes required %06lX, max size %06X, read from disc %06X\n", "", net, stn, bytes, ECONET_MAX_PACKET_SIZE-4, received);
+		if (fs_noisy) econet_debug ("   FS:%12sfrom %3d.%3d fs_getbytes() bytes required %06lX, max size %06X, read from disc %06X\n", "", net, stn, bytes, ECONET_MAX_PACKET_SIZE-4, received);
 
 		if (feof(fs_files[server][internal_handle].handle)) eofreached = 1;
 		else if (received != bytes)
@@ -6121,7 +6163,7 @@ void fs_getbytes(int server, unsigned char reply_port, unsigned char net, unsign
 	{
 		// Send a completion message
 	
-		if (fs_noisy) fprintf(stderr, "   FS:%12sfrom %3d.%3d fs_getbytes() Acknowledging %04lX tx bytes, cursor now %06lX\n", "", net, stn, sent, active[server][active_id].fhandles[handle].cursor);
+		if (fs_noisy) econet_debug ("   FS:%12sfrom %3d.%3d fs_getbytes() Acknowledging %04lX tx bytes, cursor now %06lX\n", "", net, stn, sent, active[server][active_id].fhandles[handle].cursor);
 
 		r.p.port = reply_port;
 		r.p.ctrl = 0x80;
@@ -6182,7 +6224,7 @@ void fs_putbytes(int server, unsigned char reply_port, unsigned char net, unsign
 	if (offsetstatus) // write to current position
 		offset = active[server][active_id].fhandles[handle].cursor;
 
-	if (fs_noisy) fprintf (stderr, "   FS:%12sfrom %3d.%3d fs_putbytes() %06lX at offset %06lX by user %04X on handle %02d\n",
+	if (fs_noisy) econet_debug ("   FS:%12sfrom %3d.%3d fs_putbytes() %06lX at offset %06lX by user %04X on handle %02d\n",
 			"", net, stn,
 			bytes, offset, active[server][active_id].userid, handle);
 
@@ -6295,11 +6337,11 @@ void fs_close(int server, unsigned char reply_port, unsigned char net, unsigned
 
 	unsigned short count;
 
-	if (!fs_quiet) fprintf (stderr, "   FS:%12sfrom %3d.%3d Close handle %d ", "", net, stn, handle);
+	if (!fs_quiet) econet_log ("   FS:%12sfrom %3d.%3d Close handle %d ", "", net, stn, handle);
 
 	if (handle !=0 && active[server][active_id].fhandles[handle].handle == -1) // Handle not open
 	{
-		if (!fs_quiet) fprintf (stderr, "- unknown\n");
+		if (!fs_quiet) econet_log ("- unknown\n");
 		fs_error(server, reply_port, net, stn, 222, "Channel ?");
 		return;
 	}
@@ -6308,24 +6350,24 @@ void fs_close(int server, unsigned char reply_port, unsigned char net, unsigned
 
 	if (handle != 0)
 	{
-		if (!fs_quiet) fprintf(stderr, "(%s)", active[server][active_id].fhandles[handle].acornfullpath);
+		if (!fs_quiet) econet_log ("(%s)", active[server][active_id].fhandles[handle].acornfullpath);
 		fs_close_handle(server, reply_port, net, stn, active_id, handle);
 	}
 	else // User wants to close everything
 	{
-		if (!fs_quiet) fprintf (stderr, "closing ");
+		if (!fs_quiet) econet_log ("closing ");
 		while (count < FS_MAX_OPEN_FILES)
 		{	
 			if (active[server][active_id].fhandles[count].handle != -1 && !(active[server][active_id].fhandles[count].is_dir)) // Close it only if it's open and not a directory handle
 			{
-				if (!fs_quiet) fprintf (stderr, "%d ", count);
+				if (!fs_quiet) econet_log ("%d ", count);
 				fs_close_handle(server, reply_port, net, stn, active_id, count);
 			}
 			count++;
 		}
 	}
 
-	if (!fs_quiet) fprintf (stderr, "\n");
+	if (!fs_quiet) econet_log ("\n");
 
 	fs_reply_success(server, reply_port, net, stn, 0, 0);
 
@@ -6361,7 +6403,7 @@ void fs_open(int server, unsigned char reply_port, unsigned char net, unsigned c
 
 	fs_copy_to_cr(filename, data+start, 1023);
 
-	if (fs_noisy) fprintf (stderr, "   FS:%12sfrom %3d.%3d Open %s readonly %s, must exist? %s\n", "", net, stn, filename, (readonly ? "yes" : "no"), (existingfile ? "yes" : "no"));
+	if (fs_noisy) econet_debug ("   FS:%12sfrom %3d.%3d Open %s readonly %s, must exist? %s\n", "", net, stn, filename, (readonly ? "yes" : "no"), (existingfile ? "yes" : "no"));
 
 	result = fs_normalize_path(server, active_id, filename, active[server][active_id].current, &p);
 
@@ -6441,7 +6483,7 @@ void fs_open(int server, unsigned char reply_port, unsigned char net, unsigned c
 				reply.p.data[1] = 0;
 				reply.p.data[2] = (unsigned char) (userhandle & 0xff);
 	
-				if (!fs_quiet) fprintf (stderr, "   FS:%12sfrom %3d.%3d Opened handle %d (%s)\n", "", net, stn, userhandle, p.acornfullpath);
+				if (!fs_quiet) econet_log ("   FS:%12sfrom %3d.%3d Opened handle %d (%s)\n", "", net, stn, userhandle, p.acornfullpath);
 				fs_aun_send(&reply, server, 3, net, stn);
 			}
 		}
@@ -6456,12 +6498,18 @@ int8_t fs_get_user_printer(int server, unsigned char net, unsigned char stn)
 {
 
 	int active_id;
+	int8_t printer = 0xff;
 	
+	fs_server_lock(server);
+
 	active_id = fs_stn_logged_in(server, net, stn);
 
-	if (active_id < 0)	return 0xff;
+	if (active_id >= 0)
+		printer = active[server][active_id].printer;
 
-	return active[server][active_id].printer;
+	fs_server_unlock(server);
+
+	return printer;
 }
 
 
@@ -6477,11 +6525,11 @@ void fs_select_printer(int server, unsigned char reply_port, unsigned int active
 	reply.p.ctrl = 0x80;
 	reply.p.data[0] = reply.p.data[1] = 0;
 
-	if (!fs_quiet) fprintf (stderr, "   FS:%12sfrom %3d.%3d Select printer %s", "", net, stn, pname);
+	if (!fs_quiet) econet_log ("   FS:%12sfrom %3d.%3d Select printer %s", "", net, stn, pname);
 
 	printerindex = get_printer(fs_stations[server].net, fs_stations[server].stn, pname);
 
-	if (!fs_quiet) fprintf (stderr, " %s\n", (printerindex == -1) ? "UNKNOWN" : "Succeeded");
+	if (!fs_quiet) econet_log (" %s\n", (printerindex == -1) ? "UNKNOWN" : "Succeeded");
 
 	if (printerindex == -1) // Failed
 		fs_error(server, reply_port, net, stn, 0xFF, "Unknown printer");
@@ -6536,7 +6584,7 @@ short fs_find_new_user(int server)
 }
 
 // Handle incoming file / data transfers
-void handle_fs_bulk_traffic(int server, unsigned char net, unsigned char stn, unsigned char port, unsigned char ctrl, unsigned char *data, unsigned int datalen)
+void fs_bulk_traffic(int server, unsigned char net, unsigned char stn, unsigned char port, unsigned char ctrl, unsigned char *data, unsigned int datalen)
 {
 
 	struct __econet_packet_udp r;
@@ -6569,7 +6617,7 @@ void handle_fs_bulk_traffic(int server, unsigned char net, unsigned char stn, un
 		if (fs_bulk_ports[server][port].user_handle != 0) // This is a putbytes transfer not a fs_save; in the latter there is no user handle
 			active[server][fs_bulk_ports[server][port].active_id].fhandles[fs_bulk_ports[server][port].user_handle].cursor += writeable;
 	
-		if (!fs_quiet) fprintf (stderr, "   FS:%12sfrom %3d.%3d Bulk transfer in on port %02X data length &%04X, expected total length &%04lX, writeable &%04X\n", "", net, stn, port, datalen, fs_bulk_ports[server][port].length, writeable
+		if (!fs_quiet) econet_log ("   FS:%12sfrom %3d.%3d Bulk transfer in on port %02X data length &%04X, expected total length &%04lX, writeable &%04X\n", "", net, stn, port, datalen, fs_bulk_ports[server][port].length, writeable
 				);
 
 		fs_bulk_ports[server][port].last_receive = (unsigned long long) time(NULL);
@@ -6646,6 +6694,14 @@ void handle_fs_bulk_traffic(int server, unsigned char net, unsigned char stn, un
 	
 }
 
+// Called by the bridge (on a fileserver worker) with bulk transfer traffic
+void handle_fs_bulk_traffic(int server, unsigned char net, unsigned char stn, unsigned char port, unsigned char ctrl, unsigned char *data, unsigned int datalen)
+{
+	fs_server_lock(server);
+	fs_bulk_traffic(server, net, stn, port, ctrl, data, datalen);
+	fs_server_unlock(server);
+}
+
 /* Garbage collect stale incoming bulk handles - This is called from the main loop in the bridge code */
 
 void fs_garbage_collect(int server)
@@ -6653,13 +6709,15 @@ void fs_garbage_collect(int server)
 
 	int count; // == Bulk port number
 
+	fs_server_lock(server);
+
 	for (count = 1; count < 255; count++) // Start at 1 because port 0 is immediates...
 	{
 		if (fs_bulk_ports[server][count].handle != -1) // Operating handle
 		{
 			if (fs_bulk_ports[server][count].last_receive < ((unsigned long long) time(NULL) - 10)) // 10 seconds and no traffic
 			{
-				if (!fs_quiet) fprintf (stderr, "   FS:%12sfrom %3d.%3d Garbage collecting stale incoming bulk port %d used %lld seconds ago\n", "", 
+				if (!fs_quiet) econet_log ("   FS:%12sfrom %3d.%3d Garbage collecting stale incoming bulk port %d used %lld seconds ago\n", "", 
 					fs_bulk_ports[server][count].net, fs_bulk_ports[server][count].stn, count, ((unsigned long long) time(NULL) - fs_bulk_ports[server][count].last_receive));
 
 				// fs_close_interlock(server, fs_bulk_ports[server][count].handle, fs_bulk_ports[server][count].mode); // Commented so that bulk transfers to ordinary files don't close the file
@@ -6677,6 +6735,8 @@ void fs_garbage_collect(int server)
 
 	}
 
+	fs_server_unlock(server);
+
 }
 
 // Find any servers this station is logged into and eject them in case the station is dynamically reallocated
@@ -6685,12 +6745,14 @@ void fs_eject_station(unsigned char net, unsigned char stn)
 	int count = 0; // Fileservers
 
 
-	if (!fs_quiet) fprintf (stderr, "   FS:%12s             Ejecting station %3d.%3d\n", "", net, stn);
+	if (!fs_quiet) econet_log ("   FS:%12s             Ejecting station %3d.%3d\n", "", net, stn);
 
 	while (count < fs_count)
 	{
 		int user = 0;
 
+		fs_server_lock(count);
+
 		while (user < ECONET_MAX_FS_USERS)
 		{
 			if (active[count][user].net == net && active[count][user].stn == stn)
@@ -6699,6 +6761,8 @@ void fs_eject_station(unsigned char net, unsigned char stn)
 
 		}
 
+		fs_server_unlock(count);
+
 		count++;
 
 	}
@@ -6706,7 +6770,7 @@ void fs_eject_station(unsigned char net, unsigned char stn)
 }
 
 /* Handle locally arriving fileserver traffic to server #server, from net.stn, ctrl, data, etc. - port will be &99 for FS Op */
-void handle_fs_traffic (int server, unsigned char net, unsigned char stn, unsigned char ctrl, unsigned char *data, unsigned int datalen)
+void fs_traffic (int server, unsigned char net, unsigned char stn, unsigned char ctrl, unsigned char *data, unsigned int datalen)
 {
 
 	unsigned char fsop, reply_port; 
@@ -6715,7 +6779,7 @@ void handle_fs_traffic (int server, unsigned char net, unsigned char stn, unsign
 
 	if (datalen < 1) 
 	{
-		if (!fs_quiet) fprintf (stderr, "   FS: from %3d.%3d Invalid FS Request with no data\n", net, stn);
+		if (!fs_quiet) econet_log ("   FS: from %3d.%3d Invalid FS Request with no data\n", net, stn);
 		return;
 	}
 
@@ -6816,7 +6880,7 @@ void handle_fs_traffic (int server, unsigned char net, unsigned char stn, unsign
 						strcpy(libdir, params);
 					}	
 
-					if (!fs_quiet) fprintf (stderr, "  FS:%12sfrom %3d.%3d SETLIB for uid %04X to %s\n", "", net, stn, uid, libdir);
+					if (!fs_quiet) econet_log ("  FS:%12sfrom %3d.%3d SETLIB for uid %04X to %s\n", "", net, stn, uid, libdir);
 
 					if (libdir[0] != '%' && fs_normalize_path(server, active_id, libdir, *(data+3), &p) && (p.ftype == FS_FTYPE_DIR) && strlen((const char *) p.path_from_root) < 94 && (p.disc == users[server][userid].home_disc))
 					{
@@ -6873,7 +6937,7 @@ void handle_fs_traffic (int server, unsigned char net, unsigned char stn, unsign
 				struct path p;
 				unsigned short l, n_handle;
 
-				if (!fs_quiet) fprintf (stderr, "   FS:%12sfrom %3d.%3d LIB %s\n", "", net, stn, command+4);
+				if (!fs_quiet) econet_log ("   FS:%12sfrom %3d.%3d LIB %s\n", "", net, stn, command+4);
 				if ((found = fs_normalize_path(server, active_id, command+4, *(data+3), &p)) && (p.ftype != FS_FTYPE_NOTFOUND)) // Successful path traverse
 				{
 					if (p.ftype != FS_FTYPE_DIR)
@@ -6938,7 +7002,7 @@ void handle_fs_traffic (int server, unsigned char net, unsigned char stn, unsign
 				if (*(command + 3) == '\0')	strcpy(dirname, "");
 				else	strcpy (dirname, command+4);
 
-				if (!fs_quiet) fprintf (stderr, "   FS:%12sfrom %3d.%3d DIR %s\n", "", net, stn, dirname);
+				if (!fs_quiet) econet_log ("   FS:%12sfrom %3d.%3d DIR %s\n", "", net, stn, dirname);
 			
 				if (!strcmp(dirname, "")) // Empty string
 				{
@@ -7017,7 +7081,7 @@ void handle_fs_traffic (int server, unsigned char net, unsigned char stn, unsign
 
 						if (sscanf(params, "%10s %96s", username, dir) == 2)
 						{
-							if (!fs_quiet) fprintf(stderr, "   FS:%12sfrom %3d.%3d Set Home dir for user %s to %s\n", "", net, stn, username, dir);
+							if (!fs_quiet) econet_log ("   FS:%12sfrom %3d.%3d Set Home dir for user %s to %s\n", "", net, stn, username, dir);
 							uid = fs_get_uid(server, username);
 							if (uid < 0)
 							{
@@ -7027,7 +7091,7 @@ void handle_fs_traffic (int server, unsigned char net, unsigned char stn, unsign
 						}
 						else if (sscanf(params, "%96s", (unsigned char *) dir) != 1)
 						{
-							if (!fs_quiet) fprintf(stderr, "   FS:%12sfrom %3d.%3d Set Home dir - bad parameters %s\n", "", net, stn, params);
+							if (!fs_quiet) econet_log ("   FS:%12sfrom %3d.%3d Set Home dir - bad parameters %s\n", "", net, stn, params);
 							fs_error(server, reply_port, net, stn, 0xFF, "Bad parameters");
 							return;
 						}
@@ -7077,12 +7141,12 @@ void handle_fs_traffic (int server, unsigned char net, unsigned char stn, unsign
 							else	l_net = 0;
 						}
 
-						if (!fs_quiet) fprintf(stderr, "   FS:%12sfrom %3d.%3d Force log off station %d.%d\n", "", net, stn, l_net, l_stn);
+						if (!fs_quiet) econet_log ("   FS:%12sfrom %3d.%3d Force log off station %d.%d\n", "", net, stn, l_net, l_stn);
 
 					}
 					else // Username
 					{
-						if (!fs_quiet) fprintf(stderr, "   FS%12sfrom %3d.%3d Force log off user %s\n", "", net, stn, parameter);
+						if (!fs_quiet) econet_log ("   FS%12sfrom %3d.%3d Force log off user %s\n", "", net, stn, parameter);
 
 					}
 			
@@ -7095,7 +7159,7 @@ void handle_fs_traffic (int server, unsigned char net, unsigned char stn, unsign
 	
 					fs_copy_to_cr(username, command+8, 10);
 					
-					if (!fs_quiet) fprintf (stderr, "   FS:%12sfrom %3d.%3d Create new user %s\n", "", net, stn, username);
+					if (!fs_quiet) econet_log ("   FS:%12sfrom %3d.%3d Create new user %s\n", "", net, stn, username);
 	
 					ptr = 0;
 					while (ptr < 10 && username[ptr] != ' ')
@@ -7144,7 +7208,7 @@ void handle_fs_traffic (int server, unsigned char net, unsigned char stn, unsign
 								fs_write_user(server, id, (unsigned char *) &(users[server][id]));
 								if (id >= fs_stations[server].total_users) fs_stations[server].total_users = id+1;
 								fs_reply_ok(server, reply_port, net, stn);
-								if (!fs_quiet) fprintf (stderr, "   FS:%12sfrom %3d.%3d New User %s, id = %d, total users = %d\n", "", net, stn, username, id, fs_stations[server].total_users);
+								if (!fs_quiet) econet_log ("   FS:%12sfrom %3d.%3d New User %s, id = %d, total users = %d\n", "", net, stn, username, id, fs_stations[server].total_users);
 							/*
 							}
 							*/
@@ -7214,7 +7278,7 @@ void handle_fs_traffic (int server, unsigned char net, unsigned char stn, unsign
 								{
 									if (!strncasecmp((const char *) users[server][count].username, username_padded, 10) && users[server][count].priv != FS_PRIV_INVALID)
 									{
-										if (!fs_quiet) fprintf (stderr, "   FS:%12sfrom %3d.%3d Change privilege for %s to %02x\n", "", net, stn, username, priv_byte);
+										if (!fs_quiet) econet_log ("   FS:%12sfrom %3d.%3d Change privilege for %s to %02x\n", "", net, stn, username, priv_byte);
 
 										users[server][count].priv = priv_byte;
 										fs_write_user(server, count, (unsigned char *) &(users[server][count]));
@@ -7439,7 +7503,7 @@ void handle_fs_traffic (int server, unsigned char net, unsigned char stn, unsign
 					reply.p.port = reply_port;
 					reply.p.ctrl = 0x80;
 
-					if (!fs_quiet) fprintf(stderr, "   FS:%12sfrom %3d.%3d SJ Read Account information from %d for %d entries on disc no. %d - Not yet implemented\n", "", net, stn, start, count, disc);
+					if (!fs_quiet) econet_log ("   FS:%12sfrom %3d.%3d SJ Read Account information from %d for %d entries on disc no. %d - Not yet implemented\n", "", net, stn, start, count, disc);
 
 					// For now, return a dummy entry
 			
@@ -7478,7 +7542,7 @@ void handle_fs_traffic (int server, unsigned char net, unsigned char stn, unsign
 					{
 						case 0: // Reset print server information	
 						{
-							if (!fs_quiet) fprintf(stderr, "   FS:%12sfrom %3d.%3d SJ Reset printer information\n", "", net, stn);
+							if (!fs_quiet) econet_log ("   FS:%12sfrom %3d.%3d SJ Reset printer information\n", "", net, stn);
 							// Later we might code this to put the priority things back in order etc.
 							break; // Do nothing - no data in reply
 						}
@@ -7492,7 +7556,7 @@ void handle_fs_traffic (int server, unsigned char net, unsigned char stn, unsign
 
 							printer = *(data+6) - 1; // we zero base; the spec is 1-8
 
-							if (!fs_quiet) fprintf(stderr, "   FS:%12sfrom %3d.%3d SJ Read printer information for printer %d\n", "", net, stn, printer);
+							if (!fs_quiet) econet_log ("   FS:%12sfrom %3d.%3d SJ Read printer information for printer %d\n", "", net, stn, printer);
 
 							if (!get_printer_info(fs_stations[server].net, fs_stations[server].stn,
 								printer,
@@ -7526,7 +7590,7 @@ void handle_fs_traffic (int server, unsigned char net, unsigned char stn, unsign
 							short user;
 
 							printer = *(data+6);
-							if (!fs_quiet) fprintf(stderr, "   FS:%12sfrom %3d.%3d SJ Write printer information for printer %d\n", "", net, stn, printer);
+							if (!fs_quiet) econet_log ("   FS:%12sfrom %3d.%3d SJ Write printer information for printer %d\n", "", net, stn, printer);
 							control = *(data+13);
 							user = *(data+14) + (*(data+15) << 8);
 
@@ -7549,7 +7613,7 @@ void handle_fs_traffic (int server, unsigned char net, unsigned char stn, unsign
 						case 5: // Read system message channel
 						case 6: // Set system message channel (deliberate fall through)
 						{
-							if (!fs_quiet) fprintf(stderr, "   FS:%12sfrom %3d.%3d SJ %s system message channel\n", "", net, stn, (rw_op == 5 ? "Read" : "Set"));
+							if (!fs_quiet) econet_log ("   FS:%12sfrom %3d.%3d SJ %s system message channel\n", "", net, stn, (rw_op == 5 ? "Read" : "Set"));
 							if (rw_op == 5)
 							{
 								reply.p.data[2] = 1; // Always 1 (Parallel)
@@ -7564,7 +7628,7 @@ void handle_fs_traffic (int server, unsigned char net, unsigned char stn, unsign
 						{
 							unsigned char level = 0;
 
-							if (!fs_quiet) fprintf(stderr, "   FS:%12sfrom %3d.%3d SJ Read system message level\n", "", net, stn);
+							if (!fs_quiet) econet_log ("   FS:%12sfrom %3d.%3d SJ Read system message level\n", "", net, stn);
 							if (!fs_quiet) level = 130; // "Function codes"
 							if (fs_noisy) level = 150; // "All activity"
 
@@ -7575,7 +7639,7 @@ void handle_fs_traffic (int server, unsigned char net, unsigned char stn, unsign
 						{
 							unsigned char level = *(data+6);
 	
-							if (!fs_quiet) fprintf(stderr, "   FS:%12sfrom %3d.%3d SJ Set system message level = %d\n", "", net, stn, level);
+							if (!fs_quiet) econet_log ("   FS:%12sfrom %3d.%3d SJ Set system message level = %d\n", "", net, stn, level);
 							fs_quiet = 1; fs_noisy = 0;
 							if (level > 0) fs_quiet = 0;
 							if (level > 130) fs_noisy = 1;
@@ -7587,19 +7651,19 @@ void handle_fs_traffic (int server, unsigned char net, unsigned char stn, unsign
 						case 10: // Write default printer
 						{
 
-							if (!fs_quiet) fprintf(stderr, "   FS:%12sfrom %3d.%3d SJ %s system default printer\n", "", net, stn, (rw_op == 9 ? "Read" : "Set"));
+							if (!fs_quiet) econet_log ("   FS:%12sfrom %3d.%3d SJ %s system default printer\n", "", net, stn, (rw_op == 9 ? "Read" : "Set"));
 							if (rw_op == 9) reply.p.data[reply_length++] = 1; // Always 1...
 							// We always just accept the set command
 						}
 						case 11: // Read priv required to change system time
 						{
-							if (!fs_quiet) fprintf(stderr, "   FS:%12sfrom %3d.%3d SJ Read privilege required to set system time\n", "", net, stn);
+							if (!fs_quiet) econet_log ("   FS:%12sfrom %3d.%3d SJ Read privilege required to set system time\n", "", net, stn);
 							reply.p.data[2] = 0; // Always privileged;
 							reply_length++;
 						} break;
 						case 12: // Write priv required to change system time
 						{
-							if (!fs_quiet) fprintf(stderr, "   FS:%12sfrom %3d.%3d SJ Set privilege required to set system time (ignored)\n", "", net, stn);
+							if (!fs_quiet) econet_log ("   FS:%12sfrom %3d.%3d SJ Set privilege required to set system time (ignored)\n", "", net, stn);
 							// Silently ignore - we are not going to let Econet users change the system time...
 						} break;
 						case 15: // Read printer info. Always return 0 printers for now
@@ -7615,7 +7679,7 @@ void handle_fs_traffic (int server, unsigned char net, unsigned char stn, unsign
 							short account;
 
 							number = *(data+6); start = *(data+7);
-							if (!fs_quiet) fprintf(stderr, "   FS:%12sfrom %3d.%3d SJ Read printer information, starting at %d (max %d entries)\n", "", net, stn, start, number);
+							if (!fs_quiet) econet_log ("   FS:%12sfrom %3d.%3d SJ Read printer information, starting at %d (max %d entries)\n", "", net, stn, start, number);
 							reply.p.data[2] = 0; reply_length++; // Number of entries
 
 // This broke EDITPRINT							if ((start + number) > get_printer_total(fs_stations[server].net, fs_stations[server].stn)) reply.p.data[1] = 0x80; // Attempt to flag end of list (guessing here)
@@ -7667,10 +7731,28 @@ void handle_fs_traffic (int server, unsigned char net, unsigned char stn, unsign
 			break;
 		default: // Send error
 		{
-			if (!fs_quiet) fprintf (stderr, "   FS: to %3d.%3d FS Error - Unknown operation 0x%02x\n", net, stn, fsop);
+			if (!fs_quiet) econet_log ("   FS: to %3d.%3d FS Error - Unknown operation 0x%02x\n", net, stn, fsop);
 			fs_error(server, reply_port, net, stn, 0xff, "FS Error");
 		}
 		break;
 
 	}
 }
+
+// Called by the bridge (on a fileserver worker) with an FS Op
+void handle_fs_traffic (int server, unsigned char net, unsigned char stn, unsigned char ctrl, unsigned char *data, unsigned int datalen)
+{
+	struct timespec start, end;
+
+	if (datalen >= 2)
+		__atomic_add_fetch(&(fs_ops[data[1]]), 1, __ATOMIC_RELAXED);
+
+	fs_server_lock(server);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	fs_traffic(server, net, stn, ctrl, data, datalen);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	fs_server_unlock(server);
+
+	if (datalen >= 2)
+		econet_fs_op_timed(data[1], ((end.tv_sec - start.tv_sec) * 1000000) + ((end.tv_nsec - start.tv_nsec) / 1000));
+}
@@ -0,0 +1,182 @@
+#!/bin/bash
+
+# PiEconetBridge trunk test
+# Runs two bridges on this machine, joined by a RELIABLE trunk through
+# econet-impair, sends packets from a named pipe station on one to a named
+# pipe station on the other, and checks that they all arrived and that the
+# bridges had to resend some of them to get them there.
+
+#  (c) 2022 Chris Royle
+#    This program is free software: you can redistribute it and/or modify
+#    it under the terms of the GNU General Public License as published by
+#    the Free Software Foundation, either version 3 of the License, or
+#    (at your option) any later version.
+#
+#    This program is distributed in the hope that it will be useful,
+#    but WITHOUT ANY WARRANTY; without even the implied warranty of
+#    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#    GNU General Public License for more details.
+#
+#    You should have received a copy of the GNU General Public License
+#    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+# Usage:
+# trunk-impair-test.sh [-l loss] [-n packets] [-u]
+#
+# -l loss is the % of datagrams econet-impair drops in each direction (default 5)
+# -n packets is how many to send (default 500, up to 65535)
+# -u leaves RELIABLE off the TRUNK lines, to see what gets lost without it.
+#    Then nothing is checked - it just prints the counts.
+#
+# Run it from the utilities directory after 'make'. It uses UDP ports 30001,
+# 30002, 40001, 40002, 31010 and 31020 on 127.0.0.1. Exits 0 if everything
+# checked out, 1 if not.
+
+loss=5
+count=500
+reliable=" RELIABLE"
+
+while getopts "l:n:u" opt
+do
+	case $opt in
+		l) loss=$OPTARG ;;
+		n) count=$OPTARG ;;
+		u) reliable="" ;;
+		*) echo "Usage: $0 [-l loss] [-n packets] [-u]" >&2; exit 1 ;;
+	esac
+done
+
+bin=$(dirname "$0")
+dir=$(mktemp -d /tmp/trunktest.XXXXXX)
+pids=""
+
+finish()
+{
+	kill $pids 2>/dev/null
+	wait 2>/dev/null
+	rm -rf "$dir"
+}
+
+trap finish EXIT
+
+# Bridge A is network 1, with station 10 on a named pipe; bridge B is network 2, with station 20
+
+cat > "$dir/a.cfg" <<EOF
+N 1
+UNIX 0 10 31010 $dir/a10
+TRUNK 1 30001 127.0.0.1 40001 MTU 1400$reliable
+EOF
+
+cat > "$dir/b.cfg" <<EOF
+N 2
+UNIX 0 20 31020 $dir/b20
+TRUNK 1 30002 127.0.0.1 40002 MTU 1400$reliable
+EOF
+
+# Nothing is dropped for the first 2 seconds, so that the bridges can swap their network advertisements
+
+"$bin/econet-impair" -a 40001 -A 127.0.0.1:30001 -b 40002 -B 127.0.0.1:30002 -l "$loss" -d 20 -j 5 -w 2 > "$dir/impair.log" 2>&1 &
+impair=$!
+"$bin/econet-bridge" -l -c "$dir/a.cfg" > "$dir/a.log" 2>&1 &
+bridge_a=$!
+"$bin/econet-bridge" -l -c "$dir/b.cfg" > "$dir/b.log" 2>&1 &
+bridge_b=$!
+pids="$impair $bridge_a $bridge_b"
+
+sleep 1
+
+if [ ! -p "$dir/a10.tobridge" ] || [ ! -p "$dir/b20.tobridge" ]
+then
+	echo "The bridges didn't start - see below" >&2
+	cat "$dir/a.log" "$dir/b.log" >&2
+	exit 1
+fi
+
+# Pipe framing: length (2 bytes, little endian), then dststn, dstnet, srcstn, srcnet, AUN type, port, ctrl,
+# padding, sequence number (4 bytes, little endian), data. The bridge fills in the source.
+
+le16()
+{
+	printf '\\x%02x\\x%02x' $(($1 & 255)) $((($1 >> 8) & 255))
+}
+
+# Send a packet, given as a printf format, down the pipe on descriptor $1. It is put together in a file first
+# because printf writes a line at a time, and the bridge has to be given each packet in one go.
+
+pipe_send()
+{
+	printf "$2" 0 > "$dir/packet"
+	cat "$dir/packet" >&$1
+}
+
+# The bridge only opens its end of a station's frombridge pipe once the station has said something, so
+# listen on both and have B say hello to A first
+
+cat "$dir/b20.frombridge" > "$dir/b20.rx" &
+pids="$pids $!"
+cat "$dir/a10.frombridge" > /dev/null &
+pids="$pids $!"
+
+exec 3> "$dir/a10.tobridge"
+exec 4> "$dir/b20.tobridge"
+
+pipe_send 4 "\\x0e\\x00\\x0a\\x01\\x00\\x00\\x02\\x55\\x80\\x00\\x04\\x00\\x00\\x00HI"
+
+sleep 1.5
+
+# Each packet is a data packet to 2.20 port &55 carrying its number (2 bytes, little endian) and 64 bytes of padding
+
+for ((i = 0; i < count; i++))
+do
+	pipe_send 3 "\\x4e\\x00\\x14\\x02\\x00\\x00\\x02\\x55\\x80\\x00$(le16 $((8 + (i * 4) % 65536)))\\x00\\x00$(le16 $i)%064d"
+	sleep 0.01
+done
+
+sleep 3 # Stragglers
+
+kill -USR1 $bridge_a
+sleep 0.5
+kill -INT $impair
+wait $impair
+
+arrived=$(od -An -v -tu1 "$dir/b20.rx" | awk '
+	{ for (i = 1; i <= NF; i++) b[n++] = $i }
+	END {
+		p = 0
+		while (p + 1 < n) {
+			len = b[p] + 256 * b[p + 1]
+			if (len >= 14 && b[p + 7] == 85) seen[b[p + 14] + 256 * b[p + 15]] = 1
+			p += len + 2
+		}
+		for (k in seen) c++
+		print c + 0
+	}')
+
+dropped=$(sed -n 's/.* datagrams, \([0-9]*\) dropped/\1/p' "$dir/impair.log" | awk '{ t += $1 } END { print t + 0 }')
+resent=$(sed -n 's/.*Trunk *1 reliable.* \([0-9]*\) fast & \([0-9]*\) timed out retransmissions.*/\1 \2/p' "$dir/a.log" | tail -1 | awk '{ print $1 + $2 }')
+resent=${resent:-0}
+
+echo "Sent $count, arrived $arrived; econet-impair dropped $dropped datagrams; bridge A resent $resent"
+
+if [ -z "$reliable" ]
+then
+	exit 0
+fi
+
+result=0
+
+if [ "$arrived" -ne "$count" ]
+then
+	echo "FAIL: $((count - arrived)) packets never arrived"
+	result=1
+fi
+
+if [ "$dropped" -gt 0 ] && [ "$resent" -eq 0 ]
+then
+	echo "FAIL: datagrams were dropped but nothing was resent"
+	result=1
+fi
+
+[ $result -eq 0 ] && echo "PASS"
+
+exit $result